@@ -19,8 +19,10 @@
  *      bundle can be sent:                                               *
  *          - in an IPv4 packet belonging to protocol 253 (network mode)  *
  *          - in an IPv4/UDP packet (transport mode)                      *
+ *          - or in the same over IPv6 (option -6): next header 253, or   *
+ *          IPv6/UDP                                                      *
  *                                                                        *
- * IPv6 is not supported in this implementation                           *
+ * The native packets may be IPv4 (Protocol 4) or IPv6 (Protocol 41)      *
  *                                                                        *
  *                                                                        *
  * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
@@ -49,6 +51,7 @@
  * explicit. See the file LICENSE for further details.                    *
  *************************************************************************/ 
 
+#define _GNU_SOURCE				// for using sendmmsg() and struct mmsghdr
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -72,26 +75,77 @@
 #include <rohc/rohc_comp.h>
 #include <rohc/rohc_decomp.h>
 #include <netinet/ip.h>			// for using iphdr type
+#include <netinet/ip6.h>		// for using ip6_hdr type
+#include <ifaddrs.h>			// for finding the IPv6 address of the local interface
+#include <sys/epoll.h>			// for the epoll event backend
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <pthread.h>			// for running multiplexing and demultiplexing in different threads
+#include <sched.h>
+#include <sys/eventfd.h>		// for waking up the ingress thread when there is feedback to send
+#include <stdatomic.h>			// for the lock-free feedback queue
+#include "simplemux_codec.h"	// for building and parsing the Simplemux separators
+#include "simplemux_trace.h"	// for the binary log
+#include "simplemux_timer.h"	// for the period of the peers
+#include "simplemux_stats.h"	// for the live statistics
+#include "simplemux_rohc_pool.h"	// for the ROHC compression in worker threads
+#include "simplemux_flow_cache.h"	// for the flows that are not compressed
+#include "simplemux_tun_writer.h"	// for writing the demuxed packets to tun in batches
+#include "simplemux_packet_ring.h"	// for the native packets of a network interface (-I)
+#include <sys/uio.h>
+#include <linux/virtio_net.h>	// for the header of the packets of a tun with IFF_VNET_HDR
+
+#include "simplemux_uring.h"	// for the io_uring event backend (HAVE_IO_URING)
 
 #define BUFSIZE 2304			// buffer for reading from tun interface, must be >= MTU of the network
 #define IPv4_HEADER_SIZE 20
+#define IPv6_HEADER_SIZE 40
 #define UDP_HEADER_SIZE 8
-#define SIZE_PROTOCOL_FIELD 1	// 1: protocol field of one byte
-								// 2: protocol field of two bytes
 
 #define PORT 55555				// default port
-#define MAXPKTS 100				// maximum number of packets to store
+#define MAXPKTS MUX_MAX_PACKETS	// maximum number of packets to store (a bundle of 2*MAXPKTS+1 fragments must fit in IOV_MAX)
 #define MAXTIMEOUT 100000000.0	// maximum value of the timeout (microseconds). (default 100 seconds)
+#define MAXBATCH 64				// maximum number of packets read from tun (or muxed packets sent) in a batch
+#define PPS_INTERVAL 1000000	// interval (microseconds) between two reports of the packet-per-second counters
+#define MAXEVENTFDS 16			// maximum number of file descriptors handled by the event loop
+#define FEEDBACK_QUEUE_SIZE 64	// number of ROHC feedback packets waiting to be delivered to the compressor
+#define FEEDBACK_MAX_SIZE 128	// maximum size of a ROHC feedback packet in the queue (they are a few tens of bytes)
+#define MAXPEERS 1024			// maximum number of tunnel peers
+#define PEER_HASH_BITS 11		// the hash of the peer addresses has 2^11 slots (at least 2*MAXPEERS)
+#define MAXROUTES 2048			// maximum number of prefixes routed to the peers
+#define ROUTE_HASH_BITS 12		// the hash of the prefixes has 2^12 slots (at least 2*MAXROUTES)
+#define NUM_MUX_CLASSES 2		// number of mux queues of each peer
+#define ADAPT_INTERVAL 100000	// interval (microseconds) between two decisions of the adaptive policies
+#define ADAPT_WEIGHT 0.5		// weight of the last interval in the moving averages of the adaptive policies
+#define ADAPT_MIN_PACKETS 2.0	// if fewer packets are expected in the maximum delay, they are not multiplexed
+#define ADAPT_MIN_PERIOD 100	// minimum period (microseconds) chosen by the adaptive policies
+#define ADAPT_HYSTERESIS 0.1	// the policies only change if the new value differs more than 10%
+#define ROHC_BYPASS_TIME 5000000	// (microseconds) time a flow that ROHC cannot compress is sent without compressing it
+#define FEEDBACK_DEADLINE 1000	// (microseconds) the ROHC feedback waits at most this for a bundle toward its peer
 
  
 #define IPPROTO_SIMPLEMUX	253	// N: Simplemux Protocol ID
+#define IPPROTO_ROHC_FEEDBACK	254	// 'Protocol' of the ROHC feedback carried inside the bundles (experimental value, RFC 3692)
 #define NETWORK_MODE		'N'	// N: network mode
 #define TRANSPORT_MODE		'T'	// T: transport mode
 
-#define Linux_TTL 64			// the initial value of the TTL IP field in Linux
+#define ROLE_INGRESS	1		// tun to net: compress and multiplex
+#define ROLE_EGRESS		2		// net to tun: demultiplex and decompress
+#define ROLE_BOTH		(ROLE_INGRESS | ROLE_EGRESS)
+
+#define MUX_CLASS_BULK		0	// the packets that are not realtime. Also all the packets if they are not classified
+#define MUX_CLASS_REALTIME	1	// VoIP and other latency-critical packets
+
+#define DSCP_CS5			40	// DiffServ code points of the realtime packets
+#define DSCP_VOICE_ADMIT	44
+#define DSCP_EF				46
+
+#define EVENT_BACKEND_SELECT	's'	// s: select()
+#define EVENT_BACKEND_EPOLL		'e'	// e: epoll
+#define EVENT_BACKEND_URING		'u'	// u: io_uring
 
-#define PROTOCOL_FIRST 0		// 1: protocol field goes before the length byte(s) (as in draft-saldana-tsvwg-simplemux-01)
-								// 0: protocol field goes after the length byte(s)  (as in draft-saldana-tsvwg-simplemux-02 and subsequent versions)
+#define Linux_TTL 64			// the initial value of the TTL IP field in Linux
 
 /* global variables */
 int debug;						// 0:no debug; 1:minimum debug; 2:maximum debug 
@@ -99,6 +153,31 @@ char *progname;
 
 
 
+/**
+ * @brief Check if a UDP destination port is in the list of ports reserved
+ * for RTP traffic by default (for compatibility reasons)
+ *
+ * @param port  The UDP destination port (host byte order)
+ * @return      true if the port is an RTP port, false otherwise
+ */
+static bool is_rtp_port(uint16_t port)
+{
+	const size_t default_rtp_ports_nr = 5;
+	const unsigned int default_rtp_ports[] = { 1234, 36780, 33238, 5020, 5002 };
+	size_t i;
+
+	for(i = 0; i < default_rtp_ports_nr; i++)
+	{
+		if(port == default_rtp_ports[i])
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
 /**
  * @brief The RTP detection callback which does detect RTP stream.
  * it assumes that UDP packets belonging to certain ports are RTP packets
@@ -115,11 +194,7 @@ static bool rtp_detect(const unsigned char *const ip __attribute__((unused)),
                       const unsigned int payload_size __attribute__((unused)),
                       void *const rtp_private __attribute__((unused)))
 {
-	const size_t default_rtp_ports_nr = 5;
-	unsigned int default_rtp_ports[] = { 1234, 36780, 33238, 5020, 5002 };
 	uint16_t udp_dport;
-	bool is_rtp = false;
-	size_t i;
 
 	if(udp == NULL)
 	{
@@ -129,18 +204,7 @@ static bool rtp_detect(const unsigned char *const ip __attribute__((unused)),
 	/* get the UDP destination port */
 	memcpy(&udp_dport, udp + 2, sizeof(uint16_t));
 
-	/* is the UDP destination port in the list of ports reserved for RTP
-	 * traffic by default (for compatibility reasons) */
-	for(i = 0; i < default_rtp_ports_nr; i++)
-	{
-		if(ntohs(udp_dport) == default_rtp_ports[i])
-		{
-			is_rtp = true;
-			break;
-		}
-	}
-
-	return is_rtp;
+	return is_rtp_port(ntohs(udp_dport));
 }
 
 
@@ -209,6 +273,44 @@ int cwrite(int fd, unsigned char *buf, int n){
 	return nwritten;
 }
 
+/**************************************************************************
+ * cread_vnet: read routine for a tun with IFF_VNET_HDR (option -G). The  *
+ *             virtio_net_hdr before the packet is dropped (no offloads   *
+ *             are enabled, so it is empty). It returns -1 if there is    *
+ *             nothing to read in a non-blocking descriptor               *
+ **************************************************************************/
+int cread_vnet(int fd, unsigned char *buf, int n){
+
+	struct virtio_net_hdr vnet;
+	struct iovec iov[2] = { { &vnet, sizeof(vnet) }, { buf, n } };
+	int nread;
+
+	if((nread=readv(fd, iov, 2)) < 0){
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return -1;
+		perror("Reading data");
+		exit(1);
+	}
+	if (nread < (int)sizeof(vnet)) return 0;
+	return nread - sizeof(vnet);
+}
+
+/**************************************************************************
+ * cread_nonblock: read routine for non-blocking descriptors. It returns  *
+ *                 -1 if there is nothing to read, and exits if any other *
+ *                 error is returned.                                     *
+ **************************************************************************/
+int cread_nonblock(int fd, unsigned char *buf, int n){
+
+	int nread;
+
+	if((nread=read(fd, buf, n)) < 0){
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return -1;
+		perror("Reading data");
+		exit(1);
+	}
+	return nread;
+}
+
 /**************************************************************************
  * read_n: ensures we read exactly n bytes, and puts them into "buf".     *
  *         (unless EOF, of course)                                        *
@@ -259,27 +361,259 @@ void my_err(char *msg, ...) {
  **************************************************************************/
 void usage(void) {
 	fprintf(stderr, "Usage:\n");
-	fprintf(stderr, "%s -i <ifacename> -e <ifacename> -c <peerIP> -M <N or T> [-p <port>] [-d <debug_level>] [-r <ROHC_option>] [-n <num_mux_tun>] [-m <MTU>] [-b <num_bytes_threshold>] [-t <timeout (microsec)>] [-P <period (microsec)>] [-l <log file name>] [-L]\n\n" , progname);
+	fprintf(stderr, "%s -i <ifacename> -e <ifacename> -c <peerIP> -M <N or T> [-C <peers_file>] [-p <port>] [-d <debug_level>] [-r <ROHC_option>] [-W <ROHC_workers>] [-R <ROHC_bypass_time (microsec)>] [-F] [-I <ifacename>,<next_hop_MAC>] [-n <num_mux_tun>] [-B <batch_size>] [-G] [-E <event_backend>] [-T <ingress_cpu>,<egress_cpu>] [-m <MTU>] [-b <num_bytes_threshold>] [-t <timeout (microsec)>] [-P <period (microsec)>] [-A <max_delay (microsec)>] [-Q <realtime_policies>] [-l <log file name>] [-L] [-S <statistics socket>] [-6]\n\n" , progname);
 	fprintf(stderr, "%s -h\n", progname);
 	fprintf(stderr, "\n");
-	fprintf(stderr, "-i <ifacename>: Name of tun interface to use for capturing native packets (mandatory)\n");
+	fprintf(stderr, "-i <ifacename>: Name of tun interface to use for capturing native packets (mandatory, unless -I is used)\n");
+	fprintf(stderr, "-I <ifacename>,<MAC>: take the native packets from this network interface with a PACKET_MMAP ring instead of tun (dedicated mux gateway). Only the IPv4 packets to the prefixes of the peers are taken (and IPv6 with -c). The demuxed packets are injected into the interface, sent to this MAC address (e.g. the next router). The gateway must not forward the packets taken (e.g. net.ipv4.ip_forward=0)\n");
 	fprintf(stderr, "-e <ifacename>: Name of local interface which IP will be used for reception of muxed packets, i.e., the tunnel local end (mandatory)\n");
-	fprintf(stderr, "-c <peerIP>: specify peer destination IP address, i.e. the tunnel remote end (mandatory)\n");
+	fprintf(stderr, "-c <peerIP>: specify peer destination IP address, i.e. the tunnel remote end (mandatory, unless -C is used)\n");
+	fprintf(stderr, "-6: IPv6 tunnel. The addresses of the peers are IPv6, and the muxed packets are sent over UDP/IPv6 (transport mode) or in IPv6 packets with next header 253 (network mode)\n");
+	fprintf(stderr, "-C <peers_file>: file with more peers. Each line: <peerIP> <prefix>/<length> ... [n=<num>] [b=<bytes>] [t=<usec>] [P=<usec>] [A=<usec>] [qn=<num>] [qb=<bytes>] [qt=<usec>] [qP=<usec>] [qA=<usec>]. The packets read from tun are sent to the peer of the longest prefix matching their destination. The peer of '-c' gets 0.0.0.0/0\n");
 	fprintf(stderr, "-M <mode>: Network(N) or Transport (T) mode (mandatory)\n");
 	fprintf(stderr, "-p <port>: port to listen on, and to connect to (default 55555)\n");
 	fprintf(stderr, "-d: outputs debug information while running. 0:no debug; 1:minimum debug; 2:medium debug; 3:maximum debug (incl. ROHC)\n");
 	fprintf(stderr, "-r: 0:no ROHC; 1:Unidirectional; 2: Bidirectional Optimistic; 3: Bidirectional Reliable (not available yet)\n");
-	fprintf(stderr, "-n: number of packets received, to be sent to the network at the same time, default 1, max 100\n");
-	fprintf(stderr, "-m: Maximum Transmission Unit of the network path (by default the one of the local interface is taken)\n");
-	fprintf(stderr, "-b: size threshold (bytes) to trigger the departure of packets (default MTU-28 in transport mode and MTU-20 in network mode)\n");
+	fprintf(stderr, "-W: number of threads that compress the packets with ROHC (max %i). The compressor of each peer belongs to one of them, so the packets of a peer keep their order (default 0: compressed by the thread that reads tun)\n", ROHC_POOL_MAX_WORKERS);
+	fprintf(stderr, "-R: time (in usec) a flow is sent without ROHC if the compressor fails, or if it saves less than %i bytes in %i consecutive packets of the flow (default %i, 0: always compress)\n", FLOW_MIN_SAVING, FLOW_UNPROFITABLE_PACKETS, ROHC_BYPASS_TIME);
+	fprintf(stderr, "-F: send the ROHC feedback in its own UDP packets to port+1, for peers with an older simplemux. By default it is carried inside the next bundle toward the peer (Protocol %i), or alone after %i usec if no bundle departs\n", IPPROTO_ROHC_FEEDBACK, FEEDBACK_DEADLINE);
+	fprintf(stderr, "-n: number of packets received, to be sent to the network at the same time, default 1, max %i\n", MAXPKTS);
+	fprintf(stderr, "-B: number of packets read from tun, and of muxed packets sent, per system call (batched I/O), default 1, max %i\n", MAXBATCH);
+	fprintf(stderr, "-G: open tun with IFF_VNET_HDR, so the consecutive TCP segments of a flow demuxed from the bundles are written to tun as one GSO packet\n");
+	fprintf(stderr, "-E: backend used for waiting for packets: select, epoll or io_uring (default epoll). With io_uring, the packets demuxed since the last wait are written to tun in a single system call\n");
+	fprintf(stderr, "-T: multiplex (tun to net) and demultiplex (net to tun) in two threads, pinned to these CPUs (-1: not pinned)\n");
+	fprintf(stderr, "-m: Maximum Transmission Unit of the network path (by default the one of the local interface is taken). Longer packets are dropped, or sent in ROHC segments if ROHC is used\n");
+	fprintf(stderr, "-b: size threshold (bytes) to trigger the departure of packets (default MTU-28 in transport mode and MTU-20 in network mode; MTU-48 and MTU-40 with -6)\n");
 	fprintf(stderr, "-t: timeout (in usec) to trigger the departure of packets\n");
 	fprintf(stderr, "-P: period (in usec) to trigger the departure of packets. If ( timeout < period ) then the timeout has no effect\n");
-	fprintf(stderr, "-l: log file name. Use 'stdout' if you want the log data in standard output\n");
+	fprintf(stderr, "-A: adaptive policies. The size threshold and the period are adjusted to the load, so that the delay added to the packets is at most this (usec). -b and -P are their upper bounds. The decisions are written in the log\n");
+	fprintf(stderr, "-Q: classify the packets read from tun into a realtime queue (DSCP EF, VOICE-ADMIT or CS5, and UDP to the RTP ports) and a bulk queue. The realtime queue has these policies, e.g. n=4,P=2000 (the period is its latency budget, and A= makes them adaptive; by default each packet is sent at once), and its bundles are not delayed in the batch. The other options are the policies of the bulk queue. In the peers file, qn, qb, qt, qP and qA set the realtime policies of a peer\n");
+	fprintf(stderr, "-l: log file name (binary, convert it with simplemux_trace2txt). Use 'stdout' if you want the log data in standard output (text)\n");
 	fprintf(stderr, "-L: use default log file name (day and hour Y-m-d_H.M.S)\n");
+	fprintf(stderr, "-S: Unix socket where the live statistics are served in the Prometheus text format (e.g. curl --unix-socket <socket> http://localhost/metrics)\n");
 	fprintf(stderr, "-h: prints this help text\n");
 	exit(1);
 }
 
+/**************************************************************************
+ * counters of packets and system calls, reported every PPS_INTERVAL      *
+ **************************************************************************/
+struct pps_counters {
+	uint64_t time_last_report;			// moment of the last report
+	unsigned long int tun_reads;		// read() calls on the tun interface
+	unsigned long int net_sends;		// sendto() or sendmmsg() calls for sending muxed packets
+	unsigned long int bundles;			// muxed packets sent
+	unsigned long int last_tun2net;		// values of the counters in the last report
+	unsigned long int last_tun_reads;
+	unsigned long int last_net_sends;
+	unsigned long int last_bundles;
+};
+
+/**************************************************************************
+ * sockaddr_inet: address of a tunnel end, IPv4 or IPv6 (option -6)       *
+ **************************************************************************/
+union sockaddr_inet {
+	struct sockaddr sa;
+	struct sockaddr_in in;
+	struct sockaddr_in6 in6;
+};
+
+/**************************************************************************
+ * send_batch: muxed packets waiting to be sent with a single sendmmsg()  *
+ **************************************************************************/
+struct send_batch {
+	int fd;										// socket used for sending the muxed packets
+	int max_msgs;								// the batch is flushed when it stores this number of packets
+	int num_msgs;								// number of packets currently stored
+	union sockaddr_inet dests[MAXBATCH];		// destination of each muxed packet (each one may go to a different peer)
+	struct mmsghdr msgs[MAXBATCH];
+	struct iovec iov[MAXBATCH];
+	unsigned char buffers[MAXBATCH][BUFSIZE];	// a copy of each muxed packet
+};
+
+/**************************************************************************
+ * recv_batch: muxed packets received with a single recvmmsg() in         *
+ *             preallocated slots. Each one is demuxed where it is        *
+ **************************************************************************/
+struct recv_batch {
+	int fd;										// socket used for receiving the muxed packets
+	int max_msgs;								// maximum number of packets received with each recvmmsg()
+	int num_msgs;								// number of packets received by the last recvmmsg()
+	int next;									// the next packet to be demuxed
+	union sockaddr_inet sources[MAXBATCH];		// source of each muxed packet
+	struct mmsghdr msgs[MAXBATCH];
+	struct iovec iov[MAXBATCH];
+	unsigned char buffers[MAXBATCH][BUFSIZE];	// each muxed packet, as received (with its IPv4 header)
+};
+
+/**************************************************************************
+ * mux_bundle: a multiplexed packet described as a list of fragments, so  *
+ *             it can be sent without copying the stored packets          *
+ **************************************************************************/
+struct mux_bundle {
+	union {
+		struct iphdr ipheader;									// tunneling header (only in Network mode)
+		struct ip6_hdr ip6header;								// the same, over IPv6
+	};
+	struct iovec iov[1 + 2 * MAXPKTS];							// IP header, and then the header and the payload of each packet
+	int num_iov;
+};
+
+/**************************************************************************
+ * event_loop: waits until one of the file descriptors can be read, or    *
+ *             until a timeout expires. The backend is selected at start  *
+ **************************************************************************/
+struct event_loop {
+	char backend;						// EVENT_BACKEND_SELECT, EVENT_BACKEND_EPOLL or EVENT_BACKEND_URING
+	int num_fds;						// number of file descriptors registered
+	int fds[MAXEVENTFDS];				// the file descriptors registered
+	bool ready[MAXEVENTFDS];			// it is true if the descriptor can be read after the last wait
+
+	int maxfd;							// select: maximum file descriptor
+	int epoll_fd;						// epoll: descriptor of the epoll instance
+
+#ifdef HAVE_IO_URING
+	struct uring_rings uring;			// io_uring: the ring and its mapped submission and completion rings
+	bool armed[MAXEVENTFDS];			// io_uring: it is true if a poll request is pending for the descriptor
+#endif
+};
+
+/**************************************************************************
+ * feedback_queue: lock-free single-producer single-consumer queue of     *
+ *                 ROHC feedback packets. The egress side (decompressor   *
+ *                 and feedback socket) produces, and the ingress side    *
+ *                 delivers them to the compressor, or carries the ones   *
+ *                 generated by the decompressor in the next bundle       *
+ **************************************************************************/
+struct feedback_queue {
+	atomic_uint head;										// next packet to be read. Only written by the consumer
+	atomic_uint tail;										// next free slot. Only written by the producer
+	uint16_t length[FEEDBACK_QUEUE_SIZE];
+	struct peer *peer[FEEDBACK_QUEUE_SIZE];					// the peer of each packet (only in the queue of the feedback to be sent)
+	unsigned char data[FEEDBACK_QUEUE_SIZE][FEEDBACK_MAX_SIZE];	// about 8 KB per queue, instead of a BUFSIZE slot per packet
+};
+
+/**************************************************************************
+ * mux_policies: when the packets stored in a mux queue are sent          *
+ **************************************************************************/
+struct mux_policies {
+	int size_threshold;									// if the number of bytes stored is higher than this, a muxed packet is sent
+	int limit_numpackets_tun;							// limit of the number of tun packets that can be stored
+	uint64_t timeout;									// (microseconds) the sending is triggered if a packet arrives after it
+	uint64_t period;									// (microseconds) if it expires, a packet is sent. It is the latency budget of the queue
+	uint64_t max_delay;									// (microseconds) maximum added delay of the adaptive policies. 0: the policies are static
+};
+
+/**************************************************************************
+ * mux_queue: packets of a class stored, waiting to be multiplexed and    *
+ *            sent to a peer. Each queue builds its own bundles           *
+ **************************************************************************/
+struct mux_queue {
+	struct peer *peer;									// the peer of the queue
+	int mux_class;										// MUX_CLASS_BULK or MUX_CLASS_REALTIME
+	struct mux_policies policies;						// multiplexing policies of this queue
+	bool urgent;										// its bundles are sent at once, not delayed in the batch of sendmmsg()
+
+	struct mux_encoder encoder;							// packets stored, waiting to be multiplexed (libsimplemux)
+	uint64_t time_last_sent_in_microsec;				// moment when the last multiplexed packet was sent (monotonic)
+	struct wheel_timer period_timer;					// expires at the end of the period
+
+	// adaptive policies: the size threshold and the period are set from the load, within the bounds in 'limits'
+	struct mux_policies limits;							// the policies given by the user
+	unsigned long int adapt_packets;					// packets stored since the last decision
+	unsigned long int adapt_bytes;						// and their bytes
+	int native_bytes;									// bytes of the stored packets before compressing them (statistics)
+	double arrival_rate;								// (packets per microsecond) moving average
+	double mean_size;									// (bytes) moving average of the size of the stored packets
+};
+
+/**************************************************************************
+ * peer: a remote end of the tunnel, with its mux queues (each one with   *
+ *       its own multiplexing policies) and ROHC compressor/decompressor  *
+ **************************************************************************/
+struct peer {
+	union sockaddr_inet remote, feedback_remote;		// addresses of the peer for muxed and feedback packets
+
+	// packets stored, waiting to be multiplexed and sent to this peer
+	// with one queue, all the packets go to MUX_CLASS_BULK. With two, they are classified
+	int num_queues;
+	struct mux_queue queues[NUM_MUX_CLASSES];
+
+	// ROHC header compression
+	struct rohc_comp *compressor;						// only used by the ingress role
+	struct rohc_decomp *decompressor;					// only used by the egress role
+	struct feedback_queue feedback_queue;				// feedback waiting to be delivered to the compressor
+	int rohc_worker;									// the thread of the ROHC pool that compresses the packets of this peer (-W)
+	int rohc_jobs;										// packets of this peer given to the ROHC thread, not collected yet
+
+	// tunneling header (network mode)
+	union {
+		struct iphdr ip_template;						// IPv4 header of the bundles, 'tot_len' and 'id' not set
+		struct ip6_hdr ip6_template;					// IPv6 header of the bundles, 'ip6_plen' not set
+	};
+	uint16_t ip_id;										// 'id' of the next bundle sent over IPv4
+};
+
+/**************************************************************************
+ * peer_table: the peers, indexed by their address (for dispatching the   *
+ *             muxed packets received) and by the prefixes routed to them *
+ *             (for choosing the peer of each packet read from tun)       *
+ **************************************************************************/
+struct route {
+	uint32_t prefix;									// prefix in host byte order. The bits beyond 'length' are 0
+	int length;											// length of the prefix (0 to 32)
+	struct peer *peer;									// NULL if the slot is empty
+};
+
+struct peer_table {
+	int family;											// AF_INET or AF_INET6: the family of the addresses of all the peers
+	int num_peers;
+	struct peer *peers[MAXPEERS];
+	struct peer *by_address[1 << PEER_HASH_BITS];		// open addressing hash, keyed by the address of the peer
+	int num_routes;
+	struct route routes[1 << ROUTE_HASH_BITS];			// open addressing hash, keyed by (prefix, length)
+	uint64_t prefix_lengths;							// bit n is set if there is at least one prefix of length n
+	struct peer *default_peer;							// the peer of 0.0.0.0/0. It also gets the packets that are not IPv4 (e.g. IPv6)
+};
+
+/**************************************************************************
+ * simplemux_ctx: configuration and resources shared by the threads       *
+ **************************************************************************/
+struct simplemux_ctx {
+	char mode;											// NETWORK_MODE or TRANSPORT_MODE
+	int family;											// AF_INET or AF_INET6: the family of the tunnel (option -6)
+	int tun_fd;											// file descriptor of the tun interface (or of the packet ring)
+	struct packet_ring *packet_ring;					// native packets of a network interface (-I). NULL: tun
+	int transport_mode_fd;								// socket in Transport mode
+	int network_mode_fd;								// raw socket in Network mode
+	int feedback_fd;									// socket for ROHC feedback
+	char event_backend;									// backend of the event loop of each thread
+	bool tun_vnet_hdr;									// the tun has IFF_VNET_HDR: the TCP segments written to it are coalesced (-G)
+	int batch_size;										// number of packets read from tun (and muxed packets sent) in a batch
+	unsigned short int port;
+	unsigned short int port_feedback;
+	union sockaddr_inet local, feedback;
+	int ROHC_mode;
+	struct peer_table *peers;							// the remote ends of the tunnel (read only)
+	struct trace_log *trace_log;						// binary log. NULL if there is no log
+	struct simplemux_stats *stats;						// live statistics. NULL if they are not exported
+	struct rohc_pool *rohc_pool;						// threads that compress the packets with ROHC. NULL if they are compressed inline
+	uint64_t rohc_bypass_time;							// (microseconds) time a flow that ROHC cannot compress is not compressed (0: never)
+	struct feedback_queue *feedback_to_send;			// feedback generated by the decompressors, to be sent in the bundles. NULL: sent on the feedback socket (-F)
+	int feedback_event_fd;								// eventfd written by the egress thread when it queues feedback to be sent (-T). -1 if not used
+	int selected_mtu;
+	int size_max;
+};
+
+/**************************************************************************
+ * data_plane_args: arguments of each thread                              *
+ **************************************************************************/
+struct data_plane_args {
+	struct simplemux_ctx *ctx;
+	int role;											// ROLE_INGRESS, ROLE_EGRESS or ROLE_BOTH
+	int cpu;											// CPU where the thread is pinned (-1: not pinned)
+};
+
 /**************************************************************************
  * GetTimeStamp: Get a timestamp in microseconds from the OS              *
  **************************************************************************/
@@ -289,6 +623,87 @@ uint64_t GetTimeStamp() {
 	return tv.tv_sec*(uint64_t)1000000+tv.tv_usec;
 }
 
+/**************************************************************************
+ * GetMonotonicTime: monotonic time in microseconds, for the triggers     *
+ **************************************************************************/
+// it is not affected by the changes of the system clock (e.g. NTP), so it is used for measuring intervals
+// GetTimeStamp() is still used for the timestamps of the log
+uint64_t GetMonotonicTime() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*(uint64_t)1000000+ts.tv_nsec/1000;
+}
+
+/**************************************************************************
+ *            addresses of the tunnel ends (IPv4 or IPv6)                 *
+ **************************************************************************/
+// the length of the address, for sendto() and bind()
+socklen_t sockaddr_inet_len(const union sockaddr_inet *address)
+{
+	return (address->sa.sa_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+// the port of the address, in host byte order
+unsigned short int sockaddr_inet_port(const union sockaddr_inet *address)
+{
+	return ntohs((address->sa.sa_family == AF_INET6) ? address->in6.sin6_port : address->in.sin_port);
+}
+
+// the address as text, for the debug messages. Like inet_ntoa(), the next call of the thread overwrites it
+char *sockaddr_inet_ntoa(const union sockaddr_inet *address)
+{
+	static __thread char text[INET6_ADDRSTRLEN];
+
+	if (address->sa.sa_family == AF_INET6) inet_ntop(AF_INET6, &address->in6.sin6_addr, text, sizeof(text));
+	else inet_ntop(AF_INET, &address->in.sin_addr, text, sizeof(text));
+	return text;
+}
+
+// fill the address from its text, with this family and port. It returns 0 if the text is not valid
+int sockaddr_inet_aton(union sockaddr_inet *address, int family, const char *text, unsigned short int port)
+{
+	memset(address, 0, sizeof(union sockaddr_inet));
+	address->sa.sa_family = family;
+
+	if (family == AF_INET6) {
+		address->in6.sin6_port = htons(port);
+		return (inet_pton(AF_INET6, text, &address->in6.sin6_addr) == 1);
+	}
+	address->in.sin_port = htons(port);
+	return inet_aton(text, &address->in.sin_addr);
+}
+
+// it is true if both addresses are the same. The ports are not compared
+bool sockaddr_inet_equal(const union sockaddr_inet *a, const union sockaddr_inet *b)
+{
+	if (a->sa.sa_family != b->sa.sa_family) return false;
+	if (a->sa.sa_family == AF_INET6) return IN6_ARE_ADDR_EQUAL(&a->in6.sin6_addr, &b->in6.sin6_addr);
+	return (a->in.sin_addr.s_addr == b->in.sin_addr.s_addr);
+}
+
+// write the first IPv6 address of the interface that is not link-local (as text). It returns -1 if there is none
+int get_interface_ipv6(const char *if_name, char *text)
+{
+	struct ifaddrs *addresses, *ifa;
+	const struct in6_addr *address;
+	int found = -1;
+
+	if (getifaddrs(&addresses) < 0) return -1;
+
+	for (ifa = addresses; ifa != NULL; ifa = ifa->ifa_next) {
+		if ((ifa->ifa_addr == NULL) || (ifa->ifa_addr->sa_family != AF_INET6) || (strcmp(ifa->ifa_name, if_name) != 0)) continue;
+
+		address = &((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr;
+		if (IN6_IS_ADDR_LINKLOCAL(address)) continue;
+
+		inet_ntop(AF_INET6, address, text, INET6_ADDRSTRLEN);
+		found = 0;
+		break;
+	}
+	freeifaddrs(addresses);
+	return found;
+}
+
 /**************************************************************************
  * ToByte: convert an array of booleans to a char                         *
  **************************************************************************/
@@ -397,2397 +812,3530 @@ int date_and_time(char buffer[25])
 }
 
 /**************************************************************************
- *                   build the multiplexed packet                         *
+ *                   batched sending of muxed packets                     *
  **************************************************************************/
-// it takes all the variables where packets are stored, and builds a multiplexed packet
-// the variables are:
-//	- prot[MAXPKTS][SIZE_PROTOCOL_FIELD]	the protocol byte of each packet
-//	- size_separators_to_mux[MAXPKTS]		the size of each separator (1 or 2 bytes). Protocol byte not included
-//	- separators_to_mux[MAXPKTS][2]			the separators
-//	- size_packets_to_mux[MAXPKTS]			the size of each packet to be multiplexed
-//	- packets_to_mux[MAXPKTS][BUFSIZE]		the packet to be multiplexed
-
-// the multiplexed packet is stored in mux_packet[BUFSIZE]
-// the length of the multiplexed packet is returned by this function
-uint16_t build_multiplexed_packet ( int num_packets, int single_prot, unsigned char prot[MAXPKTS][SIZE_PROTOCOL_FIELD], uint16_t size_separators_to_mux[MAXPKTS], unsigned char separators_to_mux[MAXPKTS][3], uint16_t size_packets_to_mux[MAXPKTS], unsigned char packets_to_mux[MAXPKTS][BUFSIZE], unsigned char mux_packet[BUFSIZE])
+// if the size of the batch is 1, each muxed packet is sent immediately with sendto()
+// otherwise, a copy of the packet is stored, and all the stored packets are sent
+// with a single sendmmsg() call when the batch is full or when it is flushed
+void init_send_batch(struct send_batch *batch, int fd, int max_msgs)
 {
-	int k, l;
-	int length = 0;
-
-	// for each packet, write the protocol field (if required), the separator and the packet itself
-	for (k = 0; k < num_packets ; k++) {
-
-		if ( PROTOCOL_FIRST ) {
-			// add the 'Protocol' field if necessary
-			if ( (k==0) || (single_prot == 0 ) ) {		// the protocol field is always present in the first separator (k=0), and maybe in the rest
-				for (l = 0; l < SIZE_PROTOCOL_FIELD ; l++ ) {
-					mux_packet[length] = prot[k][l];
-					length ++;
-				}
-			}
-	
-			// add the separator
-			for (l = 0; l < size_separators_to_mux[k] ; l++) {
-				mux_packet[length] = separators_to_mux[k][l];
-				length ++;
-			}
-		} else {
-			// add the separator
-			for (l = 0; l < size_separators_to_mux[k] ; l++) {
-				mux_packet[length] = separators_to_mux[k][l];
-				length ++;
-			}
-			// add the 'Protocol' field if necessary
-			if ( (k==0) || (single_prot == 0 ) ) {		// the protocol field is always present in the first separator (k=0), and maybe in the rest
-				for (l = 0; l < SIZE_PROTOCOL_FIELD ; l++ ) {
-					mux_packet[length] = prot[k][l];
-					length ++;
-				}
-			}
-		}
+	int k;
+
+	batch->fd = fd;
+	batch->max_msgs = max_msgs;
+	batch->num_msgs = 0;
+
+	memset(batch->msgs, 0, sizeof(batch->msgs));
+	for (k = 0; k < MAXBATCH; k++) {
+		batch->iov[k].iov_base = batch->buffers[k];
+		batch->msgs[k].msg_hdr.msg_iov = &batch->iov[k];
+		batch->msgs[k].msg_hdr.msg_iovlen = 1;
+		batch->msgs[k].msg_hdr.msg_name = &batch->dests[k];
+		batch->msgs[k].msg_hdr.msg_namelen = sizeof(batch->dests[k]);	// set again for each packet
+	}
+}
+
+// send all the stored packets. It returns the number of packets sent
+int flush_send_batch(struct send_batch *batch, struct pps_counters *counters)
+{
+	int sent = 0;
+	int ret;
+
+	while (sent < batch->num_msgs) {
+		ret = sendmmsg(batch->fd, &batch->msgs[sent], batch->num_msgs - sent, 0);
+		counters->net_sends++;
 
-		// add the bytes of the packet itself
-		for (l = 0; l < size_packets_to_mux[k] ; l++) {
-			mux_packet[length] = packets_to_mux[k][l];
-			length ++;
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			perror("sendmmsg()");
+			break;
 		}
+		sent = sent + ret;
 	}
-	return length;
+	batch->num_msgs = 0;
+	return sent;
 }
 
-
 /**************************************************************************
- *       predict the size of the multiplexed packet                       *
+ *                   batched reception of muxed packets                   *
  **************************************************************************/
-// it takes all the variables where packets are stored, and predicts the size of a multiplexed packet including all of them
-// the variables are:
-//	- prot[MAXPKTS][SIZE_PROTOCOL_FIELD]	the protocol byte of each packet
-//	- size_separators_to_mux[MAXPKTS]			the size of each separator (1 or 2 bytes). Protocol byte not included
-//	- separators_to_mux[MAXPKTS][2]				the separators
-//	- size_packets_to_mux[MAXPKTS]				the size of each packet to be multiplexed
-//	- packets_to_mux[MAXPKTS][BUFSIZE]		the packet to be multiplexed
-
-// the length of the multiplexed packet is returned by this function
-uint16_t predict_size_multiplexed_packet ( int num_packets, int single_prot, unsigned char prot[MAXPKTS][SIZE_PROTOCOL_FIELD], uint16_t size_separators_to_mux[MAXPKTS], unsigned char separators_to_mux[MAXPKTS][3], uint16_t size_packets_to_mux[MAXPKTS], unsigned char packets_to_mux[MAXPKTS][BUFSIZE])
+// the packets waiting in the raw socket (up to 'max_msgs') are received with a single recvmmsg()
+// in the slots of the batch, and then demuxed one by one without copying them
+void init_recv_batch(struct recv_batch *batch, int fd, int max_msgs)
 {
-	int k, l;
-	int length = 0;
+	int k;
+
+	batch->fd = fd;
+	batch->max_msgs = max_msgs;
+	batch->num_msgs = 0;
+	batch->next = 0;
+
+	memset(batch->msgs, 0, sizeof(batch->msgs));
+	for (k = 0; k < MAXBATCH; k++) {
+		batch->iov[k].iov_base = batch->buffers[k];
+		batch->iov[k].iov_len = BUFSIZE;
+		batch->msgs[k].msg_hdr.msg_iov = &batch->iov[k];
+		batch->msgs[k].msg_hdr.msg_iovlen = 1;
+		batch->msgs[k].msg_hdr.msg_name = &batch->sources[k];
+	}
+}
 
-	// for each packet, read the protocol field (if present), the separator and the packet itself
-	for (k = 0; k < num_packets ; k++) {
+// receive the packets waiting in the socket, without blocking. It returns the number of packets received
+int fill_recv_batch(struct recv_batch *batch)
+{
+	int ret, k;
 
-		// count the 'Protocol' field if necessary
-		if ( (k==0) || (single_prot == 0 ) ) {		// the protocol field is always present in the first separator (k=0), and maybe in the rest
-			for (l = 0; l < SIZE_PROTOCOL_FIELD ; l++ ) {
-				length ++;
-			}
-		}
-	
-		// count the separator
-		for (l = 0; l < size_separators_to_mux[k] ; l++) {
-			length ++;
-		}
+	for (k = 0; k < batch->max_msgs; k++) {
+		batch->msgs[k].msg_hdr.msg_namelen = sizeof(batch->sources[k]);	// set again for each packet
+	}
+	do {
+		ret = recvmmsg(batch->fd, batch->msgs, batch->max_msgs, MSG_DONTWAIT, NULL);
+	} while ((ret < 0) && (errno == EINTR));
 
-		// count the bytes of the packet itself
-		for (l = 0; l < size_packets_to_mux[k] ; l++) {
-			length ++;
-		}
+	if (ret < 0) {
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) perror("recvmmsg()");
+		ret = 0;
 	}
-	return length;
+	batch->num_msgs = ret;
+	batch->next = 0;
+	return ret;
 }
 
+// send a muxed packet given as a list of fragments, or store it in the batch. It returns -1 if there is an error
+// without batching, the fragments are sent with a single sendmsg() and the stored packets are not copied
+// in a batch, the fragments are gathered into a buffer, because the stored packets will be reused before the flush
+// an urgent packet is sent at once, ahead of the packets waiting in the batch
+int send_muxed_packet(struct send_batch *batch, struct iovec *iov, int iovcnt, int length, union sockaddr_inet dest, bool urgent, struct pps_counters *counters)
+{
+	struct msghdr msg;
+	unsigned char *buffer;
+	int k;
 
-/************ Prototypes of functions used in the program ****************/
+	counters->bundles++;
 
-static int gen_random_num(const struct rohc_comp *const comp, void *const user_context);
+	if ((batch->max_msgs <= 1) || urgent) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &dest;
+		msg.msg_namelen = sockaddr_inet_len(&dest);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
 
+		counters->net_sends++;
+		return sendmsg(batch->fd, &msg, 0);
+	}
 
-/**
- * @brief Callback to print traces of the ROHC library
- *
- * @param priv_ctxt	An optional private context, may be NULL
- * @param level		The priority level of the trace
- * @param entity	The entity that emitted the trace among:
- *					\li ROHC_TRACE_COMP
- *					\li ROHC_TRACE_DECOMP
- * @param profile	The ID of the ROHC compression/decompression profile
- *					the trace is related to
- * @param format	The format string of the trace
- */
-static void print_rohc_traces(void *const priv_ctxt,
-								const rohc_trace_level_t level,
-								const rohc_trace_entity_t entity,
-								const int profile,
-								const char *const format,
-								...)
+	buffer = batch->buffers[batch->num_msgs];
+	for (k = 0; k < iovcnt; k++) {
+		memcpy(buffer, iov[k].iov_base, iov[k].iov_len);
+		buffer = buffer + iov[k].iov_len;
+	}
+	batch->iov[batch->num_msgs].iov_len = length;
+	batch->dests[batch->num_msgs] = dest;
+	batch->msgs[batch->num_msgs].msg_hdr.msg_namelen = sockaddr_inet_len(&dest);
+	batch->num_msgs++;
+
+	if (batch->num_msgs == batch->max_msgs) flush_send_batch(batch, counters);
+
+	return length;
+}
+
+
+/**************************************************************************
+ *       report the packet-per-second and system call rates               *
+ **************************************************************************/
+void report_pps(struct pps_counters *counters, unsigned long int tun2net, uint64_t now, struct trace_ring *trace)
 {
-	// Only prints ROHC messages if debug level is > 2
-	if ( debug > 2 ) {
-		va_list args;
-		va_start(args, format);
-		vfprintf(stdout, format, args);
-		va_end(args);
+	uint64_t interval = now - counters->time_last_report;
+	double rates[4];
+
+	if (interval == 0) return;
+
+	do_debug(1, "PPS: native %.0lf pps, tun reads %.0lf/s, muxed %.0lf pps, net sends %.0lf/s\n",
+		(tun2net - counters->last_tun2net) * 1000000.0 / interval,
+		(counters->tun_reads - counters->last_tun_reads) * 1000000.0 / interval,
+		(counters->bundles - counters->last_bundles) * 1000000.0 / interval,
+		(counters->net_sends - counters->last_net_sends) * 1000000.0 / interval);
+
+	if ( trace != NULL ) {
+		rates[0] = (tun2net - counters->last_tun2net) * 1000000.0 / interval;
+		rates[1] = (counters->tun_reads - counters->last_tun_reads) * 1000000.0 / interval;
+		rates[2] = (counters->bundles - counters->last_bundles) * 1000000.0 / interval;
+		rates[3] = (counters->net_sends - counters->last_net_sends) * 1000000.0 / interval;
+		trace_stats(trace, GetTimeStamp(), rates);
 	}
+
+	counters->time_last_report = now;
+	counters->last_tun2net = tun2net;
+	counters->last_tun_reads = counters->tun_reads;
+	counters->last_net_sends = counters->net_sends;
+	counters->last_bundles = counters->bundles;
 }
 
 
 /**************************************************************************
- * Functions to work with IP Header *
+ *                   event loop (select, epoll or io_uring)               *
  **************************************************************************/
+// all the backends are level-triggered: if a descriptor still has data after
+// it has been read once, it will be reported again in the next wait
 
-// Calculate IPv4 checksum
-unsigned short in_cksum(unsigned short *addr, int len)
+#ifdef HAVE_IO_URING
+// create the io_uring and map its rings. It returns -1 if there is an error
+int uring_setup(struct event_loop *loop)
 {
-register int sum = 0;
-u_short answer = 0;
-register u_short *w = addr;
-register int nleft = len;
-/*
-* Our algorithm is simple, using a 32 bit accumulator (sum), we add
-* sequential 16 bit words to it, and at the end, fold back all the
-* carry bits from the top 16 bits into the lower 16 bits.
-*/
-while (nleft > 1)
+	if (uring_rings_create(&loop->uring, 2 * MAXEVENTFDS) < 0) return -1;
+
+	// the timeout of io_uring_enter() requires IORING_ENTER_EXT_ARG (Linux 5.11)
+	if (!(loop->uring.features & IORING_FEAT_EXT_ARG)) {
+		my_err("io_uring: the kernel does not support IORING_FEAT_EXT_ARG\n");
+		uring_rings_free(&loop->uring);
+		return -1;
+	}
+
+	return 0;
+}
+
+// add a one-shot poll request for the descriptor number 'k' to the submission ring
+// one-shot requests check the readiness when they are armed, so they behave as level-triggered
+void uring_arm_poll(struct event_loop *loop, int k)
 {
-sum += *w++;
-nleft -= 2;
+	unsigned tail = *loop->uring.sq_tail;
+	unsigned index = tail & *loop->uring.sq_mask;
+	struct io_uring_sqe *sqe = &loop->uring.sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = loop->fds[k];
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = k;
+	loop->uring.sq_array[index] = index;
+
+	__atomic_store_n(loop->uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	loop->armed[k] = true;
 }
-/* mop up an odd byte, if necessary */
-if (nleft == 1)
+
+// submit the pending poll requests and wait for completions. It returns the number of ready descriptors
+int uring_wait(struct event_loop *loop, uint64_t timeout)
 {
-*(u_char *) (&answer) = *(u_char *) w;
-sum += answer;
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	unsigned head, tail;
+	int k, to_submit = 0, ret, num_ready = 0;
+
+	// re-arm the descriptors whose poll request has completed
+	for (k = 0; k < loop->num_fds; k++) {
+		if (!loop->armed[k]) {
+			uring_arm_poll(loop, k);
+			to_submit++;
+		}
+	}
+
+	ts.tv_sec = timeout / 1000000;
+	ts.tv_nsec = (timeout % 1000000) * 1000;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (uint64_t)(uintptr_t)&ts;
+
+	ret = syscall(__NR_io_uring_enter, loop->uring.ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	if ((ret < 0) && (errno != ETIME)) return -1;
+
+	// reap the completions
+	head = *loop->uring.cq_head;
+	tail = __atomic_load_n(loop->uring.cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &loop->uring.cqes[head & *loop->uring.cq_mask];
+		k = (int)cqe->user_data;
+		if ((k >= 0) && (k < loop->num_fds)) {
+			loop->armed[k] = false;
+			if (cqe->res > 0) {
+				loop->ready[k] = true;
+				num_ready++;
+			}
+		}
+		head++;
+	}
+	__atomic_store_n(loop->uring.cq_head, head, __ATOMIC_RELEASE);
+
+	return num_ready;
 }
-/* add back carry outs from top 16 bits to low 16 bits */
-sum = (sum >> 16) + (sum & 0xffff); /* add hi 16 to low 16 */
-sum += (sum >> 16); /* add carry */
-answer = ~sum; /* truncate to 16 bits */
-return (answer);
+#endif
+
+// initialize the event loop with the selected backend. It returns -1 if there is an error
+int event_loop_init(struct event_loop *loop, char backend)
+{
+	memset(loop, 0, sizeof(*loop));
+	loop->backend = backend;
+	loop->maxfd = -1;
+
+	switch (backend) {
+		case EVENT_BACKEND_SELECT:
+		break;
+
+		case EVENT_BACKEND_EPOLL:
+			if ((loop->epoll_fd = epoll_create1(0)) < 0) {
+				perror("epoll_create1()");
+				return -1;
+			}
+		break;
+
+		case EVENT_BACKEND_URING:
+#ifdef HAVE_IO_URING
+			return uring_setup(loop);
+#else
+			my_err("io_uring is not available in this build\n");
+			return -1;
+#endif
+
+		default:
+			return -1;
+	}
+	return 0;
 }
 
+// register a file descriptor to be monitored for reading. It returns -1 if there is an error
+int event_loop_add(struct event_loop *loop, int fd)
+{
+	struct epoll_event ev;
+
+	if (loop->num_fds == MAXEVENTFDS) {
+		my_err("Too many file descriptors in the event loop\n");
+		return -1;
+	}
+
+	if (loop->backend == EVENT_BACKEND_EPOLL) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = loop->num_fds;
+		if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			perror("epoll_ctl()");
+			return -1;
+		}
+	}
 
+	if (fd > loop->maxfd) loop->maxfd = fd;
+	loop->fds[loop->num_fds] = fd;
+	loop->num_fds++;
+	return 0;
+}
 
-// Buid an IPv4 Header
-void BuildIPHeader(struct iphdr *iph, uint16_t len_data,struct sockaddr_in local, struct sockaddr_in remote)
+// wait until a descriptor can be read or the timeout (microseconds) expires
+// it returns the number of ready descriptors (0 if the timeout expired), or -1 if there is an error
+int event_loop_wait(struct event_loop *loop, uint64_t timeout)
 {
-	static uint16_t counter = 0;
+	struct epoll_event evs[MAXEVENTFDS];
+	struct timeval tv;
+	fd_set rd_set;
+	int k, ret;
 
-	// clean the variable
-	memset (iph, 0, sizeof(struct iphdr));
+	memset(loop->ready, 0, sizeof(loop->ready));
 
-	iph->ihl = 5;
-	iph->version = 4;
-	iph->tos = 0;
-	iph->tot_len = htons(sizeof(struct iphdr) + len_data);
-	iph->id = htons(1234 + counter);
-	iph->frag_off = 0;	// fragment is allowed
-	iph->ttl = Linux_TTL;
-	iph->protocol = IPPROTO_SIMPLEMUX;
-	iph->saddr = inet_addr(inet_ntoa(local.sin_addr));
-	//iph->saddr = inet_addr("192.168.137.1");
-	iph->daddr = inet_addr(inet_ntoa(remote.sin_addr));
+	switch (loop->backend) {
+		case EVENT_BACKEND_SELECT:
+			FD_ZERO(&rd_set);
+			for (k = 0; k < loop->num_fds; k++) FD_SET(loop->fds[k], &rd_set);
 
-	iph->check = in_cksum((unsigned short *)iph, sizeof(struct iphdr));
-	
-	//do_debug(1, "Checksum: %i\n", iph->check);
+			tv.tv_sec = timeout / 1000000;
+			tv.tv_usec = timeout % 1000000;
 
-	counter ++;
-}
+			ret = select(loop->maxfd + 1, &rd_set, NULL, NULL, &tv);
+			if (ret <= 0) return ret;
 
+			for (k = 0; k < loop->num_fds; k++) loop->ready[k] = FD_ISSET(loop->fds[k], &rd_set);
+			return ret;
 
-// Buid a Full IP Packet
-void BuildFullIPPacket(struct iphdr iph, unsigned char *data_packet, uint16_t len_data, unsigned char *full_ip_packet)
-{
-	memset(full_ip_packet, 0, BUFSIZE);
-	memcpy((struct iphdr*)full_ip_packet, &iph, sizeof(struct iphdr));
-	memcpy((struct iphdr*)(full_ip_packet + sizeof(struct iphdr)), data_packet, len_data);
-}
+		case EVENT_BACKEND_EPOLL:
+			// epoll works with milliseconds: round up, in order not to wake up before the timeout expires
+			ret = epoll_wait(loop->epoll_fd, evs, MAXEVENTFDS, (int)((timeout + 999) / 1000));
+			if (ret <= 0) return ret;
 
+			for (k = 0; k < ret; k++) loop->ready[evs[k].data.u32] = true;
+			return ret;
 
-//Get IP header from IP packet
-void GetIpHeader(struct iphdr *iph, unsigned char *ip_packet)
-{	
-	memcpy(iph,(struct iphdr*)ip_packet,sizeof(struct iphdr));
+#ifdef HAVE_IO_URING
+		case EVENT_BACKEND_URING:
+			return uring_wait(loop, timeout);
+#endif
+	}
+	return -1;
 }
 
-//Set IP header in IP Packet
-void SetIpHeader(struct iphdr iph, unsigned char *ip_packet)
+// it returns true if the descriptor can be read after the last wait
+bool event_loop_is_ready(struct event_loop *loop, int fd)
 {
-	memcpy((struct iphdr*)ip_packet,&iph,sizeof(struct iphdr));
+	int k;
+
+	for (k = 0; k < loop->num_fds; k++) {
+		if (loop->fds[k] == fd) return loop->ready[k];
+	}
+	return false;
 }
 
+// mark a single descriptor as ready, without waiting (used for draining it)
+void event_loop_set_ready(struct event_loop *loop, int fd)
+{
+	int k;
 
+	for (k = 0; k < loop->num_fds; k++) loop->ready[k] = (loop->fds[k] == fd);
+}
 
 
 /**************************************************************************
- ************************ main program ************************************
+ *                   ROHC feedback queue                                  *
  **************************************************************************/
-int main(int argc, char *argv[]) {
+// store a copy of a feedback packet, and its peer (it may be NULL). It returns false if the queue is full, or if
+// the packet is longer than FEEDBACK_MAX_SIZE
+bool feedback_queue_push(struct feedback_queue *queue, struct peer *peer, unsigned char *data, int length)
+{
+	unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&queue->head, memory_order_acquire);
 
-	// variables for managing the network interfaces
-	int tun_fd;													// file descriptor of the tun interface(no mux packet)
-	int transport_mode_fd = 2;					// the file descriptor of the socket of the network interface
-	int network_mode_fd = 1;						// the file descriptor of the socket in Network mode
-	int feedback_fd = 3;								// the file descriptor of the socket of the feedback received from the network interface
-	int maxfd;													// maximum number of file descriptors
-	fd_set rd_set;											// rd_set is a set of file descriptors used to know which interface has received a packet
+	if ((tail - head == FEEDBACK_QUEUE_SIZE) || (length > FEEDBACK_MAX_SIZE)) return false;
 
-	char tun_if_name[IFNAMSIZ] = "";		// name of the tun interface (e.g. "tun0")
-	char mux_if_name[IFNAMSIZ] = "";		// name of the network interface (e.g. "eth0")
+	memcpy(queue->data[tail % FEEDBACK_QUEUE_SIZE], data, length);
+	queue->length[tail % FEEDBACK_QUEUE_SIZE] = length;
+	queue->peer[tail % FEEDBACK_QUEUE_SIZE] = peer;
 
-	char mode[2] = "";									// Network(N) or Transport (T) mode
+	// publish the packet
+	atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+	return true;
+}
 
-	const int on = 1;										// needed when creating a socket
+// get the oldest feedback packet without removing it. It returns its length, or -1 if the queue is empty
+int feedback_queue_peek(struct feedback_queue *queue, unsigned char **data)
+{
+	unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
 
-	struct sockaddr_in local, remote, feedback, feedback_remote, received;	// these are structs for storing sockets
+	if (head == tail) return -1;
 
-	struct iphdr ipheader;							// IP header
-	struct ifreq iface;									// network interface
+	*data = queue->data[head % FEEDBACK_QUEUE_SIZE];
+	return queue->length[head % FEEDBACK_QUEUE_SIZE];
+}
 
-	socklen_t slen = sizeof(remote);							// size of the socket. The type is like an int, but adequate for the size of the socket
-	socklen_t slen_feedback = sizeof(feedback);		// size of the socket. The type is like an int, but adequate for the size of the socket
+// the peer of the oldest feedback packet. Only called after feedback_queue_peek() has found it
+struct peer *feedback_queue_peer(struct feedback_queue *queue)
+{
+	return queue->peer[atomic_load_explicit(&queue->head, memory_order_relaxed) % FEEDBACK_QUEUE_SIZE];
+}
 
-	char remote_ip[16] = "";											// dotted quad IP string with the IP of the remote machine
-	char local_ip[16] = "";												// dotted quad IP string with the IP of the local machine     
-	unsigned short int port = PORT;								// UDP port to be used for sending the multiplexed packets
-	unsigned short int port_feedback = PORT + 1;	// UDP port to be used for sending the ROHC feedback packets, when using ROHC bidirectional
+// remove the oldest feedback packet, so its slot can be reused
+void feedback_queue_release(struct feedback_queue *queue)
+{
+	unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
 
-	// variables for storing the packets to multiplex
-	uint16_t total_length;																	// total length of the built multiplexed packet
-	unsigned char protocol_rec;															// protocol field of the received muxed packet
-	unsigned char protocol[MAXPKTS][SIZE_PROTOCOL_FIELD];		// protocol field of each packet
-	uint16_t size_separators_to_multiplex[MAXPKTS];					// stores the size of the Simplemux separator. It does not include the "Protocol" field
-	unsigned char separators_to_multiplex[MAXPKTS][3];			// stores the header ('protocol' not included) received from tun, before sending it to the network
-	uint16_t size_packets_to_multiplex[MAXPKTS];						// stores the size of the received packet
-	unsigned char packets_to_multiplex[MAXPKTS][BUFSIZE];		// stores the packets received from tun, before storing it or sending it to the network
-	unsigned char muxed_packet[BUFSIZE];										// stores the multiplexed packet
-	bool is_multiplexed_packet;															// To determine if a received packet have been multiplexed
-	unsigned char full_ip_packet[BUFSIZE];									// Full IP packet
+	atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+}
 
-	// variables for storing the packets to demultiplex
-	uint16_t nread_from_net;												// number of bytes read from network which will be demultiplexed
-	unsigned char buffer_from_net[BUFSIZE];					// stores the packet received from the network, before sending it to tun
-	unsigned char buffer_from_net_aux[BUFSIZE];			// stores the packet received from the network, before sending it to tun
-	unsigned char demuxed_packet[BUFSIZE];					// stores each demultiplexed packet
+// deliver all the queued feedback packets to the local compressor
+void deliver_queued_feedback(struct rohc_comp *compressor, struct feedback_queue *queue)
+{
+	unsigned char *data;
+	int length;
 
-	// variables for controlling the arrival and departure of packets
-	unsigned long int tun2net = 0, net2tun = 0;		// number of packets read from tun and from net
-	unsigned long int feedback_pkts = 0;					// number of ROHC feedback packets
-	int limit_numpackets_tun = 0;									// limit of the number of tun packets that can be stored. it has to be smaller than MAXPKTS
+	while ((length = feedback_queue_peek(queue, &data)) >= 0) {
+		struct rohc_buf feedback = rohc_buf_init_empty(data, FEEDBACK_MAX_SIZE);
+		feedback.len = length;
 
-	int size_threshold = 0;												// if the number of bytes stored is higher than this, a muxed packet is sent
-	int size_max;																	// maximum value of the packet size
+		//https://rohc-lib.org/support/documentation/API/rohc-doc-1.7.0/group__rohc__comp.html
+		if ( rohc_comp_deliver_feedback2 ( compressor, feedback ) == false ) {
+			do_debug(3, "Error delivering feedback to the compressor\n");
+		} else {
+			do_debug(3, "Feedback delivered to the compressor: %i bytes\n", length);
+		}
+		feedback_queue_release(queue);
+	}
+}
 
-	uint64_t timeout = MAXTIMEOUT;								// (microseconds) if a packet arrives and the timeout has expired (time from the  
-																								//previous sending), the sending is triggered. default 100 seconds
-	uint64_t period= MAXTIMEOUT;									// period. If it expires, a packet is sent
-	uint64_t microseconds_left = period;					// the time until the period expires	
+// with a ROHC pool (-W), the worker of the peer delivers the feedback before each compression
+// so the worker is the only consumer of the feedback queue, and the only user of the compressor
+void prepare_compression(struct rohc_job *job)
+{
+	struct peer *peer = ((struct mux_queue *)job->owner)->peer;
 
-	// very long unsigned integers for storing the system clock in microseconds
-	uint64_t time_last_sent_in_microsec;					// moment when the last multiplexed packet was sent
-	uint64_t time_in_microsec;										// current time
-	uint64_t time_difference;											// difference between two timestamps
+	deliver_queued_feedback(job->compressor, &peer->feedback_queue);
+}
 
-	int option;															// command line options
-	int l,j,k;
-	int num_pkts_stored_from_tun = 0;				// number of packets received and not sent from tun (stored)
-	int size_muxed_packet = 0;							// acumulated size of the multiplexed packet
-	int predicted_size_muxed_packet;				// size of the muxed packet if the arrived packet was added to it
-	int position;														// for reading the arrived multiplexed packet
-	int packet_length;											// the length of each packet inside the multiplexed bundle
-	int interface_mtu;											// the maximum transfer unit of the interface
-	int user_mtu = 0;												// the MTU specified by the user (it must be <= interface_mtu)
-	int selected_mtu;												// the MTU that will be used in the program
-	int num_demuxed_packets;								// a counter of the number of packets inside a muxed one
-	int single_protocol;										// it is 1 when the Single-Protocol-Bit of the first header is 1
-	int single_protocol_rec;								// it is the bit Single-Protocol-Bit received in a muxed packet
-	int first_header_read;									// it is 0 when the first header has not been read
-	int LXT_position;												// the position of the LXT bit. It may be 6 (non-first header) or 7 (first header)
-	int maximum_packet_length;							// the maximum lentgh of a packet. It may be 64 (first header) or 128 (non-first header)
-	int limit_length_two_bytes;							// the maximum length of a packet in order to express it in 2 bytes. It may be 8192 or 16384 (non-first header)
-	int first_header_written = 0;						// it indicates if the first header has been written or not
-	int ret;																// value returned by the "select" function
-	int drop_packet = 0;
 
-	struct timeval period_expires;					// it is used for the maximum time waiting for a new packet
+/**************************************************************************
+ *                   table of peers                                       *
+ **************************************************************************/
+// multiplicative hash of an IPv4 address. It returns a value of 'bits' bits
+uint32_t hash_ipv4(uint32_t key, int bits)
+{
+	return (key * 2654435761u) >> (32 - bits);
+}
 
-	bool bits[8];														// it is used for printing the bits of a byte in debug mode
+// hash of the address of a peer. The four words of an IPv6 address are folded into one
+uint32_t hash_address(const union sockaddr_inet *address, int bits)
+{
+	const uint32_t *words;
 
-	// ROHC header compression variables
-	int ROHC_mode = 0;			// it is 0 if ROHC is not used
-													// it is 1 for ROHC Unidirectional mode (headers are to be compressed/decompressed)
-													// it is 2 for ROHC Bidirectional Optimistic mode
-													// it is 3 for ROHC Bidirectional Reliable mode (not implemented yet)
+	if (address->sa.sa_family != AF_INET6) return hash_ipv4(address->in.sin_addr.s_addr, bits);
 
-	struct rohc_comp *compressor;           		// the ROHC compressor
-	unsigned char ip_buffer[BUFSIZE];						// the buffer that will contain the IPv4 packet to compress
-	struct rohc_buf ip_packet = rohc_buf_init_empty(ip_buffer, BUFSIZE);	
-	unsigned char rohc_buffer[BUFSIZE];					// the buffer that will contain the resulting ROHC packet
-	struct rohc_buf rohc_packet = rohc_buf_init_empty(rohc_buffer, BUFSIZE);
-	unsigned int seed;
-	rohc_status_t status;
+	words = (const uint32_t *)&address->in6.sin6_addr;
+	return hash_ipv4(words[0] ^ words[1] ^ words[2] ^ words[3], bits);
+}
 
-	struct rohc_decomp *decompressor;       		// the ROHC decompressor
-	unsigned char ip_buffer_d[BUFSIZE];					// the buffer that will contain the resulting IP decompressed packet
-	struct rohc_buf ip_packet_d = rohc_buf_init_empty(ip_buffer_d, BUFSIZE);
-	unsigned char rohc_buffer_d[BUFSIZE];				// the buffer that will contain the ROHC packet to decompress
-	struct rohc_buf rohc_packet_d = rohc_buf_init_empty(rohc_buffer_d, BUFSIZE);
+// find the peer with this address (the port is not compared). It returns NULL if there is no such peer
+struct peer *peer_table_lookup(struct peer_table *table, const union sockaddr_inet *address)
+{
+	uint32_t mask = (1 << PEER_HASH_BITS) - 1;
+	uint32_t slot = hash_address(address, PEER_HASH_BITS);
 
-	/* structures to handle ROHC feedback */
-	unsigned char rcvd_feedback_buffer_d[BUFSIZE];	// the buffer that will contain the ROHC feedback packet received
-	struct rohc_buf rcvd_feedback = rohc_buf_init_empty(rcvd_feedback_buffer_d, BUFSIZE);
+	// the table is never more than half full, so an empty slot is always found
+	while (table->by_address[slot] != NULL) {
+		if (sockaddr_inet_equal(&table->by_address[slot]->remote, address)) return table->by_address[slot];
+		slot = (slot + 1) & mask;
+	}
+	return NULL;
+}
 
-	unsigned char feedback_send_buffer_d[BUFSIZE];	// the buffer that will contain the ROHC feedback packet to be sent
-	struct rohc_buf feedback_send = rohc_buf_init_empty(feedback_send_buffer_d, BUFSIZE);
+// add a peer, or return the existing one if the address is already in the table
+// it returns NULL if the address is not valid (or not of the family of the table) or the table is full
+struct peer *peer_table_add(struct peer_table *table, char *remote_ip, unsigned short int port, unsigned short int port_feedback)
+{
+	struct peer *peer;
+	union sockaddr_inet address;
+	uint32_t mask = (1 << PEER_HASH_BITS) - 1;
+	uint32_t slot;
+	int k;
 
+	if (sockaddr_inet_aton(&address, table->family, remote_ip, port) == 0) return NULL;
 
-	/* variables for the log file */
-	char log_file_name[100] = "";       // name of the log file	
-	FILE *log_file = NULL;							// file descriptor of the log file
-	int file_logging = 0;								// it is set to 1 if logging into a file is enabled
+	peer = peer_table_lookup(table, &address);
+	if (peer != NULL) return peer;
 
+	if (table->num_peers == MAXPEERS) return NULL;
 
+	peer = calloc(1, sizeof(struct peer));
+	if (peer == NULL) return NULL;
 
-	/************** Check command line options *********************/
-	progname = argv[0];		// argument used when calling the program
+	// assign the destination address and port for the multiplexed packets
+	peer->remote = address;								// remote IP and port
 
-	// no arguments specified by the user. Print usage and finish
-	if (argc == 1 ) {
-		usage ();
+	// assign the destination address and port for the feedback packets
+	sockaddr_inet_aton(&peer->feedback_remote, table->family, remote_ip, port_feedback);	// the same IP as the remote one
 
-	} else {
-		while((option = getopt(argc, argv, "i:e:M:c:p:n:b:t:P:l:d:r:m:hL")) > 0) {
+	// the packets are not classified unless the queue of realtime packets is enabled
+	peer->num_queues = 1;
+	for (k = 0; k < NUM_MUX_CLASSES; k++) {
+		peer->queues[k].peer = peer;
+		peer->queues[k].mux_class = k;
+		peer->queues[k].urgent = (k == MUX_CLASS_REALTIME);
+		mux_encoder_init(&peer->queues[k].encoder);		// no packet stored yet
+	}
 
-			switch(option) {
-				case 'd':
-					debug = atoi(optarg);		/* 0:no debug; 1:minimum debug; 2:medium debug; 3:maximum debug (incl. ROHC) */
-					break;
-				case 'r':
-					ROHC_mode = atoi(optarg);	/* 0:no ROHC; 1:Unidirectional; 2: Bidirectional Optimistic; 3: Bidirectional Reliable (not available yet)*/ 
-					break;
-				case 'h':						/* help */
-					usage();
-					break;
-				case 'i':						/* put the name of the tun interface (e.g. "tun0") in "tun_if_name" */
-					strncpy(tun_if_name, optarg, IFNAMSIZ-1);
-					break;
-				case 'M':						/* Network (N) or Transport (T) mode */
-					strncpy(mode, optarg, 1);
-					break;
-				case 'e':						/* the name of the network interface (e.g. "eth0") in "mux_if_name" */
-					strncpy(mux_if_name, optarg, IFNAMSIZ-1);
-					break;
-				case 'c':						/* destination address of the machine where the tunnel ends */
-					strncpy(remote_ip, optarg, 15);
-					break;
-				case 'l':						/* name of the log file */
-					strncpy(log_file_name, optarg, 100);
-					file_logging = 1;
-					break;
-				case 'L':						/* name of the log file assigned automatically */
-					date_and_time(log_file_name);
-					file_logging = 1;
-					break;
-				case 'p':						/* port number */
-					port = atoi(optarg);		/* atoi Parses a string interpreting its content as an int */
-					port_feedback = port + 1;
-					break;
-				case 'n':						/* limit of the number of packets for triggering a muxed packet */
-					limit_numpackets_tun = atoi(optarg);
-					break;
-				case 'm':						/* MTU forced by the user */
-					user_mtu = atoi(optarg);
-					break;
-				case 'b':						/* size threshold (in bytes) for triggering a muxed packet */
-					size_threshold = atoi(optarg);
-					break;
-				case 't':						/* timeout for triggering a muxed packet */
-					timeout = atof(optarg);
-					break;
-				case 'P':						/* Period for triggering a muxed packet */
-					period = atof(optarg);
-					break;
-				default:
-					my_err("Unknown option %c\n", option);
-					usage();
-					break;
-			}
+	table->peers[table->num_peers] = peer;
+	table->num_peers++;
+
+	slot = hash_address(&address, PEER_HASH_BITS);
+	while (table->by_address[slot] != NULL) slot = (slot + 1) & mask;
+	table->by_address[slot] = peer;
+
+	return peer;
+}
+
+// route a prefix to a peer. 'prefix' is in host byte order. It returns -1 if the table is full
+int peer_table_add_route(struct peer_table *table, uint32_t prefix, int length, struct peer *peer)
+{
+	uint32_t mask = (1 << ROUTE_HASH_BITS) - 1;
+	uint32_t slot;
+
+	if (length < 0 || length > 32) return -1;
+	if (length < 32) prefix = prefix & ~(0xFFFFFFFFu >> length);
+
+	slot = hash_ipv4(prefix + length, ROUTE_HASH_BITS);
+	while (table->routes[slot].peer != NULL) {
+		// the prefix already exists: it is routed to the new peer
+		if ((table->routes[slot].prefix == prefix) && (table->routes[slot].length == length)) {
+			table->routes[slot].peer = peer;
+			if (length == 0) table->default_peer = peer;
+			return 0;
 		}
+		slot = (slot + 1) & mask;
+	}
 
-		argv += optind;
-		argc -= optind;
+	if (table->num_routes == MAXROUTES) return -1;
 
-		if(argc > 0) {
-			my_err("Too many options\n");
-			usage();
+	table->routes[slot].prefix = prefix;
+	table->routes[slot].length = length;
+	table->routes[slot].peer = peer;
+	table->num_routes++;
+	if (length == 0) table->default_peer = peer;
+	table->prefix_lengths |= (1ULL << length);
+	return 0;
+}
+
+// find the peer of the longest prefix matching a destination (network byte order)
+// only the lengths in use are probed, from the longest to the shortest
+// it returns NULL if no prefix matches
+struct peer *peer_table_route(struct peer_table *table, in_addr_t destination)
+{
+	uint32_t address = ntohl(destination);
+	uint32_t mask = (1 << ROUTE_HASH_BITS) - 1;
+	uint64_t lengths = table->prefix_lengths;
+	uint32_t prefix, slot;
+	int length;
+
+	while (lengths != 0) {
+		length = 63 - __builtin_clzll(lengths);
+		lengths = lengths & ~(1ULL << length);
+
+		prefix = (length == 32) ? address : address & ~(0xFFFFFFFFu >> length);
+		slot = hash_ipv4(prefix + length, ROUTE_HASH_BITS);
+		while (table->routes[slot].peer != NULL) {
+			if ((table->routes[slot].prefix == prefix) && (table->routes[slot].length == length)) return table->routes[slot].peer;
+			slot = (slot + 1) & mask;
 		}
+	}
+	return NULL;
+}
 
+// the classifier of a packet ring (-I): it takes the IPv4 packets to the prefixes of the peers, and the
+// other packets (e.g. IPv6) if there is a peer of 0.0.0.0/0, as peer_table_route() does
+int peer_table_filter(struct peer_table *table, struct packet_ring *ring)
+{
+	static uint32_t prefixes[MAXROUTES];
+	static int lengths[MAXROUTES];
+	int num_prefixes = 0;
+	int slot;
+
+	for (slot = 0; slot < (1 << ROUTE_HASH_BITS); slot++) {
+		if (table->routes[slot].peer == NULL) continue;
+		prefixes[num_prefixes] = table->routes[slot].prefix;
+		lengths[num_prefixes] = table->routes[slot].length;
+		num_prefixes++;
+	}
+	return packet_ring_filter(ring, prefixes, lengths, num_prefixes, table->default_peer != NULL);
+}
 
-		// check interface options
-		if(*tun_if_name == '\0') {
-			my_err("Must specify a tun interface name for native packets ('-i' option)\n");
-			usage();
-		} else if(*remote_ip == '\0') {
-			my_err("Must specify the address of the peer\n");
-			usage();
-		} else if(*mux_if_name == '\0') {
-			my_err("Must specify local interface name for multiplexed packets\n");
-			usage();
-		} 
 
+/**************************************************************************
+ *                   classify the packets read from tun                   *
+ **************************************************************************/
+// the IPv4 and IPv6 packets marked with DSCP EF, VOICE-ADMIT or CS5, and the UDP packets sent to the ports that
+// rtp_detect() considers RTP, go to the realtime queue. The rest (including the packets that are not IP) are bulk
+// the packet is classified before compressing it. The IPv6 extension headers are not followed
+int classify_packet(unsigned char *packet, int size)
+{
+	int header_length;
+	int dscp;
+	bool udp;
+	uint16_t dport;
+
+	if ( ( size >= IPv4_HEADER_SIZE ) && ( ( packet[0] >> 4 ) == 4 ) ) {
+		dscp = packet[1] >> 2;
+		header_length = ( packet[0] & 0x0F ) * 4;
+
+		// a UDP packet, and the first fragment (the others have no UDP header)
+		udp = ( packet[9] == IPPROTO_UDP ) && ( ( ( packet[6] & 0x1F ) | packet[7] ) == 0 );
+	} else if ( ( size >= IPv6_HEADER_SIZE ) && ( ( packet[0] >> 4 ) == 6 ) ) {
+		dscp = ( ( ( packet[0] & 0x0F ) << 4 ) | ( packet[1] >> 4 ) ) >> 2;		// the Traffic Class is in bits 4 to 11
+		header_length = IPv6_HEADER_SIZE;
+		udp = ( packet[6] == IPPROTO_UDP );
+	} else {
+		return MUX_CLASS_BULK;
+	}
 
-		// check if NETWORK or TRANSPORT mode have been selected (mandatory)
-		else if((strcmp(mode, "N") != 0) && (strcmp(mode, "T") != 0)) {
-			my_err("Must specify a valid mode ('-M' option)\n");
-			usage();
-		} 
-	
+	if ( ( dscp == DSCP_EF ) || ( dscp == DSCP_VOICE_ADMIT ) || ( dscp == DSCP_CS5 ) ) return MUX_CLASS_REALTIME;
 
-		/* open the log file */
-		if ( file_logging == 1 ) {
-			if (strcmp(log_file_name, "stdout") == 0) {
-				log_file = stdout;
-			} else {
-				log_file = fopen(log_file_name, "w");
-				if (log_file == NULL) my_err("Error: cannot open the log file!\n");
-			}
-		}
+	if ( udp && ( size >= header_length + UDP_HEADER_SIZE ) ) {
+		memcpy(&dport, packet + header_length + 2, sizeof(dport));
+		if ( is_rtp_port(ntohs(dport)) ) return MUX_CLASS_REALTIME;
+	}
+	return MUX_CLASS_BULK;
+}
 
-		// check debug option
-		if ( debug < 0 ) debug = 0;
-		else if ( debug > 3 ) debug = 3;
-		do_debug ( 1 , "debug level set to %i\n", debug);
 
+/**************************************************************************
+ *                   build the multiplexed packet                         *
+ **************************************************************************/
+// it takes the packets stored in the encoder of a mux queue, and builds a multiplexed packet
 
-		// check ROHC option
-		if ( ROHC_mode < 0 ) {
-			ROHC_mode = 0;
-		} else if ( ROHC_mode > 2 ) { 
-			ROHC_mode = 2;
-		}
+// the packets are not copied: the multiplexed packet is the list of fragments 'bundle->iov':
+//	- iov[0] is the IP header 'bundle->ipheader' (or 'bundle->ip6header'), only sent in Network mode
+//	- then, for each packet, its separator and 'Protocol' field, and the packet itself
+// the length of the multiplexed packet (without the IP header) is returned by this function
+uint16_t build_multiplexed_packet ( struct mux_bundle *bundle, struct mux_encoder *encoder )
+{
+	bundle->iov[0].iov_base = &bundle->ipheader;
+	bundle->iov[0].iov_len = sizeof(struct iphdr);
+	bundle->num_iov = 1 + 2 * encoder->num_packets;
 
+	// for each packet, the protocol field (if required) and the separator, and the packet itself
+	return mux_encoder_fragments(encoder, bundle->iov + 1);
+}
 
-		/*** initialize tun interface for native packets ***/
-		if ( (tun_fd = tun_alloc(tun_if_name, IFF_TUN | IFF_NO_PI)) < 0 ) {
-			my_err("Error connecting to tun interface for capturing native packets %s\n", tun_if_name);
-			exit(1);
-		}
-		do_debug(1, "Successfully connected to interface for native packets %s\n", tun_if_name);
 
+/************ Prototypes of functions used in the program ****************/
 
-		// initialize header IP to be used when receiving a packet in NETWORK mode
-		if ( strcmp(mode, "N") != 0 ) {
-			memset(&ipheader, 0, sizeof(struct iphdr));
-		}
+static int gen_random_num(const struct rohc_comp *const comp, void *const user_context);
 
-		/*** Request a socket for writing and receiving muxed packets in TRANSPORT mode ***/
-		// AF_INET (exactly the same as PF_INET)
-		// transport_protocol: 	SOCK_DGRAM creates a UDP socket (SOCK_STREAM would create a TCP socket)	
-		// transport_mode_fd is the file descriptor of the socket for managing arrived multiplexed packets
-		if ( ( transport_mode_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP) ) < 0) {
-			perror("socket()");
-			exit(1);
-		}
 
+/**
+ * @brief Callback to print traces of the ROHC library
+ *
+ * @param priv_ctxt	An optional private context, may be NULL
+ * @param level		The priority level of the trace
+ * @param entity	The entity that emitted the trace among:
+ *					\li ROHC_TRACE_COMP
+ *					\li ROHC_TRACE_DECOMP
+ * @param profile	The ID of the ROHC compression/decompression profile
+ *					the trace is related to
+ * @param format	The format string of the trace
+ */
+static void print_rohc_traces(void *const priv_ctxt,
+								const rohc_trace_level_t level,
+								const rohc_trace_entity_t entity,
+								const int profile,
+								const char *const format,
+								...)
+{
+	// Only prints ROHC messages if debug level is > 2
+	if ( debug > 2 ) {
+		va_list args;
+		va_start(args, format);
+		vfprintf(stdout, format, args);
+		va_end(args);
+	}
+}
 
-		/*** Request a socket for feedback packets ***/
-		// AF_INET (exactly the same as PF_INET)
-		// transport_protocol: 	SOCK_DGRAM creates a UDP socket (SOCK_STREAM would create a TCP socket)	
-		// feedback_fd is the file descriptor of the socket for managing arrived feedback packets
-		// I only need the feedback socket if ROHC is activated 
-		if ( ( feedback_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP) ) < 0) {
-			perror("socket()");
-			exit(1);
-		}
 
+/**************************************************************************
+ * Functions to work with IP Header *
+ **************************************************************************/
 
-		// Use ioctl() to look up interface index which we will use to bind socket descriptor "transport_mode_fd" to
-		memset (&iface, 0, sizeof (iface));
-		snprintf (iface.ifr_name, sizeof (iface.ifr_name), "%s", mux_if_name);
-		if (ioctl (transport_mode_fd, SIOCGIFINDEX, &iface) < 0) {
-			perror ("ioctl() failed to find interface ");
-			return (EXIT_FAILURE);
-		}
+// Calculate IPv4 checksum
+// the data is added 64 bits at a time (with end-around carry), which gives the same one's complement
+// sum as adding 16-bit words, and then folded to 16 bits. This works in any byte order
+unsigned short in_cksum(unsigned short *addr, int len)
+{
+	const unsigned char *w = (const unsigned char *)addr;
+	uint64_t sum = 0;								// 64 bit accumulator
+	uint64_t chunk;
+	uint16_t word;
+	u_short answer = 0;
+
+	while (len >= 8) {
+		memcpy(&chunk, w, 8);						// the data may not be aligned
+		sum += chunk;
+		if (sum < chunk) sum++;						// end-around carry
+		w += 8;
+		len -= 8;
+	}
 
+	/* fold to 32 bits, so that the remaining words cannot overflow */
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
 
-		if (ioctl (feedback_fd, SIOCGIFINDEX, &iface) < 0) {
-			perror ("ioctl() failed to find interface ");
-			return (EXIT_FAILURE);
-		}
+	while (len > 1) {
+		memcpy(&word, w, 2);
+		sum += word;
+		w += 2;
+		len -= 2;
+	}
 
-		/*** get the MTU of the local interface ***/
-		if (ioctl(transport_mode_fd, SIOCGIFMTU, &iface) == -1) interface_mtu = 0;
-		else interface_mtu = iface.ifr_mtu;
+	/* mop up an odd byte, if necessary */
+	if (len == 1) {
+		*(u_char *) (&answer) = *w;
+		sum += answer;
+	}
 
-		/*** check if the user has specified a bad MTU ***/
-		do_debug (1, "Local interface MTU: %i\t ", interface_mtu);
-		if ( user_mtu > 0 ) {
-			do_debug (1, "User-selected MTU: %i\n", user_mtu);
-		}
+	/* add back carry outs from top 16 bits to low 16 bits */
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	answer = ~sum; /* truncate to 16 bits */
+	return (answer);
+}
 
-		if (user_mtu > interface_mtu) {
-			perror ("Error: The MTU specified by the user is higher than the MTU of the interface\n");
-			exit (1);
-		} else {
 
-			// if the user has specified a MTU, I use it instead of network MTU
-			if (user_mtu > 0) {
-				selected_mtu = user_mtu;
+// Build the IPv4 header template of the bundles sent to a peer in network mode
+// Only 'tot_len' and 'id' change between bundles, so its checksum is computed once
+void init_ipv4_header_template(struct peer *peer, const struct sockaddr_in *local)
+{
+	struct iphdr *iph = &peer->ip_template;
 
-			// otherwise, use the MTU of the local interface
-			} else {
-				selected_mtu = interface_mtu;
-			}
-		}
+	// clean the variable
+	memset (iph, 0, sizeof(struct iphdr));
 
-		if (selected_mtu > BUFSIZE ) {
-			do_debug (1, "Selected MTU: %i\t Size of the buffer for packet storage: %i\n", selected_mtu, BUFSIZE);
-			perror ("Error: The MTU selected is higher than the size of the buffer defined.\nCheck #define BUFSIZE at the beginning of this application\n");
-			exit (1);
-		}
+	iph->ihl = 5;
+	iph->version = 4;
+	iph->tos = 0;
+	iph->tot_len = htons(sizeof(struct iphdr));
+	iph->id = htons(1234);
+	iph->frag_off = 0;	// fragment is allowed
+	iph->ttl = Linux_TTL;
+	iph->protocol = IPPROTO_SIMPLEMUX;
+	iph->saddr = local->sin_addr.s_addr;
+	iph->daddr = peer->remote.in.sin_addr.s_addr;
 
+	iph->check = in_cksum((unsigned short *)iph, sizeof(struct iphdr));
 
-		/*** get the IP address of the local interface ***/
-		if (ioctl(transport_mode_fd, SIOCGIFADDR, &iface) < 0) {
-			perror ("ioctl() failed to find the IP address for local interface ");
-			return (EXIT_FAILURE);
-		} else {
-			// source IPv4 address: it is the one of the interface
-			strcpy (local_ip, inet_ntoa(((struct sockaddr_in *)&iface.ifr_addr)->sin_addr));
-			do_debug(1, "Local IP for multiplexing %s\n", local_ip);
-		}
+	peer->ip_id = 0;
+}
 
+// Build the IPv6 header template of the bundles sent to a peer in network mode
+// There is no checksum, and only 'ip6_plen' changes between bundles
+void init_ipv6_header_template(struct peer *peer, const struct sockaddr_in6 *local)
+{
+	struct ip6_hdr *ip6h = &peer->ip6_template;
 
-		// assign the destination address and port for the multiplexed packets
-		memset(&remote, 0, sizeof(remote));
-		remote.sin_family = AF_INET;
-		remote.sin_addr.s_addr = inet_addr(remote_ip);		// remote IP
-		remote.sin_port = htons(port);						// remote port
+	memset (ip6h, 0, sizeof(struct ip6_hdr));
 
-		// assign the local address and port for the multiplexed packets
-		memset(&local, 0, sizeof(local));
-		local.sin_family = AF_INET;
-		local.sin_addr.s_addr = inet_addr(local_ip);		// local IP; "htonl(INADDR_ANY)" would take the IP address of any interface
-		local.sin_port = htons(port);						// local port
+	ip6h->ip6_flow = htonl(6 << 28);	// version 6, traffic class 0, flow label 0
+	ip6h->ip6_plen = 0;
+	ip6h->ip6_nxt = IPPROTO_SIMPLEMUX;
+	ip6h->ip6_hlim = Linux_TTL;
+	ip6h->ip6_src = local->sin6_addr;
+	ip6h->ip6_dst = peer->remote.in6.sin6_addr;
+}
 
-		// bind the socket "transport_mode_fd" to the local address and port
-		if (*mode == TRANSPORT_MODE ) {
-		 	if (bind(transport_mode_fd, (struct sockaddr *)&local, sizeof(local))==-1) {
-				perror("bind");
-			} else {
-				do_debug(1, "Socket for multiplexing open. Remote IP %s. Port %i\n", inet_ntoa(remote.sin_addr), htons(remote.sin_port)); 
-			}
-		}
+// Build the tunneling header template of a peer, with the family of its address
+void init_ip_header_template(struct peer *peer, const union sockaddr_inet *local)
+{
+	if (peer->remote.sa.sa_family == AF_INET6) init_ipv6_header_template(peer, &local->in6);
+	else init_ipv4_header_template(peer, &local->in);
+}
 
 
-		// assign the destination address and port for the feedback packets
-		memset(&feedback_remote, 0, sizeof(feedback_remote));
-		feedback_remote.sin_family = AF_INET;
-		feedback_remote.sin_addr.s_addr = inet_addr(remote_ip);	// remote feedback IP (the same IP as the remote one)
-		feedback_remote.sin_port = htons(port_feedback);		// remote feedback port
+// Buid an IPv4 Header from the template of the peer
+// the checksum is updated incrementally for the new 'tot_len' and 'id' (RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m'))
+void BuildIPHeader(struct iphdr *iph, uint16_t len_data, struct peer *peer)
+{
+	const struct iphdr *template = &peer->ip_template;
+	uint32_t sum;
 
-		// assign the source address and port to the feedback packets
-		memset(&feedback, 0, sizeof(feedback));
-		feedback.sin_family = AF_INET;
-		feedback.sin_addr.s_addr = inet_addr(local_ip);		// local IP
-		feedback.sin_port = htons(port_feedback);			// local port (feedback)
+	*iph = *template;
 
-		// bind the socket "feedback_fd" to the local feedback address (the same used for multiplexing) and port
-	 	if (bind(feedback_fd, (struct sockaddr *)&feedback, sizeof(feedback))==-1) {
-			perror("bind");
-		} else {
-			do_debug(1, "Socket for feedback open. Remote IP %s. Port %i\n", inet_ntoa(feedback_remote.sin_addr), htons(feedback_remote.sin_port)); 
-		}
+	iph->tot_len = htons(sizeof(struct iphdr) + len_data);
+	iph->id = htons(1234 + peer->ip_id);
+
+	sum = (uint16_t)~template->check;
+	sum += (uint16_t)~template->tot_len + iph->tot_len;
+	sum += (uint16_t)~template->id + iph->id;
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	iph->check = ~sum;
+
+	//do_debug(1, "Checksum: %i\n", iph->check);
+
+	peer->ip_id ++;
+}
 
+// Build an IPv6 Header from the template of the peer
+void BuildIPv6Header(struct ip6_hdr *ip6h, uint16_t len_data, struct peer *peer)
+{
+	*ip6h = peer->ip6_template;
+	ip6h->ip6_plen = htons(len_data);
+}
+
+// Build the tunneling header of a bundle (network mode), IPv4 or IPv6. It returns its size
+int BuildTunnelHeader(struct mux_bundle *bundle, uint16_t len_data, struct peer *peer)
+{
+	if (peer->remote.sa.sa_family == AF_INET6) {
+		BuildIPv6Header(&bundle->ip6header, len_data, peer);
+		bundle->iov[0].iov_len = sizeof(struct ip6_hdr);
+	} else {
+		BuildIPHeader(&bundle->ipheader, len_data, peer);
+		bundle->iov[0].iov_len = sizeof(struct iphdr);
+	}
+	return bundle->iov[0].iov_len;
+}
+
+
+//Get IP header from IP packet
+void GetIpHeader(struct iphdr *iph, unsigned char *ip_packet)
+{	
+	memcpy(iph,(struct iphdr*)ip_packet,sizeof(struct iphdr));
+}
+
+//Set IP header in IP Packet
+void SetIpHeader(struct iphdr iph, unsigned char *ip_packet)
+{
+	memcpy((struct iphdr*)ip_packet,&iph,sizeof(struct iphdr));
+}
+
+
+
+
+/**************************************************************************
+ *            create a ROHC compressor (one per peer)                     *
+ **************************************************************************/
+// see the API here: https://rohc-lib.org/support/documentation/API/rohc-doc-1.7.0/
+// it returns NULL if there is an error
+struct rohc_comp *create_rohc_compressor()
+{
+	struct rohc_comp *compressor;   		// the ROHC compressor
+
+	/* Create a ROHC compressor with Large CIDs and the largest MAX_CID
+	 * possible for large CIDs */
+	compressor = rohc_comp_new2(ROHC_LARGE_CID, ROHC_LARGE_CID_MAX, gen_random_num, NULL);
+	if(compressor == NULL)
+	{
+		fprintf(stderr, "failed create the ROHC compressor\n");
+		return NULL;
+	}
+
+	do_debug(1, "ROHC compressor created. Profiles: ");
+
+	// Set the callback function to be used for detecting RTP.
+	// RTP is not detected automatically. So you have to create a callback function "rtp_detect" where you specify the conditions.
+	// In our case we will consider as RTP the UDP packets belonging to certain ports
+    if(!rohc_comp_set_rtp_detection_cb(compressor, rtp_detect, NULL))
+    {
+            fprintf(stderr, "failed to set RTP detection callback\n");
+            rohc_comp_free(compressor);
+            return NULL;
+    }
+
+	// set the function that will manage the ROHC compressing traces (it will be 'print_rohc_traces')
+	if(!rohc_comp_set_traces_cb2(compressor, print_rohc_traces, NULL))
+	{
+		fprintf(stderr, "failed to set the callback for traces on compressor\n");
+		rohc_comp_free(compressor);
+		return NULL;
+	}
+
+	/* Enable the ROHC compression profiles */
+	if(!rohc_comp_enable_profile(compressor, ROHC_PROFILE_UNCOMPRESSED))
+	{
+		fprintf(stderr, "failed to enable the Uncompressed compression profile\n");
+		rohc_comp_free(compressor);
+		return NULL;
+	} else {
+		do_debug(1, "Uncompressed. ");
+	}
+
+	if(!rohc_comp_enable_profile(compressor, ROHC_PROFILE_IP))
+	{
+		fprintf(stderr, "failed to enable the IP-only compression profile\n");
+		rohc_comp_free(compressor);
+		return NULL;
+	} else {
+		do_debug(1, "IP-only. ");
+	}
+
+	if(!rohc_comp_enable_profiles(compressor, ROHC_PROFILE_UDP, ROHC_PROFILE_UDPLITE, -1))
+	{
+		fprintf(stderr, "failed to enable the IP/UDP and IP/UDP-Lite compression profiles\n");
+		rohc_comp_free(compressor);
+		return NULL;
+	} else {
+		do_debug(1, "IP/UDP. IP/UDP-Lite. ");
+	}
 
-		if (*mode == NETWORK_MODE ) {
-			// create a raw socket for reading and writing multiplexed packets belonging to protocol Simplemux (protocol ID 253)
-			// Submit request for a raw socket descriptor
-			if ((network_mode_fd = socket (AF_INET, SOCK_RAW, IPPROTO_SIMPLEMUX)) < 0) {
-				perror ("Raw socket for sending muxed packets bind failed ");
-				exit (EXIT_FAILURE);
-			} else {
-				do_debug(1,"Raw socket for multiplexing open. Remote IP %s. Protocol number %i\n", inet_ntoa(remote.sin_addr), IPPROTO_SIMPLEMUX);
-			}
+	if(!rohc_comp_enable_profile(compressor, ROHC_PROFILE_RTP))
+	{
+		fprintf(stderr, "failed to enable the RTP compression profile\n");
+		rohc_comp_free(compressor);
+		return NULL;
+	} else {
+		do_debug(1, "RTP (UDP ports 1234, 36780, 33238, 5020, 5002). ");
+	}
 
-			// Set flag so socket expects us to provide IPv4 header
-			if (setsockopt (network_mode_fd, IPPROTO_IP, IP_HDRINCL, &on, sizeof (on)) < 0) {
-				perror ("setsockopt() failed to set IP_HDRINCL ");
-				exit (EXIT_FAILURE);
-			}
+	if(!rohc_comp_enable_profile(compressor, ROHC_PROFILE_ESP))
+	{
+		fprintf(stderr, "failed to enable the ESP compression profile\n");
+		rohc_comp_free(compressor);
+		return NULL;
+	} else {
+		do_debug(1, "ESP. ");
+	}
 
-			// Bind the socket "network_mode_fd" to interface index
-			// bind socket descriptor "network_mode_fd" to specified interface with setsockopt() since
-			// none of the other arguments of sendto() specify which interface to use.
-			if (setsockopt (network_mode_fd, SOL_SOCKET, SO_BINDTODEVICE, &iface, sizeof (iface)) < 0) {
-				perror ("setsockopt() failed to bind to interface ");
-				exit (EXIT_FAILURE);
-			}
-		}
+	if(!rohc_comp_enable_profile(compressor, ROHC_PROFILE_TCP))
+	{
+		fprintf(stderr, "failed to enable the TCP compression profile\n");
+		rohc_comp_free(compressor);
+		return NULL;
+	} else {
+		do_debug(1, "TCP. ");
+	}
+	do_debug(1, "\n");
 
+	// the ROHC packets longer than a bundle are split into segments
+	if(!rohc_comp_set_mrru(compressor, ROHC_MRRU))
+	{
+		fprintf(stderr, "failed to set the MRRU of the compressor\n");
+		rohc_comp_free(compressor);
+		return NULL;
+	}
 
-		// define the maximum size threshold
-		switch (*mode) {
-			case TRANSPORT_MODE:
-				size_max = selected_mtu - IPv4_HEADER_SIZE - UDP_HEADER_SIZE ;
-			break;
+	return compressor;
+}
 
-			case NETWORK_MODE:
-				size_max = selected_mtu - IPv4_HEADER_SIZE ;
-			break;
-		}
+/**************************************************************************
+ *            create a ROHC decompressor (one per peer)                   *
+ **************************************************************************/
+// it returns NULL if there is an error
+struct rohc_decomp *create_rohc_decompressor(int ROHC_mode)
+{
+	struct rohc_decomp *decompressor = NULL;		// the ROHC decompressor
+	rohc_status_t status;
 
-		// the size threshold has not been established by the user 
-		if (size_threshold == 0 ) {
-			size_threshold = size_max;
-			//do_debug (1, "Size threshold established to the maximum: %i.", size_max);
-		}
+	/* Create a ROHC decompressor to operate:
+	*  - with large CIDs use ROHC_LARGE_CID, ROHC_LARGE_CID_MAX
+	*  - with small CIDs use ROHC_SMALL_CID, ROHC_SMALL_CID_MAX maximum of 5 streams (MAX_CID = 4),
+	*  - ROHC_O_MODE: Bidirectional Optimistic mode (O-mode)
+	*  - ROHC_U_MODE: Unidirectional mode (U-mode).    */
+	if ( ROHC_mode == 1 ) {
+		decompressor = rohc_decomp_new2 (ROHC_LARGE_CID, ROHC_LARGE_CID_MAX, ROHC_U_MODE);	// Unidirectional mode
+	} else if ( ROHC_mode == 2 ) {
+		decompressor = rohc_decomp_new2 (ROHC_LARGE_CID, ROHC_LARGE_CID_MAX, ROHC_O_MODE);	// Bidirectional Optimistic mode
+	}/*else if ( ROHC_mode == 3 ) {
+		decompressor = rohc_decomp_new2 (ROHC_LARGE_CID, ROHC_LARGE_CID_MAX, ROHC_R_MODE);	// Bidirectional Reliable mode (not implemented yet)
+	}*/
+
+	if(decompressor == NULL)
+	{
+		fprintf(stderr, "failed create the ROHC decompressor\n");
+		return NULL;
+	}
 
-		// the user has specified a too big size threshold
-		if (size_threshold > size_max ) {
-			do_debug (1, "Warning: Size threshold too big: %i. Automatically set to the maximum: %i\n", size_threshold, size_max);
-			size_threshold = size_max;
-		}
+	do_debug(1, "ROHC decompressor created. Profiles: ");
 
-		/*** set the triggering parameters according to user selections (or default values) ***/
-	
-		// there are four possibilities for triggering the sending of the packets:
-		// - a threshold of the acumulated packet size. Two different options apply:
-		// 		-	the size of the multiplexed packet has exceeded the size threshold specified by the user,
-		//			but not the MTU. In this case, a packet is sent and a new period is started with the
-		//			buffer empty.
-		//		-	the size of the multiplexed packet has exceeded the MTU (and the size threshold consequently).
-		//			In this case, a packet is sent without the last one. A new period is started, and the last 
-		//			packet is stored as the first packet of the next period.
-		// - a number of packets
-		// - a timeout. A packet arrives. If the timeout has been reached, a muxed packet is triggered
-		// - a period. If the period has been reached, a muxed packet is triggered
-
-		// if ( timeout < period ) then the timeout has no effect
-		// as soon as one of the conditions is accomplished, all the accumulated packets are sent
-
-		// if no limit of the number of packets is set, then it is set to the maximum
-		if (( (size_threshold < size_max) || (timeout < MAXTIMEOUT) || (period < MAXTIMEOUT) ) && (limit_numpackets_tun == 0))
-			limit_numpackets_tun = MAXPKTS;
-
-		// if no option is set by the user, it is assumed that every packet will be sent immediately
-		if (( (size_threshold == size_max) && (timeout == MAXTIMEOUT) && (period == MAXTIMEOUT)) && (limit_numpackets_tun == 0))
-			limit_numpackets_tun = 1;
-	
+	// set the function that will manage the ROHC decompressing traces (it will be 'print_rohc_traces')
+	if(!rohc_decomp_set_traces_cb2(decompressor, print_rohc_traces, NULL))
+	{
+		fprintf(stderr, "failed to set the callback for traces on decompressor\n");
+		rohc_decomp_free(decompressor);
+		return NULL;
+	}
 
-		// I calculate 'now' as the moment of the last sending
-		time_last_sent_in_microsec = GetTimeStamp() ; 
+	// enable rohc decompression profiles
+	status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_UNCOMPRESSED, -1);
+	if(!status)
+	{
+		fprintf(stderr, "failed to enable the Uncompressed decompression profile\n");
+		rohc_decomp_free(decompressor);
+		return NULL;
+	} else {
+		do_debug(1, "Uncompressed. ");
+	}
 
-		do_debug(1, "Multiplexing policies: size threshold: %i. numpackets: %i. timeout: %.2lf. period: %.2lf\n", size_threshold, limit_numpackets_tun, timeout, period);
+	status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_IP, -1);
+	if(!status)
+	{
+		fprintf(stderr, "failed to enable the IP-only decompression profile\n");
+		rohc_decomp_free(decompressor);
+		return NULL;
+	} else {
+		do_debug(1, "IP-only. ");
+	}
 
+	status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_UDP, -1);
+	if(!status)
+	{
+		fprintf(stderr, "failed to enable the IP/UDP decompression profile\n");
+		rohc_decomp_free(decompressor);
+		return NULL;
+	} else {
+		do_debug(1, "IP/UDP. ");
+	}
 
+	status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_UDPLITE, -1);
+	if(!status)
+	{
+		fprintf(stderr, "failed to enable the IP/UDP-Lite decompression profile\n");
+		rohc_decomp_free(decompressor);
+		return NULL;
+	} else {
+		do_debug(1, "IP/UDP-Lite. ");
+	}
 
-		switch(ROHC_mode) {
-				case 0:
-					do_debug ( 1 , "ROHC not activated\n", debug);
-					break;
-				case 1:
-					do_debug ( 1 , "ROHC Unidirectional Mode\n", debug);
-					break;
-				case 2:
-					do_debug ( 1 , "ROHC Bidirectional Optimistic Mode\n", debug);
-					break;
-				/*case 3:
-					do_debug ( 1 , "ROHC Bidirectional Reliable Mode\n", debug);	// Bidirectional Reliable mode (not implemented yet)
-					break;*/
-		}
+	status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_RTP, -1);
+	if(!status)
+	{
+		fprintf(stderr, "failed to enable the RTP decompression profile\n");
+		rohc_decomp_free(decompressor);
+		return NULL;
+	} else {
+		do_debug(1, "RTP. ");
+	}
 
-		// If ROHC has been selected, I have to initialize it
-		// see the API here: https://rohc-lib.org/support/documentation/API/rohc-doc-1.7.0/
-		if ( ROHC_mode > 0 ) {
+	status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_ESP,-1);
+	if(!status)
+	{
+	fprintf(stderr, "failed to enable the ESP decompression profile\n");
+		rohc_decomp_free(decompressor);
+		return NULL;
+	} else {
+		do_debug(1, "ESP. ");
+	}
 
-			/* initialize the random generator */
-			seed = time(NULL);
-			srand(seed);
+	status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_TCP, -1);
+	if(!status)
+	{
+		fprintf(stderr, "failed to enable the TCP decompression profile\n");
+		rohc_decomp_free(decompressor);
+		return NULL;
+	} else {
+		do_debug(1, "TCP. ");
+	}
 
-			/* Create a ROHC compressor with Large CIDs and the largest MAX_CID
-			 * possible for large CIDs */
-			compressor = rohc_comp_new2(ROHC_LARGE_CID, ROHC_LARGE_CID_MAX, gen_random_num, NULL);
-			if(compressor == NULL)
-			{
-				fprintf(stderr, "failed create the ROHC compressor\n");
-				goto error;
-			}
+	do_debug(1, "\n");
 
-			do_debug(1, "ROHC compressor created. Profiles: ");
-
-			// Set the callback function to be used for detecting RTP.
-			// RTP is not detected automatically. So you have to create a callback function "rtp_detect" where you specify the conditions.
-			// In our case we will consider as RTP the UDP packets belonging to certain ports
-		    if(!rohc_comp_set_rtp_detection_cb(compressor, rtp_detect, NULL))
-		    {
-		            fprintf(stderr, "failed to set RTP detection callback\n");
-		            goto error;
-		    }
-
-			// set the function that will manage the ROHC compressing traces (it will be 'print_rohc_traces')
-			if(!rohc_comp_set_traces_cb2(compressor, print_rohc_traces, NULL))
-			{
-				fprintf(stderr, "failed to set the callback for traces on compressor\n");
-				goto release_compressor;
-			}
+	// the segments of a ROHC packet are reassembled by the decompressor
+	if(!rohc_decomp_set_mrru(decompressor, ROHC_MRRU))
+	{
+		fprintf(stderr, "failed to set the MRRU of the decompressor\n");
+		rohc_decomp_free(decompressor);
+		return NULL;
+	}
 
-			/* Enable the ROHC compression profiles */
-			if(!rohc_comp_enable_profile(compressor, ROHC_PROFILE_UNCOMPRESSED))
-			{
-				fprintf(stderr, "failed to enable the Uncompressed compression profile\n");
-				goto release_compressor;
-			} else {
-				do_debug(1, "Uncompressed. ");
-			}
+	return decompressor;
+}
 
-			if(!rohc_comp_enable_profile(compressor, ROHC_PROFILE_IP))
-			{
-				fprintf(stderr, "failed to enable the IP-only compression profile\n");
-				goto release_compressor;
-			} else {
-				do_debug(1, "IP-only. ");
-			}
+/**************************************************************************
+ *            statistics of a muxed packet sent                           *
+ **************************************************************************/
+// the bundle has the first 'num_packets' packets of the queue, which take 'native_bytes' before compressing them
+// 'size_tunnel_header' is added to each native packet (as if it was tunneled alone) and to the bundle
+void count_bundle(struct simplemux_stats *stats, struct mux_queue *queue, int num_packets, int native_bytes, int total_length,
+				  int size_tunnel_header, int triggers, uint64_t now)
+{
+	int k;
 
-			if(!rohc_comp_enable_profiles(compressor, ROHC_PROFILE_UDP, ROHC_PROFILE_UDPLITE, -1))
-			{
-				fprintf(stderr, "failed to enable the IP/UDP and IP/UDP-Lite compression profiles\n");
-				goto release_compressor;
-			} else {
-				do_debug(1, "IP/UDP. IP/UDP-Lite. ");
-			}
+	stats_bundle(stats, num_packets, triggers, native_bytes + num_packets * size_tunnel_header, total_length + size_tunnel_header);
+	for (k = 0; k < num_packets; k++) stats_delay(stats, now - queue->encoder.stored[k].arrival_time);
+}
 
-			if(!rohc_comp_enable_profile(compressor, ROHC_PROFILE_RTP))
-			{
-				fprintf(stderr, "failed to enable the RTP compression profile\n");
-				goto release_compressor;
-			} else {
-				do_debug(1, "RTP (UDP ports 1234, 36780, 33238, 5020, 5002). ");
-			}
+/**************************************************************************
+ *            set the multiplexing policies of a mux queue                *
+ **************************************************************************/
+// the size threshold, the number of packets, the timeout and the period of the queue have been
+// set by the user (or they keep the default values). Adjust them to 'size_max'
+void set_multiplexing_policies(struct mux_queue *queue, int size_max)
+{
+	struct mux_policies *policies = &queue->policies;
 
-			if(!rohc_comp_enable_profile(compressor, ROHC_PROFILE_ESP))
-			{
-				fprintf(stderr, "failed to enable the ESP compression profile\n");
-				goto release_compressor;
-			} else {
-				do_debug(1, "ESP. ");
-			}
+	// the size threshold has not been established by the user 
+	if (policies->size_threshold == 0 ) {
+		policies->size_threshold = size_max;
+		//do_debug (1, "Size threshold established to the maximum: %i.", size_max);
+	}
 
-			if(!rohc_comp_enable_profile(compressor, ROHC_PROFILE_TCP))
-			{
-				fprintf(stderr, "failed to enable the TCP compression profile\n");
-				goto release_compressor;
-			} else {
-				do_debug(1, "TCP. ");
-			}
-			do_debug(1, "\n");
-
-
-			/* Create a ROHC decompressor to operate:
-			*  - with large CIDs use ROHC_LARGE_CID, ROHC_LARGE_CID_MAX
-			*  - with small CIDs use ROHC_SMALL_CID, ROHC_SMALL_CID_MAX maximum of 5 streams (MAX_CID = 4),
-			*  - ROHC_O_MODE: Bidirectional Optimistic mode (O-mode)
-			*  - ROHC_U_MODE: Unidirectional mode (U-mode).    */
-			if ( ROHC_mode == 1 ) {
-				decompressor = rohc_decomp_new2 (ROHC_LARGE_CID, ROHC_LARGE_CID_MAX, ROHC_U_MODE);	// Unidirectional mode
-			} else if ( ROHC_mode == 2 ) {
-				decompressor = rohc_decomp_new2 (ROHC_LARGE_CID, ROHC_LARGE_CID_MAX, ROHC_O_MODE);	// Bidirectional Optimistic mode
-			}/*else if ( ROHC_mode == 3 ) {
-				decompressor = rohc_decomp_new2 (ROHC_LARGE_CID, ROHC_LARGE_CID_MAX, ROHC_R_MODE);	// Bidirectional Reliable mode (not implemented yet)
-			}*/
-
-			if(decompressor == NULL)
-			{
-				fprintf(stderr, "failed create the ROHC decompressor\n");
-				goto release_decompressor;
-			}
+	// the user has specified a too big size threshold
+	if (policies->size_threshold > size_max ) {
+		do_debug (1, "Warning: Size threshold too big: %i. Automatically set to the maximum: %i\n", policies->size_threshold, size_max);
+		policies->size_threshold = size_max;
+	}
 
-			do_debug(1, "ROHC decompressor created. Profiles: ");
+	/*** set the triggering parameters according to user selections (or default values) ***/
+
+	// there are four possibilities for triggering the sending of the packets:
+	// - a threshold of the acumulated packet size. Two different options apply:
+	// 		-	the size of the multiplexed packet has exceeded the size threshold specified by the user,
+	//			but not the MTU. In this case, a packet is sent and a new period is started with the
+	//			buffer empty.
+	//		-	the size of the multiplexed packet has exceeded the MTU (and the size threshold consequently).
+	//			In this case, a packet is sent without the last one. A new period is started, and the last 
+	//			packet is stored as the first packet of the next period.
+	// - a number of packets
+	// - a timeout. A packet arrives. If the timeout has been reached, a muxed packet is triggered
+	// - a period. If the period has been reached, a muxed packet is triggered
+
+	// if ( timeout < period ) then the timeout has no effect
+	// as soon as one of the conditions is accomplished, all the accumulated packets are sent
+
+	// with adaptive policies, the period is never longer than the maximum delay
+	if ((policies->max_delay > 0) && (policies->period > policies->max_delay))
+		policies->period = policies->max_delay;
+
+	// the packets are stored in an array of MAXPKTS descriptors
+	if (policies->limit_numpackets_tun > MAXPKTS) {
+		do_debug (1, "Warning: Number of packets too big: %i. Automatically set to the maximum: %i\n", policies->limit_numpackets_tun, MAXPKTS);
+		policies->limit_numpackets_tun = MAXPKTS;
+	}
 
-			// set the function that will manage the ROHC decompressing traces (it will be 'print_rohc_traces')
-			if(!rohc_decomp_set_traces_cb2(decompressor, print_rohc_traces, NULL))
-			{
-				fprintf(stderr, "failed to set the callback for traces on decompressor\n");
-				goto release_decompressor;
-			}
+	// if no limit of the number of packets is set, then it is set to the maximum
+	if (( (policies->size_threshold < size_max) || (policies->timeout < MAXTIMEOUT) || (policies->period < MAXTIMEOUT) ) && (policies->limit_numpackets_tun == 0))
+		policies->limit_numpackets_tun = MAXPKTS;
 
-			// enable rohc decompression profiles
-			status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_UNCOMPRESSED, -1);
-			if(!status)
-			{
-				fprintf(stderr, "failed to enable the Uncompressed decompression profile\n");
-				goto release_decompressor;
-			} else {
-				do_debug(1, "Uncompressed. ");
-			}
+	// if no option is set by the user, it is assumed that every packet will be sent immediately
+	if (( (policies->size_threshold == size_max) && (policies->timeout == MAXTIMEOUT) && (policies->period == MAXTIMEOUT)) && (policies->limit_numpackets_tun == 0))
+		policies->limit_numpackets_tun = 1;
 
-			status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_IP, -1);
-			if(!status)
-			{
-				fprintf(stderr, "failed to enable the IP-only decompression profile\n");
-				goto release_decompressor;
-			} else {
-				do_debug(1, "IP-only. ");
-			}
+	do_debug(1, "Multiplexing policies for peer %s (%s queue): size threshold: %i. numpackets: %i. timeout: %"PRIu64". period: %"PRIu64"\n", sockaddr_inet_ntoa(&queue->peer->remote), (queue->mux_class == MUX_CLASS_REALTIME) ? "realtime" : "bulk", policies->size_threshold, policies->limit_numpackets_tun, policies->timeout, policies->period);
+	if (policies->max_delay > 0)
+		do_debug(1, " Adaptive policies. Maximum delay: %"PRIu64". The size threshold and the period above are the upper bounds\n", policies->max_delay);
 
-			status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_UDP, -1);
-			if(!status)
-			{
-				fprintf(stderr, "failed to enable the IP/UDP decompression profile\n");
-				goto release_decompressor;
-			} else {
-				do_debug(1, "IP/UDP. ");
-			}
+	// the bounds of the adaptive policies
+	queue->limits = *policies;
+}
 
-			status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_UDPLITE, -1);
-			if(!status)
-			{
-				fprintf(stderr, "failed to enable the IP/UDP-Lite decompression profile\n");
-				goto release_decompressor;
-			} else {
-				do_debug(1, "IP/UDP-Lite. ");
-			}
+/**************************************************************************
+ *            adapt the multiplexing policies of a mux queue              *
+ **************************************************************************/
+// it is true if the new value of a policy differs more than ADAPT_HYSTERESIS from the old one
+static bool policy_changed(double old_value, double new_value)
+{
+	double difference = (new_value > old_value) ? new_value - old_value : old_value - new_value;
 
-			status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_RTP, -1);
-			if(!status)
-			{
-				fprintf(stderr, "failed to enable the RTP decompression profile\n");
-				goto release_decompressor;
-			} else {
-				do_debug(1, "RTP. ");
-			}
+	return difference > ADAPT_HYSTERESIS * old_value;
+}
 
-			status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_ESP,-1);
-			if(!status)
-			{
-			fprintf(stderr, "failed to enable the ESP decompression profile\n");
-				goto release_decompressor;
-			} else {
-				do_debug(1, "ESP. ");
-			}
+// called every ADAPT_INTERVAL with the packets stored during 'interval' (microseconds)
+// the delay added to a packet is at most the period, and the saving grows with the packets of each bundle:
+//	- if fewer than ADAPT_MIN_PACKETS are expected during the maximum period, nothing would be saved, so
+//	  each packet is sent at once (size threshold 0)
+//	- otherwise, the period is the time needed for filling a bundle of the maximum size threshold, and the
+//	  size threshold is the bytes expected during the period. At low load, the period is the maximum one and
+//	  the threshold is lower; at high load, the bundles are full and the period is shorter
+// it returns 1 if the policies have changed
+int adapt_multiplexing_policies(struct mux_queue *queue, uint64_t interval)
+{
+	struct mux_policies *policies = &queue->policies;
+	struct mux_policies *limits = &queue->limits;
+	double bytes_per_microsec;
+	double mean_size;
+	double fill_time;
+	uint64_t period;
+	int size_threshold;
+
+	// moving averages of the arrival rate and of the size of the packets
+	queue->arrival_rate = ADAPT_WEIGHT * ((double)queue->adapt_packets / interval) + (1 - ADAPT_WEIGHT) * queue->arrival_rate;
+	if (queue->adapt_packets > 0) {
+		mean_size = (double)queue->adapt_bytes / queue->adapt_packets;
+		queue->mean_size = (queue->mean_size == 0) ? mean_size : ADAPT_WEIGHT * mean_size + (1 - ADAPT_WEIGHT) * queue->mean_size;
+	}
+	queue->adapt_packets = 0;
+	queue->adapt_bytes = 0;
 
-			status = rohc_decomp_enable_profiles(decompressor, ROHC_PROFILE_TCP, -1);
-			if(!status)
-			{
-				fprintf(stderr, "failed to enable the TCP decompression profile\n");
-				goto release_decompressor;
-			} else {
-				do_debug(1, "TCP. ");
-			}
+	if (queue->arrival_rate * limits->period < ADAPT_MIN_PACKETS) {
+		size_threshold = 0;
+		period = limits->period;
+	} else {
+		bytes_per_microsec = queue->arrival_rate * queue->mean_size;
+		fill_time = limits->size_threshold / bytes_per_microsec;
 
-			do_debug(1, "\n");
+		if (fill_time > limits->period) {
+			period = limits->period;
+		} else if (fill_time < ADAPT_MIN_PERIOD) {
+			period = ADAPT_MIN_PERIOD;
+		} else {
+			period = fill_time;
 		}
 
-		/*** I need the value of the maximum file descriptor, in order to let select() handle four interface descriptors at once ***/
-		if(tun_fd >= transport_mode_fd && tun_fd >= feedback_fd && tun_fd >= network_mode_fd)
-			maxfd = tun_fd;
-		if(network_mode_fd >= transport_mode_fd && network_mode_fd >= feedback_fd && network_mode_fd >= tun_fd)
-			maxfd = network_mode_fd;
-		if(transport_mode_fd >= tun_fd && transport_mode_fd >= feedback_fd && transport_mode_fd >= network_mode_fd)
-			maxfd = transport_mode_fd;
-		if(feedback_fd >= tun_fd && feedback_fd >= transport_mode_fd && feedback_fd >= network_mode_fd)
-			maxfd = feedback_fd;
-
+		size_threshold = bytes_per_microsec * period;
+		if (size_threshold > limits->size_threshold) size_threshold = limits->size_threshold;
+	}
 
+	// small changes are ignored, so the policies do not change in every interval
+	if (!policy_changed(policies->size_threshold, size_threshold) && !policy_changed(policies->period, period))
+		return 0;
 
-		/*****************************************/
-		/************** Main loop ****************/
-		/*****************************************/
-		while(1) {
-
-			FD_ZERO(&rd_set);					/* FD_ZERO() clears a set */
-			FD_SET(tun_fd, &rd_set);			/* FD_SET() adds a given file descriptor to a set */
-			FD_SET(network_mode_fd, &rd_set);
-			FD_SET(transport_mode_fd, &rd_set);
-			FD_SET(feedback_fd, &rd_set);
-
-			/* Initialize the timeout data structure. */
-			time_in_microsec = GetTimeStamp();
-			if ( period > (time_in_microsec - time_last_sent_in_microsec)) {
-				microseconds_left = (period - (time_in_microsec - time_last_sent_in_microsec));			
-			} else {
-				microseconds_left = 0;
-			}
-			// do_debug (1, "microseconds_left: %i\n", microseconds_left);
+	policies->size_threshold = size_threshold;
+	policies->period = period;
+	return 1;
+}
 
-			period_expires.tv_sec = 0;
-			period_expires.tv_usec = microseconds_left;		// this is the moment when the period will expire
+/**************************************************************************
+ *            parse a multiplexing policy: n=, b=, t=, P= or A=           *
+ **************************************************************************/
+// it returns -1 if the token is not a policy
+int parse_policy(struct mux_policies *policies, char *token)
+{
+	if (strncmp(token, "n=", 2) == 0) {
+		policies->limit_numpackets_tun = atoi(token + 2);
+	} else if (strncmp(token, "b=", 2) == 0) {
+		policies->size_threshold = atoi(token + 2);
+	} else if (strncmp(token, "t=", 2) == 0) {
+		policies->timeout = atof(token + 2);
+	} else if (strncmp(token, "P=", 2) == 0) {
+		policies->period = atof(token + 2);
+	} else if (strncmp(token, "A=", 2) == 0) {
+		policies->max_delay = atof(token + 2);
+	} else {
+		return -1;
+	}
+	return 0;
+}
 
+/**************************************************************************
+ *            read the peers and their prefixes from a file               *
+ **************************************************************************/
+// each line has the IP of a peer, the prefixes routed to it, and optionally its own policies
+// (the others take the values given in the command line):
+//	<peerIP> <prefix>/<length> [<prefix>/<length> ...] [n=<num_mux_tun>] [b=<num_bytes_threshold>] [t=<timeout>] [P=<period>] [A=<max_delay>]
+//		[qn=<num_mux_tun>] [qb=<num_bytes_threshold>] [qt=<timeout>] [qP=<period>] [qA=<max_delay>]
+// the 'q' policies are the ones of the realtime queue. They enable the classification for the peer
+// a prefix without length is a /32. Lines starting with '#' are comments
+// it returns the number of peers in the table, or -1 if there is an error
+int read_peers_file(struct peer_table *table, char *file_name, unsigned short int port, unsigned short int port_feedback,
+					struct mux_policies policies[NUM_MUX_CLASSES], int num_queues)
+{
+	FILE *peers_file;
+	char line[1024];
+	char *token, *slash;
+	struct peer *peer;
+	struct in_addr prefix;
+	int length;
+	int line_number = 0;
+	int num_peers;
+	int k;
+
+	peers_file = fopen(file_name, "r");
+	if (peers_file == NULL) {
+		perror("fopen() peers file");
+		return -1;
+	}
 
-			/* select () allows a program to monitor multiple file descriptors, */ 
-			/* waiting until one or more of the file descriptors become "ready" */
-			/* for some class of I/O operation*/
-			ret = select(maxfd + 1, &rd_set, NULL, NULL, &period_expires); 	//this line stops the program until something
-																			//happens or the period expires
+	while (fgets(line, sizeof(line), peers_file) != NULL) {
+		line_number++;
 
-			// if the program gets here, it means that a packet has arrived (from tun or from the network), or the period has expired
-			if (ret < 0 && errno == EINTR) continue;
+		// the first token is the address of the peer
+		token = strtok(line, " \t\r\n");
+		if ((token == NULL) || (token[0] == '#')) continue;
 
-			if (ret < 0) {
-				perror("select()");
-				exit(1);
-			}
+		// a peer may appear in more than one line. Its policies are only initialized in the first one
+		num_peers = table->num_peers;
+		peer = peer_table_add(table, token, port, port_feedback);
+		if (peer == NULL) {
+			my_err("Peers file, line %i: bad peer address %s, or too many peers\n", line_number, token);
+			fclose(peers_file);
+			return -1;
+		}
+		if (table->num_peers > num_peers) {
+			peer->num_queues = num_queues;
+			for (k = 0; k < NUM_MUX_CLASSES; k++) peer->queues[k].policies = policies[k];
+		}
 
+		// the rest of tokens are prefixes or policies
+		while ((token = strtok(NULL, " \t\r\n")) != NULL) {
+			if (token[0] == '#') break;
 
-			/*****************************************************************************/
-			/***************** NET to tun. demux and decompress **************************/
-			/*****************************************************************************/
+			if (parse_policy(&peer->queues[MUX_CLASS_BULK].policies, token) == 0) {
+				// a policy of the bulk queue
+			} else if ((token[0] == 'q') && (parse_policy(&peer->queues[MUX_CLASS_REALTIME].policies, token + 1) == 0)) {
+				// a policy of the realtime queue
+				peer->num_queues = NUM_MUX_CLASSES;
+			} else {
+				length = 32;
+				slash = strchr(token, '/');
+				if (slash != NULL) {
+					*slash = '\0';
+					length = atoi(slash + 1);
+				}
+				if ((inet_aton(token, &prefix) == 0) || (peer_table_add_route(table, ntohl(prefix.s_addr), length, peer) < 0)) {
+					my_err("Peers file, line %i: bad prefix %s, or too many prefixes\n", line_number, token);
+					fclose(peers_file);
+					return -1;
+				}
+			}
+		}
+	}
 
-			// data arrived at the network interface: read, demux, decompress and forward it
-			// in Transport mode, the traffic has arrived to transport_mode_fd
-			// in Network mode, the packet has arrived to network_mode_fd
+	fclose(peers_file);
+	return table->num_peers;
+}
 
-			// FD_ISSET tests to see if a file descriptor is part of the set
-			if(FD_ISSET(transport_mode_fd, &rd_set) || FD_ISSET(network_mode_fd, &rd_set)) {		
 
-				switch (*mode) {
-					case TRANSPORT_MODE:
-						// a packet has been received from the network, destinated to the multiplexing port. 'slen' is the length of the IP address
-						// I cannot use 'remote' because it would replace the IP address and port. I use 'received'
-						nread_from_net = recvfrom ( transport_mode_fd, buffer_from_net, BUFSIZE, 0, (struct sockaddr *)&received, &slen );
-						if (nread_from_net==-1) perror ("recvfrom()");
-						// now buffer_from_net contains the payload (simplemux headers and multiplexled packets) of a full packet or frame.
-						// I don't have the IP and UDP headers
-
-						// check if the packet comes from the multiplexing port (default 55555). (Its destination IS the multiplexing port)
-						if (port == ntohs(received.sin_port)) 
-							 is_multiplexed_packet = 1;
-						else is_multiplexed_packet = 0;
-					break;
+/**************************************************************************
+ * write_to_tun: a demuxed packet is added to the batch of the egress     *
+ *               side. The batch is written when it is full, or by        *
+ *               flush_to_tun() before the thread waits                   *
+ **************************************************************************/
+void write_to_tun(struct tun_writer *writer, unsigned char *packet, int size, struct simplemux_stats *stats)
+{
+	int calls = tun_writer_add(writer, packet, size);
 
-					case NETWORK_MODE:
-						// a packet has been received from the network, destinated to the local interface for muxed packets
-						nread_from_net = cread ( network_mode_fd, buffer_from_net_aux, BUFSIZE);
+	if ( stats != NULL ) {
+		stats_add(&stats->tun_written, 1);
+		stats_add(&stats->tun_writes, calls);
+	}
+}
 
-						if (nread_from_net==-1) perror ("cread demux()");
-						// now buffer_from_net contains the headers (IP and Simplemux) and the payload of a full packet or frame.
+void flush_to_tun(struct tun_writer *writer, struct simplemux_stats *stats)
+{
+	int calls = tun_writer_flush(writer);
 
-						// copy from "buffer_from_net_aux" everything except the IP header (usually the first 20 bytes)
-						memcpy ( buffer_from_net, buffer_from_net_aux + sizeof(struct iphdr), nread_from_net - sizeof(struct iphdr));
-						// correct the size of "nread from net"
-						nread_from_net = nread_from_net - sizeof(struct iphdr);
+	if ( stats != NULL ) stats_add(&stats->tun_writes, calls);
+}
 
-						// Get IP Header of received packet
-						GetIpHeader(&ipheader,buffer_from_net_aux);
-						if (ipheader.protocol == IPPROTO_SIMPLEMUX )
-							 is_multiplexed_packet = 1;
-						else is_multiplexed_packet = 0;
 
-					break;
-				}
+/**************************************************************************
+ * data_plane: main loop of a thread. It multiplexes the packets read     *
+ *             from tun (ROLE_INGRESS) and/or demultiplexes the packets   *
+ *             read from the network (ROLE_EGRESS)                        *
+ **************************************************************************/
+void *data_plane(void *arg)
+{
+	struct data_plane_args *args = (struct data_plane_args *)arg;
+	struct simplemux_ctx *ctx = args->ctx;
+	int role = args->role;
+	cpu_set_t cpus;
+
+	// configuration shared by all the threads (read only)
+	char mode = ctx->mode;
+	int tun_fd = ctx->tun_fd;
+	struct packet_ring *packet_ring = ctx->packet_ring;
+	int transport_mode_fd = ctx->transport_mode_fd;
+	int network_mode_fd = ctx->network_mode_fd;
+	int feedback_fd = ctx->feedback_fd;
+	int batch_size = ctx->batch_size;
+	unsigned short int port = ctx->port;
+	unsigned short int port_feedback = ctx->port_feedback;
+	union sockaddr_inet feedback = ctx->feedback, received;
+	int ROHC_mode = ctx->ROHC_mode;
+	struct peer_table *peers = ctx->peers;
+	struct trace_ring *trace = trace_log_attach(ctx->trace_log);	// the ring of this thread in the log. NULL if there is no log
+	struct simplemux_stats *stats = ctx->stats;					// live statistics. NULL if they are not exported
+	int selected_mtu = ctx->selected_mtu;
+	int size_max = ctx->size_max;
+
+	struct peer *peer = NULL;									// the peer of the packet being processed
+	struct mux_queue *queue = NULL;							// the mux queue of the packet being processed
+
+	struct event_loop events;										// the event loop, used to know which interface has received a packet
+	struct iphdr ipheader;							// IP header
+	socklen_t slen = sizeof(received);							// size of the socket. The type is like an int, but adequate for the size of the socket
+	socklen_t slen_feedback = sizeof(feedback);		// size of the socket. The type is like an int, but adequate for the size of the socket
 
+	// variables for storing the packets to multiplex
+	uint16_t total_length;																	// total length of the built multiplexed packet
+	uint16_t protocol_rec;																	// protocol field of the received muxed packet
+	unsigned char native_packet[BUFSIZE];										// the packet read from tun, before storing it in its mux queue
+	uint16_t size_native_packet;														// the size of the packet read from tun
+	uint16_t size_tun_packet;																// the size of the packet read from tun, before compressing it
+	uint8_t protocol_native;																// 'Protocol' field of the packet read from tun if it is not compressed
+	uint16_t protocol_to_store;																// 'Protocol' field of the packet to store in the mux queue
+	int size_ip_header = (ctx->family == AF_INET6) ? IPv6_HEADER_SIZE : IPv4_HEADER_SIZE;	// outer IP header of the tunnel
+	int size_tunnel_header = (mode == TRANSPORT_MODE) ? size_ip_header + UDP_HEADER_SIZE : size_ip_header;
+	in_addr_t destination;																	// destination IP address of the packet read from tun
+	struct mux_bundle bundle;																// the multiplexed packet, as a list of fragments
+	bool is_multiplexed_packet;															// To determine if a received packet have been multiplexed
 
-				// now buffer_from_net contains a full packet or frame.
-				// check if the packet is a multiplexed one
-				if (is_multiplexed_packet) {
+	// variables for storing the packets to demultiplex
+	uint16_t nread_from_net;												// number of bytes read from network which will be demultiplexed
+	unsigned char buffer_from_net[BUFSIZE];					// stores the packet received from the network, before sending it to tun
+	struct recv_batch net_batch;										// muxed packets received with recvmmsg() (Network mode)
+	unsigned char *data_from_net;										// the payload of the muxed packet (in buffer_from_net, or in a slot of net_batch)
+	int size_outer_header;													// IP header of the muxed packet received in Network mode
+	struct mux_decoder decoder;												// the packets of the bundle (libsimplemux)
+	unsigned char *demuxed_packet;									// each demultiplexed packet (inside the bundle, or decompressed)
 
-					/* increase the counter of the number of packets read from the network */
-					net2tun++;
-					switch (*mode) {
-						case TRANSPORT_MODE:
-							do_debug(1, "MUXED PACKET #%lu: Read muxed packet from %s:%d: %i bytes\n", net2tun, inet_ntoa(remote.sin_addr), ntohs(remote.sin_port), nread_from_net + IPv4_HEADER_SIZE + UDP_HEADER_SIZE );				
+	// variables for controlling the arrival and departure of packets
+	unsigned long int tun2net = 0, net2tun = 0;		// number of packets read from tun and from net
+	unsigned long int feedback_pkts = 0;					// number of ROHC feedback packets
+	int tun_batch_left = 0;												// number of packets that can still be read from tun without waiting
+	int nread_from_tun;														// number of bytes read from tun in a non-blocking read
+	struct send_batch bundle_batch;								// muxed packets waiting to be sent with sendmmsg()
+	struct tun_writer tun_out;										// demuxed packets waiting to be written to tun
+	struct pps_counters pps;											// counters for calculating the packet-per-second rates
+	uint64_t microseconds_left;					// the time until the period expires	
+	struct timer_wheel period_timers;			// the period of each mux queue (ingress)
+	struct wheel_timer *expired_timers;			// the periods that have expired
+	uint64_t time_last_adapt;					// moment of the last decision of the adaptive policies
 
-							// write the log file
-							if ( log_file != NULL ) {
-								fprintf (log_file, "%"PRIu64"\trec\tmuxed\t%i\t%lu\tfrom\t%s\t%d\n", GetTimeStamp(), nread_from_net  + IPv4_HEADER_SIZE + UDP_HEADER_SIZE, net2tun, inet_ntoa(remote.sin_addr), ntohs(remote.sin_port));
-								fflush(log_file);	// If the IO is buffered, I have to insert fflush(fp) after the write in order to avoid things lost when pressing Ctrl+C.
-							}
-						break;
+	// very long unsigned integers for storing the system clock in microseconds
+	uint64_t time_in_microsec;										// current time
+	uint64_t time_difference;											// difference between two timestamps
 
-						case NETWORK_MODE:
-							do_debug(1, "MUXED PACKET #%lu: Read muxed packet from %s: %i bytes\n", net2tun, inet_ntoa(remote.sin_addr), nread_from_net + IPv4_HEADER_SIZE );				
+	int l,p,k;
+	int triggers;														// what triggered the sending of a muxed packet (for the log)
+	int predicted_size_muxed_packet;				// size of the muxed packet if the arrived packet was added to it
+	int packet_length;											// the length of each packet inside the multiplexed bundle
+	int num_demuxed_packets;								// a counter of the number of packets inside a muxed one
+	struct stored_packet *stored;						// descriptor of the packet being stored
+	int ret;																// value returned by the event loop
+	int drop_packet = 0;
+	rohc_status_t status;
 
-							// write the log file
-							if ( log_file != NULL ) {
-								fprintf (log_file, "%"PRIu64"\trec\tmuxed\t%i\t%lu\tfrom\t%s\t\n", GetTimeStamp(), nread_from_net  + IPv4_HEADER_SIZE, net2tun, inet_ntoa(remote.sin_addr));
-								fflush(log_file);	// If the IO is buffered, I have to insert fflush(fp) after the write in order to avoid things lost when pressing Ctrl+C.
-							}
-						break;
-					}
+	bool bits[8];														// it is used for printing the bits of a byte in debug mode
 
-					// if the packet comes from the multiplexing port, I have to demux it and write each packet to the tun interface
-					position = 0; //this is the index for reading the packet/frame
-					num_demuxed_packets = 0;
+	// ROHC header compression variables
+	unsigned char rohc_buffer[ROHC_SEGMENTS_BUFSIZE];		// the buffer that will contain the resulting ROHC packet (or its segments)
+	unsigned char *rohc_output;									// the ROHC packet (in 'rohc_buffer', or in the job of a ROHC thread)
+	uint16_t size_rohc_packet;									// its size
+	int max_rohc_size = size_max - 3;							// a longer ROHC packet is split into segments (3: separator and Protocol)
+	bool too_long;															// the native packet does not fit in a bundle: it can only be sent in ROHC segments
+
+	// ROHC segments: the ones of a packet are stored one after another, like the packets read from tun
+	struct rohc_segments rohc_segments;					// the segments compressed by this thread
+	struct rohc_segments *segments = NULL;			// the segments of the last ROHC packet (in 'rohc_segments' or in a job)
+	int segments_left = 0;											// segments of that packet not stored yet
+	int segment_index = 0;											// the segment being stored
+	unsigned char *segment_data = NULL;					// the next segment
+	struct mux_queue *segment_queue = NULL;			// the mux queue of the segments
+	struct rohc_job *segment_job = NULL;				// the job of the segments (NULL if they are in 'rohc_buffer')
+	bool is_segment;														// the packet being stored is a segment, after the first one
+	bool flush_segments;												// the last segment has been stored: send the bundle at once
+	unsigned char *packet_to_store;							// the packet stored in the mux queue, compressed or not
+
+	// ROHC compression in other threads (-W)
+	struct rohc_pool *rohc_pool = (role & ROLE_INGRESS) ? ctx->rohc_pool : NULL;
+	struct rohc_job *rohc_job;									// a packet compressed by a ROHC thread. NULL if the packet has been read from tun
+	struct rohc_job *new_job;										// a packet given to a ROHC thread
+	bool rohc_jobs_pending = false;							// the compressed packets are being drained without waiting
+
+	// flows sent without compressing them (-R)
+	struct flow_cache bypass_cache;							// the flows that ROHC cannot compress, or compresses with almost no saving
+	bool bypass_flows = ( role & ROLE_INGRESS ) && ( ROHC_mode > 0 ) && ( ctx->rohc_bypass_time > 0 );
+	struct flow_key flow;												// 5-tuple of the packet being compressed
+	bool has_flow;															// the packet is IP, and 'flow' is valid
+	bool compress;															// the packet has to be compressed with ROHC
+
+	// ROHC feedback generated by the decompressor, carried in the bundles toward its peer
+	struct feedback_queue *feedback_to_send = ctx->feedback_to_send;	// NULL if it is sent on the feedback socket (-F)
+	int feedback_event_fd = ( role == ROLE_INGRESS ) ? ctx->feedback_event_fd : -1;	// only needed if the egress side is another thread
+	unsigned char *feedback_data;								// the oldest feedback packet to be sent
+	int feedback_length;
+	bool is_feedback;														// the packet being stored is ROHC feedback
+	uint64_t event_value;													// value read from an eventfd
 
-					first_header_read = 0;
+	unsigned char ip_buffer_d[BUFSIZE];					// the buffer that will contain the resulting IP decompressed packet
+	struct rohc_buf ip_packet_d = rohc_buf_init_empty(ip_buffer_d, BUFSIZE);
+	unsigned char rohc_buffer_d[BUFSIZE];				// the buffer that will contain the ROHC packet to decompress
+	struct rohc_buf rohc_packet_d = rohc_buf_init_empty(rohc_buffer_d, BUFSIZE);
+	struct rohc_buf demuxed_rohc_packet = rohc_buf_init_empty(NULL, 0);	// a ROHC packet inside the received bundle
 
-					while (position < nread_from_net) {
+	/* structures to handle ROHC feedback */
+	unsigned char rcvd_feedback_buffer_d[BUFSIZE];	// the buffer that will contain the ROHC feedback packet received
+	struct rohc_buf rcvd_feedback = rohc_buf_init_empty(rcvd_feedback_buffer_d, BUFSIZE);
+	unsigned char feedback_send_buffer_d[BUFSIZE];	// the buffer that will contain the ROHC feedback packet to be sent
+	struct rohc_buf feedback_send = rohc_buf_init_empty(feedback_send_buffer_d, BUFSIZE);
 
-						if ( PROTOCOL_FIRST ) {
-							/* read the separator */
-							// - read 'protocol', the SPB and LXT bits
 
-							// check if this is the first separator or not
-							if (first_header_read == 0) {		// this is the first separator
+	// pin the thread to a CPU
+	if ( args->cpu >= 0 ) {
+		CPU_ZERO(&cpus);
+		CPU_SET(args->cpu, &cpus);
+		if ( pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0 ) {
+			my_err("Warning: cannot pin the thread to CPU %i\n", args->cpu);
+		} else {
+			do_debug(1, "Thread (role %i) pinned to CPU %i\n", role, args->cpu);
+		}
+	}
 
-								// the first thing I expect is a 'protocol' field
-								if ( SIZE_PROTOCOL_FIELD == 1 ) {
-									protocol_rec = buffer_from_net[position];
-									position ++;
-								} else {	// SIZE_PROTOCOL_FIELD == 2
-									protocol_rec = 256 * (buffer_from_net[position]) + buffer_from_net[position + 1];
-									position = position + 2;
-								}
+	/*** register the interface descriptors in the event loop ***/
+	// only the socket of the selected mode is registered (in Transport mode, network_mode_fd is not a socket)
+	if ( event_loop_init(&events, ctx->event_backend) < 0 ) {
+		my_err("Error creating the event loop\n");
+		exit(1);
+	}
+	if ( role & ROLE_INGRESS ) {
+		if ( ( event_loop_add(&events, tun_fd) < 0 ) ||
+			 ( ( rohc_pool != NULL ) && ( event_loop_add(&events, rohc_pool_fd(rohc_pool)) < 0 ) ) ||
+			 ( ( feedback_event_fd >= 0 ) && ( event_loop_add(&events, feedback_event_fd) < 0 ) ) ) {
+			my_err("Error registering the interfaces in the event loop\n");
+			exit(1);
+		}
+	}
+	if ( role & ROLE_EGRESS ) {
+		if ( ( event_loop_add(&events, (mode == NETWORK_MODE) ? network_mode_fd : transport_mode_fd) < 0 ) ||
+			 ( event_loop_add(&events, feedback_fd) < 0 ) ) {
+			my_err("Error registering the interfaces in the event loop\n");
+			exit(1);
+		}
+	}
 
-								// after the first byte I will find a Mux separator, so I check the next byte
-								// Since this is a first header:
-								//	- SPB will be stored in 'bits[7]'
-								//	- LXT will be stored in 'bits[6]'
-								FromByte(buffer_from_net[position], bits);
-
-								// check the Single Protocol Bit (SPB, one bit), which only appears in the first
-								// Simplemux header.  It would is set to 0 if all the multiplexed
-								// packets belong to the same protocol (in this case, the "protocol"
-								// field will only appear in the first Simplemux header).  It is set to
-								// 1 when each packet MAY belong to a different protocol.
-								if (bits[7]) {
-									single_protocol_rec = 1;
-								} else {
-									single_protocol_rec = 0;
-								}
+	// prepare the batch for sending the muxed packets
+	// in Network mode, the muxed packets are also received in batches, whatever the size of the sending batch
+	if (mode == NETWORK_MODE ) {
+		init_send_batch(&bundle_batch, network_mode_fd, batch_size);
+		init_recv_batch(&net_batch, network_mode_fd, MAXBATCH);
+	} else {
+		init_send_batch(&bundle_batch, transport_mode_fd, batch_size);
+	}
 
-								// as this is a first header, the length extension bit is the second one, and the 
-								// maximum length of a single-byte packet is 64 bytes
-								LXT_position = 6;
-								maximum_packet_length = 64;
+	if ( bypass_flows ) flow_cache_init(&bypass_cache, ctx->rohc_bypass_time);
+
+	// the demuxed packets are written to tun in batches. With io_uring, each batch is a single system call
+	if ( role & ROLE_EGRESS ) tun_writer_init(&tun_out, tun_fd, packet_ring, ctx->tun_vnet_hdr, ctx->event_backend == EVENT_BACKEND_URING);
+
+	// I calculate 'now' as the moment of the last sending of each mux queue, and start the period of each one
+	time_in_microsec = GetMonotonicTime();
+	timer_wheel_init(&period_timers, time_in_microsec);
+	if ( role & ROLE_INGRESS ) {
+		for (p = 0; p < peers->num_peers; p++) {
+			peer = peers->peers[p];
+			for (k = 0; k < peer->num_queues; k++) {
+				queue = &peer->queues[k];
+				queue->time_last_sent_in_microsec = time_in_microsec;
+				wheel_timer_init(&queue->period_timer, queue);
+				timer_wheel_arm(&period_timers, &queue->period_timer, time_in_microsec + queue->policies.period);
+			}
+		}
+		peer = NULL;
+		queue = NULL;
+	}
 
-								// if I am here, it means that I have read the first separator
-								first_header_read = 1;
-									
-							} else {
-								// Non-first header
+	// start the packet-per-second counters
+	memset(&pps, 0, sizeof(pps));
+	pps.time_last_report = time_in_microsec;
+	time_last_adapt = time_in_microsec;
 
-								if (single_protocol_rec == 1) {
-									// all the packets belong to the same protocol, so the first byte belongs to the Mux separator, so I check it
-									FromByte(buffer_from_net[position], bits);
-								} else {
-									// each packet belongs to a different protocol, so the first thing I find is the 'Protocol' field
-									// and the second one belongs to the Mux separator, so I check it
-									if ( SIZE_PROTOCOL_FIELD == 1 ) {
-										protocol_rec = buffer_from_net[position];
-										position ++;
-									} else {	// SIZE_PROTOCOL_FIELD == 2
-										protocol_rec = 256 * (buffer_from_net[position]) + buffer_from_net[position + 1];
-										position = position + 2;
-									}
 
-									// get the value of the bits of the first byte
-									// as this is a non-first header:
-									//	- LXT will be stored in 'bits[7]'
-									FromByte(buffer_from_net[position], bits);
-								}
+	/*****************************************/
+	/************** Main loop ****************/
+	/*****************************************/
+	while(1) {
 
-								// as this is a non-first header, the length extension bit is the first one (7), and the
-								// maximum length of a single-byte packet is 128 bytes
-								LXT_position = 7;
-								maximum_packet_length = 128;
-							}
+		if ( segments_left > 0 ) {
+			// store the next segment of a ROHC packet before anything else
+			event_loop_set_ready(&events, tun_fd);
 
-							// I have demuxed another packet
-							num_demuxed_packets ++;
-							//do_debug(2, "\n");
+		} else if ( ( role & ROLE_INGRESS ) && ( feedback_to_send != NULL ) && ( feedback_queue_peek(feedback_to_send, &feedback_data) >= 0 ) ) {
+			// store the feedback generated by the decompressor in a mux queue of its peer, without waiting
+			event_loop_set_ready(&events, tun_fd);
 
-							do_debug(1, " DEMUXED PACKET #%i", num_demuxed_packets);
-							//if ((debug == 1) && (ROHC_mode == 0) ) do_debug (1,"\n");
-							do_debug(2, ": ");
+		} else if ( tun_batch_left > 0 ) {
+			// batched mode: keep on draining the tun interface without waiting
+			event_loop_set_ready(&events, tun_fd);
 
-							// read the length
-							// Check the LXT (length extension) bit.
-							// if this is a first header, the length extension bit is the second one (6), and the maximum
-							// length of a single-byte packet is 64 bytes
+		} else if ( ( mode == NETWORK_MODE ) && ( role & ROLE_EGRESS ) && ( net_batch.next < net_batch.num_msgs ) ) {
+			// demux the muxed packets received by the last recvmmsg() before waiting again
+			event_loop_set_ready(&events, network_mode_fd);
 
-							if (bits[LXT_position]== false) {
-								// if the LXT bit is 0, it means that the separator is one-byte
-								// I have to convert the six less significant bits to an integer, which means the length of the packet
-								// since the two most significant bits are 0, the length is the value of the char
-								packet_length = buffer_from_net[position] % maximum_packet_length;
-								do_debug(2, " Mux separator of 1 byte: (%02x) ", buffer_from_net[position]);
-								PrintByte(2, 8, bits);
+		} else if ( rohc_jobs_pending ) {
+			// keep on taking the packets compressed by the ROHC threads without waiting
+			event_loop_set_ready(&events, rohc_pool_fd(rohc_pool));
 
-								position ++;
+		} else {
+			// send the muxed packets stored in the batch, and write the demuxed ones to tun, before waiting
+			if ( bundle_batch.num_msgs > 0 ) flush_send_batch(&bundle_batch, &pps);
+			if ( ( role & ROLE_EGRESS ) && ( tun_out.num_packets > 0 ) ) flush_to_tun(&tun_out, stats);
+
+			/* Initialize the timeout. */
+			time_in_microsec = GetMonotonicTime();
+			if ( !(role & ROLE_INGRESS) ) {
+				microseconds_left = MAXTIMEOUT;		// the period is only handled by the ingress side
+			} else {
+				// wait until the period of one of the mux queues expires
+				microseconds_left = timer_wheel_time_left(&period_timers, time_in_microsec, MAXTIMEOUT);
+			}
+			// do_debug (1, "microseconds_left: %i\n", microseconds_left);
 
-							} else {
-								// if the second bit (LXT) of the first byte is 1, it means that the separator is not one-byte
+			/* the event loop monitors multiple file descriptors, */ 
+			/* waiting until one or more of them become "ready" for reading */
+			ret = event_loop_wait(&events, microseconds_left); 	//this line stops the program until something
+																//happens or the period expires
 
-								// check the bit 7 of the second byte
-								FromByte(buffer_from_net[position+1], bits);
+			// if the program gets here, it means that a packet has arrived (from tun or from the network), or the period has expired
+			if (ret < 0 && errno == EINTR) continue;
 
-								// If the LXT bit is 0, this is a two-byte length
-								if (bits[7] == 0) {
+			if (ret < 0) {
+				perror("event_loop_wait()");
+				exit(1);
+			}
 
-									// I get the 6 (or 7) less significant bits of the first byte by using modulo maximum_packet_length
-									// I do the product by 128, because the next byte includes 7 bits of the length
-									packet_length = ((buffer_from_net[position] % maximum_packet_length) * 128 );
+			// the egress thread has queued feedback to be sent. It is stored in the next iteration
+			if ( ( feedback_event_fd >= 0 ) && event_loop_is_ready(&events, feedback_event_fd) ) {
+				if ( ( read(feedback_event_fd, &event_value, sizeof(event_value)) < 0 ) && ( errno != EAGAIN ) ) perror("read() feedback");
+			}
 
-									// I add the value of the 7 less significant bits of the second byte
-									packet_length = packet_length + (buffer_from_net[position+1] % 128);
+			// in batched mode, up to 'batch_size' packets will be read from tun before waiting again
+			if ( ( batch_size > 1 ) && event_loop_is_ready(&events, tun_fd) ) tun_batch_left = batch_size;
 
-									if (debug ) {
-										do_debug(2, " Mux separator of 2 bytes: (%02x) ", buffer_from_net[position]);
-										PrintByte(2, 8, bits);
-										FromByte(buffer_from_net[position+1], bits);
-										do_debug(2, " (%02x) ",buffer_from_net[position+1]);
-										PrintByte(2, 8, bits);	
-									}					
-									position = position + 2;
+			// report the packet-per-second and system call rates
+			time_in_microsec = GetMonotonicTime();
+			if ( ( time_in_microsec - pps.time_last_report ) >= PPS_INTERVAL ) {
+				report_pps(&pps, tun2net, time_in_microsec, trace);
+			}
 
+			// adapt the policies of the mux queues to the load
+			if ( ( role & ROLE_INGRESS ) && ( ( time_in_microsec - time_last_adapt ) >= ADAPT_INTERVAL ) ) {
+				for (p = 0; p < peers->num_peers; p++) {
+					peer = peers->peers[p];
+					for (k = 0; k < peer->num_queues; k++) {
+						queue = &peer->queues[k];
+						if ( queue->limits.max_delay == 0 ) continue;
+						if ( adapt_multiplexing_policies(queue, time_in_microsec - time_last_adapt) == 0 ) continue;
 
-								// If the LXT bit is 1, this is a three-byte length
-								} else {
-									// I get the 6 (or 7) less significant bits of the first byte by using modulo maximum_packet_length
-									// I do the product by 16384 (2^14), because the next two bytes include 14 bits of the length
-									packet_length = ((buffer_from_net[position] % maximum_packet_length) * 16384 );
-
-									// I get the 6 (or 7) less significant bits of the second byte by using modulo 128
-									// I do the product by 128, because the next byte includes 7 bits of the length
-									packet_length = packet_length + ((buffer_from_net[position+1] % 128) * 128 );
-
-									// I add the value of the 7 less significant bits of the second byte
-									packet_length = packet_length + (buffer_from_net[position+2] % 128);
-
-									if (debug ) {
-										do_debug(2, " Mux separator of 2 bytes: (%02x) ", buffer_from_net[position]);
-										PrintByte(2, 8, bits);
-										FromByte(buffer_from_net[position+1], bits);
-										do_debug(2, " (%02x) ",buffer_from_net[position+1]);
-										PrintByte(2, 8, bits);	
-										FromByte(buffer_from_net[position+2], bits);
-										do_debug(2, " (%02x) ",buffer_from_net[position+2]);
-										PrintByte(2, 8, bits);
-									}					
-									position = position + 3;
-								}
-							}
+						do_debug(1, "Adaptive policies for peer %s (%s queue): %.0f pps of %.0f bytes. size threshold: %i. period: %"PRIu64"\n",
+							sockaddr_inet_ntoa(&peer->remote), (queue->mux_class == MUX_CLASS_REALTIME) ? "realtime" : "bulk",
+							queue->arrival_rate * 1000000, queue->mean_size, queue->policies.size_threshold, queue->policies.period);
 
-							do_debug(1, ": total %i bytes\n", packet_length);
+						// the period runs from the last sending, with the new length
+						timer_wheel_arm(&period_timers, &queue->period_timer, queue->time_last_sent_in_microsec + queue->policies.period);
 
+						// write the log file
+						if ( trace != NULL ) {
+							trace_policy(trace, GetTimeStamp(), &peer->remote.sa, (mode == TRANSPORT_MODE) ? sockaddr_inet_port(&peer->remote) : -1,
+								queue->mux_class, queue->policies.size_threshold, queue->policies.period, queue->arrival_rate * 1000000, queue->mean_size);
+						}
+					}
+				}
+				peer = NULL;
+				queue = NULL;
+				time_last_adapt = time_in_microsec;
+			}
+		}
 
-						} else { 	// 'Protocol' field goes after the separator
 
-							// read the SPB and LXT bits and 'protocol', 
+		/*****************************************************************************/
+		/***************** NET to tun. demux and decompress **************************/
+		/*****************************************************************************/
+
+		// data arrived at the network interface: read, demux, decompress and forward it
+		// in Transport mode, the traffic has arrived to transport_mode_fd
+		// in Network mode, the packet has arrived to network_mode_fd
+
+		// event_loop_is_ready tests if a file descriptor can be read
+		if(event_loop_is_ready(&events, transport_mode_fd) || event_loop_is_ready(&events, network_mode_fd)) {		
+
+			switch (mode) {
+				case TRANSPORT_MODE:
+					// a packet has been received from the network, destinated to the multiplexing port. 'slen' is the length of the IP address
+					// I cannot use 'remote' because it would replace the IP address and port. I use 'received'
+					nread_from_net = recvfrom ( transport_mode_fd, buffer_from_net, BUFSIZE, 0, (struct sockaddr *)&received, &slen );
+					if (nread_from_net==-1) perror ("recvfrom()");
+					data_from_net = buffer_from_net;
+					// now buffer_from_net contains the payload (simplemux headers and multiplexled packets) of a full packet or frame.
+					// I don't have the IP and UDP headers
+
+					// check if the packet comes from the multiplexing port (default 55555). (Its destination IS the multiplexing port)
+					if (port == sockaddr_inet_port(&received)) 
+						 is_multiplexed_packet = 1;
+					else is_multiplexed_packet = 0;
+				break;
+
+				case NETWORK_MODE:
+					// the muxed packets waiting in the socket are received with a single recvmmsg(), and demuxed one by one
+					// from their slots. If the socket has been drained, go back to wait
+					if ( ( net_batch.next >= net_batch.num_msgs ) && ( fill_recv_batch(&net_batch) == 0 ) ) continue;
+					k = net_batch.next++;
+					nread_from_net = net_batch.msgs[k].msg_len;
+					data_from_net = net_batch.buffers[k];
+
+					if (ctx->family == AF_INET6) {
+						// an IPv6 raw socket does not deliver the IPv6 header: the source of the packet is given by recvmmsg()
+						// and the socket only receives the packets of protocol Simplemux
+						received = net_batch.sources[k];
+						is_multiplexed_packet = 1;
+						break;
+					}
 
-							// check if this is the first separator or not
-							if (first_header_read == 0) {
+					// an IPv4 raw socket delivers the IP header: the bundle is demuxed after it (options included), without copying it
+					GetIpHeader(&ipheader, data_from_net);
+					size_outer_header = ipheader.ihl * 4;
+					if ( ( nread_from_net < IPv4_HEADER_SIZE ) || ( size_outer_header < IPv4_HEADER_SIZE ) || ( size_outer_header > nread_from_net ) ) {
+						do_debug(1, "Packet received with a wrong IP header: %i bytes. Packet dropped\n", nread_from_net);
+						continue;
+					}
+					data_from_net = data_from_net + size_outer_header;
+					nread_from_net = nread_from_net - size_outer_header;
+
+					if (ipheader.protocol == IPPROTO_SIMPLEMUX )
+						 is_multiplexed_packet = 1;
+					else is_multiplexed_packet = 0;
+
+					// the source of the packet is in the IP header
+					received.in.sin_family = AF_INET;
+					received.in.sin_addr.s_addr = ipheader.saddr;
+					received.in.sin_port = 0;
+				break;
+			}
 
-								// in the first byte I will find a Mux separator, so I check it
-								// Since this is a first header:
-								//	- SPB will be stored in 'bits[7]'
-								//	- LXT will be stored in 'bits[6]'
-								FromByte(buffer_from_net[position], bits);
+			// find the peer that has sent the packet
+			peer = peer_table_lookup(peers, &received);
 
-								// check the Single Protocol Bit (SPB, one bit), which only appears in the first
-								// Simplemux header.  It would is set to 0 if all the multiplexed
-								// packets belong to the same protocol (in this case, the "protocol"
-								// field will only appear in the first Simplemux header).  It is set to
-								// 1 when each packet MAY belong to a different protocol.
-								if (bits[7]) {
-									single_protocol_rec = 1;
-								} else {
-									single_protocol_rec = 0;
-								}
 
-								// as this is a first header, the length extension bit is the second one, and the 
-								// maximum length of a single-byte packet is 64 bytes
-								LXT_position = 6;
-								maximum_packet_length = 64;
-
-							} else {	// Non-first header
-
-								// get the value of the bits of the first byte
-								// as this is a non-first header:
-								//	- LXT will be stored in 'bits[7]'
-								FromByte(buffer_from_net[position], bits);
-							
-								// as this is a non-first header, the length extension bit is the first one (7), and the
-								// maximum length of a single-byte packet is 128 bytes
-								LXT_position = 7;
-								maximum_packet_length = 128;
-							}
+			// now data_from_net contains a full packet or frame.
+			// check if the packet is a multiplexed one
+			if (is_multiplexed_packet && (peer == NULL)) {
+				// the packet does not come from a known peer: it cannot be decompressed
+				do_debug(1, "MUXED PACKET from unknown peer %s: %i bytes. Packet dropped\n", sockaddr_inet_ntoa(&received), nread_from_net);
 
-							// I have demuxed another packet
-							num_demuxed_packets ++;
-							//do_debug(2, "\n");
+				// write the log file
+				if ( trace != NULL ) {
+					trace_peer(trace, GetTimeStamp(), TRACE_DROP_UNKNOWN_PEER, nread_from_net, net2tun, &received.sa, -1, 0, 0);
+				}
+			}
 
-							do_debug(1, " DEMUXED PACKET #%i", num_demuxed_packets);
-							do_debug(2, ": ");
+			else if (is_multiplexed_packet) {
 
-							// read the length
-							// Check the LXT (length extension) bit.
-							if (bits[LXT_position]== false) {
-								// if the LXT bit is 0, it means that the separator is one-byte
+				/* increase the counter of the number of packets read from the network */
+				net2tun++;
+				if ( stats != NULL ) stats_add(&stats->net2tun, 1);
+				switch (mode) {
+					case TRANSPORT_MODE:
+						do_debug(1, "MUXED PACKET #%lu: Read muxed packet from %s:%d: %i bytes\n", net2tun, sockaddr_inet_ntoa(&peer->remote), sockaddr_inet_port(&peer->remote), nread_from_net + size_ip_header + UDP_HEADER_SIZE );				
 
-								// I have to convert the 6 (or 7) less significant bits to an integer, which means the length of the packet
-								// since the two most significant bits are 0, the length is the value of the char
-								packet_length = buffer_from_net[position] % maximum_packet_length;
-								do_debug(2, " Mux separator of 1 byte: (%02x) ", buffer_from_net[position]);
-								PrintByte(2, 8, bits);
+						// write the log file
+						if ( trace != NULL ) {
+							trace_peer(trace, GetTimeStamp(), TRACE_REC_MUXED, nread_from_net + size_ip_header + UDP_HEADER_SIZE, net2tun, &peer->remote.sa, sockaddr_inet_port(&peer->remote), 0, 0);
+						}
+					break;
 
-								position ++;
+					case NETWORK_MODE:
+						do_debug(1, "MUXED PACKET #%lu: Read muxed packet from %s: %i bytes\n", net2tun, sockaddr_inet_ntoa(&peer->remote), nread_from_net + size_ip_header );				
 
-							} else {
-								// if the second bit (LXT) of the first byte is 1, it means that the separator is not one-byte
+						// write the log file
+						if ( trace != NULL ) {
+							trace_peer(trace, GetTimeStamp(), TRACE_REC_MUXED, nread_from_net + size_ip_header, net2tun, &peer->remote.sa, -1, 0, 0);
+						}
+					break;
+				}
 
-								// check the bit 7 of the second byte
-								FromByte(buffer_from_net[position+1], bits);
+				// if the packet comes from the multiplexing port, I have to demux it and write each packet to the tun interface
+				// find the boundaries of all the packets of the bundle. Each packet is a slice of data_from_net
+				num_demuxed_packets = mux_decoder_feed(&decoder, data_from_net, nread_from_net);
 
-								// If the LXT bit is 0, this is a two-byte length
-								if (bits[7] == 0) {
-									// I get the 6 (or 7) less significant bits of the first byte by using modulo maximum_packet_length
-									// I do the product by 128, because the next byte includes 7 bits of the length
-									packet_length = ((buffer_from_net[position] % maximum_packet_length) * 128 );
+				for (k = 0; k < num_demuxed_packets; k++) {
+					demuxed_packet = decoder.slices[k].data;
+					packet_length = decoder.slices[k].length;
+					protocol_rec = decoder.slices[k].protocol;
 
-									// I add the value of the 7 less significant bits of the second byte
-									packet_length = packet_length + (buffer_from_net[position+1] % 128);
+					do_debug(1, " DEMUXED PACKET #%i", k + 1);
+					do_debug(2, ": ");
 
-									if (debug ) {
-										do_debug(2, " Mux separator of 2 bytes: (%02x) ", buffer_from_net[position]);
-										PrintByte(2, 8, bits);
-										FromByte(buffer_from_net[position+1], bits);
-										do_debug(2, " (%02x) ",buffer_from_net[position+1]);
-										PrintByte(2, 8, bits);	
-									}					
-									position = position + 2;
+					if (debug) {
+						do_debug(2, " Mux separator of %i byte(s):", decoder.slices[k].size_separator);
+						for (l = 0; l < decoder.slices[k].size_separator; l++) {
+							FromByte(data_from_net[decoder.slices[k].separator + l], bits);
+							do_debug(2, " (%02x) ", data_from_net[decoder.slices[k].separator + l]);
+							PrintByte(2, 8, bits);
+						}
+					}
+					do_debug(1, ": total %i bytes\n", packet_length);
 
 
-								// If the LXT bit of the second byte is 1, this is a three-byte length
-								} else {
-									// I get the 6 (or 7) less significant bits of the first byte by using modulo maximum_packet_length
-									// I do the product by 16384 (2^14), because the next two bytes include 14 bits of the length
-									packet_length = ((buffer_from_net[position] % maximum_packet_length) * 16384 );
-
-									// I get the 6 (or 7) less significant bits of the second byte by using modulo 128
-									// I do the product by 128, because the next byte includes 7 bits of the length
-									packet_length = packet_length + ((buffer_from_net[position+1] % 128) * 128 );
-
-									// I add the value of the 7 less significant bits of the second byte
-									packet_length = packet_length + (buffer_from_net[position+2] % 128);
-
-									if (debug ) {
-										do_debug(2, " Mux separator of 2 bytes: (%02x) ", buffer_from_net[position]);
-										PrintByte(2, 8, bits);
-										FromByte(buffer_from_net[position+1], bits);
-										do_debug(2, " (%02x) ",buffer_from_net[position+1]);
-										PrintByte(2, 8, bits);	
-										FromByte(buffer_from_net[position+2], bits);
-										do_debug(2, " (%02x) ",buffer_from_net[position+2]);
-										PrintByte(2, 8, bits);
-									}					
-									position = position + 3;
-								}
-							}
+					/************ decompress the packet ***************/
 
-							do_debug(1, ": total %i bytes\n", packet_length);
+					// the entry is only written to tun if its decompression succeeds (e.g. not without ROHC mode)
+					status = ROHC_STATUS_ERROR;
 
+					// ROHC feedback from the remote decompressor, carried in the bundle: it is not decompressed
+					if ( protocol_rec == IPPROTO_ROHC_FEEDBACK ) {
+						feedback_pkts ++;
+						if ( stats != NULL ) stats_add(&stats->feedback_pkts, 1);
+						do_debug(1, " ROHC feedback packet\n");
 
-							// check if this is the first separator or not
-							if (first_header_read == 0) {		// this is the first separator. The protocol field will always be present
-								// the next thing I expect is a 'protocol' field
-								if ( SIZE_PROTOCOL_FIELD == 1 ) {
-									protocol_rec = buffer_from_net[position];
-									position ++;
-								} else {	// SIZE_PROTOCOL_FIELD == 2
-									protocol_rec = 256 * (buffer_from_net[position]) + buffer_from_net[position + 1];
-									position = position + 2;
-								}
+						// write the log file
+						if ( trace != NULL ) {
+							trace_peer(trace, GetTimeStamp(), TRACE_REC_ROHC_FEEDBACK, packet_length, feedback_pkts, &peer->remote.sa, sockaddr_inet_port(&peer->remote), 0, 0);
+						}
 
-								// if I am here, it means that I have read the first separator
-								first_header_read = 1;
-
-							} else {			// non-first separator. The protocol field may or may not be present
-								if ( single_protocol_rec == 0 ) {
-									// each packet belongs to a different protocol, so the first thing is the 'Protocol' field
-									if ( SIZE_PROTOCOL_FIELD == 1 ) {
-										protocol_rec = buffer_from_net[position];
-										position ++;
-									} else {	// SIZE_PROTOCOL_FIELD == 2
-										protocol_rec = 256 * (buffer_from_net[position]) + buffer_from_net[position + 1];
-										position = position + 2;
-									}
-								}
-							}
+						// queue the feedback received. The ingress side will deliver it to the local compressor
+						if ( peer->compressor == NULL ) {
+							do_debug(3, "Feedback received, but ROHC is not activated\n");
+						} else if ( feedback_queue_push ( &peer->feedback_queue, NULL, demuxed_packet, packet_length ) == false ) {
+							do_debug(3, "Error queuing feedback for the compressor: queue full or feedback too long\n");
+						} else {
+							do_debug(3, "Feedback queued for the compressor: %i bytes\n", packet_length);
 						}
+					}
 
-						// copy the packet to a new string
-						for (l = 0; l < packet_length ; l++) {
-							demuxed_packet[l] = buffer_from_net[l + position ];
+					// if the number of the protocol is NOT 142 (ROHC) I do not decompress the packet
+					else if ( protocol_rec != 142 ) {
+						// non-compressed packet
+						// dump the received packet on terminal
+						if (debug) {
+							//do_debug(1, " Received ");
+							do_debug(2, "   ");
+							dump_packet ( packet_length, demuxed_packet );
 						}
-						position = position + packet_length;
 
-						// Check if the position has gone beyond the size of the packet (wrong packet)
-						if (position > nread_from_net) {
-							// The last length read from the separator goes beyond the end of the packet
-							do_debug (1, "  The length of the packet does not fit. Packet discarded\n");
+					} else {
+						// ROHC-compressed packet
+
+						// I cannot decompress the packet if I am in no-ROHC mode
+						if ( ROHC_mode == 0 ) {
+							do_debug(1," ROHC packet received, but not in ROHC mode. Packet dropped\n");
 
 							// write the log file
-							if ( log_file != NULL ) {
-								// the packet is bad so I add a line
-								fprintf (log_file, "%"PRIu64"\terror\tdemux_bad_length\t%i\t%lu\n", GetTimeStamp(), nread_from_net, net2tun );	
-								fflush(log_file);
+							if ( trace != NULL ) {
+								trace_packet(trace, GetTimeStamp(), TRACE_DROP_NO_ROHC_MODE, packet_length, net2tun);	// the packet may be good, but the decompressor is not in ROHC mode
 							}
-						
 						} else {
+							// reset the buffers where the rohc packets, ip packets and feedback info are to be stored
+							rohc_buf_reset (&ip_packet_d);
+							rohc_buf_reset (&rcvd_feedback);
+							rohc_buf_reset (&feedback_send);
+
+							// the ROHC packet is decompressed from the bundle itself, without copying it
+							demuxed_rohc_packet.data = demuxed_packet;
+							demuxed_rohc_packet.max_len = packet_length;
+							demuxed_rohc_packet.offset = 0;
+							demuxed_rohc_packet.len = packet_length;
+
+							// dump the ROHC packet on terminal
+							if (debug == 1) {
+								do_debug(1, " ROHC. ");
+							}
+							if (debug == 2) {
+								do_debug(2, " ");
+								do_debug(2, " ROHC packet\n   ");
+								dump_packet (packet_length, demuxed_packet);
+							}
 
-							/************ decompress the packet ***************/
+							// decompress the packet
+							status = rohc_decompress3 (peer->decompressor, demuxed_rohc_packet, &ip_packet_d, &rcvd_feedback, &feedback_send);
 
-							// if the number of the protocol is NOT 142 (ROHC) I do not decompress the packet
-							if ( protocol_rec != 142 ) {
-								// non-compressed packet
-								// dump the received packet on terminal
-								if (debug) {
-									//do_debug(1, " Received ");
-									do_debug(2, "   ");
-									dump_packet ( packet_length, demuxed_packet );
-								}
+							// if bidirectional mode has been set, check the feedback
+							if ( ROHC_mode > 1 ) {
 
-							} else {
-								// ROHC-compressed packet
+								// check if the decompressor has received feedback, and it has to be delivered to the local compressor
+								if ( !rohc_buf_is_empty( rcvd_feedback) ) { 
+									do_debug(3, "Feedback received from the remote compressor by the decompressor (%i bytes), to be delivered to the local compressor\n", rcvd_feedback.len);
+									// dump the feedback packet on terminal
+									if (debug) {
+										do_debug(2, "  ROHC feedback packet received\n   ");
 
-								// I cannot decompress the packet if I am in no-ROHC mode
-								if ( ROHC_mode == 0 ) {
-									do_debug(1," ROHC packet received, but not in ROHC mode. Packet dropped\n");
+										dump_packet (rcvd_feedback.len, rcvd_feedback.data );
+									}
 
-									// write the log file
-									if ( log_file != NULL ) {
-										fprintf (log_file, "%"PRIu64"\tdrop\tno_ROHC_mode\t%i\t%lu\n", GetTimeStamp(), packet_length, net2tun);	// the packet may be good, but the decompressor is not in ROHC mode
-										fflush(log_file);
+									// queue the feedback received. The ingress side will deliver it to the local compressor
+									if ( feedback_queue_push ( &peer->feedback_queue, NULL, rohc_buf_data_at(rcvd_feedback, 0), rcvd_feedback.len ) == false ) {
+										do_debug(3, "Error queuing feedback received from the remote compressor: queue full or feedback too long\n");
+									} else {
+										do_debug(3, "Feedback from the remote compressor queued for the compressor: %i bytes\n", rcvd_feedback.len);
 									}
 								} else {
-									// reset the buffers where the rohc packets, ip packets and feedback info are to be stored
-									rohc_buf_reset (&ip_packet_d);
-									rohc_buf_reset (&rohc_packet_d);
-									rohc_buf_reset (&rcvd_feedback);
-									rohc_buf_reset (&feedback_send);
-
-									// Copy the compressed length and the compressed packet
-									rohc_packet_d.len = packet_length;
-						
-									// Copy the packet itself
-									for (l = 0; l < packet_length ; l++) {
-										rohc_buf_byte_at(rohc_packet_d, l) = demuxed_packet[l];
-									}
+									do_debug(3, "No feedback received by the decompressor from the remote compressor\n");
+								}
+
+								// check if the decompressor has generated feedback to be sent to the other peer
+								if ( !rohc_buf_is_empty( feedback_send ) ) { 
+									do_debug(3, "Generated feedback (%i bytes) to be sent to the peer\n", feedback_send.len);
 
 									// dump the ROHC packet on terminal
-									if (debug == 1) {
-										do_debug(1, " ROHC. ");
-									}
-									if (debug == 2) {
-										do_debug(2, " ");
-										do_debug(2, " ROHC packet\n   ");
-										dump_packet (packet_length, demuxed_packet);
+									if (debug) {
+										do_debug(2, "  ROHC feedback packet generated\n   ");
+										dump_packet (feedback_send.len, feedback_send.data );
 									}
 
-									// decompress the packet
-									status = rohc_decompress3 (decompressor, rohc_packet_d, &ip_packet_d, &rcvd_feedback, &feedback_send);
-
-									// if bidirectional mode has been set, check the feedback
-									if ( ROHC_mode > 1 ) {
-
-										// check if the decompressor has received feedback, and it has to be delivered to the local compressor
-										if ( !rohc_buf_is_empty( rcvd_feedback) ) { 
-											do_debug(3, "Feedback received from the remote compressor by the decompressor (%i bytes), to be delivered to the local compressor\n", rcvd_feedback.len);
-											// dump the feedback packet on terminal
-											if (debug) {
-												do_debug(2, "  ROHC feedback packet received\n   ");
-
-												dump_packet (rcvd_feedback.len, rcvd_feedback.data );
-											}
-
-											// deliver the feedback received to the local compressor
-											//https://rohc-lib.org/support/documentation/API/rohc-doc-1.7.0/group__rohc__comp.html
-											if ( rohc_comp_deliver_feedback2 ( compressor, rcvd_feedback ) == false ) {
-												do_debug(3, "Error delivering feedback received from the remote compressor to the compressor\n");
-											} else {
-												do_debug(3, "Feedback from the remote compressor delivered to the compressor: %i bytes\n", rcvd_feedback.len);
-											}
-										} else {
-											do_debug(3, "No feedback received by the decompressor from the remote compressor\n");
-										}
 
-										// check if the decompressor has generated feedback to be sent by the feedback channel to the other peer
-										if ( !rohc_buf_is_empty( feedback_send ) ) { 
-											do_debug(3, "Generated feedback (%i bytes) to be sent by the feedback channel to the peer\n", feedback_send.len);
-
-											// dump the ROHC packet on terminal
-											if (debug) {
-												do_debug(2, "  ROHC feedback packet generated\n   ");
-												dump_packet (feedback_send.len, feedback_send.data );
-											}
-
-
-											// send the feedback packet to the peer
-											if (sendto(feedback_fd, feedback_send.data, feedback_send.len, 0, (struct sockaddr *)&feedback_remote, sizeof(feedback_remote))==-1) {
-												perror("sendto()");
-											} else {
-												do_debug(3, "Feedback generated by the decompressor (%i bytes), sent to the compressor\n", feedback_send.len);
-											}
-										} else {
-											do_debug(3, "No feedback generated by the decompressor\n");
-										}
-									}
+									// the feedback goes in the next bundle toward the peer. The ingress side stores it in a mux queue
+									// it is sent by the feedback channel if the peer does not understand it (-F), or if the queue is full
+									if ( ( feedback_to_send != NULL ) && feedback_queue_push ( feedback_to_send, peer, feedback_send.data, feedback_send.len ) ) {
+										do_debug(3, "Feedback generated by the decompressor (%i bytes), queued for the next bundle\n", feedback_send.len);
 
-									// check the result of the decompression
-
-									// decompression is successful
-									if ( status == ROHC_STATUS_OK) {
-
-										if(!rohc_buf_is_empty(ip_packet_d))	{	// decompressed packet is not empty
-								
-											// ip_packet.len bytes of decompressed IP data available in ip_packet
-											packet_length = ip_packet_d.len;
-
-											// copy the packet
-											memcpy(demuxed_packet, rohc_buf_data_at(ip_packet_d, 0), packet_length);
-
-											//dump the IP packet on the standard output
-											do_debug(2, "  ");
-											do_debug(1, "IP packet resulting from the ROHC decompression: %i bytes\n", packet_length);
-											do_debug(2, "   ");
-
-											if (debug) {
-												// dump the decompressed IP packet on terminal
-												dump_packet (ip_packet_d.len, ip_packet_d.data );
-											}
-
-										} else {
-											/* no IP packet was decompressed because of ROHC segmentation or
-											 * feedback-only packet:
-											 *  - the ROHC packet was a non-final segment, so at least another
-											 *    ROHC segment is required to be able to decompress the full
-											 *    ROHC packet
-											 *  - the ROHC packet was a feedback-only packet, it contained only
-											 *    feedback information, so there was nothing to decompress */
-											do_debug(1, "  no IP packet decompressed\n");
-
-											// write the log file
-											if ( log_file != NULL ) {
-												fprintf (log_file, "%"PRIu64"\trec\tROHC_feedback\t%i\t%lu\tfrom\t%s\t%d\n", GetTimeStamp(), nread_from_net, net2tun, inet_ntoa(remote.sin_addr), ntohs(remote.sin_port));	// the packet is bad so I add a line
-												fflush(log_file);
-											}
+										// wake up the ingress thread (-T)
+										if ( ( ctx->feedback_event_fd >= 0 ) && !( role & ROLE_INGRESS ) ) {
+											event_value = 1;
+											if ( write(ctx->feedback_event_fd, &event_value, sizeof(event_value)) < 0 ) perror("write() feedback");
 										}
+									} else if (sendto(feedback_fd, feedback_send.data, feedback_send.len, 0, &peer->feedback_remote.sa, sockaddr_inet_len(&peer->feedback_remote))==-1) {
+										perror("sendto()");
+									} else {
+										do_debug(3, "Feedback generated by the decompressor (%i bytes), sent to the compressor\n", feedback_send.len);
 									}
+								} else {
+									do_debug(3, "No feedback generated by the decompressor\n");
+								}
+							}
 
-									else if ( status == ROHC_STATUS_NO_CONTEXT ) {
+							// check the result of the decompression
 
-										// failure: decompressor failed to decompress the ROHC packet 
-										do_debug(1, "  decompression of ROHC packet failed. No context\n");
-										//fprintf(stderr, "  decompression of ROHC packet failed. No context\n");
+							// decompression is successful
+							if ( status == ROHC_STATUS_OK) {
 
-										// write the log file
-										if ( log_file != NULL ) {
-											// the packet is bad
-											fprintf (log_file, "%"PRIu64"\terror\tdecomp_failed\t%i\t%lu\n", GetTimeStamp(), nread_from_net, net2tun);	
-											fflush(log_file);
-										}
-									}
+								if(!rohc_buf_is_empty(ip_packet_d))	{	// decompressed packet is not empty
+						
+									// ip_packet.len bytes of decompressed IP data available in ip_packet
+									packet_length = ip_packet_d.len;
 
-									else if ( status == ROHC_STATUS_OUTPUT_TOO_SMALL ) {	// the output buffer is too small for the compressed packet
+									// the packet to write is now the decompressed one
+									demuxed_packet = rohc_buf_data_at(ip_packet_d, 0);
 
-										// failure: decompressor failed to decompress the ROHC packet 
-										do_debug(1, "  decompression of ROHC packet failed. Output buffer is too small\n");
-										//fprintf(stderr, "  decompression of ROHC packet failed. Output buffer is too small\n");
+									//dump the IP packet on the standard output
+									do_debug(2, "  ");
+									do_debug(1, "IP packet resulting from the ROHC decompression: %i bytes\n", packet_length);
+									do_debug(2, "   ");
 
-										// write the log file
-										if ( log_file != NULL ) {
-											// the packet is bad
-											fprintf (log_file, "%"PRIu64"\terror\tdecomp_failed. Output buffer is too small\t%i\t%lu\n", GetTimeStamp(), nread_from_net, net2tun);	
-											fflush(log_file);
-										}
+									if (debug) {
+										// dump the decompressed IP packet on terminal
+										dump_packet (ip_packet_d.len, ip_packet_d.data );
 									}
 
-									else if ( status == ROHC_STATUS_MALFORMED ) {			// the decompression failed because the ROHC packet is malformed 
-
-										// failure: decompressor failed to decompress the ROHC packet 
-										do_debug(1, "  decompression of ROHC packet failed. No context\n");
-										//fprintf(stderr, "  decompression of ROHC packet failed. No context\n");
+								} else {
+									/* no IP packet was decompressed because of ROHC segmentation or
+									 * feedback-only packet:
+									 *  - the ROHC packet was a non-final segment, so at least another
+									 *    ROHC segment is required to be able to decompress the full
+									 *    ROHC packet
+									 *  - the ROHC packet was a feedback-only packet, it contained only
+									 *    feedback information, so there was nothing to decompress */
+									do_debug(1, "  no IP packet decompressed\n");
 
-										// write the log file
-										if ( log_file != NULL ) {
-											// the packet is bad
-											fprintf (log_file, "%"PRIu64"\terror\tdecomp_failed. No context\t%i\t%lu\n", GetTimeStamp(), nread_from_net, net2tun);	
-											fflush(log_file);
-										}
+									// write the log file
+									if ( trace != NULL ) {
+										trace_peer(trace, GetTimeStamp(), TRACE_REC_ROHC_FEEDBACK_ONLY, nread_from_net, net2tun, &peer->remote.sa, sockaddr_inet_port(&peer->remote), 0, 0);	// the packet is bad so I add a line
 									}
+								}
+							}
 
-									else if ( status == ROHC_STATUS_BAD_CRC ) {			// the CRC detected a transmission or decompression problem
+							else if ( status == ROHC_STATUS_NO_CONTEXT ) {
 
-										// failure: decompressor failed to decompress the ROHC packet 
-										do_debug(1, "  decompression of ROHC packet failed. Bad CRC\n");
-										//fprintf(stderr, "  decompression of ROHC packet failed. Bad CRC\n");
+								// failure: decompressor failed to decompress the ROHC packet 
+								do_debug(1, "  decompression of ROHC packet failed. No context\n");
+								//fprintf(stderr, "  decompression of ROHC packet failed. No context\n");
 
-										// write the log file
-										if ( log_file != NULL ) {
-											// the packet is bad
-											fprintf (log_file, "%"PRIu64"\terror\tdecomp_failed. Bad CRC\t%i\t%lu\n", GetTimeStamp(), nread_from_net, net2tun);	
-											fflush(log_file);
-										}
-									}
+								// write the log file
+								if ( trace != NULL ) {
+									// the packet is bad
+									trace_packet(trace, GetTimeStamp(), TRACE_DECOMP_FAILED, nread_from_net, net2tun);	
+								}
+							}
 
-									else if ( status == ROHC_STATUS_ERROR ) {				// another problem occurred
+							else if ( status == ROHC_STATUS_OUTPUT_TOO_SMALL ) {	// the output buffer is too small for the compressed packet
 
-										// failure: decompressor failed to decompress the ROHC packet 
-										do_debug(1, "  decompression of ROHC packet failed. Other error\n");
-										//fprintf(stderr, "  decompression of ROHC packet failed. Other error\n");
+								// failure: decompressor failed to decompress the ROHC packet 
+								do_debug(1, "  decompression of ROHC packet failed. Output buffer is too small\n");
+								//fprintf(stderr, "  decompression of ROHC packet failed. Output buffer is too small\n");
 
-										// write the log file
-										if ( log_file != NULL ) {
-											// the packet is bad
-											fprintf (log_file, "%"PRIu64"\terror\tdecomp_failed. Other error\t%i\t%lu\n", GetTimeStamp(), nread_from_net, net2tun);	
-											fflush(log_file);
-										}
-									}
+								// write the log file
+								if ( trace != NULL ) {
+									// the packet is bad
+									trace_packet(trace, GetTimeStamp(), TRACE_DECOMP_OUTPUT_TOO_SMALL, nread_from_net, net2tun);	
 								}
-							} /*********** end decompression **************/
+							}
+
+							else if ( status == ROHC_STATUS_MALFORMED ) {			// the decompression failed because the ROHC packet is malformed 
+
+								// failure: decompressor failed to decompress the ROHC packet 
+								do_debug(1, "  decompression of ROHC packet failed. No context\n");
+								//fprintf(stderr, "  decompression of ROHC packet failed. No context\n");
+
+								// write the log file
+								if ( trace != NULL ) {
+									// the packet is bad
+									trace_packet(trace, GetTimeStamp(), TRACE_DECOMP_MALFORMED, nread_from_net, net2tun);	
+								}
+							}
 
-							// write the demuxed (and perhaps decompressed) packet to the tun interface
-							// if compression is used, check that ROHC has decompressed correctly
-							if ( ( protocol_rec != 142 ) || ((protocol_rec == 142) && ( status == ROHC_STATUS_OK))) {
+							else if ( status == ROHC_STATUS_BAD_CRC ) {			// the CRC detected a transmission or decompression problem
 
-								// print the debug information
-								//do_debug(2, "  Protocol: %i ",protocol_rec);
+								// failure: decompressor failed to decompress the ROHC packet 
+								do_debug(1, "  decompression of ROHC packet failed. Bad CRC\n");
+								//fprintf(stderr, "  decompression of ROHC packet failed. Bad CRC\n");
 
-								/*switch(protocol_rec) {
-									case 4:
-										do_debug (2, "(IP)");
-										break;
-									case 142:
-										do_debug (2, "(ROHC)");
-										break;
-								}*/
-								do_debug(2, "\n");
-								//do_debug(2, "packet length (without separator): %i\n", packet_length);
+								// write the log file
+								if ( trace != NULL ) {
+									// the packet is bad
+									trace_packet(trace, GetTimeStamp(), TRACE_DECOMP_BAD_CRC, nread_from_net, net2tun);	
+								}
+							}
 
+							else if ( status == ROHC_STATUS_ERROR ) {				// another problem occurred
 
-								// write the demuxed packet to the network
-								cwrite ( tun_fd, demuxed_packet, packet_length );
+								// failure: decompressor failed to decompress the ROHC packet 
+								do_debug(1, "  decompression of ROHC packet failed. Other error\n");
+								//fprintf(stderr, "  decompression of ROHC packet failed. Other error\n");
 
 								// write the log file
-								if ( log_file != NULL ) {
-									fprintf (log_file, "%"PRIu64"\tsent\tdemuxed\t%i\t%lu\n", GetTimeStamp(), packet_length, net2tun);	// the packet is good
-									fflush(log_file);
+								if ( trace != NULL ) {
+									// the packet is bad
+									trace_packet(trace, GetTimeStamp(), TRACE_DECOMP_OTHER_ERROR, nread_from_net, net2tun);	
 								}
 							}
+
+							// the packets lost by a damaged context, e.g. after losses in the network
+							if ( ( status != ROHC_STATUS_OK ) && ( stats != NULL ) ) stats_add(&stats->rohc_decomp_failed, 1);
+						}
+					} /*********** end decompression **************/
+
+					// write the demuxed (and perhaps decompressed) packet to the tun interface
+					// if compression is used, check that ROHC has decompressed correctly, and that there is
+					// a packet (a non-final segment or a feedback-only packet give none)
+					if ( ( ( protocol_rec != 142 ) && ( protocol_rec != IPPROTO_ROHC_FEEDBACK ) ) || ((protocol_rec == 142) && ( status == ROHC_STATUS_OK) && !rohc_buf_is_empty(ip_packet_d))) {
+
+						// print the debug information
+						//do_debug(2, "  Protocol: %i ",protocol_rec);
+
+						/*switch(protocol_rec) {
+							case 4:
+								do_debug (2, "(IP)");
+								break;
+							case 41:
+								do_debug (2, "(IPv6)");
+								break;
+							case 142:
+								do_debug (2, "(ROHC)");
+								break;
+						}*/
+						do_debug(2, "\n");
+						//do_debug(2, "packet length (without separator): %i\n", packet_length);
+
+
+						// write the demuxed packet to tun (in the batch, written before waiting)
+						write_to_tun ( &tun_out, demuxed_packet, packet_length, stats );
+
+						// write the log file
+						if ( trace != NULL ) {
+							trace_packet(trace, GetTimeStamp(), TRACE_SENT_DEMUXED, packet_length, net2tun);	// the packet is good
 						}
 					}
 				}
 
-				else {
-					// packet with destination port 55555, but a source port different from the multiplexing one
-					// if the packet does not come from the multiplexing port, write it directly into the tun interface
-					cwrite ( tun_fd, buffer_from_net, nread_from_net);
-					do_debug(1, "NON-MUXED PACKET #%lu: Non-multiplexed packet. Written %i bytes to tun\n", net2tun, nread_from_net);
+				// check if a separator has gone beyond the size of the packet (wrong packet)
+				if (decoder.bad_length) {
+					// The last length read from the separator goes beyond the end of the packet
+					do_debug (1, "  The length of the packet does not fit. Packet discarded\n");
 
 					// write the log file
-					if ( log_file != NULL ) {
-						// the packet is good
-						fprintf (log_file, "%"PRIu64"\tforward\tnative\t%i\t%lu\tfrom\t%s\t%d\n", GetTimeStamp(), nread_from_net, net2tun, inet_ntoa(remote.sin_addr), ntohs(remote.sin_port));
-						fflush(log_file);
+					if ( trace != NULL ) {
+						// the packet is bad so I add a line
+						trace_packet(trace, GetTimeStamp(), TRACE_DEMUX_BAD_LENGTH, nread_from_net, net2tun);
 					}
 				}
 			}
 
+			else {
+				// packet with destination port 55555, but a source port different from the multiplexing one
+				// if the packet does not come from the multiplexing port, write it directly into the tun interface
+				write_to_tun ( &tun_out, data_from_net, nread_from_net, stats );
+				do_debug(1, "NON-MUXED PACKET #%lu: Non-multiplexed packet. Written %i bytes to tun\n", net2tun, nread_from_net);
+
+				// write the log file
+				if ( trace != NULL ) {
+					// the packet is good
+					trace_peer(trace, GetTimeStamp(), TRACE_FORWARD_NATIVE, nread_from_net, net2tun, &received.sa, sockaddr_inet_port(&received), 0, 0);
+				}
+			}
+		}
 
 
-			/****************************************************************************************************************************/		
-			/******* NET to tun. ROHC feedback packet from the remote decompressor to be delivered to the local compressor **************/
-			/****************************************************************************************************************************/
-
-			/*** ROHC feedback data arrived at the network interface: read it in order to deliver it to the local compressor ***/
 
-			// the ROHC mode only affects the decompressor. So if I receive a ROHC feedback packet, I will use it
-			// this implies that if the origin is in ROHC Unidirectional mode and the destination in Bidirectional, feedback will still work
+		/****************************************************************************************************************************/		
+		/******* NET to tun. ROHC feedback packet from the remote decompressor to be delivered to the local compressor **************/
+		/****************************************************************************************************************************/
 
-			else if ( FD_ISSET ( feedback_fd, &rd_set )) {		/* FD_ISSET tests to see if a file descriptor is part of the set */
+		/*** ROHC feedback data arrived at the network interface: read it in order to deliver it to the local compressor ***/
 
-		  		// a packet has been received from the network, destinated to the feedbadk port. 'slen_feedback' is the length of the IP address
-				nread_from_net = recvfrom ( feedback_fd, buffer_from_net, BUFSIZE, 0, (struct sockaddr *)&feedback_remote, &slen_feedback );
+		// the ROHC mode only affects the decompressor. So if I receive a ROHC feedback packet, I will use it
+		// this implies that if the origin is in ROHC Unidirectional mode and the destination in Bidirectional, feedback will still work
 
-				if (nread_from_net == -1) perror ("recvfrom()");
+		else if ( event_loop_is_ready ( &events, feedback_fd )) {		/* event_loop_is_ready tests if a file descriptor can be read */
 
-				// now buffer_from_net contains a full packet or frame.
-				// check if the packet comes (source port) from the feedback port (default 55556).  (Its destination port IS the feedback port)
+	  		// a packet has been received from the network, destinated to the feedbadk port. 'slen_feedback' is the length of the IP address
+			nread_from_net = recvfrom ( feedback_fd, buffer_from_net, BUFSIZE, 0, (struct sockaddr *)&received, &slen_feedback );
 
-				if (port_feedback == ntohs(feedback_remote.sin_port)) {
+			if (nread_from_net == -1) perror ("recvfrom()");
 
-					// the packet comes from the feedback port (default 55556)
-					do_debug(1, "\nFEEDBACK %lu: Read ROHC feedback packet (%i bytes) from %s:%d\n", feedback_pkts, nread_from_net, inet_ntoa(feedback.sin_addr), ntohs(feedback.sin_port));
+			// now buffer_from_net contains a full packet or frame.
+			// check if the packet comes (source port) from the feedback port (default 55556).  (Its destination port IS the feedback port)
 
-					feedback_pkts ++;
+			if (port_feedback == sockaddr_inet_port(&received)) {
 
-					// write the log file
-					if ( log_file != NULL ) {
-						fprintf (log_file, "%"PRIu64"\trec\tROHC feedback\t%i\t%lu\tfrom\t%s\t%d\n", GetTimeStamp(), nread_from_net, feedback_pkts, inet_ntoa(remote.sin_addr), ntohs(remote.sin_port));
-						fflush(log_file);	// If the IO is buffered, I have to insert fflush(fp) after the write in order to avoid things lost when pressing Ctrl+C.
-					}
+				// the packet comes from the feedback port (default 55556)
+				do_debug(1, "\nFEEDBACK %lu: Read ROHC feedback packet (%i bytes) from %s:%d\n", feedback_pkts, nread_from_net, sockaddr_inet_ntoa(&received), sockaddr_inet_port(&received));
 
+				feedback_pkts ++;
+				if ( stats != NULL ) stats_add(&stats->feedback_pkts, 1);
 
-					// reset the buffer where the packet is to be stored
-					rohc_buf_reset (&rohc_packet_d);
+				// write the log file
+				if ( trace != NULL ) {
+					trace_peer(trace, GetTimeStamp(), TRACE_REC_ROHC_FEEDBACK, nread_from_net, feedback_pkts, &received.sa, sockaddr_inet_port(&received), 0, 0);
+				}
 
 
-					// Copy the compressed length and the compressed packet
-					rohc_packet_d.len = nread_from_net;
-		
-					// Copy the packet itself
-					for (l = 0; l < nread_from_net ; l++) {
-						rohc_buf_byte_at(rohc_packet_d, l) = buffer_from_net[l];
-					}
+				// reset the buffer where the packet is to be stored
+				rohc_buf_reset (&rohc_packet_d);
 
-					// dump the ROHC packet on terminal
-					if (debug) {
 
-						do_debug(2, " ROHC feedback packet received\n   ");
-						dump_packet ( rohc_packet_d.len, rohc_packet_d.data );
-					}
+				// Copy the compressed length and the compressed packet
+				rohc_packet_d.len = nread_from_net;
+	
+				// Copy the packet itself
+				for (l = 0; l < nread_from_net ; l++) {
+					rohc_buf_byte_at(rohc_packet_d, l) = buffer_from_net[l];
+				}
 
+				// dump the ROHC packet on terminal
+				if (debug) {
 
-					// deliver the feedback received to the local compressor
-					//https://rohc-lib.org/support/documentation/API/rohc-doc-1.7.0/group__rohc__comp.html
+					do_debug(2, " ROHC feedback packet received\n   ");
+					dump_packet ( rohc_packet_d.len, rohc_packet_d.data );
+				}
 
-					if ( rohc_comp_deliver_feedback2 ( compressor, rohc_packet_d ) == false ) {
-						do_debug(3, "Error delivering feedback to the compressor");
-					} else {
-						do_debug(3, "Feedback delivered to the compressor: %i bytes\n", rohc_packet_d.len);
-					}
 
-					// the information received does not have to be decompressed, because it has been 
-					// generated as feedback on the other side.
-					// So I don't have to decompress the packet
+				// queue the feedback received. The ingress side will deliver it to the local compressor
+				// (there is no compressor if ROHC is not activated)
+				peer = peer_table_lookup(peers, &received);
+				if ( peer == NULL ) {
+					do_debug(3, "Feedback received from an unknown peer\n");
+				} else if ( peer->compressor == NULL ) {
+					do_debug(3, "Feedback received, but ROHC is not activated\n");
+				} else if ( feedback_queue_push ( &peer->feedback_queue, NULL, rohc_buf_data_at(rohc_packet_d, 0), rohc_packet_d.len ) == false ) {
+					do_debug(3, "Error queuing feedback for the compressor: queue full or feedback too long\n");
+				} else {
+					do_debug(3, "Feedback queued for the compressor: %i bytes\n", rohc_packet_d.len);
 				}
 
-				else {
+				// the information received does not have to be decompressed, because it has been 
+				// generated as feedback on the other side.
+				// So I don't have to decompress the packet
+			}
+
+			else {
 
-					// packet with destination port 55556, but a source port different from the feedback one
-					// if the packet does not come from the feedback port, write it directly into the tun interface
-					cwrite ( tun_fd, buffer_from_net, nread_from_net);
-					do_debug(1, "NON-FEEDBACK PACKET %lu: Non-feedback packet. Written %i bytes to tun\n", net2tun, nread_from_net);
+				// packet with destination port 55556, but a source port different from the feedback one
+				// if the packet does not come from the feedback port, write it directly into the tun interface
+				write_to_tun ( &tun_out, buffer_from_net, nread_from_net, stats );
+				do_debug(1, "NON-FEEDBACK PACKET %lu: Non-feedback packet. Written %i bytes to tun\n", net2tun, nread_from_net);
 
-					// write the log file
-					if ( log_file != NULL ) {
-						// the packet is good
-						fprintf (log_file, "%"PRIu64"\tforward\tnative\t%i\t%lu\tfrom\t%s\t%d\n", GetTimeStamp(), nread_from_net, net2tun, inet_ntoa(remote.sin_addr), ntohs(remote.sin_port));
-						fflush(log_file);
-					}
+				// write the log file
+				if ( trace != NULL ) {
+					// the packet is good
+					trace_peer(trace, GetTimeStamp(), TRACE_FORWARD_NATIVE, nread_from_net, net2tun, &received.sa, sockaddr_inet_port(&received), 0, 0);
 				}
 			}
+		}
 
 
 
-			/**************************************************************************************/	
-			/***************** TUN to NET: compress and multiplex *********************************/
-			/**************************************************************************************/
+		/**************************************************************************************/	
+		/***************** TUN to NET: compress and multiplex *********************************/
+		/**************************************************************************************/
 
-			/*** data arrived at tun: read it, and check if the stored packets should be written to the network ***/
+		/*** data arrived at tun: read it, and check if the stored packets should be written to the network ***/
 
-			/* FD_ISSET tests if a file descriptor is part of the set */
-			else if(FD_ISSET(tun_fd, &rd_set)) {
+		/* event_loop_is_ready tests if a file descriptor can be read */
+		else if( event_loop_is_ready(&events, tun_fd) || ( ( rohc_pool != NULL ) && event_loop_is_ready(&events, rohc_pool_fd(rohc_pool)) ) ) {
 
-				/* read the packet from tun, store it in the array, and store its size */
-				size_packets_to_multiplex[num_pkts_stored_from_tun] = cread (tun_fd, packets_to_multiplex[num_pkts_stored_from_tun], BUFSIZE);
-		
+			rohc_job = NULL;
+			is_segment = false;
+			is_feedback = false;
+			if ( segments_left > 0 ) {
+				/* the next segment of a ROHC packet. It goes to the same mux queue as the previous ones */
+				is_segment = true;
+				rohc_job = segment_job;
+				queue = segment_queue;
+				peer = queue->peer;
+				segment_index++;
+				segments_left--;
+				size_native_packet = segments->size[segment_index];
+				size_tun_packet = 0;			// the native packet has been counted with the first segment
+				protocol_native = 4;
+				drop_packet = 0;
+
+			} else if ( ( feedback_to_send != NULL ) && ( ( feedback_length = feedback_queue_peek(feedback_to_send, &feedback_data) ) >= 0 ) ) {
+				/* ROHC feedback generated by the decompressor. It goes to the realtime queue of its peer (if any), which departs first */
+				is_feedback = true;
+				peer = feedback_queue_peer(feedback_to_send);
+				queue = &peer->queues[( peer->num_queues > 1 ) ? MUX_CLASS_REALTIME : MUX_CLASS_BULK];
+				memcpy(native_packet, feedback_data, feedback_length);
+				feedback_queue_release(feedback_to_send);
+				size_native_packet = feedback_length;
+				size_tun_packet = feedback_length;
+				protocol_native = IPPROTO_ROHC_FEEDBACK;
+				drop_packet = 0;
+
+				if ( stats != NULL ) stats_add(&stats->feedback_piggybacked, 1);
+				do_debug(1, "ROHC FEEDBACK for %s: %i bytes, stored in the next bundle\n", sockaddr_inet_ntoa(&peer->remote), size_native_packet);
+
+			} else if ( ( rohc_pool != NULL ) && event_loop_is_ready(&events, rohc_pool_fd(rohc_pool)) ) {
+				/* a packet compressed by a ROHC thread. The ones of each peer come back in the order they were read */
+				// the descriptor is only acknowledged after a real wait, not while the compressed packets are drained
+				if ( !rohc_jobs_pending ) rohc_pool_ack(rohc_pool);
+				rohc_job = rohc_pool_collect(rohc_pool);
+				if ( rohc_job == NULL ) {
+					rohc_jobs_pending = false;
+					continue;
+				}
+				rohc_jobs_pending = true;
+
+				// the packet was routed, classified and checked against the MTU before giving it to the thread
+				queue = (struct mux_queue *)rohc_job->owner;
+				peer = queue->peer;
+				peer->rohc_jobs--;
+				size_native_packet = rohc_job->size;
+				size_tun_packet = size_native_packet;
+				protocol_native = ( ( size_native_packet > 0 ) && ( ( rohc_job->packet[0] >> 4 ) == 6 ) ) ? 41 : 4;
+				drop_packet = 0;
+
+			} else {
+				/* read the packet from tun, and store its size */
+				if ( packet_ring != NULL ) {
+					// the packet is taken from the RX ring without a system call. If the ring is empty, go back to wait
+					nread_from_tun = packet_ring_read(packet_ring, native_packet, BUFSIZE);
+					if ( nread_from_tun < 0 ) {
+						tun_batch_left = 0;
+						continue;
+					}
+					size_native_packet = nread_from_tun;
+					if ( tun_batch_left > 0 ) tun_batch_left--;
+				} else if ( batch_size > 1 ) {
+					// non-blocking read: if the tun interface has been drained, go back to wait
+					pps.tun_reads++;
+					nread_from_tun = ctx->tun_vnet_hdr ? cread_vnet (tun_fd, native_packet, BUFSIZE) : cread_nonblock (tun_fd, native_packet, BUFSIZE);
+					if ( nread_from_tun < 0 ) {
+						tun_batch_left = 0;
+						continue;
+					}
+					size_native_packet = nread_from_tun;
+					tun_batch_left--;
+				} else {
+					pps.tun_reads++;
+					size_native_packet = ctx->tun_vnet_hdr ? cread_vnet (tun_fd, native_packet, BUFSIZE) : cread (tun_fd, native_packet, BUFSIZE);
+				}
+	
 				/* increase the counter of the number of packets read from tun*/
 				tun2net++;
+				size_tun_packet = size_native_packet;
+				if ( stats != NULL ) stats_add(&stats->tun2net, 1);
 
 				if (debug > 1 ) do_debug (2,"\n");
-				do_debug(1, "NATIVE PACKET #%lu: Read packet from tun: %i bytes\n", tun2net, size_packets_to_multiplex[num_pkts_stored_from_tun]);
+				do_debug(1, "NATIVE PACKET #%lu: Read packet from tun: %i bytes\n", tun2net, size_native_packet);
 
 				// print the native packet received
 				if (debug) {
 					do_debug(2, "   ");
 					// dump the newly-created IP packet on terminal
-					dump_packet ( size_packets_to_multiplex[num_pkts_stored_from_tun], packets_to_multiplex[num_pkts_stored_from_tun] );
+					dump_packet ( size_native_packet, native_packet );
 				}
 
 				// write in the log file
-				if ( log_file != NULL ) {
-					fprintf (log_file, "%"PRIu64"\trec\tnative\t%i\t%lu\n", GetTimeStamp(), size_packets_to_multiplex[num_pkts_stored_from_tun], tun2net);
-					fflush(log_file);	// If the IO is buffered, I have to insert fflush(fp) after the write in order to avoid things lost when pressing
+				if ( trace != NULL ) {
+					trace_packet(trace, GetTimeStamp(), TRACE_REC_NATIVE, size_native_packet, tun2net);
+				}
+
+				// find the peer of the packet: the longest prefix matching its destination IP address (bytes 16 to 19)
+				// the packets that are not IPv4 go to the peer of 0.0.0.0/0 (if any)
+				if ( ( size_native_packet >= IPv4_HEADER_SIZE ) && ( ( native_packet[0] >> 4 ) == 4 ) ) {
+					memcpy(&destination, &native_packet[16], sizeof(destination));
+					peer = peer_table_route(peers, destination);
+				} else {
+					peer = peers->default_peer;
+				}
+				// the 'Protocol' field of the packet if it is not compressed: 4 'IP on IP', or 41 for IPv6
+				// (IANA protocol numbers, http://www.iana.org/assignments/protocol-numbers/protocol-numbers.xhtml)
+				protocol_native = ( ( size_native_packet > 0 ) && ( ( native_packet[0] >> 4 ) == 6 ) ) ? 41 : 4;
+
+				if ( peer == NULL ) {
+					do_debug(1, " No peer for the destination of the packet. Packet dropped\n");
+
+					// write the log file
+					if ( trace != NULL ) {
+						trace_packet(trace, GetTimeStamp(), TRACE_DROP_NO_ROUTE, size_native_packet, tun2net);
+					}
+					continue;
+				}
+
+				// the mux queue of the packet. It is classified before compressing its headers
+				if ( peer->num_queues > 1 ) {
+					queue = &peer->queues[classify_packet(native_packet, size_native_packet)];
+					do_debug(2, " Packet classified into the %s queue\n", (queue->mux_class == MUX_CLASS_REALTIME) ? "realtime" : "bulk");
+				} else {
+					queue = &peer->queues[MUX_CLASS_BULK];
 				}
 
 
 				// check if this packet (plus the tunnel and simplemux headers ) is bigger than the MTU. Drop it in that case
+				// with ROHC, it is not dropped here: the ROHC packet will be split into segments
 				drop_packet = 0;
-				if (*mode == TRANSPORT_MODE) {
-					
-					if ( size_packets_to_multiplex[num_pkts_stored_from_tun] + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + 3 > selected_mtu ) {
+				if (mode == TRANSPORT_MODE) {
+				
+					if ( ( size_native_packet + size_ip_header + UDP_HEADER_SIZE + 3 > selected_mtu ) && ( ROHC_mode == 0 ) ) {
 						drop_packet = 1;
 
-						do_debug(1, " Warning: Packet dropped (too long). Size when tunneled %i. Selected MTU %i\n", size_packets_to_multiplex[num_pkts_stored_from_tun] + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + 3, selected_mtu);
+						do_debug(1, " Warning: Packet dropped (too long). Size when tunneled %i. Selected MTU %i\n", size_native_packet + size_ip_header + UDP_HEADER_SIZE + 3, selected_mtu);
 
 						// write the log file
-						if ( log_file != NULL ) {
-							fprintf (log_file, "%"PRIu64"\tdrop\ttoo_long\t%i\t%lu\tto\t%s\t%d\t%i\n", GetTimeStamp(), size_packets_to_multiplex[num_pkts_stored_from_tun] + IPv4_HEADER_SIZE + UDP_HEADER_SIZE + 3, tun2net, inet_ntoa(remote.sin_addr), ntohs(remote.sin_port), num_pkts_stored_from_tun);
-							fflush(log_file);	// If the IO is buffered, I have to insert fflush(fp) after the write in order to avoid things lost when pressing
+						if ( trace != NULL ) {
+							trace_peer(trace, GetTimeStamp(), TRACE_DROP_TOO_LONG, size_native_packet + size_ip_header + UDP_HEADER_SIZE + 3, tun2net, &peer->remote.sa, sockaddr_inet_port(&peer->remote), queue->encoder.num_packets, 0);
 						}
 					}
 
 				// network mode
 				} else {
-					if ( size_packets_to_multiplex[num_pkts_stored_from_tun] + IPv4_HEADER_SIZE + 3 > selected_mtu ) {
+					if ( ( size_native_packet + size_ip_header + 3 > selected_mtu ) && ( ROHC_mode == 0 ) ) {
 						drop_packet = 1;
 
-						do_debug(1, " Warning: Packet dropped (too long). Size when tunneled %i. Selected MTU %i\n", size_packets_to_multiplex[num_pkts_stored_from_tun] + IPv4_HEADER_SIZE + 3, selected_mtu);
+						do_debug(1, " Warning: Packet dropped (too long). Size when tunneled %i. Selected MTU %i\n", size_native_packet + size_ip_header + 3, selected_mtu);
 
 						// write the log file
-						if ( log_file != NULL ) {
-							fprintf (log_file, "%"PRIu64"\tdrop\ttoo_long\t%i\t%lu\tto\t%s\t%d\t%i\n", GetTimeStamp(), size_packets_to_multiplex[num_pkts_stored_from_tun] + IPv4_HEADER_SIZE + 3, tun2net, inet_ntoa(remote.sin_addr), ntohs(remote.sin_port), num_pkts_stored_from_tun);
-							fflush(log_file);	// If the IO is buffered, I have to insert fflush(fp) after the write in order to avoid things lost when pressing
+						if ( trace != NULL ) {
+							trace_peer(trace, GetTimeStamp(), TRACE_DROP_TOO_LONG, size_native_packet + size_ip_header + 3, tun2net, &peer->remote.sa, sockaddr_inet_port(&peer->remote), queue->encoder.num_packets, 0);
+						}
+					}
+				}
+			}
+
+			// the length of the packet is adequate
+			if ( drop_packet == 0 ) {
+
+
+				/******************** compress the headers if the ROHC option has been set ****************/
+				packet_to_store = native_packet;
+				compress = ( ROHC_mode > 0 ) && !is_segment && !is_feedback;
+				too_long = ( size_tun_packet + 3 > size_max );
+
+				// the flows that ROHC cannot compress (or compresses with almost no saving) are sent native for a while
+				// (the packets that do not fit in a bundle are always compressed, because they can only be sent in segments)
+				// with -W, a flow is not bypassed while the ROHC thread has packets of the peer: they would be overtaken
+				has_flow = false;
+				if ( compress && bypass_flows ) {
+					has_flow = flow_key_get(&flow, (rohc_job != NULL) ? rohc_job->packet : native_packet, size_tun_packet);
+					if ( has_flow && !too_long && ( rohc_job == NULL ) && ( peer->rohc_jobs == 0 ) && flow_cache_bypass(&bypass_cache, &flow, time_in_microsec) ) {
+						compress = false;
+						do_debug(2, " The flow is not compressed with ROHC for now\n");
+						if ( stats != NULL ) stats_add(&stats->rohc_bypassed, 1);
+					}
+				}
+
+				if ( is_segment ) {
+					// a segment after the first one: it is stored like a ROHC packet
+					protocol_to_store = 142;
+					packet_to_store = segment_data;
+					segment_data = segment_data + size_native_packet;
+
+					do_debug(1, "ROHC SEGMENT %i of %i: %i bytes\n", segment_index + 1, segments->num_segments, size_native_packet);
+
+				} else if ( compress ) {
+					// header compression has been selected by the user
+
+					if ( rohc_job != NULL ) {
+						// the packet has been compressed by a ROHC thread
+						packet_to_store = rohc_job->packet;
+						status = rohc_job->status;
+						segments = &rohc_job->segments;
+						rohc_output = rohc_job->rohc_packet;
+						size_rohc_packet = rohc_job->rohc_size;
+
+					} else if ( rohc_pool != NULL ) {
+						// give the packet to the ROHC thread of its peer. It will come back compressed through rohc_pool_fd()
+						new_job = rohc_pool_job(rohc_pool, peer->rohc_worker);
+						if ( new_job == NULL ) {
+							do_debug(1, " The ROHC thread is busy. Packet dropped\n");
+
+							// write the log file
+							if ( trace != NULL ) {
+								trace_peer(trace, GetTimeStamp(), TRACE_DROP_ROHC_BUSY, size_native_packet, tun2net, &peer->remote.sa, sockaddr_inet_port(&peer->remote), queue->encoder.num_packets, 0);
+							}
+							continue;
+						}
+						new_job->compressor = peer->compressor;
+						new_job->owner = queue;
+						new_job->counter = tun2net;
+						new_job->size = size_native_packet;
+						new_job->max_rohc_size = max_rohc_size;
+						memcpy(new_job->packet, native_packet, size_native_packet);
+						rohc_pool_submit(rohc_pool, new_job);
+						peer->rohc_jobs++;
+						continue;
+
+					} else {
+						// deliver the feedback received since the previous packet
+						deliver_queued_feedback(peer->compressor, &peer->feedback_queue);
+
+						// compress the IP packet from the buffer where it was read
+						// if the ROHC packet does not fit in a bundle, it is split into segments
+						status = rohc_compress_segmented(peer->compressor, native_packet, size_native_packet, rohc_buffer, sizeof(rohc_buffer), max_rohc_size, &rohc_segments);
+						segments = &rohc_segments;
+						rohc_output = rohc_buffer;
+						for (k = 0, size_rohc_packet = 0; k < rohc_segments.num_segments; k++) size_rohc_packet = size_rohc_packet + rohc_segments.size[k];
+					}
+
+					// check the result of the compression
+					if (status == ROHC_STATUS_OK) {
+						/* success: compression succeeded. 'rohc_output' contains the ROHC packet, or all its
+						* segments one after another if it was longer than a bundle (the MRRU of the compressor
+						* is set with \ref rohc_comp_set_mrru, and the segments are got with \ref rohc_comp_get_segment2) */
+
+						// since this packet has been compressed with ROHC, its protocol number must be 142
+						// (IANA protocol numbers, http://www.iana.org/assignments/protocol-numbers/protocol-numbers.xhtml)
+						protocol_to_store = 142;
+
+						// the compressed packet is stored from the ROHC buffer, without copying it
+						size_native_packet = segments->size[0];
+						packet_to_store = rohc_output;
+
+						// the first segment is stored now, and the others in the next iterations of the main loop
+						if ( segments->num_segments > 1 ) {
+							segments_left = segments->num_segments - 1;
+							segment_index = 0;
+							segment_data = rohc_output + segments->size[0];
+							segment_queue = queue;
+							segment_job = rohc_job;
+							do_debug(1, " ROHC packet split into %i segments\n", segments->num_segments);
 						}
+
+						if ( stats != NULL ) {
+							stats_add(&stats->rohc_input_bytes, size_tun_packet);
+							stats_add(&stats->rohc_output_bytes, size_rohc_packet);
+						}
+
+						// the packets of the flow will not be compressed for a while if ROHC does not save bytes
+						if ( has_flow && flow_cache_compressed(&bypass_cache, &flow, size_tun_packet, size_rohc_packet, time_in_microsec) ) {
+							do_debug(1, " ROHC saves less than %i bytes in this flow. It will not be compressed for %"PRIu64" usec\n", FLOW_MIN_SAVING, ctx->rohc_bypass_time);
+
+							// write the log file
+							if ( trace != NULL ) {
+								trace_packet(trace, GetTimeStamp(), TRACE_ROHC_BYPASS, size_tun_packet, (rohc_job != NULL) ? rohc_job->counter : tun2net);
+							}
+						}
+
+						/* dump the ROHC packet on terminal */
+						if (debug >= 1 ) {
+							do_debug(1, " ROHC-compressed to %i bytes\n", size_rohc_packet);
+						}
+						if (debug == 2) {
+							do_debug(2, "   ");
+							dump_packet ( size_rohc_packet, rohc_output );
+						}
+
+					} else {
+						/* compressor failed to compress the IP packet */
+
+						// the packet does not fit in a bundle without ROHC segments
+						if ( too_long ) {
+							do_debug(1, " Warning: Packet dropped (too long, and ROHC failed). Size when tunneled %i. Selected MTU %i\n", size_tun_packet + size_tunnel_header + 3, selected_mtu);
+
+							// write the log file
+							if ( trace != NULL ) {
+								trace_peer(trace, GetTimeStamp(), TRACE_DROP_TOO_LONG, size_tun_packet + size_tunnel_header + 3, (rohc_job != NULL) ? rohc_job->counter : tun2net, &peer->remote.sa, sockaddr_inet_port(&peer->remote), queue->encoder.num_packets, 0);
+							}
+							if ( has_flow ) flow_cache_failed(&bypass_cache, &flow, time_in_microsec);
+							if ( rohc_job != NULL ) rohc_pool_release(rohc_pool, rohc_job);
+							continue;
+						}
+
+						/* Send it in its native form */
+
+						// I don't have to copy the native length and the native packet, because they
+						// are already in 'size_native_packet' and 'packet_to_store'
+
+						// since this packet is NOT compressed, its protocol number has to be 4: 'IP on IP' (41 if it is IPv6)
+						protocol_to_store = protocol_native;
+						// the compressor is not called again for the packets of the flow for a while
+						if ( has_flow ) flow_cache_failed(&bypass_cache, &flow, time_in_microsec);
+
+						// print in the log file
+						if ( trace != NULL ) {
+							trace_packet(trace, GetTimeStamp(), TRACE_COMPR_FAILED, size_native_packet, (rohc_job != NULL) ? rohc_job->counter : tun2net);
+						}
+
+						do_debug(1, "  ROHC did not work. Native packet sent: %i bytes\n", size_native_packet);
+						//goto release_compressor;
 					}
+
+				} else {
+					// header compression has not been selected by the user, or the flow is not compressed for now
+
+					// since this packet is NOT compressed, its protocol number has to be 4: 'IP on IP' (41 if it is IPv6)
+					// or IPPROTO_ROHC_FEEDBACK if it is feedback
+					protocol_to_store = protocol_native;
 				}
 
-				// the length of the packet is adequate
-				if ( drop_packet == 0 ) {
 
+				// with more than one mux queue, the last segment is sent at once: the segments of a packet
+				// must reach the decompressor one after another, without other ROHC packets in between
+				flush_segments = is_segment && ( segments_left == 0 ) && ( peer->num_queues > 1 );
+
+				// the load seen by the adaptive policies
+				queue->adapt_packets++;
+				queue->adapt_bytes = queue->adapt_bytes + size_native_packet;
+
+
+				/*** Calculate if the size limit will be reached when multiplexing the present packet ***/
+				// if the addition of the present packet will imply a multiplexed packet bigger than the size limit:
+				// - I send the previously stored packets
+				// - I store the present one
+				// - I reset the period
+				predicted_size_muxed_packet = mux_encoder_predict(&queue->encoder, size_native_packet, protocol_to_store);
+
+				if ( ( queue->encoder.num_packets > 0 ) && ( predicted_size_muxed_packet > size_max ) ) {
+					// if the present packet is muxed, the max size of the packet will be overriden. So I first empty the buffer
+					//i.e. I build and send a multiplexed packet not including the current one
+
+					do_debug(2, "\n");
+
+					switch (mode) {
+						case TRANSPORT_MODE:
+							do_debug(1, "SENDING TRIGGERED: MTU size reached. Predicted size: %i bytes (over MTU)\n", predicted_size_muxed_packet + size_ip_header + UDP_HEADER_SIZE );
+						case NETWORK_MODE:
+							do_debug(1, "SENDING TRIGGERED: MTU size reached. Predicted size: %i bytes (over MTU)\n", predicted_size_muxed_packet + size_ip_header );
+						break;
+					}
+
+					// build the multiplexed packet without the current one. The Single Protocol Bit of the first separator
+					// is '1' if all the multiplexed packets belong to the same protocol
+					total_length = build_multiplexed_packet ( &bundle, &queue->encoder );
+
+					if (queue->encoder.single_protocol) {
+						do_debug(2, "   All packets belong to the same protocol. Added 1 Protocol byte in the first separator\n");
+					} else {
+						do_debug(2, "   Not all packets belong to the same protocol. Added 1 Protocol byte in each separator. Total %i bytes\n",queue->encoder.num_packets);
+					}
+					switch (mode) {
+						case TRANSPORT_MODE:
+							do_debug(2, "   Added tunneling header: %i bytes\n", size_ip_header + UDP_HEADER_SIZE);
+							do_debug(1, " Sending muxed packet without this one: %i bytes\n", total_length + size_ip_header + UDP_HEADER_SIZE );
+						break;
+						case NETWORK_MODE:
+							do_debug(2, "   Added tunneling header: %i bytes\n", size_ip_header );
+							do_debug(1, " Sending muxed packet without this one: %i bytes\n", total_length + size_ip_header );
+						break;
+					}
+
+					// send the multiplexed packet without the current one
+					switch (mode) {
+						case TRANSPORT_MODE:
+							// printf ("length: %i", total_length);
+
+							// send the packet
+							if (send_muxed_packet(&bundle_batch, bundle.iov + 1, bundle.num_iov - 1, total_length, peer->remote, queue->urgent, &pps)==-1) perror("sendto()");
+							// write the log file
+							if ( trace != NULL ) {
+								trace_peer(trace, GetTimeStamp(), TRACE_SENT_MUXED, total_length + size_ip_header + UDP_HEADER_SIZE, tun2net, &peer->remote.sa, sockaddr_inet_port(&peer->remote), queue->encoder.num_packets, TRIGGER_MTU);
+							}
+					
+						break;
+
+						case NETWORK_MODE:
+
+							// build the header
+							BuildTunnelHeader(&bundle, total_length, peer);
+
+							// send the packet
+							if (send_muxed_packet(&bundle_batch, bundle.iov, bundle.num_iov, total_length + size_ip_header, peer->remote, queue->urgent, &pps) < 0)  {
+								perror ("sendto() failed");
+								exit (EXIT_FAILURE);
+							}
+							// write the log file
+							if ( trace != NULL ) {
+								trace_peer(trace, GetTimeStamp(), TRACE_SENT_MUXED, total_length + size_ip_header, tun2net, &peer->remote.sa, -1, queue->encoder.num_packets, TRIGGER_MTU);
+							}
 
-					/******************** compress the headers if the ROHC option has been set ****************/
-					if ( ROHC_mode > 0 ) {
-						// header compression has been selected by the user
+						break;
+					}
 
-						// copy the length read from tun to the buffer where the packet to be compressed is stored
-						ip_packet.len = size_packets_to_multiplex[num_pkts_stored_from_tun];
 
-						// copy the packet
-						memcpy(rohc_buf_data_at(ip_packet, 0), packets_to_multiplex[num_pkts_stored_from_tun], size_packets_to_multiplex[num_pkts_stored_from_tun]);
+					// I have sent a packet, so I restart the period: update the time of the last packet sent
+					time_in_microsec = GetMonotonicTime();
+					queue->time_last_sent_in_microsec = time_in_microsec;
+					timer_wheel_arm(&period_timers, &queue->period_timer, time_in_microsec + queue->policies.period);
 
-						// reset the buffer where the rohc packet is to be stored
-						rohc_buf_reset (&rohc_packet);
+					if ( stats != NULL ) {
+						count_bundle(stats, queue, queue->encoder.num_packets, queue->native_bytes, total_length, size_tunnel_header, TRIGGER_MTU, time_in_microsec);
+					}
 
-						// compress the IP packet
-						status = rohc_compress4(compressor, ip_packet, &rohc_packet);
+					// the bundle has been sent (or copied into the batch), so the mux queue is empty
+					mux_encoder_reset(&queue->encoder);
+					queue->native_bytes = 0;
+				}	/*** end check if size limit would be reached ***/
 
-						// check the result of the compression
-						if(status == ROHC_STATUS_SEGMENT) {
-							/* success: compression succeeded, but resulting ROHC packet was too
-							 * large for the Maximum Reconstructed Reception Unit (MRRU) configured
-							 * with \ref rohc_comp_set_mrru, the rohc_packet buffer contains the
-							 * first ROHC segment and \ref rohc_comp_get_segment can be used to
-							 * retrieve the next ones. */
-						}
 
-						else if (status == ROHC_STATUS_OK) {
-							/* success: compression succeeded, and resulting ROHC packet fits the
-							* Maximum Reconstructed Reception Unit (MRRU) configured with
-							* \ref rohc_comp_set_mrru, the rohc_packet buffer contains the
-							* rohc_packet_len bytes of the ROHC packet */
-
-							// since this packet has been compressed with ROHC, its protocol number must be 142
-							// (IANA protocol numbers, http://www.iana.org/assignments/protocol-numbers/protocol-numbers.xhtml)
-							if ( SIZE_PROTOCOL_FIELD == 1 ) {
-								protocol[num_pkts_stored_from_tun][0] = 142;
-							} else {	// SIZE_PROTOCOL_FIELD == 2 
-								protocol[num_pkts_stored_from_tun][0] = 0;
-								protocol[num_pkts_stored_from_tun][1] = 142;
-							}
+				// store the packet (compressed or not) in its mux queue, and add the multiplexing separator
+				//   - It is 1 byte if the length is smaller than 64 (or 128 for non-first separators) 
+				//   - It is 2 bytes if the length is 64 (or 128 for non-first separators) or more
+				//   - It is 3 bytes if the length is 8192 (or 16384 for non-first separators) or more
+				// it should always fit: the queue is sent when it has 'limit_numpackets_tun' packets (at most MAXPKTS)
+				time_in_microsec = GetMonotonicTime();
+				if ( mux_encoder_add(&queue->encoder, packet_to_store, size_native_packet, protocol_to_store, time_in_microsec) < 0 ) {
+					do_debug(1, " Warning: Packet dropped (it does not fit in the mux queue). %i packets, %i bytes stored\n", queue->encoder.num_packets, queue->encoder.size);
 
-							// Copy the compressed length and the compressed packet over the packet read from tun
-							size_packets_to_multiplex[num_pkts_stored_from_tun] = rohc_packet.len;
-							for (l = 0; l < size_packets_to_multiplex[num_pkts_stored_from_tun] ; l++) {
-								packets_to_multiplex[num_pkts_stored_from_tun][l] = rohc_buf_byte_at(rohc_packet, l);
-							}
+					// write the log file
+					if ( trace != NULL ) {
+						trace_peer(trace, GetTimeStamp(), TRACE_DROP_TOO_LONG, size_native_packet, tun2net, &peer->remote.sa, sockaddr_inet_port(&peer->remote), queue->encoder.num_packets, 0);
+					}
 
-							/* dump the ROHC packet on terminal */
-							if (debug >= 1 ) {
-								do_debug(1, " ROHC-compressed to %i bytes\n", rohc_packet.len);
-							}
-							if (debug == 2) {
-								do_debug(2, "   ");
-								dump_packet ( rohc_packet.len, rohc_packet.data );
+					// the rest of the segments of the packet are useless without this one
+					segments_left = 0;
+					if ( rohc_job != NULL ) rohc_pool_release(rohc_pool, rohc_job);
+					continue;
+				}
+				if ( ( rohc_job != NULL ) && ( segments_left == 0 ) ) rohc_pool_release(rohc_pool, rohc_job);
+				queue->native_bytes = queue->native_bytes + size_tun_packet;
+
+				// print the Mux separator
+				if(debug) {
+					stored = &queue->encoder.stored[queue->encoder.num_packets - 1];
+					for (l = 0; l < stored->size_separator; l++) {
+						FromByte(stored->separator[l], bits);
+						if (l == 0) {
+							do_debug(2, " Mux separator of %i byte(s): (%02x) ", stored->size_separator, stored->separator[0]);
+							if (queue->encoder.num_packets == 1) {
+								PrintByte(2, 7, bits);			// first header
+							} else {
+								PrintByte(2, 8, bits);			// non-first header
 							}
-
 						} else {
-							/* compressor failed to compress the IP packet */
-							/* Send it in its native form */
-
-							// I don't have to copy the native length and the native packet, because they
-							// have already been stored in 'size_packets_to_multiplex[num_pkts_stored_from_tun]' and 'packets_to_multiplex[num_pkts_stored_from_tun]'
-
-							// since this packet is NOT compressed, its protocol number has to be 4: 'IP on IP'
-							// (IANA protocol numbers, http://www.iana.org/assignments/protocol-numbers/protocol-numbers.xhtml)
-							if ( SIZE_PROTOCOL_FIELD == 1 ) {
-								protocol[num_pkts_stored_from_tun][0] = 4;
-							} else {	// SIZE_PROTOCOL_FIELD == 2 
-								protocol[num_pkts_stored_from_tun][0] = 0;
-								protocol[num_pkts_stored_from_tun][1] = 4;
-							}
-							fprintf(stderr, "compression of IP packet failed\n");
+							do_debug(2, " (%02x) ", stored->separator[l]);
+							PrintByte(2, 8, bits);
+						}
+					}
+					do_debug(2, "\n");
+				}
 
-							// print in the log file
-							if ( log_file != NULL ) {
-								fprintf (log_file, "%"PRIu64"\terror\tcompr_failed. Native packet sent\t%i\t%lu\\n", GetTimeStamp(), size_packets_to_multiplex[num_pkts_stored_from_tun], tun2net);
-								fflush(log_file);	// If the IO is buffered, I have to insert fflush(fp) after the write in order to avoid things lost when pressing
-							}
+				do_debug(1, " Packet stopped and multiplexed: accumulated %i pkts: %i bytes.", queue->encoder.num_packets, queue->encoder.size);
+				time_difference = time_in_microsec - queue->time_last_sent_in_microsec;		
+				do_debug(1, " Time since last trigger: %" PRIu64 " usec\n", time_difference);//PRIu64 is used for printing uint64_t numbers
 
-							do_debug(2, "  ROHC did not work. Native packet sent: %i bytes:\n   ", size_packets_to_multiplex[num_pkts_stored_from_tun]);
-							//goto release_compressor;
-						}
 
-					} else {
-						// header compression has not been selected by the user
+				// check if a multiplexed packet has to be sent
 
-						// since this packet is NOT compressed, its protocol number has to be 4: 'IP on IP' 
-						// (IANA protocol numbers, http://www.iana.org/assignments/protocol-numbers/protocol-numbers.xhtml)
-						if ( SIZE_PROTOCOL_FIELD == 1 ) {
-							protocol[num_pkts_stored_from_tun][0] = 4;
-						} else {	// SIZE_PROTOCOL_FIELD == 2 
-							protocol[num_pkts_stored_from_tun][0] = 0;
-							protocol[num_pkts_stored_from_tun][1] = 4;
-						}
-					}
+				// if the packet limit or the size threshold are reached, send all the stored packets to the network
+				// do not worry about the MTU. if it is reached, a number of packets will be sent
+				if ((queue->encoder.num_packets == queue->policies.limit_numpackets_tun) || (queue->encoder.size > queue->policies.size_threshold) || (time_difference > queue->policies.timeout ) || flush_segments) {
 
+					// a multiplexed packet has to be sent
 
-					/*** Calculate if the size limit will be reached when multiplexing the present packet ***/
-					// if the addition of the present packet will imply a multiplexed packet bigger than the size limit:
-					// - I send the previously stored packets
-					// - I store the present one
-					// - I reset the period
+					// build the multiplexed packet including the current one
+					// the Single Protocol Bit of the first separator is 1 if all the multiplexed packets belong to the same protocol
+					total_length = build_multiplexed_packet ( &bundle, &queue->encoder );
 
-					// calculate if all the packets belong to the same protocol (single_protocol = 1) 
-					//or they belong to different protocols (single_protocol = 0)
-					single_protocol = 1;
-					for (k = 1; k < num_pkts_stored_from_tun ; k++) {
-						for ( l = 0 ; l < SIZE_PROTOCOL_FIELD ; l++) {
-							if (protocol[k][l] != protocol[k-1][l]) single_protocol = 0;
+					// write the debug information
+					if (debug) {
+						do_debug(2, "\n");
+						do_debug(1, "SENDING TRIGGERED: ");
+						if (queue->encoder.num_packets == queue->policies.limit_numpackets_tun)
+							do_debug(1, "num packet limit reached\n");
+						if (queue->encoder.size > queue->policies.size_threshold)
+							do_debug(1," size threshold reached\n");
+						if (time_difference > queue->policies.timeout)
+							do_debug(1, "timeout reached\n");
+						if (flush_segments)
+							do_debug(1, "last ROHC segment stored\n");
+
+						if (queue->encoder.single_protocol) {
+							do_debug(2, "   All packets belong to the same protocol. Added 1 Protocol byte in the first separator\n");
+						} else {
+							do_debug(2, "   Not all packets belong to the same protocol. Added 1 Protocol byte in each separator. Total %i bytes\n",queue->encoder.num_packets);
 						}
+						switch (mode) {
+							case TRANSPORT_MODE:
+								do_debug(2, "   Added tunneling header: %i bytes\n", size_ip_header + UDP_HEADER_SIZE);
+								do_debug(1, " Writing %i packets to network: %i bytes\n", queue->encoder.num_packets, total_length + size_ip_header + UDP_HEADER_SIZE);
+							break;
+							case NETWORK_MODE:
+								do_debug(2, "   Added tunneling header: %i bytes\n", size_ip_header );
+								do_debug(1, " Writing %i packets to network: %i bytes\n", queue->encoder.num_packets, total_length + size_ip_header );
+							break;
+						}			
 					}
 
-					// calculate the size without the present packet
-					predicted_size_muxed_packet = predict_size_multiplexed_packet (num_pkts_stored_from_tun, single_protocol, protocol, size_separators_to_multiplex, separators_to_multiplex, size_packets_to_multiplex, packets_to_multiplex);
+					// send the multiplexed packet
+					switch (mode) {
+						case TRANSPORT_MODE:
+							// send the packet. I don't need to build the header, because I have a UDP socket
+							if (send_muxed_packet(&bundle_batch, bundle.iov + 1, bundle.num_iov - 1, total_length, peer->remote, queue->urgent, &pps)==-1)
+								perror("sendto()");
+						break;
 
-					// I add the length of the present packet:
+						case NETWORK_MODE:
+							// build the header
+							BuildTunnelHeader(&bundle, total_length, peer);
 
-					// separator and length of the present packet
-					if (first_header_written == 0) {
-						// this is the first header, so the maximum length is 64
-						if (size_packets_to_multiplex[num_pkts_stored_from_tun] < 64 ) {
-							predicted_size_muxed_packet = predicted_size_muxed_packet + 1 + size_packets_to_multiplex[num_pkts_stored_from_tun];
-						} else {
-							predicted_size_muxed_packet = predicted_size_muxed_packet + 2 + size_packets_to_multiplex[num_pkts_stored_from_tun];
-						}
-					} else {
-						// this is not the first header, so the maximum length is 128
-						if (size_packets_to_multiplex[num_pkts_stored_from_tun] < 128 ) {
-							predicted_size_muxed_packet = predicted_size_muxed_packet + 1 + size_packets_to_multiplex[num_pkts_stored_from_tun];
-						} else {
-							predicted_size_muxed_packet = predicted_size_muxed_packet + 2 + size_packets_to_multiplex[num_pkts_stored_from_tun];
-						}
+							// send the multiplexed packet
+							if (send_muxed_packet(&bundle_batch, bundle.iov, bundle.num_iov, total_length + size_ip_header, peer->remote, queue->urgent, &pps) < 0)  {
+								perror ("sendto() failed ");
+								exit (EXIT_FAILURE);
+							}
+						break;
 					}
 
-					if (predicted_size_muxed_packet > size_max ) {
-						// if the present packet is muxed, the max size of the packet will be overriden. So I first empty the buffer
-						//i.e. I build and send a multiplexed packet not including the current one
-
-						do_debug(2, "\n");
+					// what triggered the sending
+					triggers = 0;
+					if (queue->encoder.num_packets == queue->policies.limit_numpackets_tun)
+						triggers = triggers | TRIGGER_NUMPACKET_LIMIT;
+					if (queue->encoder.size > queue->policies.size_threshold)
+						triggers = triggers | TRIGGER_SIZE_LIMIT;
+					if (time_difference > queue->policies.timeout)
+						triggers = triggers | TRIGGER_TIMEOUT;
+
+					if ( stats != NULL ) {
+						count_bundle(stats, queue, queue->encoder.num_packets, queue->native_bytes, total_length, size_tunnel_header, triggers, time_in_microsec);
+					}
 
-						switch (*mode) {
+					// write the log file
+					if ( trace != NULL ) {
+						switch (mode) {
 							case TRANSPORT_MODE:
-								do_debug(1, "SENDING TRIGGERED: MTU size reached. Predicted size: %i bytes (over MTU)\n", predicted_size_muxed_packet + IPv4_HEADER_SIZE + UDP_HEADER_SIZE );
+								trace_peer(trace, GetTimeStamp(), TRACE_SENT_MUXED, total_length + size_ip_header + UDP_HEADER_SIZE, tun2net, &peer->remote.sa, sockaddr_inet_port(&peer->remote), queue->encoder.num_packets, triggers);
+							break;
 							case NETWORK_MODE:
-								do_debug(1, "SENDING TRIGGERED: MTU size reached. Predicted size: %i bytes (over MTU)\n", predicted_size_muxed_packet + IPv4_HEADER_SIZE );
+								trace_peer(trace, GetTimeStamp(), TRACE_SENT_MUXED, total_length + size_ip_header, tun2net, &peer->remote.sa, -1, queue->encoder.num_packets, triggers);
 							break;
 						}
+					}
 
-						// add the Single Protocol Bit in the first header (the most significant bit)
-						// it is '1' if all the multiplexed packets belong to the same protocol
-						if (single_protocol == 1) {
-							separators_to_multiplex[0][0] = separators_to_multiplex[0][0] + 128;	// this puts a 1 in the most significant bit position
-							size_muxed_packet = size_muxed_packet + 1;								// one byte corresponding to the 'protocol' field of the first header
-						} else {
-							size_muxed_packet = size_muxed_packet + num_pkts_stored_from_tun;		// one byte per packet, corresponding to the 'protocol' field
-						}
+					// reset the length and the number of packets. The ring is empty, so it starts again from the beginning
+					mux_encoder_reset(&queue->encoder);
+					queue->native_bytes = 0;
+
+					// restart the period: update the time of the last packet sent
+					queue->time_last_sent_in_microsec = time_in_microsec;
+					timer_wheel_arm(&period_timers, &queue->period_timer, time_in_microsec + queue->policies.period);
+				}
+
+				// the feedback does not wait for the whole period: if no bundle departs before the deadline, the period ends then
+				if ( is_feedback && ( queue->encoder.num_packets > 0 ) &&
+					 ( !wheel_timer_armed(&queue->period_timer) || ( queue->period_timer.expires > time_in_microsec + FEEDBACK_DEADLINE ) ) ) {
+					timer_wheel_arm(&period_timers, &queue->period_timer, time_in_microsec + FEEDBACK_DEADLINE);
+				}
+			}
+		}
+
+		/*************************************************************************************/	
+		/******************** Period expired: multiplex **************************************/
+		/*************************************************************************************/	
+
+		// The period of some mux queues may have expired
+		// Check if there is something stored, and send it
+		// it is checked in every iteration, not only when nothing was read: under a sustained load the loop
+		// does not wait (tun and the muxed packets are drained), and the periods would never be processed
+
+		if ( role & ROLE_INGRESS ) {
+			time_in_microsec = GetMonotonicTime();
 
-						// build the multiplexed packet without the current one
-						total_length = build_multiplexed_packet ( num_pkts_stored_from_tun, single_protocol, protocol, size_separators_to_multiplex, separators_to_multiplex, size_packets_to_multiplex, packets_to_multiplex, muxed_packet);
+			// the mux queues whose period has expired
+			expired_timers = timer_wheel_advance(&period_timers, time_in_microsec);
+			while (expired_timers != NULL) {
+				queue = (struct mux_queue *)expired_timers->data;
+				peer = queue->peer;
+				expired_timers = expired_timers->next;
 
-						if (single_protocol) {
+				if ( queue->encoder.num_packets > 0 ) {
+
+					// There are some packets stored
+
+					// calculate the time difference
+					time_difference = time_in_microsec - queue->time_last_sent_in_microsec;		
+
+					if (debug) {
+						do_debug(2, "\n");
+						do_debug(1, "SENDING TRIGGERED. Period expired. Time since last trigger: %" PRIu64 " usec\n", time_difference);
+						if (queue->encoder.single_protocol) {
 							do_debug(2, "   All packets belong to the same protocol. Added 1 Protocol byte in the first separator\n");
 						} else {
-							do_debug(2, "   Not all packets belong to the same protocol. Added 1 Protocol byte in each separator. Total %i bytes\n",num_pkts_stored_from_tun);
+							do_debug(2, "   Not all packets belong to the same protocol. Added 1 Protocol byte in each separator. Total %i bytes\n",queue->encoder.num_packets);
 						}
-						switch (*mode) {
+						switch (mode) {
 							case TRANSPORT_MODE:
-								do_debug(2, "   Added tunneling header: %i bytes\n", IPv4_HEADER_SIZE + UDP_HEADER_SIZE);
-								do_debug(1, " Sending muxed packet without this one: %i bytes\n", size_muxed_packet + IPv4_HEADER_SIZE + UDP_HEADER_SIZE );
+								do_debug(2, "   Added tunneling header: %i bytes\n", size_ip_header + UDP_HEADER_SIZE);
+								do_debug(1, " Writing %i packets to network: %i bytes\n", queue->encoder.num_packets, mux_encoder_length(&queue->encoder) + size_ip_header + UDP_HEADER_SIZE);	
 							break;
 							case NETWORK_MODE:
-								do_debug(2, "   Added tunneling header: %i bytes\n", IPv4_HEADER_SIZE );
-								do_debug(1, " Sending muxed packet without this one: %i bytes\n", size_muxed_packet + IPv4_HEADER_SIZE );
+								do_debug(2, "   Added tunneling header: %i bytes\n", size_ip_header );
+								do_debug(1, " Writing %i packets to network: %i bytes\n", queue->encoder.num_packets, mux_encoder_length(&queue->encoder) + size_ip_header );
 							break;
 						}
+					}
 
-						// send the multiplexed packet without the current one
-						switch (*mode) {
-							case TRANSPORT_MODE:
-								// printf ("length: %i", total_length);
+					// build the multiplexed packet
+					// the Single Protocol Bit of the first separator is 1 if all the multiplexed packets belong to the same protocol
+					total_length = build_multiplexed_packet ( &bundle, &queue->encoder );
 
-								// send the packet
-								if (sendto(transport_mode_fd, muxed_packet, total_length, 0, (struct sockaddr *)&remote, sizeof(remote))==-1) perror("sendto()");
-								// write the log file
-								if ( log_file != NULL ) {
-									fprintf (log_file, "%"PRIu64"\tsent\tmuxed\t%i\t%lu\tto\t%s\t%d\t%i\tMTU\n", GetTimeStamp(), total_length + IPv4_HEADER_SIZE + UDP_HEADER_SIZE, tun2net, inet_ntoa(remote.sin_addr), ntohs(remote.sin_port), num_pkts_stored_from_tun);
-									fflush(log_file);	// If the IO is buffered, I have to insert fflush(fp) after the write in order to avoid things lost when pressing
-								}
-						
-							break;
+					// send the multiplexed packet
+					switch (mode) {
+						case TRANSPORT_MODE:
+							// send the packet. I don't need to build the header, because I have a UDP socket	
+							if (send_muxed_packet(&bundle_batch, bundle.iov + 1, bundle.num_iov - 1, total_length, peer->remote, queue->urgent, &pps)==-1) perror("sendto()");
+							// write the log file
+							if ( trace != NULL ) {
+								trace_peer(trace, GetTimeStamp(), TRACE_SENT_MUXED, total_length + size_ip_header + UDP_HEADER_SIZE, tun2net, &peer->remote.sa, -1, queue->encoder.num_packets, TRIGGER_PERIOD);	
+							}
+						break;
 
-							case NETWORK_MODE:
+						case NETWORK_MODE:
+							// build the header
+							BuildTunnelHeader(&bundle, total_length, peer);
 
-								// build the header
-								BuildIPHeader(&ipheader, total_length, local, remote);
+							// send the packet
+							if (send_muxed_packet(&bundle_batch, bundle.iov, bundle.num_iov, total_length + size_ip_header, peer->remote, queue->urgent, &pps) < 0)  {
+								perror ("sendto() failed ");
+								exit (EXIT_FAILURE);
+							}
+							// write the log file
+							if ( trace != NULL ) {
+								trace_peer(trace, GetTimeStamp(), TRACE_SENT_MUXED, total_length + size_ip_header, tun2net, &peer->remote.sa, -1, queue->encoder.num_packets, TRIGGER_PERIOD);	
+							}
+						break;
+					}
 
-								// build the full IP multiplexed packet
-								BuildFullIPPacket(ipheader, muxed_packet, total_length, full_ip_packet);
+					if ( stats != NULL ) {
+						count_bundle(stats, queue, queue->encoder.num_packets, queue->native_bytes, total_length, size_tunnel_header, TRIGGER_PERIOD, time_in_microsec);
+					}
+		
+					// reset the length and the number of packets. The ring is empty, so it starts again from the beginning
+					mux_encoder_reset(&queue->encoder);
+					queue->native_bytes = 0;
 
-								// send the packet
-								if (sendto (network_mode_fd, full_ip_packet, total_length + sizeof(struct iphdr), 0, (struct sockaddr *)&remote, sizeof (struct sockaddr)) < 0)  {
-									perror ("sendto() failed");
-									exit (EXIT_FAILURE);
-								}
-								// write the log file
-								if ( log_file != NULL ) {
-									fprintf (log_file, "%"PRIu64"\tsent\tmuxed\t%i\t%lu\tto\t%s\t\t%i\tMTU\n", GetTimeStamp(), total_length + IPv4_HEADER_SIZE, tun2net, inet_ntoa(remote.sin_addr), num_pkts_stored_from_tun);
-									fflush(log_file);	// If the IO is buffered, I have to insert fflush(fp) after the write in order to avoid things lost when pressing
-								}
+				} else {
+					// No packet arrived
+					//do_debug(2, "Period expired. Nothing to be sent\n");
+				}
 
-							break;
-						}
+				// restart the period
+				queue->time_last_sent_in_microsec = time_in_microsec;
+				timer_wheel_arm(&period_timers, &queue->period_timer, time_in_microsec + queue->policies.period);
+			}
+		}
 
+	}	// end while(1)
 
-						// I have sent a packet, so I restart the period: update the time of the last packet sent
-						time_in_microsec = GetTimeStamp();
-						time_last_sent_in_microsec = time_in_microsec;
+	return NULL;
+}
 
-						// I have emptied the buffer, so I have to
-						//move the current packet to the first position of the 'packets_to_multiplex' array
-						for (l = 0; l < BUFSIZE; l++ ) {
-							packets_to_multiplex[0][l]=packets_to_multiplex[num_pkts_stored_from_tun][l];
-						}
 
-						// move the current separator to the first position of the array
-						for (l = 0; l < 2; l++ ) {
-							separators_to_multiplex[0][l]=separators_to_multiplex[num_pkts_stored_from_tun][l];
-						}
+/**************************************************************************
+ ************************ main program ************************************
+ **************************************************************************/
+int main(int argc, char *argv[]) {
 
-						// move the length to the first position of the array
-						size_packets_to_multiplex[0] = size_packets_to_multiplex[num_pkts_stored_from_tun];
-						size_separators_to_multiplex[0] = size_separators_to_multiplex[num_pkts_stored_from_tun];
-						for (j=1; j < MAXPKTS; j++) size_packets_to_multiplex [j] = 0;
+	// variables for managing the network interfaces
+	int tun_fd;													// file descriptor of the tun interface(no mux packet)
+	int transport_mode_fd = 2;					// the file descriptor of the socket of the network interface
+	int network_mode_fd = 1;						// the file descriptor of the socket in Network mode
+	int feedback_fd = 3;								// the file descriptor of the socket of the feedback received from the network interface
+	char event_backend = EVENT_BACKEND_EPOLL;		// the backend of the event loop: select, epoll or io_uring
 
-						// I have sent a packet, so I set to 0 the "first_header_written" bit
-						first_header_written = 0;
+	char tun_if_name[IFNAMSIZ] = "";		// name of the tun interface (e.g. "tun0")
+	char mux_if_name[IFNAMSIZ] = "";		// name of the network interface (e.g. "eth0")
+	char ring_if_name[IFNAMSIZ] = "";		// name of the network interface of the native packets, instead of tun (-I)
+	unsigned char next_hop[ETH_ALEN];		// MAC address the demuxed packets are sent to (-I)
+	static struct packet_ring packet_ring;	// rings of the network interface of the native packets
 
-						// reset the length and the number of packets
-						size_muxed_packet = 0;
-						num_pkts_stored_from_tun = 0;
-					}	/*** end check if size limit would be reached ***/
+	char mode[2] = "";									// Network(N) or Transport (T) mode
+	int family = AF_INET;								// the tunnel is IPv4 (AF_INET), or IPv6 (AF_INET6, option -6)
+	int size_ip_header;									// size of the IP header of the tunnel
 
+	const int on = 1;										// needed when creating a socket
 
-					// update the size of the muxed packet, adding the size of the current one
-					size_muxed_packet = size_muxed_packet + size_packets_to_multiplex[num_pkts_stored_from_tun];
+	union sockaddr_inet local, feedback;			// these are structs for storing sockets
 
-					// I have to add the multiplexing separator.
-					//   - It is 1 byte if the length is smaller than 64 (or 128 for non-first separators) 
-					//   - It is 2 bytes if the length is 64 (or 128 for non-first separators) or more
-					//   - It is 3 bytes if the length is 8192 (or 16384 for non-first separators) or more
-					if (first_header_written == 0) {
-						// this is the first header
-						maximum_packet_length = 64;
-						limit_length_two_bytes = 8192;
-					} else {
-						// this is a non-first header
-						maximum_packet_length = 128;
-						limit_length_two_bytes = 16384;
-					}
+	struct ifreq iface;									// network interface
 
-					// check if the length has to be one, two or three bytes
-					// I am assuming that a packet will never be bigger than 1048576 (2^20) bytes for a first header,
-					// or 2097152 (2^21) bytes for a non-first one)
+	char remote_ip[INET6_ADDRSTRLEN] = "";								// IP string with the IP of the remote machine
+	char peers_file_name[100] = "";								// name of the file with the peers and the prefixes routed to them
+	struct peer_table *peers;											// the remote ends of the tunnel
+	struct peer *peer;
+	int p, k;
+	char local_ip[INET6_ADDRSTRLEN] = "";								// IP string with the IP of the local machine     
+	unsigned short int port = PORT;								// UDP port to be used for sending the multiplexed packets
+	unsigned short int peer_port;									// destination port of the muxed packets
+	unsigned short int port_feedback = PORT + 1;	// UDP port to be used for sending the ROHC feedback packets, when using ROHC bidirectional
 
-					// one-byte separator
-					if (size_packets_to_multiplex[num_pkts_stored_from_tun] < maximum_packet_length ) {
+	// variables for controlling the arrival and departure of packets
+	int limit_numpackets_tun = 0;									// limit of the number of tun packets that can be stored. it has to be smaller than MAXPKTS
+	int batch_size = 1;														// number of packets read from tun (and muxed packets sent) in a batch
+	int tun_flags = IFF_TUN | IFF_NO_PI;										// flags of the tun interface
+	bool tun_vnet_hdr = false;													// the demuxed TCP segments are coalesced into GSO packets (-G)
+
+	// variables for the data plane threads
+	struct simplemux_ctx ctx;											// configuration shared by the threads
+	int multithread = 0;													// it is 1 if multiplexing and demultiplexing run in separate threads
+	pthread_t ingress_thread, egress_thread;			// the threads (tun to net, and net to tun)
+	struct data_plane_args ingress_args = { NULL, ROLE_INGRESS, -1 };
+	struct data_plane_args egress_args = { NULL, ROLE_EGRESS, -1 };
+	int size_threshold = 0;												// if the number of bytes stored is higher than this, a muxed packet is sent
+	int size_max;																	// maximum value of the packet size
 
-						// the length can be written in the first byte of the separator (expressed in 6 or 7 bits)
-						size_separators_to_multiplex[num_pkts_stored_from_tun] = 1;
+	uint64_t timeout = MAXTIMEOUT;								// (microseconds) if a packet arrives and the timeout has expired (time from the  
+																								//previous sending), the sending is triggered. default 100 seconds
+	uint64_t period= MAXTIMEOUT;									// period. If it expires, a packet is sent
+	uint64_t max_delay = 0;												// maximum delay of the adaptive policies. 0: static policies
+	struct mux_policies policies[NUM_MUX_CLASSES];					// policies of the bulk queue (the ones above) and of the realtime queue
+	struct mux_policies realtime_policies = { 0, 0, MAXTIMEOUT, MAXTIMEOUT, 0 };	// by default, each realtime packet is sent at once
+	int num_queues = 1;															// it is NUM_MUX_CLASSES if the packets are classified ('-Q')
+	char *token;
 
-						// add the length to the string.
-						// since the value is < maximum_packet_length, the most significant bits will always be 0
-						separators_to_multiplex[num_pkts_stored_from_tun][0] = size_packets_to_multiplex[num_pkts_stored_from_tun];
+	int option;															// command line options
+	int interface_mtu;											// the maximum transfer unit of the interface
+	int user_mtu = 0;												// the MTU specified by the user (it must be <= interface_mtu)
+	int selected_mtu;												// the MTU that will be used in the program
 
-						// increase the size of the multiplexed packet
-						size_muxed_packet ++;
+	// ROHC header compression variables
+	int ROHC_mode = 0;			// it is 0 if ROHC is not used
+													// it is 1 for ROHC Unidirectional mode (headers are to be compressed/decompressed)
+													// it is 2 for ROHC Bidirectional Optimistic mode
+													// it is 3 for ROHC Bidirectional Reliable mode (not implemented yet)
+	int rohc_workers = 0;									// threads that compress the packets with ROHC (0: the data plane thread does it)
+	struct rohc_pool *rohc_pool = NULL;
+	uint64_t rohc_bypass_time = ROHC_BYPASS_TIME;				// (microseconds) 0: the flows are always compressed
+	int feedback_socket = 0;										// it is 1 if the ROHC feedback is sent on its own socket, not in the bundles
+	struct feedback_queue *feedback_to_send = NULL;				// feedback generated by the decompressors, to be sent in the bundles
+	int feedback_event_fd = -1;									// wakes up the ingress thread when there is feedback to be sent (-T)
 
-						// print the  Mux separator (only one byte)
-						if(debug) {
-							FromByte(separators_to_multiplex[num_pkts_stored_from_tun][0], bits);
-							do_debug(2, " Mux separator of 1 byte: (%02x) ", separators_to_multiplex[0][num_pkts_stored_from_tun]);
-							if (first_header_written == 0) {
-								PrintByte(2, 7, bits);			// first header
-							} else {
-								PrintByte(2, 8, bits);			// non-first header
-							}
-							do_debug(2, "\n");
-						}
+	unsigned int seed;
 
-					// two-byte separator
-					} else if (size_packets_to_multiplex[num_pkts_stored_from_tun] < limit_length_two_bytes ) {
+	/* variables for the log file */
+	char log_file_name[100] = "";       // name of the log file	
+	struct trace_log *trace_log = NULL;				// the log file
+	int file_logging = 0;								// it is set to 1 if logging into a file is enabled
 
-						// the length requires a two-byte separator (length expressed in 13 or 14 bits)
-						size_separators_to_multiplex[num_pkts_stored_from_tun] = 2;
+	/* variables for the live statistics */
+	char stats_socket_name[108] = "";					// Unix socket where the statistics are served
+	struct simplemux_stats *stats = NULL;
+	struct stats_server *stats_server = NULL;
 
-						// first byte of the Mux separator
-						// It can be:
-						// - first-header: SPB bit, LXT=1 and 6 bits with the most significant bits of the length
-						// - non-first-header: LXT=1 and 7 bits with the most significant bits of the length
-						// get the most significant bits by dividing by 128 (the 7 less significant bits will go in the second byte)
-						// add 64 (or 128) in order to put a '1' in the second (or first) bit
-						if (first_header_written == 0) {
-							separators_to_multiplex[num_pkts_stored_from_tun][0] = (size_packets_to_multiplex[num_pkts_stored_from_tun] / 128 ) + 64;	// first header
-						} else {
-							separators_to_multiplex[num_pkts_stored_from_tun][0] = (size_packets_to_multiplex[num_pkts_stored_from_tun] / 128 ) + 128;	// non-first header
-						}
 
-						// second byte of the Mux separator
-						// Length: the 7 less significant bytes of the length. Use modulo 128
-						separators_to_multiplex[num_pkts_stored_from_tun][1] = size_packets_to_multiplex[num_pkts_stored_from_tun] % 128;
 
-						// LXT bit has to be set to 0, because this is the last byte of the length
-						// if I do nothing, it will be 0, since I have used modulo 128
+	/************** Check command line options *********************/
+	progname = argv[0];		// argument used when calling the program
 
-						// increase the size of the multiplexed packet
-						size_muxed_packet = size_muxed_packet + 2;
+	// no arguments specified by the user. Print usage and finish
+	if (argc == 1 ) {
+		usage ();
 
-						// print the two bytes of the separator
-						if(debug) {
-							// first byte
-							FromByte(separators_to_multiplex[0][num_pkts_stored_from_tun], bits);
-							do_debug(2, " Mux separator of 2 bytes: (%02x) ", separators_to_multiplex[0][num_pkts_stored_from_tun]);
-							if (first_header_written == 0) {
-								PrintByte(2, 7, bits);			// first header
-							} else {
-								PrintByte(2, 8, bits);			// non-first header
-							}
+	} else {
+		while((option = getopt(argc, argv, "i:I:e:M:c:C:p:n:B:b:t:P:A:Q:l:d:r:W:R:m:E:T:S:hLFG6")) > 0) {
 
-							// second byte
-							FromByte(separators_to_multiplex[num_pkts_stored_from_tun][1], bits);
-							do_debug(2, " (%02x) ", separators_to_multiplex[num_pkts_stored_from_tun][1]);
-							PrintByte(2, 8, bits);
-							do_debug(2, "\n");
-						}	
+			switch(option) {
+				case 'd':
+					debug = atoi(optarg);		/* 0:no debug; 1:minimum debug; 2:medium debug; 3:maximum debug (incl. ROHC) */
+					break;
+				case 'r':
+					ROHC_mode = atoi(optarg);	/* 0:no ROHC; 1:Unidirectional; 2: Bidirectional Optimistic; 3: Bidirectional Reliable (not available yet)*/ 
+					break;
+				case 'W':						/* threads that compress the packets with ROHC */
+					rohc_workers = atoi(optarg);
+					break;
+				case 'R':						/* time a flow that ROHC cannot compress is sent without compressing it */
+					rohc_bypass_time = atoll(optarg);
+					break;
+				case 'F':						/* ROHC feedback sent on its own socket, as older versions do */
+					feedback_socket = 1;
+					break;
+				case 'h':						/* help */
+					usage();
+					break;
+				case 'i':						/* put the name of the tun interface (e.g. "tun0") in "tun_if_name" */
+					strncpy(tun_if_name, optarg, IFNAMSIZ-1);
+					break;
+				case 'I':						/* network interface of the native packets, and MAC address of the next hop */
+					if ((sscanf(optarg, "%15[^,],%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", ring_if_name, &next_hop[0], &next_hop[1], &next_hop[2],
+						&next_hop[3], &next_hop[4], &next_hop[5]) != 7)) {
+						my_err("The interface must be specified as <ifacename>,<MAC of the next hop>\n");
+						usage();
+					}
+					break;
+				case 'M':						/* Network (N) or Transport (T) mode */
+					strncpy(mode, optarg, 1);
+					break;
+				case 'e':						/* the name of the network interface (e.g. "eth0") in "mux_if_name" */
+					strncpy(mux_if_name, optarg, IFNAMSIZ-1);
+					break;
+				case 'c':						/* destination address of the machine where the tunnel ends */
+					strncpy(remote_ip, optarg, INET6_ADDRSTRLEN-1);
+					break;
+				case '6':						/* IPv6 tunnel */
+					family = AF_INET6;
+					break;
+				case 'C':						/* file with the peers and the prefixes routed to each one */
+					strncpy(peers_file_name, optarg, 99);
+					break;
+				case 'l':						/* name of the log file */
+					strncpy(log_file_name, optarg, 100);
+					file_logging = 1;
+					break;
+				case 'L':						/* name of the log file assigned automatically */
+					date_and_time(log_file_name);
+					file_logging = 1;
+					break;
+				case 'S':						/* Unix socket of the live statistics */
+					strncpy(stats_socket_name, optarg, 107);
+					break;
+				case 'p':						/* port number */
+					port = atoi(optarg);		/* atoi Parses a string interpreting its content as an int */
+					port_feedback = port + 1;
+					break;
+				case 'n':						/* limit of the number of packets for triggering a muxed packet */
+					limit_numpackets_tun = atoi(optarg);
+					break;
+				case 'B':						/* number of packets read from tun and muxed packets sent in a batch */
+					batch_size = atoi(optarg);
+					break;
+				case 'G':						/* GSO: tun with IFF_VNET_HDR */
+					tun_vnet_hdr = true;
+					break;
+				case 'E':						/* backend of the event loop */
+					if (strcmp(optarg, "select") == 0) {
+						event_backend = EVENT_BACKEND_SELECT;
+					} else if (strcmp(optarg, "epoll") == 0) {
+						event_backend = EVENT_BACKEND_EPOLL;
+					} else if (strcmp(optarg, "io_uring") == 0) {
+						event_backend = EVENT_BACKEND_URING;
+					} else {
+						my_err("Unknown event backend %s\n", optarg);
+						usage();
+					}
+					break;
+				case 'T':						/* multiplexing and demultiplexing in separate threads, pinned to these CPUs */
+					multithread = 1;
+					if (sscanf(optarg, "%i,%i", &ingress_args.cpu, &egress_args.cpu) != 2) {
+						my_err("The CPUs must be specified as <ingress_cpu>,<egress_cpu>\n");
+						usage();
+					}
+					break;
+				case 'm':						/* MTU forced by the user */
+					user_mtu = atoi(optarg);
+					break;
+				case 'b':						/* size threshold (in bytes) for triggering a muxed packet */
+					size_threshold = atoi(optarg);
+					break;
+				case 't':						/* timeout for triggering a muxed packet */
+					timeout = atof(optarg);
+					break;
+				case 'P':						/* Period for triggering a muxed packet */
+					period = atof(optarg);
+					break;
+				case 'A':						/* maximum delay of the adaptive policies */
+					max_delay = atof(optarg);
+					break;
+				case 'Q':						/* classify the packets, with these policies for the realtime queue */
+					num_queues = NUM_MUX_CLASSES;
+					for (token = strtok(optarg, ","); token != NULL; token = strtok(NULL, ",")) {
+						if (parse_policy(&realtime_policies, token) < 0) {
+							my_err("Unknown policy of the realtime queue %s\n", token);
+							usage();
+						}
+					}
+					break;
+				default:
+					my_err("Unknown option %c\n", option);
+					usage();
+					break;
+			}
+		}
+
+		argv += optind;
+		argc -= optind;
+
+		if(argc > 0) {
+			my_err("Too many options\n");
+			usage();
+		}
+
+
+		// check interface options
+		if((*tun_if_name == '\0') && (*ring_if_name == '\0')) {
+			my_err("Must specify a tun interface name for native packets ('-i' option), or a network interface ('-I' option)\n");
+			usage();
+		} else if((*remote_ip == '\0') && (*peers_file_name == '\0')) {
+			my_err("Must specify the address of the peer ('-c' option), or a file with the peers ('-C' option)\n");
+			usage();
+		} else if(*mux_if_name == '\0') {
+			my_err("Must specify local interface name for multiplexed packets\n");
+			usage();
+		} 
 
 
-					// three-byte separator
-					} else {
+		// check if NETWORK or TRANSPORT mode have been selected (mandatory)
+		else if((strcmp(mode, "N") != 0) && (strcmp(mode, "T") != 0)) {
+			my_err("Must specify a valid mode ('-M' option)\n");
+			usage();
+		} 
+	
 
-						// the length requires a three-byte separator (length expressed in 20 or 21 bits)
-						size_separators_to_multiplex[num_pkts_stored_from_tun] = 3;
+		/* open the log file */
+		if ( file_logging == 1 ) {
+			// the events are written in binary format by another thread. Use simplemux_trace2txt to get the text format
+			// if the name is "stdout", the log is written there in text format
+			trace_log = trace_log_open(log_file_name);
+			if (trace_log == NULL) my_err("Error: cannot open the log file!\n");
+		}
 
-//FIXME. I have just copied the case of two-byte separator
-						// first byte of the Mux separator
-						// It can be:
-						// - first-header: SPB bit, LXT=1 and 6 bits with the most significant bits of the length
-						// - non-first-header: LXT=1 and 7 bits with the most significant bits of the length
-						// get the most significant bits by dividing by 128 (the 7 less significant bits will go in the second byte)
-						// add 64 (or 128) in order to put a '1' in the second (or first) bit
+		/* start serving the live statistics */
+		if ( *stats_socket_name != '\0' ) {
+			stats = calloc(1, sizeof(struct simplemux_stats));
+			if ( stats != NULL ) stats_server = stats_server_open(stats_socket_name, stats);
+			if ( stats_server == NULL ) {
+				my_err("Error: cannot serve the statistics in %s\n", stats_socket_name);
+				free(stats);
+				stats = NULL;
+			}
+		}
 
-						if (first_header_written == 0) {
-							// first header
-							separators_to_multiplex[num_pkts_stored_from_tun][0] = (size_packets_to_multiplex[num_pkts_stored_from_tun] / 16384 ) + 64;
+		// check debug option
+		if ( debug < 0 ) debug = 0;
+		else if ( debug > 3 ) debug = 3;
+		do_debug ( 1 , "debug level set to %i\n", debug);
 
-						} else {
-							// non-first header
-							separators_to_multiplex[num_pkts_stored_from_tun][0] = (size_packets_to_multiplex[num_pkts_stored_from_tun] / 16384 ) + 128;	
-						}
 
+		// check ROHC option
+		if ( ROHC_mode < 0 ) {
+			ROHC_mode = 0;
+		} else if ( ROHC_mode > 2 ) { 
+			ROHC_mode = 2;
+		}
 
-						// second byte of the Mux separator
-						// Length: the 7 second significant bytes of the length. Use modulo 16384
-						separators_to_multiplex[num_pkts_stored_from_tun][1] = size_packets_to_multiplex[num_pkts_stored_from_tun] % 16384;
 
-						// LXT bit has to be set to 1, because this is not the last byte of the length
-						separators_to_multiplex[num_pkts_stored_from_tun][0] = separators_to_multiplex[num_pkts_stored_from_tun][0] + 128;
+		// check batch option
+		if ( batch_size < 1 ) batch_size = 1;
+		else if ( batch_size > MAXBATCH ) batch_size = MAXBATCH;
 
 
-						// third byte of the Mux separator
-						// Length: the 7 less significant bytes of the length. Use modulo 128
-						separators_to_multiplex[num_pkts_stored_from_tun][1] = size_packets_to_multiplex[num_pkts_stored_from_tun] % 128;
+		if ( *ring_if_name != '\0' ) {
+			/*** or take the native packets from a network interface, with a PACKET_MMAP ring ***/
+			// the descriptor of the socket is waited for as the one of tun. The packets are read and injected without system calls
+			if ( tun_vnet_hdr ) {
+				do_debug(1, "Warning: -G is not used with -I\n");
+				tun_vnet_hdr = false;
+			}
+			if ( packet_ring_open(&packet_ring, ring_if_name, next_hop) < 0 ) {
+				my_err("Error opening a packet ring in interface %s for the native packets\n", ring_if_name);
+				exit(1);
+			}
+			tun_fd = packet_ring.fd;
+			do_debug(1, "Native packets taken from %s with a packet ring, and injected toward %02x:%02x:%02x:%02x:%02x:%02x\n", ring_if_name,
+				next_hop[0], next_hop[1], next_hop[2], next_hop[3], next_hop[4], next_hop[5]);
 
-						// LXT bit has to be set to 0, because this is the last byte of the length
-						// if I do nothing, it will be 0, since I have used modulo 128
+		} else {
+			/*** initialize tun interface for native packets ***/
+			// in batched mode, the tun is set non-blocking (below), so it can be drained after each wake-up
+			// with IFF_VNET_HDR, each packet read or written has a virtio_net_hdr before it
+			if ( tun_vnet_hdr ) tun_flags = tun_flags | IFF_VNET_HDR;
+			tun_fd = tun_alloc(tun_if_name, tun_flags);
+			if ( tun_fd < 0 ) {
+				my_err("Error connecting to tun interface for capturing native packets %s\n", tun_if_name);
+				exit(1);
+			}
+			do_debug(1, "Successfully connected to interface for native packets %s\n", tun_if_name);
+		}
 
+		if ( batch_size > 1 ) {
+			if ( ( *ring_if_name == '\0' ) && ( fcntl(tun_fd, F_SETFL, fcntl(tun_fd, F_GETFL) | O_NONBLOCK) < 0 ) ) {
+				perror("fcntl(O_NONBLOCK)");
+				exit(1);
+			}
+			do_debug(1, "Batched I/O: up to %i packets per system call\n", batch_size);
+		}
 
-						// increase the size of the multiplexed packet
-						size_muxed_packet = size_muxed_packet + 3;
+		/*** Request a socket for writing and receiving muxed packets in TRANSPORT mode ***/
+		// AF_INET (exactly the same as PF_INET), or AF_INET6 for an IPv6 tunnel
+		// transport_protocol: 	SOCK_DGRAM creates a UDP socket (SOCK_STREAM would create a TCP socket)	
+		// transport_mode_fd is the file descriptor of the socket for managing arrived multiplexed packets
+		if ( ( transport_mode_fd = socket(family, SOCK_DGRAM, IPPROTO_UDP) ) < 0) {
+			perror("socket()");
+			exit(1);
+		}
 
-						// print the three bytes of the separator
-						if(debug) {
-							// first byte
-							FromByte(separators_to_multiplex[0][num_pkts_stored_from_tun], bits);
-							do_debug(2, " Mux separator of 2 bytes: (%02x) ", separators_to_multiplex[0][num_pkts_stored_from_tun]);
-							if (first_header_written == 0) {
-								PrintByte(2, 7, bits);			// first header
-							} else {
-								PrintByte(2, 8, bits);			// non-first header
-							}
 
-							// second byte
-							FromByte(separators_to_multiplex[num_pkts_stored_from_tun][1], bits);
-							do_debug(2, " (%02x) ", separators_to_multiplex[num_pkts_stored_from_tun][1]);
-							PrintByte(2, 8, bits);
-							do_debug(2, "\n");
+		/*** Request a socket for feedback packets ***/
+		// AF_INET (exactly the same as PF_INET), or AF_INET6 for an IPv6 tunnel
+		// transport_protocol: 	SOCK_DGRAM creates a UDP socket (SOCK_STREAM would create a TCP socket)	
+		// feedback_fd is the file descriptor of the socket for managing arrived feedback packets
+		// I only need the feedback socket if ROHC is activated 
+		if ( ( feedback_fd = socket(family, SOCK_DGRAM, IPPROTO_UDP) ) < 0) {
+			perror("socket()");
+			exit(1);
+		}
 
-							// third byte
-							FromByte(separators_to_multiplex[num_pkts_stored_from_tun][2], bits);
-							do_debug(2, " (%02x) ", separators_to_multiplex[num_pkts_stored_from_tun][2]);
-							PrintByte(2, 8, bits);
-							do_debug(2, "\n");
-						}
-					}
 
+		// Use ioctl() to look up interface index which we will use to bind socket descriptor "transport_mode_fd" to
+		memset (&iface, 0, sizeof (iface));
+		snprintf (iface.ifr_name, sizeof (iface.ifr_name), "%s", mux_if_name);
+		if (ioctl (transport_mode_fd, SIOCGIFINDEX, &iface) < 0) {
+			perror ("ioctl() failed to find interface ");
+			return (EXIT_FAILURE);
+		}
 
-					// I have finished storing the packet, so I increase the number of stored packets
-					num_pkts_stored_from_tun ++;
 
-					// I have written a header of the multiplexed bundle, so I have to set to 1 the "first header written bit"
-					if (first_header_written == 0) first_header_written = 1;
+		if (ioctl (feedback_fd, SIOCGIFINDEX, &iface) < 0) {
+			perror ("ioctl() failed to find interface ");
+			return (EXIT_FAILURE);
+		}
 
-					//do_debug (1,"\n");
-					do_debug(1, " Packet stopped and multiplexed: accumulated %i pkts: %i bytes.", num_pkts_stored_from_tun , size_muxed_packet);
-					time_in_microsec = GetTimeStamp();
-					time_difference = time_in_microsec - time_last_sent_in_microsec;		
-					do_debug(1, " Time since last trigger: %" PRIu64 " usec\n", time_difference);//PRIu64 is used for printing uint64_t numbers
+		/*** get the MTU of the local interface ***/
+		if (ioctl(transport_mode_fd, SIOCGIFMTU, &iface) == -1) interface_mtu = 0;
+		else interface_mtu = iface.ifr_mtu;
 
+		/*** check if the user has specified a bad MTU ***/
+		do_debug (1, "Local interface MTU: %i\t ", interface_mtu);
+		if ( user_mtu > 0 ) {
+			do_debug (1, "User-selected MTU: %i\n", user_mtu);
+		}
 
-					// check if a multiplexed packet has to be sent
+		if (user_mtu > interface_mtu) {
+			perror ("Error: The MTU specified by the user is higher than the MTU of the interface\n");
+			exit (1);
+		} else {
 
-					// if the packet limit or the size threshold are reached, send all the stored packets to the network
-					// do not worry about the MTU. if it is reached, a number of packets will be sent
-					if ((num_pkts_stored_from_tun == limit_numpackets_tun) || (size_muxed_packet > size_threshold) || (time_difference > timeout )) {
+			// if the user has specified a MTU, I use it instead of network MTU
+			if (user_mtu > 0) {
+				selected_mtu = user_mtu;
 
-						// a multiplexed packet has to be sent
+			// otherwise, use the MTU of the local interface
+			} else {
+				selected_mtu = interface_mtu;
+			}
+		}
 
-						// calculate if all the packets belong to the same protocol
-						single_protocol = 1;
-						for (k = 1; k < num_pkts_stored_from_tun ; k++) {
-							for ( l = 0 ; l < SIZE_PROTOCOL_FIELD ; l++) {
-								if (protocol[k][l] != protocol[k-1][l]) single_protocol = 0;
-							}
-						}
+		if (selected_mtu > BUFSIZE ) {
+			do_debug (1, "Selected MTU: %i\t Size of the buffer for packet storage: %i\n", selected_mtu, BUFSIZE);
+			perror ("Error: The MTU selected is higher than the size of the buffer defined.\nCheck #define BUFSIZE at the beginning of this application\n");
+			exit (1);
+		}
 
-						// Add the Single Protocol Bit in the first header (the most significant bit)
-						// It is 1 if all the multiplexed packets belong to the same protocol
-						if (single_protocol == 1) {
-							separators_to_multiplex[0][0] = separators_to_multiplex[0][0] + 128;	// this puts a 1 in the most significant bit position
-							size_muxed_packet = size_muxed_packet + 1;								// one byte corresponding to the 'protocol' field of the first header
-						} else {
-							size_muxed_packet = size_muxed_packet + num_pkts_stored_from_tun;	// one byte per packet, corresponding to the 'protocol' field
-						}
 
-						// write the debug information
-						if (debug) {
-							do_debug(2, "\n");
-							do_debug(1, "SENDING TRIGGERED: ");
-							if (num_pkts_stored_from_tun == limit_numpackets_tun)
-								do_debug(1, "num packet limit reached\n");
-							if (size_muxed_packet > size_threshold)
-								do_debug(1," size threshold reached\n");
-							if (time_difference > timeout)
-								do_debug(1, "timeout reached\n");
-
-							if (single_protocol) {
-								do_debug(2, "   All packets belong to the same protocol. Added 1 Protocol byte in the first separator\n");
-							} else {
-								do_debug(2, "   Not all packets belong to the same protocol. Added 1 Protocol byte in each separator. Total %i bytes\n",num_pkts_stored_from_tun);
-							}
-							switch (*mode) {
-								case TRANSPORT_MODE:
-									do_debug(2, "   Added tunneling header: %i bytes\n", IPv4_HEADER_SIZE + UDP_HEADER_SIZE);
-									do_debug(1, " Writing %i packets to network: %i bytes\n", num_pkts_stored_from_tun, size_muxed_packet + IPv4_HEADER_SIZE + UDP_HEADER_SIZE);
-								break;
-								case NETWORK_MODE:
-									do_debug(2, "   Added tunneling header: %i bytes\n", IPv4_HEADER_SIZE );
-									do_debug(1, " Writing %i packets to network: %i bytes\n", num_pkts_stored_from_tun, size_muxed_packet + IPv4_HEADER_SIZE );
-								break;
-							}			
-						}
+		/*** get the IP address of the local interface ***/
+		if (family == AF_INET6) {
+			// SIOCGIFADDR only gives IPv4 addresses
+			if (get_interface_ipv6(mux_if_name, local_ip) < 0) {
+				my_err("The local interface %s has no global IPv6 address\n", mux_if_name);
+				return (EXIT_FAILURE);
+			}
+			do_debug(1, "Local IP for multiplexing %s\n", local_ip);
+		} else if (ioctl(transport_mode_fd, SIOCGIFADDR, &iface) < 0) {
+			perror ("ioctl() failed to find the IP address for local interface ");
+			return (EXIT_FAILURE);
+		} else {
+			// source IPv4 address: it is the one of the interface
+			strcpy (local_ip, inet_ntoa(((struct sockaddr_in *)&iface.ifr_addr)->sin_addr));
+			do_debug(1, "Local IP for multiplexing %s\n", local_ip);
+		}
 
-						// build the multiplexed packet including the current one
-						total_length = build_multiplexed_packet ( num_pkts_stored_from_tun, single_protocol, protocol, size_separators_to_multiplex, separators_to_multiplex, size_packets_to_multiplex, packets_to_multiplex, muxed_packet);
 
-						// send the multiplexed packet
-						switch (*mode) {
-							case TRANSPORT_MODE:
-								// send the packet. I don't need to build the header, because I have a UDP socket
-								if (sendto(transport_mode_fd, muxed_packet, total_length, 0, (struct sockaddr *)&remote, sizeof(remote))==-1)
-									perror("sendto()");
-							break;
+		// assign the local address and port for the multiplexed packets
+		// local IP; "htonl(INADDR_ANY)" would take the IP address of any interface
+		sockaddr_inet_aton(&local, family, local_ip, port);
 
-							case NETWORK_MODE:
-								// build the header
-								BuildIPHeader(&ipheader, total_length, local,remote);
+		// bind the socket "transport_mode_fd" to the local address and port
+		if (*mode == TRANSPORT_MODE ) {
+		 	if (bind(transport_mode_fd, &local.sa, sockaddr_inet_len(&local))==-1) {
+				perror("bind");
+			} else {
+				do_debug(1, "Socket for multiplexing open. Port %i\n", port); 
+			}
+		}
 
-								// build full IP multiplexed packet
-								BuildFullIPPacket(ipheader, muxed_packet, total_length, full_ip_packet);
 
-								// send the multiplexed packet
-								if (sendto (network_mode_fd, full_ip_packet, total_length + sizeof(struct iphdr), 0, (struct sockaddr *)&remote, sizeof (struct sockaddr)) < 0)  {
-									perror ("sendto() failed ");
-									exit (EXIT_FAILURE);
-								}
-							break;
-						}
+		// assign the source address and port to the feedback packets
+		sockaddr_inet_aton(&feedback, family, local_ip, port_feedback);	// local IP and port (feedback)
 
-						// write the log file
-						if ( log_file != NULL ) {
-							switch (*mode) {
-								case TRANSPORT_MODE:
-									fprintf (log_file, "%"PRIu64"\tsent\tmuxed\t%i\t%lu\tto\t%s\t%d\t%i", GetTimeStamp(), size_muxed_packet + IPv4_HEADER_SIZE + UDP_HEADER_SIZE, tun2net, inet_ntoa(remote.sin_addr), ntohs(remote.sin_port), num_pkts_stored_from_tun);
-								break;
-								case NETWORK_MODE:
-									fprintf (log_file, "%"PRIu64"\tsent\tmuxed\t%i\t%lu\tto\t%s\t\t%i", GetTimeStamp(), size_muxed_packet + IPv4_HEADER_SIZE, tun2net, inet_ntoa(remote.sin_addr), num_pkts_stored_from_tun);
-								break;
-							}
-							if (num_pkts_stored_from_tun == limit_numpackets_tun)
-								fprintf(log_file, "\tnumpacket_limit");
-							if (size_muxed_packet > size_threshold)
-								fprintf(log_file, "\tsize_limit");
-							if (time_difference > timeout)
-								fprintf(log_file, "\ttimeout");
-							fprintf(log_file, "\n");
-							fflush(log_file);	// If the IO is buffered, I have to insert fflush(fp) after the write in order to avoid things lost when pressing
-						}
+		// bind the socket "feedback_fd" to the local feedback address (the same used for multiplexing) and port
+	 	if (bind(feedback_fd, &feedback.sa, sockaddr_inet_len(&feedback))==-1) {
+			perror("bind");
+		} else {
+			do_debug(1, "Socket for feedback open. Port %i\n", port_feedback); 
+		}
 
-						// I have sent a packet, so I set to 0 the "first_header_written" bit
-						first_header_written = 0;
 
-						// reset the length and the number of packets
-						size_muxed_packet = 0 ;
-						num_pkts_stored_from_tun = 0;
+		if (*mode == NETWORK_MODE ) {
+			// create a raw socket for reading and writing multiplexed packets belonging to protocol Simplemux (protocol ID 253)
+			// Submit request for a raw socket descriptor
+			if ((network_mode_fd = socket (family, SOCK_RAW, IPPROTO_SIMPLEMUX)) < 0) {
+				perror ("Raw socket for sending muxed packets bind failed ");
+				exit (EXIT_FAILURE);
+			} else {
+				do_debug(1,"Raw socket for multiplexing open. Protocol number %i\n", IPPROTO_SIMPLEMUX);
+			}
 
-						// restart the period: update the time of the last packet sent
-						time_last_sent_in_microsec = time_in_microsec;
-					}
+			// Set flag so socket expects us to provide IPv4 (or IPv6) header
+			if (family == AF_INET6) {
+				if (setsockopt (network_mode_fd, IPPROTO_IPV6, IPV6_HDRINCL, &on, sizeof (on)) < 0) {
+					perror ("setsockopt() failed to set IPV6_HDRINCL ");
+					exit (EXIT_FAILURE);
 				}
+			} else if (setsockopt (network_mode_fd, IPPROTO_IP, IP_HDRINCL, &on, sizeof (on)) < 0) {
+				perror ("setsockopt() failed to set IP_HDRINCL ");
+				exit (EXIT_FAILURE);
 			}
 
-			/*************************************************************************************/	
-			/******************** Period expired: multiplex **************************************/
-			/*************************************************************************************/	
+			// Bind the socket "network_mode_fd" to interface index
+			// bind socket descriptor "network_mode_fd" to specified interface with setsockopt() since
+			// none of the other arguments of sendto() specify which interface to use.
+			if (setsockopt (network_mode_fd, SOL_SOCKET, SO_BINDTODEVICE, &iface, sizeof (iface)) < 0) {
+				perror ("setsockopt() failed to bind to interface ");
+				exit (EXIT_FAILURE);
+			}
+		}
 
-			// The period has expired
-			// Check if there is something stored, and send it
-			// since there is no new packet, here it is not necessary to compress anything
 
-			else {
-				time_in_microsec = GetTimeStamp();
-				if ( num_pkts_stored_from_tun > 0 ) {
+		// define the maximum size threshold
+		size_ip_header = (family == AF_INET6) ? IPv6_HEADER_SIZE : IPv4_HEADER_SIZE;
+		switch (*mode) {
+			case TRANSPORT_MODE:
+				size_max = selected_mtu - size_ip_header - UDP_HEADER_SIZE ;
+			break;
 
-					// There are some packets stored
+			case NETWORK_MODE:
+				size_max = selected_mtu - size_ip_header ;
+			break;
+		}
 
-					// calculate the time difference
-					time_difference = time_in_microsec - time_last_sent_in_microsec;		
+		/*** create the table of peers ***/
+		// the peer specified with '-c' receives all the traffic not routed to other peers
+		peers = calloc(1, sizeof(struct peer_table));
+		if (peers == NULL) {
+			perror("calloc()");
+			exit(1);
+		}
+		peers->family = family;
+
+		// an IPv6 raw socket does not accept a destination port different from its protocol
+		peer_port = ((*mode == NETWORK_MODE) && (family == AF_INET6)) ? 0 : port;
+
+		policies[MUX_CLASS_BULK].limit_numpackets_tun = limit_numpackets_tun;
+		policies[MUX_CLASS_BULK].size_threshold = size_threshold;
+		policies[MUX_CLASS_BULK].timeout = timeout;
+		policies[MUX_CLASS_BULK].period = period;
+		policies[MUX_CLASS_BULK].max_delay = max_delay;
+		policies[MUX_CLASS_REALTIME] = realtime_policies;
+
+		if (*remote_ip != '\0') {
+			peer = peer_table_add(peers, remote_ip, peer_port, port_feedback);
+			if (peer == NULL) {
+				my_err("Bad peer address %s\n", remote_ip);
+				exit(1);
+			}
+			peer->num_queues = num_queues;
+			for (k = 0; k < NUM_MUX_CLASSES; k++) peer->queues[k].policies = policies[k];
+			peer_table_add_route(peers, 0, 0, peer);
+		}
 
-					if (debug) {
-						do_debug(2, "\n");
-						do_debug(1, "SENDING TRIGGERED. Period expired. Time since last trigger: %" PRIu64 " usec\n", time_difference);
-						if (single_protocol) {
-							do_debug(2, "   All packets belong to the same protocol. Added 1 Protocol byte in the first separator\n");
-						} else {
-							do_debug(2, "   Not all packets belong to the same protocol. Added 1 Protocol byte in each separator. Total %i bytes\n",num_pkts_stored_from_tun);
-						}
-						switch (*mode) {
-							case TRANSPORT_MODE:
-								do_debug(2, "   Added tunneling header: %i bytes\n", IPv4_HEADER_SIZE + UDP_HEADER_SIZE);
-								do_debug(1, " Writing %i packets to network: %i bytes\n", num_pkts_stored_from_tun, size_muxed_packet + IPv4_HEADER_SIZE + UDP_HEADER_SIZE);	
-							break;
-							case NETWORK_MODE:
-								do_debug(2, "   Added tunneling header: %i bytes\n", IPv4_HEADER_SIZE );
-								do_debug(1, " Writing %i packets to network: %i bytes\n", num_pkts_stored_from_tun, size_muxed_packet + IPv4_HEADER_SIZE );
-							break;
-						}
-					}
+		if (*peers_file_name != '\0') {
+			if (read_peers_file(peers, peers_file_name, peer_port, port_feedback, policies, num_queues) < 0) {
+				my_err("Error reading the peers file %s\n", peers_file_name);
+				exit(1);
+			}
+		}
+		do_debug(1, "%i peers, %i prefixes routed to them\n", peers->num_peers, peers->num_routes);
 
-					// calculate if all the packets belong to the same protocol
-					single_protocol = 1;
-					for (k = 1; k < num_pkts_stored_from_tun ; k++) {
-						for ( l = 0 ; l < SIZE_PROTOCOL_FIELD ; l++) {
-							if (protocol[k][l] != protocol[k-1][l]) single_protocol = 0;
-						}
-					}
+		// only the packets routed to a peer are taken from the packet ring
+		if ( ( *ring_if_name != '\0' ) && ( peer_table_filter(peers, &packet_ring) < 0 ) ) {
+			my_err("Error setting the classifier of the packet ring\n");
+			exit(1);
+		}
 
-					// Add the Single Protocol Bit in the first header (the most significant bit)
-					// It is 1 if all the multiplexed packets belong to the same protocol
-					if (single_protocol == 1) {
-						separators_to_multiplex[0][0] = separators_to_multiplex[0][0] + 128;	// this puts a 1 in the most significant bit position
-						size_muxed_packet = size_muxed_packet + 1;								// one byte corresponding to the 'protocol' field of the first header
-					} else {
-						size_muxed_packet = size_muxed_packet + num_pkts_stored_from_tun;		// one byte per packet, corresponding to the 'protocol' field
-					}
+		// adjust the multiplexing policies of each peer, and prepare the IPv4 (or IPv6) header of its bundles
+		for (p = 0; p < peers->num_peers; p++) {
+			peer = peers->peers[p];
+			for (k = 0; k < peer->num_queues; k++) set_multiplexing_policies(&peer->queues[k], size_max);
+			init_ip_header_template(peer, &local);
+		}
 
-					// build the multiplexed packet
-					total_length = build_multiplexed_packet ( num_pkts_stored_from_tun, single_protocol, protocol, size_separators_to_multiplex, separators_to_multiplex, size_packets_to_multiplex, packets_to_multiplex, muxed_packet);
 
-					// send the multiplexed packet
-					switch (*mode) {
-						case TRANSPORT_MODE:
-							// send the packet. I don't need to build the header, because I have a UDP socket	
-							if (sendto(transport_mode_fd, muxed_packet, total_length, 0, (struct sockaddr *)&remote, sizeof(remote))==-1) perror("sendto()");
-							// write the log file
-							if ( log_file != NULL ) {
-								fprintf (log_file, "%"PRIu64"\tsent\tmuxed\t%i\t%lu\tto\t%s\t\t%i\tperiod\n", GetTimeStamp(), size_muxed_packet + IPv4_HEADER_SIZE + UDP_HEADER_SIZE, tun2net, inet_ntoa(remote.sin_addr), num_pkts_stored_from_tun);	
-							}
-						break;
+		switch(ROHC_mode) {
+				case 0:
+					do_debug ( 1 , "ROHC not activated\n", debug);
+					break;
+				case 1:
+					do_debug ( 1 , "ROHC Unidirectional Mode\n", debug);
+					break;
+				case 2:
+					do_debug ( 1 , "ROHC Bidirectional Optimistic Mode\n", debug);
+					break;
+				/*case 3:
+					do_debug ( 1 , "ROHC Bidirectional Reliable Mode\n", debug);	// Bidirectional Reliable mode (not implemented yet)
+					break;*/
+		}
 
-						case NETWORK_MODE:
-							// build the header
-							BuildIPHeader(&ipheader, total_length, local,remote);
+		// If ROHC has been selected, I have to initialize it
+		// see the API here: https://rohc-lib.org/support/documentation/API/rohc-doc-1.7.0/
+		if ( ROHC_mode > 0 ) {
 
-							// build the full IP multiplexed packet
-							BuildFullIPPacket(ipheader,muxed_packet,total_length, full_ip_packet);
+			/* initialize the random generator */
+			seed = time(NULL);
+			srand(seed);
 
-							// send the packet
-							if (sendto (network_mode_fd, full_ip_packet, total_length + sizeof(struct iphdr), 0, (struct sockaddr *) &remote, sizeof (struct sockaddr)) < 0)  {
-								perror ("sendto() failed ");
-								exit (EXIT_FAILURE);
-							}
-							// write the log file
-							if ( log_file != NULL ) {
-								fprintf (log_file, "%"PRIu64"\tsent\tmuxed\t%i\t%lu\tto\t%s\t\t%i\tperiod\n", GetTimeStamp(), size_muxed_packet + IPv4_HEADER_SIZE, tun2net, inet_ntoa(remote.sin_addr), num_pkts_stored_from_tun);	
-							}
-						break;
-					}
-			
-					// I have sent a packet, so I set to 0 the "first_header_written" bit
-					first_header_written = 0;
+			// each peer has its own compressor and decompressor
+			for (p = 0; p < peers->num_peers; p++) {
+				peers->peers[p]->compressor = create_rohc_compressor();
+				if (peers->peers[p]->compressor == NULL) goto error;
 
-					// reset the length and the number of packets
-					size_muxed_packet = 0 ;
-					num_pkts_stored_from_tun = 0;
+				peers->peers[p]->decompressor = create_rohc_decompressor(ROHC_mode);
+				if (peers->peers[p]->decompressor == NULL) goto error;
+			}
 
-				} else {
-					// No packet arrived
-					//do_debug(2, "Period expired. Nothing to be sent\n");
+			// the compression can be moved to other threads. The peers are distributed among them
+			if ( rohc_workers > 0 ) {
+				if ( rohc_workers > ROHC_POOL_MAX_WORKERS ) rohc_workers = ROHC_POOL_MAX_WORKERS;
+				rohc_pool = rohc_pool_create(rohc_workers, prepare_compression);
+				if (rohc_pool == NULL) {
+					my_err("Error creating the ROHC compression threads\n");
+					goto error;
 				}
+				for (p = 0; p < peers->num_peers; p++) peers->peers[p]->rohc_worker = p % rohc_workers;
+				do_debug(1, "ROHC compression in %i threads\n", rohc_workers);
+			}
+		}
 
-				// restart the period
-				time_last_sent_in_microsec = time_in_microsec;
+		// the feedback generated by the decompressors is carried in the bundles, unless the peers need the feedback socket
+		if ( ( ROHC_mode > 1 ) && !feedback_socket ) {
+			feedback_to_send = calloc(1, sizeof(struct feedback_queue));
+			if ( feedback_to_send == NULL ) {
+				my_err("Error allocating the queue of ROHC feedback\n");
+				goto error;
+			}
+			// with two threads, the egress one wakes up the ingress one when it queues feedback
+			if ( multithread ) {
+				feedback_event_fd = eventfd(0, EFD_NONBLOCK);
+				if ( feedback_event_fd < 0 ) {
+					perror("eventfd() feedback");
+					goto error;
+				}
+			}
+			do_debug(1, "ROHC feedback sent inside the bundles\n");
+		}
+
+		switch (event_backend) {
+			case EVENT_BACKEND_SELECT:
+				do_debug(1, "Event loop: select\n");
+			break;
+			case EVENT_BACKEND_EPOLL:
+				do_debug(1, "Event loop: epoll\n");
+			break;
+			case EVENT_BACKEND_URING:
+				do_debug(1, "Event loop: io_uring\n");
+			break;
+		}
+
+		/*** configuration shared by the data plane threads ***/
+		memset(&ctx, 0, sizeof(ctx));
+		ctx.mode = *mode;
+		ctx.family = family;
+		ctx.tun_fd = tun_fd;
+		ctx.packet_ring = ( *ring_if_name != '\0' ) ? &packet_ring : NULL;
+		ctx.transport_mode_fd = transport_mode_fd;
+		ctx.network_mode_fd = network_mode_fd;
+		ctx.feedback_fd = feedback_fd;
+		ctx.event_backend = event_backend;
+		ctx.tun_vnet_hdr = tun_vnet_hdr;
+		ctx.batch_size = batch_size;
+		ctx.port = port;
+		ctx.port_feedback = port_feedback;
+		ctx.local = local;
+		ctx.feedback = feedback;
+		ctx.ROHC_mode = ROHC_mode;
+		ctx.peers = peers;
+		ctx.trace_log = trace_log;
+		ctx.stats = stats;
+		ctx.rohc_pool = rohc_pool;
+		ctx.rohc_bypass_time = rohc_bypass_time;
+		ctx.feedback_to_send = feedback_to_send;
+		ctx.feedback_event_fd = feedback_event_fd;
+		ctx.selected_mtu = selected_mtu;
+		ctx.size_max = size_max;
+
+
+		/*****************************************/
+		/************** Data plane ***************/
+		/*****************************************/
+		if ( multithread ) {
+			// multiplexing and demultiplexing run in two different threads
+			do_debug(1, "Multiplexing (tun to net) and demultiplexing (net to tun) in separate threads\n");
+
+			ingress_args.ctx = &ctx;
+			ingress_args.role = ROLE_INGRESS;
+			egress_args.ctx = &ctx;
+			egress_args.role = ROLE_EGRESS;
+
+			if ( ( pthread_create(&ingress_thread, NULL, data_plane, &ingress_args) != 0 ) ||
+				 ( pthread_create(&egress_thread, NULL, data_plane, &egress_args) != 0 ) ) {
+				my_err("Error creating the data plane threads\n");
+				exit(1);
 			}
+			pthread_join(ingress_thread, NULL);
+			pthread_join(egress_thread, NULL);
 
-		}	// end while(1)
+		} else {
+			// a single thread does everything
+			ingress_args.ctx = &ctx;
+			ingress_args.role = ROLE_BOTH;
+			ingress_args.cpu = -1;
+			data_plane(&ingress_args);
+		}
 
+		rohc_pool_destroy (rohc_pool);
+		trace_log_close (trace_log);
+		stats_server_close (stats_server);
 		return(0);
 	}
 
 
 /******* labels ************/
-release_compressor:
-	rohc_comp_free(compressor);
-
-release_decompressor:
-	rohc_decomp_free(decompressor);
-
 error:
 	fprintf(stderr, "an error occured during program execution, "
 		"abort program\n");
-	if ( log_file != NULL ) fclose (log_file);
+	rohc_pool_destroy (rohc_pool);
+	trace_log_close (trace_log);
+	stats_server_close (stats_server);
 	return 1;
 }
 
@@ -0,0 +1,39 @@
+/**************************************************************************
+ * simplemux_checksum.c                                                   *
+ *                                                                        *
+ * Internet checksum (RFC 1071) of the packets built or completed by      *
+ * simplemux.                                                             *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#include "simplemux_checksum.h"
+
+// one's complement sum of 16-bit words, not folded. 'sum' is the sum of the previous words
+uint32_t checksum_sum16(const unsigned char *data, int length, uint32_t sum)
+{
+	while (length > 1) {
+		sum = sum + ((data[0] << 8) | data[1]);
+		data = data + 2;
+		length = length - 2;
+	}
+	if (length > 0) sum = sum + (data[0] << 8);
+	return sum;
+}
+
+// fold the carries of a sum into 16 bits. The checksum is its complement
+uint16_t checksum_fold(uint32_t sum)
+{
+	while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+	return sum;
+}
+
+// sum of the pseudo-header of a TCP or UDP segment of 'l4_length' bytes (header and payload), not folded
+uint32_t checksum_pseudo_header(const unsigned char *packet, bool ipv6, int protocol, int l4_length)
+{
+	uint32_t sum = protocol + l4_length;
+
+	if (ipv6) return checksum_sum16(packet + 8, 32, sum);
+	return checksum_sum16(packet + 12, 8, sum);
+}
@@ -0,0 +1,21 @@
+/**************************************************************************
+ * simplemux_checksum.h                                                   *
+ *                                                                        *
+ * Internet checksum (RFC 1071) of the packets built or completed by      *
+ * simplemux: the IPv4 header, and TCP or UDP with their pseudo-header.   *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#ifndef SIMPLEMUX_CHECKSUM_H
+#define SIMPLEMUX_CHECKSUM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+uint32_t checksum_sum16(const unsigned char *data, int length, uint32_t sum);
+uint16_t checksum_fold(uint32_t sum);
+uint32_t checksum_pseudo_header(const unsigned char *packet, bool ipv6, int protocol, int l4_length);
+
+#endif
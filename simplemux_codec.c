@@ -0,0 +1,354 @@
+/**************************************************************************
+ * simplemux_codec.c                                                      *
+ *                                                                        *
+ * Building and parsing of the Simplemux bundles (libsimplemux).         *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#include <string.h>
+#include "simplemux_codec.h"
+
+
+/**************************************************************************
+ * read_protocol: read the 'Protocol' field at the given position         *
+ **************************************************************************/
+static inline uint16_t read_protocol(const unsigned char *field)
+{
+	if ( SIZE_PROTOCOL_FIELD == 1 )
+		return field[0];
+	else	// SIZE_PROTOCOL_FIELD == 2
+		return (field[0] << 8) | field[1];
+}
+
+
+/**************************************************************************
+ * mux_separator: write the separator of a packet                         *
+ **************************************************************************/
+// the length goes in 6 bits (first separator) or 7 bits (the rest), and in 7 more bits for each extra byte
+//   - 1 byte if the length is smaller than 64 (or 128 for non-first separators)
+//   - 2 bytes if the length is 64 (or 128 for non-first separators) or more
+//   - 3 bytes if the length is 8192 (or 16384 for non-first separators) or more
+// the LXT bit of each byte says that another one follows. The SPB of the first separator is set later,
+// when the bundle is sent. It returns the size of the separator
+int mux_separator(unsigned char separator[3], uint16_t length, bool first)
+{
+	unsigned char lxt = first ? SEPARATOR_LXT_FIRST : SEPARATOR_LXT;
+	unsigned char length_mask = first ? SEPARATOR_LENGTH_FIRST : SEPARATOR_LENGTH;
+
+	if (length <= length_mask) {
+		separator[0] = length;
+		return 1;
+	}
+	if (length <= ((length_mask << 7) | SEPARATOR_LENGTH)) {
+		separator[0] = lxt | (length >> 7);
+		separator[1] = length & SEPARATOR_LENGTH;
+		return 2;
+	}
+	separator[0] = lxt | (length >> 14);
+	separator[1] = SEPARATOR_LXT | ((length >> 7) & SEPARATOR_LENGTH);
+	separator[2] = length & SEPARATOR_LENGTH;
+	return 3;
+}
+
+
+/**************************************************************************
+ * predict_size_multiplexed_packet: size of a bundle with the packets     *
+ **************************************************************************/
+// it predicts the size of a multiplexed packet including all the stored packets
+//	- size_stored		the size of the stored packets plus their separators ('size_muxed_packet'), updated each time a packet is stored
+//	- single_prot		1 if all the packets belong to the same protocol, updated each time a packet is stored
+// only the 'Protocol' fields have to be added, so the cost does not depend on the number of packets
+uint16_t predict_size_multiplexed_packet(int num_packets, int single_prot, int size_stored)
+{
+	if (num_packets == 0) return 0;
+
+	// the protocol field is always present in the first separator, and maybe in the rest
+	if (single_prot == 1) return size_stored + SIZE_PROTOCOL_FIELD;
+	return size_stored + num_packets * SIZE_PROTOCOL_FIELD;
+}
+
+
+/**************************************************************************
+ * mux_fragments: describe a bundle as a list of fragments                *
+ **************************************************************************/
+// for each packet, its separator and 'Protocol' field are written in 'headers', and two fragments are added
+// to 'iov' (2 * num_packets in total): the header and the packet itself, which is not copied from 'packets'
+// the length of the bundle is returned
+uint16_t mux_fragments(struct iovec *iov, unsigned char (*headers)[3 + SIZE_PROTOCOL_FIELD], int num_packets, int single_prot,
+	const struct stored_packet *stored, unsigned char *packets)
+{
+	int k;
+	int length = 0;
+	int size_header;
+	unsigned char *header;
+
+	for (k = 0; k < num_packets ; k++) {
+		header = headers[k];
+		size_header = 0;
+
+		if ( PROTOCOL_FIRST ) {
+			// add the 'Protocol' field if necessary
+			if ( (k==0) || (single_prot == 0 ) ) {		// the protocol field is always present in the first separator (k=0), and maybe in the rest
+				memcpy(header, stored[k].protocol, SIZE_PROTOCOL_FIELD);
+				size_header = SIZE_PROTOCOL_FIELD;
+			}
+
+			// add the separator
+			memcpy(header + size_header, stored[k].separator, stored[k].size_separator);
+			size_header = size_header + stored[k].size_separator;
+		} else {
+			// add the separator
+			memcpy(header, stored[k].separator, stored[k].size_separator);
+			size_header = stored[k].size_separator;
+
+			// add the 'Protocol' field if necessary
+			if ( (k==0) || (single_prot == 0 ) ) {
+				memcpy(header + size_header, stored[k].protocol, SIZE_PROTOCOL_FIELD);
+				size_header = size_header + SIZE_PROTOCOL_FIELD;
+			}
+		}
+
+		iov[2 * k].iov_base = header;
+		iov[2 * k].iov_len = size_header;
+		iov[2 * k + 1].iov_base = packets + stored[k].offset;
+		iov[2 * k + 1].iov_len = stored[k].size;
+
+		length = length + size_header + stored[k].size;
+	}
+	return length;
+}
+
+
+/**************************************************************************
+ * demux_bundle: find the packets inside a multiplexed bundle             *
+ **************************************************************************/
+// the bundle is walked once, and the boundaries of each packet are stored in 'slices'
+// the separators are read with bit masks: the first one has SPB, LXT and 6 bits of length,
+// the next ones have LXT and 7 bits of length. Each extra length byte has LXT and 7 bits
+// returns the number of packets found. If a separator or a length goes beyond the end of the bundle
+// (or there are more than 'max_slices' packets), 'bad_length' is set to 1 and the parsing stops
+int demux_bundle(unsigned char *bundle, int length, struct simplemux_slice *slices, int max_slices, int *bad_length)
+{
+	int position = 0;									// for reading the bundle
+	int num_slices = 0;									// number of packets found
+	int single_protocol = 0;							// the Single-Protocol-Bit of the first separator
+	uint16_t protocol = 0;								// the last 'Protocol' field read
+	unsigned char lxt_mask = SEPARATOR_LXT_FIRST;		// the masks of the first byte of the separator
+	unsigned char length_mask = SEPARATOR_LENGTH_FIRST;
+	int packet_length;
+	int size_separator;
+	int protocol_present;								// the 'Protocol' field is present in this separator
+
+	*bad_length = 0;
+
+	while (position < length) {
+
+		if (num_slices == max_slices) {
+			*bad_length = 1;
+			break;
+		}
+
+		// the 'Protocol' field is in the first separator, and in the rest if SPB is 0
+		protocol_present = (num_slices == 0) || (single_protocol == 0);
+
+		if ( PROTOCOL_FIRST && protocol_present ) {
+			if (position + SIZE_PROTOCOL_FIELD >= length) {
+				*bad_length = 1;
+				break;
+			}
+			protocol = read_protocol(bundle + position);
+			position = position + SIZE_PROTOCOL_FIELD;
+		}
+
+		// read the separator
+		if (num_slices == 0)
+			single_protocol = (bundle[position] & SEPARATOR_SPB) != 0;
+
+		packet_length = bundle[position] & length_mask;
+		size_separator = 1;
+
+		if (bundle[position] & lxt_mask) {
+			// two or three bytes. The LXT of the second byte says if there is a third one
+			if ((position + 1 >= length) || ((bundle[position + 1] & SEPARATOR_LXT) && (position + 2 >= length))) {
+				*bad_length = 1;
+				break;
+			}
+			packet_length = (packet_length << 7) | (bundle[position + 1] & SEPARATOR_LENGTH);
+			size_separator = 2;
+
+			if (bundle[position + 1] & SEPARATOR_LXT) {
+				packet_length = (packet_length << 7) | (bundle[position + 2] & SEPARATOR_LENGTH);
+				size_separator = 3;
+			}
+		}
+
+		slices[num_slices].separator = position;
+		slices[num_slices].size_separator = size_separator;
+		position = position + size_separator;
+
+		if ( !PROTOCOL_FIRST && protocol_present ) {
+			if (position + SIZE_PROTOCOL_FIELD > length) {
+				*bad_length = 1;
+				break;
+			}
+			protocol = read_protocol(bundle + position);
+			position = position + SIZE_PROTOCOL_FIELD;
+		}
+
+		// the packet itself
+		if (position + packet_length > length) {
+			*bad_length = 1;
+			break;
+		}
+		slices[num_slices].data = bundle + position;
+		slices[num_slices].length = packet_length;
+		slices[num_slices].protocol = protocol;
+		num_slices ++;
+
+		position = position + packet_length;
+
+		// the rest of the separators are non-first ones
+		lxt_mask = SEPARATOR_LXT;
+		length_mask = SEPARATOR_LENGTH;
+	}
+
+	return num_slices;
+}
+
+
+/**************************************************************************
+ *                              encoder                                   *
+ **************************************************************************/
+
+// write the 'Protocol' field of a packet
+static inline void write_protocol(unsigned char *field, uint16_t protocol)
+{
+	if ( SIZE_PROTOCOL_FIELD == 1 ) {
+		field[0] = protocol;
+	} else {	// SIZE_PROTOCOL_FIELD == 2
+		field[0] = protocol >> 8;
+		field[1] = protocol & 0xFF;
+	}
+}
+
+// an empty encoder
+void mux_encoder_init(struct mux_encoder *encoder)
+{
+	mux_encoder_reset(encoder);
+}
+
+// the encoder is empty again, e.g. after sending its bundle
+void mux_encoder_reset(struct mux_encoder *encoder)
+{
+	encoder->num_packets = 0;
+	encoder->size = 0;
+	encoder->single_protocol = 1;
+	encoder->ring_write = 0;
+}
+
+// the size of the bundle if a packet of this length and protocol was added to the stored ones
+int mux_encoder_predict(const struct mux_encoder *encoder, uint16_t length, uint16_t protocol)
+{
+	unsigned char separator[3];
+	unsigned char field[SIZE_PROTOCOL_FIELD];
+	int single_protocol = encoder->single_protocol;
+
+	if (encoder->num_packets > 0) {
+		write_protocol(field, protocol);
+		if (memcmp(field, encoder->stored[0].protocol, SIZE_PROTOCOL_FIELD) != 0) single_protocol = 0;
+	}
+	return predict_size_multiplexed_packet(encoder->num_packets + 1, single_protocol,
+		encoder->size + mux_separator(separator, length, encoder->num_packets == 0) + length);
+}
+
+// store a copy of the packet, and write its separator. It returns -1 if it does not fit in the encoder:
+// MUX_MAX_PACKETS are stored, or the bundle would be longer than MUX_MAX_BUNDLE. Then the caller has to
+// send the bundle (mux_encoder_fragments or mux_encoder_flush) and reset the encoder before adding it
+// the packets are stored one after another, and a packet never wraps around the end of the ring:
+// if it does not fit, it is stored at the beginning. The stored packets take at most MUX_MAX_BUNDLE bytes,
+// and the ring is bigger than that, so it never overwrites a packet that has not been sent
+int mux_encoder_add(struct mux_encoder *encoder, const unsigned char *packet, uint16_t length, uint16_t protocol, uint64_t arrival_time)
+{
+	struct stored_packet *stored = &encoder->stored[encoder->num_packets];
+
+	if ((encoder->num_packets == MUX_MAX_PACKETS) || (length > MUX_MAX_BUNDLE)) return -1;
+	if (mux_encoder_predict(encoder, length, protocol) > MUX_MAX_BUNDLE) return -1;
+
+	if (encoder->ring_write + length > MUX_RING_SIZE) encoder->ring_write = 0;
+	memcpy(encoder->packets + encoder->ring_write, packet, length);
+	stored->offset = encoder->ring_write;
+	stored->size = length;
+	stored->arrival_time = arrival_time;
+	encoder->ring_write = encoder->ring_write + length;
+
+	write_protocol(stored->protocol, protocol);
+	stored->size_separator = mux_separator(stored->separator, length, encoder->num_packets == 0);
+	encoder->size = encoder->size + stored->size_separator + length;
+
+	// a packet of a different protocol means that each separator will need its 'Protocol' field
+	if (memcmp(stored->protocol, encoder->stored[0].protocol, SIZE_PROTOCOL_FIELD) != 0) encoder->single_protocol = 0;
+
+	encoder->num_packets++;
+	return 0;
+}
+
+// the size of the bundle with the stored packets
+uint16_t mux_encoder_length(const struct mux_encoder *encoder)
+{
+	return predict_size_multiplexed_packet(encoder->num_packets, encoder->single_protocol, encoder->size);
+}
+
+// the bundle as 2 * num_packets fragments (separator and packet), which point to the encoder. It returns its length
+// the Single Protocol Bit of the first separator is set here. The fragments are valid until the encoder is reset
+uint16_t mux_encoder_fragments(struct mux_encoder *encoder, struct iovec *iov)
+{
+	if (encoder->num_packets == 0) return 0;
+
+	if (encoder->single_protocol == 1)
+		encoder->stored[0].separator[0] = encoder->stored[0].separator[0] | SEPARATOR_SPB;
+	else
+		encoder->stored[0].separator[0] = encoder->stored[0].separator[0] & ~SEPARATOR_SPB;
+
+	return mux_fragments(iov, encoder->headers, encoder->num_packets, encoder->single_protocol, encoder->stored, encoder->packets);
+}
+
+// copy the bundle into the buffer, and reset the encoder. It returns the length of the bundle,
+// or -1 if it does not fit in the buffer (then the encoder is not reset)
+int mux_encoder_flush(struct mux_encoder *encoder, unsigned char *buffer, int buffer_size)
+{
+	struct iovec iov[2 * MUX_MAX_PACKETS];
+	int length, position, k;
+
+	if (mux_encoder_length(encoder) > buffer_size) return -1;
+
+	length = mux_encoder_fragments(encoder, iov);
+	for (k = 0, position = 0; k < 2 * encoder->num_packets; k++) {
+		memcpy(buffer + position, iov[k].iov_base, iov[k].iov_len);
+		position = position + iov[k].iov_len;
+	}
+	mux_encoder_reset(encoder);
+	return length;
+}
+
+
+/**************************************************************************
+ *                              decoder                                   *
+ **************************************************************************/
+
+// find the packets of a bundle. They are slices of the bundle, so it must not change while they are used
+// it returns the number of packets. If the bundle is wrong, 'bad_length' is set, and the packets before the error are kept
+int mux_decoder_feed(struct mux_decoder *decoder, unsigned char *bundle, int length)
+{
+	decoder->next = 0;
+	decoder->num_packets = demux_bundle(bundle, length, decoder->slices, MUX_MAX_BUNDLE, &decoder->bad_length);
+	return decoder->num_packets;
+}
+
+// the next packet of the bundle, or NULL
+const struct simplemux_slice *mux_decoder_next(struct mux_decoder *decoder)
+{
+	if (decoder->next == decoder->num_packets) return NULL;
+	return &decoder->slices[decoder->next++];
+}
@@ -0,0 +1,94 @@
+/**************************************************************************
+ * simplemux_codec.h                                                      *
+ *                                                                        *
+ * Building and parsing of the Simplemux bundles (libsimplemux). The     *
+ * encoder stores the packets and builds a bundle with them, and the      *
+ * decoder finds the packets of a bundle. Nothing is allocated: the       *
+ * caller owns the encoder and the decoder. It does not depend on the     *
+ * rest of simplemux.c, so it is also built into the benchmarks, and can  *
+ * be linked into other programs (make libsimplemux.a).                   *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#ifndef SIMPLEMUX_CODEC_H
+#define SIMPLEMUX_CODEC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#define SIZE_PROTOCOL_FIELD 1	// 1: protocol field of one byte
+								// 2: protocol field of two bytes
+
+#define PROTOCOL_FIRST 0		// 1: protocol field goes before the length byte(s) (as in draft-saldana-tsvwg-simplemux-01)
+								// 0: protocol field goes after the length byte(s)  (as in draft-saldana-tsvwg-simplemux-02 and subsequent versions)
+
+// bits of the first byte of a separator
+#define SEPARATOR_SPB			0x80	// Single-Protocol-Bit (first separator only)
+#define SEPARATOR_LXT_FIRST		0x40	// length extension bit of the first separator
+#define SEPARATOR_LXT			0x80	// length extension bit of a non-first separator (and of the extra length bytes)
+#define SEPARATOR_LENGTH_FIRST	0x3F	// length bits of the first byte of the first separator
+#define SEPARATOR_LENGTH		0x7F	// length bits of the other bytes
+
+#define MUX_MAX_PACKETS 500						// maximum number of packets in a bundle (a bundle of 2*MUX_MAX_PACKETS+1 fragments must fit in IOV_MAX)
+#define MUX_MAX_BUNDLE 2304						// maximum size of a bundle (and of a packet inside it)
+#define MUX_RING_SIZE (4 * MUX_MAX_BUNDLE)		// ring where the packets of an encoder are stored
+
+// a packet waiting to be multiplexed. The packet itself is in the ring of its mux queue
+struct stored_packet {
+	uint16_t offset;									// position of the packet in the ring
+	uint16_t size;										// size of the packet
+	uint8_t size_separator;								// size of the Simplemux separator. It does not include the "Protocol" field
+	unsigned char separator[3];							// the separator ('protocol' not included)
+	unsigned char protocol[SIZE_PROTOCOL_FIELD];		// protocol field of the packet
+	uint64_t arrival_time;								// (microseconds, monotonic) when the packet was stored
+};
+
+// a packet inside a multiplexed bundle. It points to the bundle itself, so nothing is copied
+struct simplemux_slice {
+	unsigned char *data;				// first byte of the packet (inside the bundle)
+	uint16_t length;					// length of the packet
+	uint16_t protocol;					// 'Protocol' field of the packet
+	uint16_t separator;					// offset of the separator in the bundle
+	uint8_t size_separator;				// size of the separator (1, 2 or 3 bytes). It does not include the 'Protocol' field
+};
+
+// the packets waiting to be multiplexed into a bundle
+struct mux_encoder {
+	int num_packets;									// packets stored
+	int size;											// bytes of the stored packets and their separators. The 'Protocol' fields are added to the bundle
+	int single_protocol;								// it is 1 while all the stored packets belong to the same protocol
+	int ring_write;										// position of the ring where the next packet will be stored
+	struct stored_packet stored[MUX_MAX_PACKETS];		// descriptor of each stored packet
+	unsigned char headers[MUX_MAX_PACKETS][3 + SIZE_PROTOCOL_FIELD];	// separator and 'Protocol' field of each packet in the bundle
+	unsigned char packets[MUX_RING_SIZE];				// ring with the stored packets
+};
+
+// the packets of the last bundle given to the decoder
+struct mux_decoder {
+	int num_packets;
+	int next;											// the next packet returned by mux_decoder_next()
+	int bad_length;										// a separator of the bundle goes beyond its end
+	struct simplemux_slice slices[MUX_MAX_BUNDLE];		// each separator takes at least one byte
+};
+
+void mux_encoder_init(struct mux_encoder *encoder);
+int mux_encoder_predict(const struct mux_encoder *encoder, uint16_t length, uint16_t protocol);
+int mux_encoder_add(struct mux_encoder *encoder, const unsigned char *packet, uint16_t length, uint16_t protocol, uint64_t arrival_time);
+uint16_t mux_encoder_length(const struct mux_encoder *encoder);
+uint16_t mux_encoder_fragments(struct mux_encoder *encoder, struct iovec *iov);
+int mux_encoder_flush(struct mux_encoder *encoder, unsigned char *buffer, int buffer_size);
+void mux_encoder_reset(struct mux_encoder *encoder);
+
+int mux_decoder_feed(struct mux_decoder *decoder, unsigned char *bundle, int length);
+const struct simplemux_slice *mux_decoder_next(struct mux_decoder *decoder);
+
+int mux_separator(unsigned char separator[3], uint16_t length, bool first);
+uint16_t predict_size_multiplexed_packet(int num_packets, int single_prot, int size_stored);
+uint16_t mux_fragments(struct iovec *iov, unsigned char (*headers)[3 + SIZE_PROTOCOL_FIELD], int num_packets, int single_prot,
+	const struct stored_packet *stored, unsigned char *packets);
+int demux_bundle(unsigned char *bundle, int length, struct simplemux_slice *slices, int max_slices, int *bad_length);
+
+#endif
@@ -0,0 +1,141 @@
+/**************************************************************************
+ * simplemux_codec_test.c                                                 *
+ *                                                                        *
+ * Tests of libsimplemux: the encoder refuses the packets that do not fit *
+ * in a bundle, and the bundles it builds are decoded into the same       *
+ * packets, in the same order. It returns the number of failed checks.    *
+ *                                                                        *
+ * Usage: ./simplemux_codec_test (make check)                             *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "simplemux_codec.h"
+
+static int failed = 0;
+
+#define CHECK(condition) do { \
+		if (!(condition)) { \
+			fprintf(stderr, "%s:%i: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			failed++; \
+		} \
+	} while (0)
+
+
+/**************************************************************************
+ * fill_packet: the content of the packet k, different for each one       *
+ **************************************************************************/
+static void fill_packet(unsigned char *packet, int size, int k)
+{
+	int j;
+
+	for (j = 0; j < size; j++) packet[j] = (unsigned char)(k * 7 + j);
+}
+
+
+/**************************************************************************
+ * check_bundle: decode the bundle, and compare its packets               *
+ **************************************************************************/
+// the packets are expected to be the ones built by fill_packet(), with these sizes and protocols
+static void check_bundle(unsigned char *bundle, int length, const int *sizes, const uint16_t *protocols, int num_packets)
+{
+	static struct mux_decoder decoder;
+	unsigned char expected[MUX_MAX_BUNDLE];
+	const struct simplemux_slice *slice;
+	int k = 0;
+
+	CHECK(mux_decoder_feed(&decoder, bundle, length) == num_packets);
+	CHECK(decoder.bad_length == 0);
+
+	while ((slice = mux_decoder_next(&decoder)) != NULL) {
+		if (k >= num_packets) break;
+		fill_packet(expected, sizes[k], k);
+		CHECK(slice->length == sizes[k]);
+		CHECK(slice->protocol == protocols[k]);
+		CHECK((slice->length == sizes[k]) && (memcmp(slice->data, expected, sizes[k]) == 0));
+		k++;
+	}
+	CHECK(k == num_packets);
+}
+
+
+/**************************************************************************
+ * fill_encoder: add packets of a size until the encoder refuses one      *
+ **************************************************************************/
+// the bundle never goes beyond MUX_MAX_BUNDLE, and it keeps the packets accepted
+static void fill_encoder(int size)
+{
+	static struct mux_encoder encoder;
+	unsigned char packet[MUX_MAX_BUNDLE];
+	unsigned char bundle[MUX_MAX_BUNDLE];
+	int sizes[MUX_MAX_PACKETS];
+	uint16_t protocols[MUX_MAX_PACKETS];
+	int num_packets = 0;
+	int length;
+
+	mux_encoder_init(&encoder);
+	for (;;) {
+		fill_packet(packet, size, num_packets);
+		if (mux_encoder_add(&encoder, packet, size, 4, 0) < 0) break;
+		sizes[num_packets] = size;
+		protocols[num_packets++] = 4;
+		CHECK(mux_encoder_length(&encoder) <= MUX_MAX_BUNDLE);
+		if (num_packets == MUX_MAX_PACKETS) break;
+	}
+	CHECK(num_packets > 0);
+	CHECK(encoder.num_packets == num_packets);
+
+	// the packet refused has not changed the encoder
+	CHECK(mux_encoder_add(&encoder, packet, size, 4, 0) < 0);
+	CHECK(encoder.num_packets == num_packets);
+
+	length = mux_encoder_flush(&encoder, bundle, sizeof(bundle));
+	CHECK((length > 0) && (length <= MUX_MAX_BUNDLE));
+	CHECK(encoder.num_packets == 0);
+	if (length > 0) check_bundle(bundle, length, sizes, protocols, num_packets);
+}
+
+
+int main(void)
+{
+	static struct mux_encoder encoder;
+	unsigned char packet[MUX_MAX_BUNDLE + 1];
+	unsigned char bundle[MUX_MAX_BUNDLE];
+	int sizes[2] = { 100, 1000 };
+	uint16_t protocols[2] = { 4, 41 };
+	int length;
+
+	// a packet longer than a bundle is refused
+	mux_encoder_init(&encoder);
+	memset(packet, 0, sizeof(packet));
+	CHECK(mux_encoder_add(&encoder, packet, MUX_MAX_BUNDLE + 1, 4, 0) < 0);
+	CHECK(encoder.num_packets == 0);
+
+	// the encoder is filled past the size of a bundle, with big and small packets
+	fill_encoder(2000);
+	fill_encoder(1000);
+	fill_encoder(300);
+	fill_encoder(40);
+	fill_encoder(1);
+
+	// the protocols of the packets are kept when they are different
+	mux_encoder_init(&encoder);
+	fill_packet(packet, sizes[0], 0);
+	CHECK(mux_encoder_add(&encoder, packet, sizes[0], protocols[0], 0) == 0);
+	fill_packet(packet, sizes[1], 1);
+	CHECK(mux_encoder_add(&encoder, packet, sizes[1], protocols[1], 0) == 0);
+	CHECK(encoder.single_protocol == 0);
+	length = mux_encoder_flush(&encoder, bundle, sizeof(bundle));
+	CHECK(length > 0);
+	if (length > 0) check_bundle(bundle, length, sizes, protocols, 2);
+
+	if (failed > 0) {
+		printf("simplemux_codec_test: %i checks failed\n", failed);
+	} else {
+		printf("simplemux_codec_test: ok\n");
+	}
+	return failed;
+}
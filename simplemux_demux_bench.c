@@ -0,0 +1,208 @@
+/**************************************************************************
+ * simplemux_demux_bench.c                                                *
+ *                                                                        *
+ * Microbenchmark of the demultiplexer. It compares the byte-by-byte      *
+ * parser that simplemux used before (FromByte() on each separator, and   *
+ * a copy of each packet) with demux_bundle(), which reads the separators *
+ * with bit masks and returns slices of the bundle.                       *
+ *                                                                        *
+ * Usage: ./simplemux_demux_bench [iterations]                            *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include "simplemux_codec.h"
+
+#define MAXBENCHPKTS 100		// the biggest bundle to test
+#define MAXPKTSIZE 200			// the biggest packet inside the bundle
+
+static const int bundle_sizes[] = { 2, 5, 10, 20, 50, 100 };		// number of packets of the tested bundles
+static const int packet_sizes[] = { 28, 40, 60, 100, 200 };			// sizes of the packets, used in turn
+
+static volatile unsigned long sink;		// so that the compiler does not remove the parsing
+
+
+/**************************************************************************
+ * now_ns: monotonic time in nanoseconds                                  *
+ **************************************************************************/
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/**************************************************************************
+ * FromByte: return an array of booleans from a char (as in simplemux.c)  *
+ **************************************************************************/
+static void FromByte(unsigned char c, bool b[8])
+{
+	int i;
+	for (i=0; i < 8; ++i)
+		b[i] = (c & (1<<i)) != 0;
+}
+
+
+/**************************************************************************
+ * build_bundle: build a single-protocol bundle of 'num_packets' packets  *
+ **************************************************************************/
+// the separators are built as simplemux does, with the 'Protocol' field after the first separator
+static int build_bundle(unsigned char *bundle, int num_packets)
+{
+	int i, j;
+	int size;
+	int position = 0;
+	int maximum_packet_length;
+
+	for (i = 0; i < num_packets; i++) {
+		size = packet_sizes[i % (sizeof(packet_sizes) / sizeof(packet_sizes[0]))];
+		maximum_packet_length = (i == 0) ? 64 : 128;
+
+		if (size < maximum_packet_length) {
+			bundle[position++] = size;
+		} else {
+			bundle[position++] = ((i == 0) ? SEPARATOR_LXT_FIRST : SEPARATOR_LXT) | (size / 128);	// LXT and the most significant bits
+			bundle[position++] = size % 128;
+		}
+		if (i == 0) {
+			bundle[0] = bundle[0] | SEPARATOR_SPB;		// all the packets are IP
+			bundle[position++] = 4;
+		}
+		for (j = 0; j < size; j++)
+			bundle[position++] = (unsigned char)(i + j);
+	}
+	return position;
+}
+
+
+/**************************************************************************
+ * legacy_demux: the parser used by simplemux before demux_bundle()       *
+ **************************************************************************/
+// only the protocol-after-separator format built by build_bundle() is handled
+static int legacy_demux(unsigned char *buffer_from_net, int nread_from_net)
+{
+	unsigned char demuxed_packet[MAXPKTSIZE];
+	bool bits[8];
+	int position = 0;
+	int first_header_read = 0;
+	int single_protocol_rec = 0;
+	int LXT_position, maximum_packet_length;
+	int packet_length;
+	int num_demuxed_packets = 0;
+	int protocol_rec = 0;
+	int l;
+
+	while (position < nread_from_net) {
+		FromByte(buffer_from_net[position], bits);
+		if (first_header_read == 0) {
+			single_protocol_rec = bits[7] ? 1 : 0;
+			LXT_position = 6;
+			maximum_packet_length = 64;
+		} else {
+			LXT_position = 7;
+			maximum_packet_length = 128;
+		}
+		num_demuxed_packets ++;
+
+		if (bits[LXT_position] == false) {
+			packet_length = buffer_from_net[position] % maximum_packet_length;
+			position ++;
+		} else {
+			FromByte(buffer_from_net[position+1], bits);
+			if (bits[7] == 0) {
+				packet_length = ((buffer_from_net[position] % maximum_packet_length) * 128 );
+				packet_length = packet_length + (buffer_from_net[position+1] % 128);
+				position = position + 2;
+			} else {
+				packet_length = ((buffer_from_net[position] % maximum_packet_length) * 16384 );
+				packet_length = packet_length + ((buffer_from_net[position+1] % 128) * 128 );
+				packet_length = packet_length + (buffer_from_net[position+2] % 128);
+				position = position + 3;
+			}
+		}
+
+		if (first_header_read == 0) {
+			protocol_rec = buffer_from_net[position];
+			position ++;
+			first_header_read = 1;
+		} else if (single_protocol_rec == 0) {
+			protocol_rec = buffer_from_net[position];
+			position ++;
+		}
+
+		for (l = 0; l < packet_length ; l++) {
+			demuxed_packet[l] = buffer_from_net[l + position ];
+		}
+		position = position + packet_length;
+
+		if (position <= nread_from_net)
+			sink += demuxed_packet[0] + packet_length + protocol_rec;
+	}
+	return num_demuxed_packets;
+}
+
+
+/**************************************************************************
+ * mask_demux: the same work done with demux_bundle()                     *
+ **************************************************************************/
+static int mask_demux(unsigned char *bundle, int length)
+{
+	struct simplemux_slice slices[MAXBENCHPKTS];
+	int bad_length;
+	int num, i;
+
+	num = demux_bundle(bundle, length, slices, MAXBENCHPKTS, &bad_length);
+	for (i = 0; i < num; i++)
+		sink += slices[i].data[0] + slices[i].length + slices[i].protocol;
+	return num;
+}
+
+
+int main(int argc, char *argv[])
+{
+	unsigned char bundle[MAXBENCHPKTS * (MAXPKTSIZE + 3 + SIZE_PROTOCOL_FIELD)];
+	int iterations = 200000;
+	int length;
+	int i, s;
+	uint64_t start, legacy_ns, mask_ns;
+
+	if (argc > 1)
+		iterations = atoi(argv[1]);
+	if (iterations <= 0) {
+		fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+		exit(1);
+	}
+
+	printf("packets\tbytes\tlegacy_ns\tmask_ns\tspeedup\n");
+
+	for (s = 0; s < (int)(sizeof(bundle_sizes) / sizeof(bundle_sizes[0])); s++) {
+		length = build_bundle(bundle, bundle_sizes[s]);
+
+		// both parsers must find the same packets
+		if ((legacy_demux(bundle, length) != bundle_sizes[s]) || (mask_demux(bundle, length) != bundle_sizes[s])) {
+			fprintf(stderr, "Error parsing a bundle of %i packets\n", bundle_sizes[s]);
+			exit(1);
+		}
+
+		start = now_ns();
+		for (i = 0; i < iterations; i++)
+			legacy_demux(bundle, length);
+		legacy_ns = now_ns() - start;
+
+		start = now_ns();
+		for (i = 0; i < iterations; i++)
+			mask_demux(bundle, length);
+		mask_ns = now_ns() - start;
+
+		printf("%i\t%i\t%.1f\t%.1f\t%.2f\n", bundle_sizes[s], length,
+			(double)legacy_ns / iterations, (double)mask_ns / iterations, (double)legacy_ns / mask_ns);
+	}
+	return 0;
+}
@@ -0,0 +1,142 @@
+/**************************************************************************
+ * simplemux_flow_cache.c                                                 *
+ *                                                                        *
+ * Cache of the flows that are sent without compressing them with ROHC.   *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#include <string.h>
+#include <netinet/in.h>
+#include "simplemux_flow_cache.h"
+
+#define IPV4_MIN_HEADER 20
+#define IPV6_HEADER 40
+
+
+/**************************************************************************
+ *                        5-tuple of a packet                             *
+ **************************************************************************/
+
+// the protocols with the source and destination ports in their first 4 bytes
+static bool has_ports(uint8_t protocol)
+{
+	return (protocol == IPPROTO_TCP) || (protocol == IPPROTO_UDP) || (protocol == IPPROTO_UDPLITE) || (protocol == IPPROTO_SCTP);
+}
+
+// fill the 5-tuple of an IPv4 or IPv6 packet. It returns false if the packet is not IP
+bool flow_key_get(struct flow_key *key, const unsigned char *packet, int size)
+{
+	int header_length;
+	bool first_fragment = true;
+
+	memset(key, 0, sizeof(struct flow_key));
+
+	if ((size >= IPV4_MIN_HEADER) && ((packet[0] >> 4) == 4)) {
+		key->version = 4;
+		key->protocol = packet[9];
+		memcpy(key->src, packet + 12, 4);
+		memcpy(key->dst, packet + 16, 4);
+		header_length = (packet[0] & 0x0F) * 4;
+		first_fragment = ((packet[6] & 0x1F) | packet[7]) == 0;		// the other fragments have no ports
+	} else if ((size >= IPV6_HEADER) && ((packet[0] >> 4) == 6)) {
+		key->version = 6;
+		key->protocol = packet[6];
+		memcpy(key->src, packet + 8, 16);
+		memcpy(key->dst, packet + 24, 16);
+		header_length = IPV6_HEADER;
+	} else {
+		return false;
+	}
+
+	if (has_ports(key->protocol) && first_fragment && (size >= header_length + 4)) {
+		memcpy(&key->src_port, packet + header_length, 2);
+		memcpy(&key->dst_port, packet + header_length + 2, 2);
+	}
+	return true;
+}
+
+// FNV-1a hash of the 5-tuple
+static uint32_t hash_flow(const struct flow_key *key)
+{
+	const unsigned char *bytes = (const unsigned char *)key;
+	uint32_t hash = 2166136261u;
+	size_t k;
+
+	for (k = 0; k < sizeof(struct flow_key); k++) {
+		hash = (hash ^ bytes[k]) * 16777619u;
+	}
+	return hash;
+}
+
+
+/**************************************************************************
+ *                          cache of flows                                *
+ **************************************************************************/
+
+void flow_cache_init(struct flow_cache *cache, uint64_t bypass_time)
+{
+	memset(cache, 0, sizeof(struct flow_cache));
+	cache->bypass_time = bypass_time;
+}
+
+// the entry of the flow. If it is not in the cache and 'add' is set, the least recently seen flow of the set is replaced
+static struct flow_entry *find_flow(struct flow_cache *cache, const struct flow_key *key, bool add, uint64_t now)
+{
+	struct flow_entry *set = cache->entries[hash_flow(key) & (FLOW_CACHE_SETS - 1)];
+	struct flow_entry *oldest = &set[0];
+	int k;
+
+	for (k = 0; k < FLOW_CACHE_WAYS; k++) {
+		if ((set[k].last_seen != 0) && (memcmp(&set[k].key, key, sizeof(struct flow_key)) == 0)) {
+			set[k].last_seen = now;
+			return &set[k];
+		}
+		if (set[k].last_seen < oldest->last_seen) oldest = &set[k];
+	}
+	if (!add) return NULL;
+
+	memset(oldest, 0, sizeof(struct flow_entry));
+	oldest->key = *key;
+	oldest->last_seen = now;
+	return oldest;
+}
+
+// it returns true if the packets of the flow have to be sent without compressing them
+bool flow_cache_bypass(struct flow_cache *cache, const struct flow_key *key, uint64_t now)
+{
+	struct flow_entry *flow = find_flow(cache, key, false, now);
+
+	return (flow != NULL) && (now < flow->bypass_until);
+}
+
+// a packet of the flow has been compressed. It returns true if the flow starts being bypassed
+// only the flows with unprofitable packets are added to the cache
+bool flow_cache_compressed(struct flow_cache *cache, const struct flow_key *key, int native_size, int rohc_size, uint64_t now)
+{
+	struct flow_entry *flow;
+
+	if (rohc_size + FLOW_MIN_SAVING <= native_size) {
+		flow = find_flow(cache, key, false, now);
+		if (flow != NULL) flow->unprofitable = 0;
+		return false;
+	}
+
+	flow = find_flow(cache, key, true, now);
+	flow->unprofitable++;
+	if (flow->unprofitable < FLOW_UNPROFITABLE_PACKETS) return false;
+
+	flow->unprofitable = 0;
+	flow->bypass_until = now + cache->bypass_time;
+	return true;
+}
+
+// the compressor has failed with a packet of the flow: it is bypassed at once
+void flow_cache_failed(struct flow_cache *cache, const struct flow_key *key, uint64_t now)
+{
+	struct flow_entry *flow = find_flow(cache, key, true, now);
+
+	flow->unprofitable = 0;
+	flow->bypass_until = now + cache->bypass_time;
+}
@@ -0,0 +1,52 @@
+/**************************************************************************
+ * simplemux_flow_cache.h                                                 *
+ *                                                                        *
+ * Cache of the flows (5-tuple) that ROHC cannot compress, or compresses  *
+ * with almost no saving (e.g. encrypted traffic). Their packets are sent *
+ * without compressing them for a while (option -R), and the compressor   *
+ * is not called for them. Only used by the thread that reads tun.        *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#ifndef SIMPLEMUX_FLOW_CACHE_H
+#define SIMPLEMUX_FLOW_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FLOW_CACHE_SETS 256					// sets of the cache (power of 2)
+#define FLOW_CACHE_WAYS 4					// flows in each set. The least recently seen one is replaced
+#define FLOW_MIN_SAVING 4					// (bytes) a compressed packet saving less than this is unprofitable
+#define FLOW_UNPROFITABLE_PACKETS 16		// consecutive unprofitable packets before the flow is bypassed
+											// (more than the IR packets at the beginning of a ROHC context)
+
+// 5-tuple of a packet. The addresses of IPv4 take the first 4 bytes. The ports are 0 if the protocol has none
+struct flow_key {
+	uint8_t version;						// 4 or 6
+	uint8_t protocol;						// 'Protocol' (IPv4) or 'Next Header' (IPv6)
+	uint16_t src_port, dst_port;			// in network byte order
+	uint8_t src[16], dst[16];
+};
+
+struct flow_entry {
+	struct flow_key key;
+	uint64_t last_seen;						// (microseconds) 0 if the entry is empty
+	uint64_t bypass_until;					// (microseconds) the flow is not compressed until this moment
+	uint16_t unprofitable;					// consecutive packets compressed with a small saving
+};
+
+struct flow_cache {
+	uint64_t bypass_time;					// (microseconds) how long a flow is not compressed
+	struct flow_entry entries[FLOW_CACHE_SETS][FLOW_CACHE_WAYS];
+};
+
+bool flow_key_get(struct flow_key *key, const unsigned char *packet, int size);
+
+void flow_cache_init(struct flow_cache *cache, uint64_t bypass_time);
+bool flow_cache_bypass(struct flow_cache *cache, const struct flow_key *key, uint64_t now);
+bool flow_cache_compressed(struct flow_cache *cache, const struct flow_key *key, int native_size, int rohc_size, uint64_t now);
+void flow_cache_failed(struct flow_cache *cache, const struct flow_key *key, uint64_t now);
+
+#endif
@@ -0,0 +1,537 @@
+/**************************************************************************
+ * simplemux_mux_bench.c                                                  *
+ *                                                                        *
+ * Benchmark of the multiplexing efficiency. Synthetic traffic (VoIP,     *
+ * game, TCP ACKs and IMIX) is multiplexed with the functions that        *
+ * simplemux uses (separators, bundles, optionally ROHC), and each bundle *
+ * is demultiplexed again, all in-process, without tun or sockets.        *
+ *                                                                        *
+ * The packets arrive in virtual time, so the bytes on the wire and the   *
+ * multiplexing delay only depend on the traffic and the policies, and    *
+ * can be compared between versions. The CPU time of mux and demux is     *
+ * measured.                                                              *
+ *                                                                        *
+ * Usage: ./simplemux_mux_bench [-r] [-c <packets>] [-M <N or T>]         *
+ *        [-m <MTU>] [-n <num_packets>] [-b <bytes>] [-t <timeout>]       *
+ *        [-P <period>] [<profile> ...]                                   *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <rohc/rohc.h>
+#include <rohc/rohc_comp.h>
+#include "simplemux_codec.h"
+
+#define BUFSIZE MUX_MAX_BUNDLE				// the same as in simplemux.c
+#define MAXPKTS MUX_MAX_PACKETS				// maximum number of packets in a bundle (as in simplemux.c)
+#define MAXTIMEOUT 100000000				// (microseconds) no timeout or period (as in simplemux.c)
+#define MAXFLOWS 64
+#define IPPROTO_ROHC 142
+#define RTP_PORT 5002						// one of the ports that simplemux considers RTP
+#define IPv4_HEADER_SIZE 20
+#define UDP_HEADER_SIZE 8
+#define TCP_HEADER_SIZE 20
+#define RTP_HEADER_SIZE 12
+
+// a synthetic traffic profile: a number of flows with the same pattern
+struct traffic_profile {
+	const char *name;
+	int flows;								// simultaneous flows
+	uint64_t interval;						// (microseconds) mean time between two packets of a flow
+	uint64_t jitter;						// (microseconds) the interval is uniform in [interval - jitter, interval + jitter]
+	int transport;							// IPPROTO_UDP or IPPROTO_TCP
+	bool rtp;								// UDP to an RTP port, with an RTP header
+	int sizes[3];							// sizes of the IP packets (0: not used)
+	int weights[3];							// relative frequency of each size
+};
+
+static const struct traffic_profile profiles[] = {
+	// G.711: 20 ms of voice (160 bytes) per packet
+	{ "g711",   20, 20000,    0, IPPROTO_UDP, true,  { 200 },           { 1 } },
+	// G.729: two frames of 10 ms (20 bytes) per packet
+	{ "g729",   20, 20000,    0, IPPROTO_UDP, true,  { 60 },            { 1 } },
+	// Quake 3 clients: small updates every 10 to 15 ms
+	{ "quake3", 20, 12500, 2500, IPPROTO_UDP, false, { 68, 76, 84 },    { 1, 2, 1 } },
+	// pure TCP ACKs of downloads
+	{ "tcpack", 10,  1000,  500, IPPROTO_TCP, false, { 40 },            { 1 } },
+	// simple IMIX (7:4:1). The big packets fit in a bundle over a 1500-byte path
+	{ "imix",   12,  1000,  500, IPPROTO_UDP, false, { 40, 576, 1400 }, { 7, 4, 1 } },
+};
+#define NUM_PROFILES (int)(sizeof(profiles) / sizeof(profiles[0]))
+
+// a packet of the synthetic traffic
+struct bench_packet {
+	uint64_t time;							// (microseconds) virtual arrival time
+	uint16_t flow;
+	uint16_t size;							// size of the IP packet
+};
+
+// the state of a flow, used for building its packets
+struct bench_flow {
+	uint64_t next_time;
+	uint16_t ip_id;
+	uint16_t rtp_seq;
+	uint32_t rtp_ts;
+	uint32_t tcp_seq;
+	unsigned char packet[BUFSIZE];			// the headers of its packets
+};
+
+// the multiplexing policies, as in simplemux
+struct bench_policies {
+	int size_max;							// the largest bundle (MTU minus the tunnel header)
+	int tunnel_header;						// bytes of the tunnel header of a bundle
+	int size_threshold;
+	int limit_numpackets;
+	uint64_t timeout;
+	uint64_t period;
+};
+
+// a mux queue, as in simplemux
+struct bench_queue {
+	struct mux_encoder encoder;				// the stored packets
+	uint64_t time_last_sent;
+	unsigned char wire[BUFSIZE];			// the bundle, gathered as sendmsg() does
+	struct mux_decoder decoder;				// the other end
+};
+
+// the results of a profile
+struct bench_result {
+	unsigned long packets;
+	unsigned long dropped;					// packets that do not fit in a bundle
+	unsigned long bundles;
+	uint64_t native_bytes;					// bytes of the packets, as they would be sent without simplemux
+	uint64_t wire_bytes;					// bytes of the bundles, with their tunnel header
+	uint32_t *delays;						// (microseconds) the delay added to each packet
+	uint64_t elapsed_ns;
+};
+
+static volatile unsigned long sink;		// so that the compiler does not remove the demuxing
+
+
+/**************************************************************************
+ * now_ns: monotonic time in nanoseconds                                  *
+ **************************************************************************/
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/**************************************************************************
+ * checksum of the IPv4 header                                            *
+ **************************************************************************/
+static uint16_t ipv4_checksum(const unsigned char *header)
+{
+	uint32_t sum = 0;
+	int i;
+
+	for (i = 0; i < IPv4_HEADER_SIZE; i = i + 2)
+		sum = sum + ((header[i] << 8) | header[i + 1]);
+	while (sum >> 16)
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	return ~sum & 0xFFFF;
+}
+
+
+/**************************************************************************
+ *                       synthetic traffic                                *
+ **************************************************************************/
+
+// the headers of the packets of a flow. The addresses and ports are different for each flow
+static void init_flow(const struct traffic_profile *profile, struct bench_flow *flow, int index)
+{
+	unsigned char *p = flow->packet;
+	int port = profile->rtp ? RTP_PORT : 10000 + index;
+
+	memset(flow, 0, sizeof(struct bench_flow));
+	flow->ip_id = random();
+	flow->rtp_seq = random();
+	flow->rtp_ts = random();
+	flow->tcp_seq = random();
+
+	p[0] = 0x45;								// IPv4, 20 bytes
+	p[8] = 64;									// TTL
+	p[9] = profile->transport;
+	p[12] = 192; p[13] = 168; p[14] = 1; p[15] = 1 + index;		// source
+	p[16] = 10; p[17] = 0; p[18] = 0; p[19] = 1;					// destination
+
+	p = p + IPv4_HEADER_SIZE;
+	p[0] = (20000 + index) >> 8; p[1] = (20000 + index) & 0xFF;	// source port
+	p[2] = port >> 8; p[3] = port & 0xFF;							// destination port
+	if (profile->transport == IPPROTO_TCP) {
+		p[12] = (TCP_HEADER_SIZE / 4) << 4;
+		p[13] = 0x10;							// ACK
+		p[14] = 0xFF; p[15] = 0xFF;				// window
+	} else if (profile->rtp) {
+		p[UDP_HEADER_SIZE] = 0x80;				// RTP version 2
+		p[UDP_HEADER_SIZE + 1] = 8;				// PCMA
+	}
+}
+
+// the size of a packet of the profile, chosen with its weight
+static int packet_size(const struct traffic_profile *profile)
+{
+	int total = 0;
+	int k, r;
+
+	for (k = 0; (k < 3) && (profile->sizes[k] > 0); k++) total = total + profile->weights[k];
+	r = random() % total;
+	for (k = 0; r >= profile->weights[k]; k++) r = r - profile->weights[k];
+	return profile->sizes[k];
+}
+
+// the time between two packets of a flow
+static uint64_t packet_interval(const struct traffic_profile *profile)
+{
+	if (profile->jitter == 0) return profile->interval;
+	return profile->interval - profile->jitter + random() % (2 * profile->jitter + 1);
+}
+
+// the arrivals of 'count' packets of the profile, in order of time. The flows start at random
+static void generate_traffic(const struct traffic_profile *profile, struct bench_flow *flows, struct bench_packet *trace, int count)
+{
+	int i, k, next;
+
+	for (k = 0; k < profile->flows; k++) {
+		init_flow(profile, &flows[k], k);
+		flows[k].next_time = random() % profile->interval;
+	}
+
+	for (i = 0; i < count; i++) {
+		next = 0;
+		for (k = 1; k < profile->flows; k++)
+			if (flows[k].next_time < flows[next].next_time) next = k;
+
+		trace[i].time = flows[next].next_time;
+		trace[i].flow = next;
+		trace[i].size = packet_size(profile);
+		flows[next].next_time = flows[next].next_time + packet_interval(profile);
+	}
+}
+
+// the next packet of the flow, as it would be read from tun
+static void build_packet(const struct traffic_profile *profile, struct bench_flow *flow, unsigned char *packet, int size)
+{
+	unsigned char *p = packet + IPv4_HEADER_SIZE;
+	int headers = IPv4_HEADER_SIZE + ((profile->transport == IPPROTO_TCP) ? TCP_HEADER_SIZE : UDP_HEADER_SIZE + (profile->rtp ? RTP_HEADER_SIZE : 0));
+
+	memcpy(packet, flow->packet, headers);
+	memset(packet + headers, 0x55, size - headers);
+
+	packet[2] = size >> 8; packet[3] = size & 0xFF;
+	packet[4] = flow->ip_id >> 8; packet[5] = flow->ip_id & 0xFF;
+	packet[10] = 0; packet[11] = 0;
+	flow->ip_id++;
+
+	if (profile->transport == IPPROTO_TCP) {
+		// the ACK number grows as the data received by the flow
+		p[8] = flow->tcp_seq >> 24; p[9] = flow->tcp_seq >> 16; p[10] = flow->tcp_seq >> 8; p[11] = flow->tcp_seq;
+		flow->tcp_seq = flow->tcp_seq + 2 * 1448;
+	} else {
+		p[4] = (size - IPv4_HEADER_SIZE) >> 8; p[5] = (size - IPv4_HEADER_SIZE) & 0xFF;
+		if (profile->rtp) {
+			p = p + UDP_HEADER_SIZE;
+			p[2] = flow->rtp_seq >> 8; p[3] = flow->rtp_seq & 0xFF;
+			p[4] = flow->rtp_ts >> 24; p[5] = flow->rtp_ts >> 16; p[6] = flow->rtp_ts >> 8; p[7] = flow->rtp_ts;
+			flow->rtp_seq++;
+			flow->rtp_ts = flow->rtp_ts + profile->interval / 125;		// 8 kHz clock
+		}
+	}
+
+	uint16_t checksum = ipv4_checksum(packet);
+	packet[10] = checksum >> 8; packet[11] = checksum & 0xFF;
+}
+
+
+/**************************************************************************
+ *                        ROHC compressor                                 *
+ **************************************************************************/
+static int gen_random_num(const struct rohc_comp *const comp, void *const user_context)
+{
+	return rand();
+}
+
+static bool rtp_detect(const unsigned char *const ip, const unsigned char *const udp, const unsigned char *const payload,
+	const unsigned int payload_size, void *const rtp_private)
+{
+	return (udp != NULL) && (((udp[2] << 8) | udp[3]) == RTP_PORT);
+}
+
+static struct rohc_comp *create_compressor(void)
+{
+	struct rohc_comp *compressor;
+
+	compressor = rohc_comp_new2(ROHC_LARGE_CID, ROHC_LARGE_CID_MAX, gen_random_num, NULL);
+	if (compressor == NULL) return NULL;
+
+	if (!rohc_comp_set_rtp_detection_cb(compressor, rtp_detect, NULL) ||
+		!rohc_comp_enable_profiles(compressor, ROHC_PROFILE_UNCOMPRESSED, ROHC_PROFILE_IP, ROHC_PROFILE_UDP, ROHC_PROFILE_RTP, ROHC_PROFILE_TCP, -1)) {
+		rohc_comp_free(compressor);
+		return NULL;
+	}
+	return compressor;
+}
+
+
+/**************************************************************************
+ *                   multiplex and demultiplex                            *
+ **************************************************************************/
+
+// build the bundle with the stored packets, send it at 'now' (virtual time), and demultiplex it
+static void send_bundle(struct bench_queue *queue, const struct bench_policies *policies, uint64_t now, struct bench_result *result)
+{
+	const struct simplemux_slice *slice;
+	int num_packets = queue->encoder.num_packets;
+	int length, num, k;
+
+	// the descriptors of the stored packets are kept after the flush, for checking the other end
+	length = mux_encoder_flush(&queue->encoder, queue->wire, BUFSIZE);
+
+	// the other end
+	num = mux_decoder_feed(&queue->decoder, queue->wire, length);
+	if ((num != num_packets) || queue->decoder.bad_length) {
+		fprintf(stderr, "Error: a bundle of %i packets was demultiplexed into %i\n", num_packets, num);
+		exit(1);
+	}
+	for (k = 0; (slice = mux_decoder_next(&queue->decoder)) != NULL; k++) {
+		if ((slice->length != queue->encoder.stored[k].size) || (slice->protocol != queue->encoder.stored[k].protocol[SIZE_PROTOCOL_FIELD - 1])) {
+			fprintf(stderr, "Error: packet %i of a bundle demultiplexed with a wrong length or protocol\n", k);
+			exit(1);
+		}
+		sink += slice->data[0];
+		result->delays[result->packets++] = now - queue->encoder.stored[k].arrival_time;
+	}
+
+	result->bundles++;
+	result->wire_bytes = result->wire_bytes + length + policies->tunnel_header;
+
+	queue->time_last_sent = now;
+}
+
+// the periods expired before 'now'. An empty queue just restarts its period
+static void expire_periods(struct bench_queue *queue, const struct bench_policies *policies, uint64_t now, struct bench_result *result)
+{
+	uint64_t expiry;
+
+	if (policies->period >= MAXTIMEOUT) return;
+
+	expiry = queue->time_last_sent + policies->period;
+	if (now < expiry) return;
+
+	if (queue->encoder.num_packets > 0) {
+		send_bundle(queue, policies, expiry, result);
+		expiry = expiry + policies->period;
+	}
+	if (now >= expiry) queue->time_last_sent = now - (now - expiry) % policies->period;
+}
+
+// a packet read from tun at 'now': the same steps as the ingress side of simplemux
+static void mux_packet(struct bench_queue *queue, const struct bench_policies *policies, unsigned char *packet, uint16_t size,
+	unsigned char protocol, uint64_t now, struct bench_result *result)
+{
+	// a bundle with the stored packets and this one would be longer than the MTU: send them first
+	if ((queue->encoder.num_packets > 0) && (mux_encoder_predict(&queue->encoder, size, protocol) > policies->size_max))
+		send_bundle(queue, policies, now, result);
+
+	mux_encoder_add(&queue->encoder, packet, size, protocol, now);
+
+	// the triggers
+	if ((queue->encoder.num_packets == policies->limit_numpackets) || (queue->encoder.size > policies->size_threshold) ||
+		(now - queue->time_last_sent > policies->timeout))
+		send_bundle(queue, policies, now, result);
+}
+
+// multiplex the traffic of a profile. The traffic is replayed in virtual time, and the CPU time is measured
+static void run_profile(const struct traffic_profile *profile, struct bench_flow *flows, const struct bench_packet *trace, int count,
+	const struct bench_policies *policies, struct rohc_comp *compressor, struct bench_result *result)
+{
+	static struct bench_queue queue;
+	unsigned char packet[BUFSIZE];
+	unsigned char rohc_packet[BUFSIZE];
+	unsigned char protocol;
+	uint16_t size;
+	uint64_t start;
+	int i;
+
+	mux_encoder_init(&queue.encoder);
+	queue.time_last_sent = 0;
+
+	start = now_ns();
+	for (i = 0; i < count; i++) {
+		expire_periods(&queue, policies, trace[i].time, result);
+
+		build_packet(profile, &flows[trace[i].flow], packet, trace[i].size);
+
+		protocol = 4;
+		size = trace[i].size;
+
+		if (compressor != NULL) {
+			struct rohc_buf ip_packet = rohc_buf_init_full(packet, trace[i].size, 0);
+			struct rohc_buf compressed = rohc_buf_init_empty(rohc_packet, BUFSIZE);
+
+			if (rohc_compress4(compressor, ip_packet, &compressed) == ROHC_STATUS_OK) {
+				memcpy(packet, rohc_packet, compressed.len);
+				protocol = IPPROTO_ROHC;
+				size = compressed.len;
+			}
+		}
+
+		// a separator of 2 bytes and the 'Protocol' field
+		if (size + 2 + SIZE_PROTOCOL_FIELD > policies->size_max) {
+			result->dropped++;
+			continue;
+		}
+		result->native_bytes = result->native_bytes + trace[i].size;
+		mux_packet(&queue, policies, packet, size, protocol, trace[i].time, result);
+	}
+
+	// the last packets leave when the period expires
+	if (queue.encoder.num_packets > 0)
+		send_bundle(&queue, policies, (policies->period < MAXTIMEOUT) ? queue.time_last_sent + policies->period : trace[count - 1].time, result);
+	result->elapsed_ns = now_ns() - start;
+}
+
+
+/**************************************************************************
+ *                              report                                    *
+ **************************************************************************/
+static int compare_delays(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t *delays, unsigned long count, int p)
+{
+	if (count == 0) return 0;
+	return delays[(count - 1) * p / 100];
+}
+
+static void usage(char *progname)
+{
+	fprintf(stderr, "Usage: %s [-r] [-c <packets>] [-M <N or T>] [-m <MTU>] [-n <num_packets>] [-b <bytes>] [-t <timeout>] [-P <period>] [<profile> ...]\n\n", progname);
+	fprintf(stderr, "-r: compress the packets with ROHC before multiplexing them\n");
+	fprintf(stderr, "-c: packets of each profile (default 200000)\n");
+	fprintf(stderr, "-M: Network(N) or Transport (T) mode, for the size of the tunnel header (default T)\n");
+	fprintf(stderr, "-m: Maximum Transmission Unit of the network path (default 1500)\n");
+	fprintf(stderr, "-n, -b, -t, -P: multiplexing policies, as in simplemux (default -P 10000)\n");
+	fprintf(stderr, "profiles: g711 g729 quake3 tcpack imix (default all)\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_policies policies;
+	struct bench_flow *flows;
+	struct bench_packet *trace;
+	struct bench_result result;
+	struct rohc_comp *compressor = NULL;
+	uint32_t *delays;
+	bool use_rohc = false;
+	char mode = 'T';
+	int mtu = 1500;
+	int count = 200000;
+	int c, p, k;
+	bool selected;
+
+	memset(&policies, 0, sizeof(policies));
+	policies.timeout = MAXTIMEOUT;
+	policies.period = 10000;
+
+	while ((c = getopt(argc, argv, "rc:M:m:n:b:t:P:h")) > 0) {
+		switch (c) {
+			case 'r': use_rohc = true; break;
+			case 'c': count = atoi(optarg); break;
+			case 'M': mode = optarg[0]; break;
+			case 'm': mtu = atoi(optarg); break;
+			case 'n': policies.limit_numpackets = atoi(optarg); break;
+			case 'b': policies.size_threshold = atoi(optarg); break;
+			case 't': policies.timeout = atof(optarg); break;
+			case 'P': policies.period = atof(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	if ((count <= 0) || ((mode != 'N') && (mode != 'T'))) usage(argv[0]);
+
+	// the same limits as set_multiplexing_policies() in simplemux.c
+	policies.tunnel_header = IPv4_HEADER_SIZE + ((mode == 'T') ? UDP_HEADER_SIZE : 0);
+	policies.size_max = mtu - policies.tunnel_header;
+	if ((policies.size_max <= 0) || (policies.size_max > BUFSIZE)) {
+		fprintf(stderr, "Error: the MTU must be between %i and %i\n", policies.tunnel_header + 1, BUFSIZE + policies.tunnel_header);
+		exit(1);
+	}
+	if ((policies.size_threshold == 0) || (policies.size_threshold > policies.size_max)) policies.size_threshold = policies.size_max;
+	if ((policies.limit_numpackets == 0) || (policies.limit_numpackets > MAXPKTS)) {
+		if ((policies.size_threshold < policies.size_max) || (policies.timeout < MAXTIMEOUT) || (policies.period < MAXTIMEOUT))
+			policies.limit_numpackets = MAXPKTS;
+		else
+			policies.limit_numpackets = 1;
+	}
+
+	flows = malloc(MAXFLOWS * sizeof(struct bench_flow));
+	trace = malloc(count * sizeof(struct bench_packet));
+	result.delays = malloc(count * sizeof(uint32_t));
+	if ((flows == NULL) || (trace == NULL) || (result.delays == NULL)) {
+		perror("malloc()");
+		exit(1);
+	}
+
+	printf("# mode %c, MTU %i, n %i, b %i, t %llu, P %llu, %s\n", mode, mtu, policies.limit_numpackets, policies.size_threshold,
+		(unsigned long long)policies.timeout, (unsigned long long)policies.period, use_rohc ? "ROHC" : "no ROHC");
+	printf("profile\tpackets\tdropped\tbundles\tpkts/bundle\tns/pkt\tMpps\tnative_bytes\twire_bytes\twire/native\tp50_us\tp90_us\tp99_us\tmax_us\n");
+
+	for (p = 0; p < NUM_PROFILES; p++) {
+		// only the profiles in the command line, if any
+		selected = (optind == argc);
+		for (k = optind; k < argc; k++)
+			if (strcmp(argv[k], profiles[p].name) == 0) selected = true;
+		if (!selected) continue;
+
+		// the same traffic in each run
+		srandom(1);
+		generate_traffic(&profiles[p], flows, trace, count);
+
+		if (use_rohc) {
+			compressor = create_compressor();
+			if (compressor == NULL) {
+				fprintf(stderr, "Error: failed to create the ROHC compressor\n");
+				exit(1);
+			}
+		}
+
+		delays = result.delays;
+		memset(&result, 0, sizeof(result));
+		result.delays = delays;
+		run_profile(&profiles[p], flows, trace, count, &policies, compressor, &result);
+
+		if (compressor != NULL) rohc_comp_free(compressor);
+		compressor = NULL;
+
+		qsort(result.delays, result.packets, sizeof(uint32_t), compare_delays);
+
+		printf("%s\t%lu\t%lu\t%lu\t%.1f\t%.1f\t%.2f\t%llu\t%llu\t%.3f\t%u\t%u\t%u\t%u\n", profiles[p].name,
+			result.packets, result.dropped, result.bundles,
+			result.bundles ? (double)result.packets / result.bundles : 0.0,
+			(double)result.elapsed_ns / count, count * 1000.0 / result.elapsed_ns,
+			(unsigned long long)result.native_bytes, (unsigned long long)result.wire_bytes,
+			result.native_bytes ? (double)result.wire_bytes / result.native_bytes : 0.0,
+			percentile(result.delays, result.packets, 50), percentile(result.delays, result.packets, 90),
+			percentile(result.delays, result.packets, 99), percentile(result.delays, result.packets, 100));
+	}
+
+	free(flows);
+	free(trace);
+	free(result.delays);
+	return 0;
+}
@@ -0,0 +1,333 @@
+/**************************************************************************
+ * simplemux_packet_ring.c                                                *
+ *                                                                        *
+ * Native packets read from and injected into a network interface with   *
+ * the PACKET_MMAP rings (TPACKET_V3) of a packet socket.                 *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#include "simplemux_packet_ring.h"
+#include "simplemux_checksum.h"
+
+#ifndef PACKET_IGNORE_OUTGOING
+#define PACKET_IGNORE_OUTGOING 23			// linux/if_packet.h of kernels older than 4.20
+#endif
+
+#define RX_RING_SIZE ((size_t)PACKET_RING_BLOCK_SIZE * PACKET_RING_RX_BLOCKS)
+#define TX_RING_SIZE ((size_t)PACKET_RING_BLOCK_SIZE * PACKET_RING_TX_BLOCKS)
+#define TX_FRAMES (TX_RING_SIZE / PACKET_RING_TX_FRAME)
+#define TX_DATA_OFFSET TPACKET_ALIGN(sizeof(struct tpacket3_hdr))		// the frame goes after its header (no sockaddr_ll in TX)
+#define FILTER_ACCEPT 0xFFFFFFFF			// the whole packet is taken
+
+#define RX_BLOCK(ring, k) ((struct tpacket_block_desc *)((ring)->map + (size_t)(k) * PACKET_RING_BLOCK_SIZE))
+#define TX_FRAME(ring, k) ((struct tpacket3_hdr *)((ring)->tx + (size_t)(k) * PACKET_RING_TX_FRAME))
+
+
+/**************************************************************************
+ *                              the socket                                *
+ **************************************************************************/
+
+// open a packet socket on the interface, with its RX and TX rings. Nothing is taken until the filter is set
+// (packet_ring_filter). It returns -1 if the socket or the rings cannot be created (e.g. without CAP_NET_RAW)
+int packet_ring_open(struct packet_ring *ring, const char *if_name, const unsigned char next_hop[ETH_ALEN])
+{
+	struct sock_filter drop_all = BPF_STMT(BPF_RET | BPF_K, 0);
+	struct sock_fprog program = { 1, &drop_all };
+	struct tpacket_req3 request;
+	struct sockaddr_ll address;
+	struct ifreq ifr;
+	int version = TPACKET_V3;
+	int on = 1;
+
+	memset(ring, 0, sizeof(*ring));
+	memcpy(ring->next_hop, next_hop, ETH_ALEN);
+
+	if ((ring->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL))) < 0) {
+		perror("socket(AF_PACKET)");
+		return -1;
+	}
+
+	// the index and the MAC address of the interface
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, if_name, IFNAMSIZ - 1);
+	if (ioctl(ring->fd, SIOCGIFINDEX, &ifr) < 0) {
+		perror("ioctl(SIOCGIFINDEX)");
+		goto error;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sll_family = AF_PACKET;
+	address.sll_protocol = htons(ETH_P_ALL);
+	address.sll_ifindex = ifr.ifr_ifindex;
+
+	if (ioctl(ring->fd, SIOCGIFHWADDR, &ifr) < 0) {
+		perror("ioctl(SIOCGIFHWADDR)");
+		goto error;
+	}
+	memcpy(ring->local_mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+	if (setsockopt(ring->fd, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) < 0) {
+		perror("setsockopt(SO_ATTACH_FILTER)");
+		goto error;
+	}
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+		perror("setsockopt(PACKET_VERSION)");
+		goto error;
+	}
+	// the frames injected are not read back. Older kernels do not have it: they are discarded when read
+	setsockopt(ring->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &on, sizeof(on));
+
+	// the RX ring: the packets are packed in blocks, and a block is given to the reader when it is full,
+	// or after PACKET_RING_RETIRE_TIME
+	memset(&request, 0, sizeof(request));
+	request.tp_block_size = PACKET_RING_BLOCK_SIZE;
+	request.tp_block_nr = PACKET_RING_RX_BLOCKS;
+	request.tp_frame_size = PACKET_RING_RX_FRAME;
+	request.tp_frame_nr = RX_RING_SIZE / PACKET_RING_RX_FRAME;
+	request.tp_retire_blk_tov = PACKET_RING_RETIRE_TIME;
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &request, sizeof(request)) < 0) {
+		perror("setsockopt(PACKET_RX_RING)");
+		goto error;
+	}
+
+	// the TX ring: a frame per packet
+	memset(&request, 0, sizeof(request));
+	request.tp_block_size = PACKET_RING_BLOCK_SIZE;
+	request.tp_block_nr = PACKET_RING_TX_BLOCKS;
+	request.tp_frame_size = PACKET_RING_TX_FRAME;
+	request.tp_frame_nr = TX_FRAMES;
+	if (setsockopt(ring->fd, SOL_PACKET, PACKET_TX_RING, &request, sizeof(request)) < 0) {
+		perror("setsockopt(PACKET_TX_RING)");
+		goto error;
+	}
+
+	ring->map_size = RX_RING_SIZE + TX_RING_SIZE;
+	ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+	if (ring->map == MAP_FAILED) {
+		perror("mmap() packet ring");
+		ring->map = NULL;
+		goto error;
+	}
+	ring->tx = ring->map + RX_RING_SIZE;
+
+	if (bind(ring->fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+		perror("bind() packet ring");
+		goto error;
+	}
+	return 0;
+
+error:
+	packet_ring_close(ring);
+	return -1;
+}
+
+// the classifier: only the IPv4 packets to one of the prefixes (in host byte order) are taken, and the IPv6 ones
+// if 'ipv6' is set. With a prefix of length 0 (or too many of them) every IPv4 packet is taken
+int packet_ring_filter(struct packet_ring *ring, const uint32_t *prefixes, const int *lengths, int num_prefixes, bool ipv6)
+{
+	struct sock_filter code[6 + 4 * PACKET_RING_MAX_PREFIXES];
+	struct sock_fprog program;
+	bool all_ipv4 = (num_prefixes > PACKET_RING_MAX_PREFIXES);
+	uint32_t mask;
+	int n = 0, k;
+
+	for (k = 0; k < num_prefixes; k++) {
+		if (lengths[k] == 0) all_ipv4 = true;
+	}
+
+	// the EtherType. The jumps only skip the next instruction, so they never go beyond 255
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12);
+	code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IPV6, 0, 1);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, ipv6 ? FILTER_ACCEPT : 0);
+	code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 1, 0);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+	// the destination address of IPv4 against each prefix
+	for (k = 0; !all_ipv4 && (k < num_prefixes); k++) {
+		mask = 0xFFFFFFFF << (32 - lengths[k]);
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, ETH_HLEN + 16);
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_AND | BPF_K, mask);
+		code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, prefixes[k] & mask, 0, 1);
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, FILTER_ACCEPT);
+	}
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, all_ipv4 ? FILTER_ACCEPT : 0);
+
+	program.len = n;
+	program.filter = code;
+	if (setsockopt(ring->fd, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) < 0) {
+		perror("setsockopt(SO_ATTACH_FILTER)");
+		return -1;
+	}
+	return 0;
+}
+
+void packet_ring_close(struct packet_ring *ring)
+{
+	if (ring->map != NULL) munmap(ring->map, ring->map_size);
+	if (ring->fd >= 0) close(ring->fd);
+	ring->map = NULL;
+	ring->fd = -1;
+}
+
+
+/**************************************************************************
+ *                              RX ring                                   *
+ **************************************************************************/
+
+// the TCP or UDP checksum of a packet taken before the NIC computes it (TP_STATUS_CSUMNOTREADY: a packet
+// of a local socket, or received through a veth). It is computed here, as the NIC would do
+static void complete_checksum(unsigned char *packet, int length)
+{
+	bool ipv6 = ((packet[0] >> 4) == 6);
+	int header, protocol, offset, l4_length;
+	uint16_t checksum;
+
+	if (ipv6) {
+		if (length < 40) return;
+		header = 40;
+		protocol = packet[6];
+	} else {
+		if (length < 20) return;
+		header = (packet[0] & 0x0F) * 4;
+		protocol = packet[9];
+		if (((packet[6] & 0x3F) | packet[7]) != 0) return;		// a fragment
+	}
+	if (protocol == IPPROTO_TCP) offset = header + 16;
+	else if (protocol == IPPROTO_UDP) offset = header + 6;
+	else return;
+	l4_length = length - header;
+	if (offset + 2 > length) return;
+
+	// the pseudo-header, and the segment with its checksum set to 0
+	packet[offset] = 0;
+	packet[offset + 1] = 0;
+	checksum = ~checksum_fold(checksum_sum16(packet + header, l4_length, checksum_pseudo_header(packet, ipv6, protocol, l4_length)));
+	if ((protocol == IPPROTO_UDP) && (checksum == 0)) checksum = 0xFFFF;
+
+	packet[offset] = checksum >> 8;
+	packet[offset + 1] = checksum & 0xFF;
+}
+
+// copy the next IP packet of the RX ring into the buffer. It returns its size, or -1 if the ring is empty
+// a block is given back to the kernel when all its packets have been read, in the next call
+int packet_ring_read(struct packet_ring *ring, unsigned char *buffer, int size)
+{
+	struct tpacket_block_desc *block;
+	struct tpacket3_hdr *header;
+	struct sockaddr_ll *address;
+	unsigned char *frame;
+	int length, ip_length;
+
+	while (1) {
+		if (ring->rx_left == 0) {
+			block = RX_BLOCK(ring, ring->rx_block);
+
+			if (ring->rx_packet != NULL) {
+				// the packets of the block have been read
+				__sync_synchronize();
+				block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+				ring->rx_packet = NULL;
+				ring->rx_block = (ring->rx_block + 1) % PACKET_RING_RX_BLOCKS;
+				block = RX_BLOCK(ring, ring->rx_block);
+			}
+
+			if ((block->hdr.bh1.block_status & TP_STATUS_USER) == 0) return -1;
+			__sync_synchronize();
+			ring->rx_left = block->hdr.bh1.num_pkts;
+			ring->rx_packet = (unsigned char *)block + block->hdr.bh1.offset_to_first_pkt;
+			continue;
+		}
+
+		header = (struct tpacket3_hdr *)ring->rx_packet;
+		ring->rx_left--;
+		if (ring->rx_left > 0) ring->rx_packet = ring->rx_packet + header->tp_next_offset;
+
+		// only the IP packets sent to this host. The ones injected by the TX ring are also seen as outgoing
+		address = (struct sockaddr_ll *)((unsigned char *)header + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+		if (address->sll_pkttype != PACKET_HOST) continue;
+		if (header->tp_snaplen <= ETH_HLEN) continue;
+
+		frame = (unsigned char *)header + header->tp_mac;
+		length = header->tp_snaplen - ETH_HLEN;
+		if ((frame[12] << 8 | frame[13]) == ETH_P_IP) {
+			ip_length = (length >= 4) ? (frame[ETH_HLEN + 2] << 8 | frame[ETH_HLEN + 3]) : 0;
+		} else if ((frame[12] << 8 | frame[13]) == ETH_P_IPV6) {
+			ip_length = (length >= 6) ? 40 + (frame[ETH_HLEN + 4] << 8 | frame[ETH_HLEN + 5]) : 0;
+		} else {
+			continue;
+		}
+
+		// the short frames may have been padded up to the minimum size of Ethernet
+		if ((ip_length > 0) && (ip_length < length)) length = ip_length;
+		if (length > size) continue;
+
+		memcpy(buffer, frame + ETH_HLEN, length);
+		if (header->tp_status & TP_STATUS_CSUMNOTREADY) complete_checksum(buffer, length);
+		return length;
+	}
+}
+
+
+/**************************************************************************
+ *                              TX ring                                   *
+ **************************************************************************/
+
+// put an IP packet in the next frame of the TX ring, with an Ethernet header toward the next hop
+// the frames are sent by packet_ring_flush. It returns the number of system calls made (the frames
+// are sent if the ring is full). If the kernel has not sent the frame yet, the packet is dropped
+int packet_ring_write(struct packet_ring *ring, const unsigned char *packet, int size)
+{
+	struct tpacket3_hdr *header = TX_FRAME(ring, ring->tx_frame);
+	unsigned char *frame = (unsigned char *)header + TX_DATA_OFFSET;
+	uint16_t ethertype;
+	int calls = 0;
+
+	if ((size <= 0) || (TX_DATA_OFFSET + ETH_HLEN + size > PACKET_RING_TX_FRAME)) return 0;
+
+	if ((header->tp_status != TP_STATUS_AVAILABLE) && !(header->tp_status & TP_STATUS_WRONG_FORMAT)) {
+		calls = packet_ring_flush(ring);
+		__sync_synchronize();
+		if ((header->tp_status != TP_STATUS_AVAILABLE) && !(header->tp_status & TP_STATUS_WRONG_FORMAT)) {
+			fprintf(stderr, "Packet ring: the TX ring is full. Packet dropped\n");
+			return calls;
+		}
+	}
+
+	ethertype = htons(((packet[0] >> 4) == 6) ? ETH_P_IPV6 : ETH_P_IP);
+	memcpy(frame, ring->next_hop, ETH_ALEN);
+	memcpy(frame + ETH_ALEN, ring->local_mac, ETH_ALEN);
+	memcpy(frame + 2 * ETH_ALEN, &ethertype, sizeof(ethertype));
+	memcpy(frame + ETH_HLEN, packet, size);
+
+	header->tp_len = ETH_HLEN + size;
+	header->tp_next_offset = 0;
+	__sync_synchronize();
+	header->tp_status = TP_STATUS_SEND_REQUEST;
+
+	ring->tx_frame = (ring->tx_frame + 1) % TX_FRAMES;
+	ring->tx_pending++;
+	return calls;
+}
+
+// send the frames filled in the TX ring, in a single system call. It returns the number of system calls
+int packet_ring_flush(struct packet_ring *ring)
+{
+	if (ring->tx_pending == 0) return 0;
+
+	if ((send(ring->fd, NULL, 0, MSG_DONTWAIT) < 0) && (errno != EAGAIN) && (errno != ENOBUFS)) perror("send() packet ring");
+	ring->tx_pending = 0;
+	return 1;
+}
@@ -0,0 +1,57 @@
+/**************************************************************************
+ * simplemux_packet_ring.h                                                *
+ *                                                                        *
+ * Native packets taken from a network interface instead of tun (option   *
+ * -I), for a dedicated mux gateway: a packet socket with PACKET_MMAP     *
+ * rings (TPACKET_V3). The packets to multiplex are read from the RX      *
+ * ring, and the demuxed ones are injected through the TX ring of the     *
+ * same socket, sent to a fixed MAC address (e.g. the next router).       *
+ * A classic BPF filter built from the prefixes of the peers classifies   *
+ * the packets in the kernel, so only the flows to multiplex are copied   *
+ * to the RX ring. The kernel also gets the captured packets, so the      *
+ * gateway must not forward them (e.g. net.ipv4.ip_forward=0).            *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#ifndef SIMPLEMUX_PACKET_RING_H
+#define SIMPLEMUX_PACKET_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <net/ethernet.h>
+
+#define PACKET_RING_BLOCK_SIZE (1 << 17)	// (bytes) size of each block of the rings
+#define PACKET_RING_RX_BLOCKS 32			// blocks of the RX ring
+#define PACKET_RING_TX_BLOCKS 8				// blocks of the TX ring
+#define PACKET_RING_RX_FRAME 2048			// nominal frame of the RX ring (the packets of a block are packed one after another)
+#define PACKET_RING_TX_FRAME 4096			// frame of the TX ring: a frame header and an Ethernet frame
+#define PACKET_RING_RETIRE_TIME 1			// (ms) a block that is not full is given to the reader after this
+#define PACKET_RING_MAX_PREFIXES 1000		// prefixes in the filter. With more, every IPv4 packet is taken
+
+struct packet_ring {
+	int fd;
+	unsigned char *map;						// RX ring, and then TX ring
+	size_t map_size;
+	unsigned char *tx;						// beginning of the TX ring inside 'map'
+	unsigned char local_mac[ETH_ALEN];		// source of the injected frames
+	unsigned char next_hop[ETH_ALEN];		// destination of the injected frames
+
+	unsigned int rx_block;					// block being read
+	unsigned int rx_left;					// packets of the block not read yet
+	unsigned char *rx_packet;				// next packet of the block. NULL: no block is held
+	unsigned int tx_frame;					// next frame of the TX ring to be filled
+	unsigned int tx_pending;				// frames filled since the last send()
+};
+
+int packet_ring_open(struct packet_ring *ring, const char *if_name, const unsigned char next_hop[ETH_ALEN]);
+int packet_ring_filter(struct packet_ring *ring, const uint32_t *prefixes, const int *lengths, int num_prefixes, bool ipv6);
+void packet_ring_close(struct packet_ring *ring);
+
+int packet_ring_read(struct packet_ring *ring, unsigned char *buffer, int size);
+int packet_ring_write(struct packet_ring *ring, const unsigned char *packet, int size);
+int packet_ring_flush(struct packet_ring *ring);
+
+#endif
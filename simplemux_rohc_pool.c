@@ -0,0 +1,282 @@
+/**************************************************************************
+ * simplemux_rohc_pool.c                                                  *
+ *                                                                        *
+ * Worker threads for ROHC compression. Each worker has a ring of jobs    *
+ * with a single producer (the data plane thread) and a single consumer   *
+ * (the worker). The compression with segmentation is also used by the    *
+ * data plane thread when there are no workers.                           *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "simplemux_rohc_pool.h"
+
+#define ROHC_POOL_MASK (ROHC_POOL_JOBS - 1)
+
+struct rohc_worker {
+	struct rohc_pool *pool;
+	int index;
+	pthread_t thread;
+	int wake_fd;									// eventfd written by the data plane when the worker is sleeping
+	atomic_bool sleeping;							// the worker is waiting for jobs
+	atomic_uint tail;								// next free job. Only written by the data plane thread
+	atomic_uint done;								// next job to be compressed. Only written by the worker
+	unsigned int head;								// oldest job not released yet. Only used by the data plane thread
+	struct rohc_job jobs[ROHC_POOL_JOBS];
+};
+
+struct rohc_pool {
+	int num_workers;
+	rohc_job_hook prepare;
+	int done_fd;									// eventfd written by the workers when they have compressed jobs
+	atomic_bool signaled;							// 'done_fd' has been written since the last rohc_pool_ack()
+	atomic_bool stop;								// set to stop the workers
+	int next_worker;								// rohc_pool_collect() starts looking in this worker
+	struct rohc_worker *workers[ROHC_POOL_MAX_WORKERS];
+};
+
+
+/**************************************************************************
+ *                   compression with segmentation                        *
+ **************************************************************************/
+
+// compress a packet into 'output'. If the ROHC packet is longer than 'max_size', the compressor (with its MRRU set)
+// splits it into segments of at most 'max_size' bytes, stored one after another
+// it returns ROHC_STATUS_OK if all the segments have been written
+rohc_status_t rohc_compress_segmented(struct rohc_comp *compressor, unsigned char *packet, uint16_t size,
+	unsigned char *output, int output_size, int max_size, struct rohc_segments *segments)
+{
+	struct rohc_buf ip_packet = rohc_buf_init_empty(packet, size);
+	struct rohc_buf rohc_packet = rohc_buf_init_empty(output, (max_size < output_size) ? max_size : output_size);
+	rohc_status_t status;
+	int used = 0;
+
+	ip_packet.len = size;
+	segments->num_segments = 0;
+
+	status = rohc_compress4(compressor, ip_packet, &rohc_packet);
+	if (status == ROHC_STATUS_OK) {
+		segments->size[0] = rohc_packet.len;
+		segments->num_segments = 1;
+	}
+	if (status != ROHC_STATUS_SEGMENT) return status;
+
+	// the ROHC packet is kept by the compressor, and each call gives the next segment. The last one returns ROHC_STATUS_OK
+	do {
+		if ((segments->num_segments == ROHC_MAX_SEGMENTS) || (used >= output_size)) return ROHC_STATUS_OUTPUT_TOO_SMALL;
+
+		struct rohc_buf segment = rohc_buf_init_empty(output + used, (max_size < output_size - used) ? max_size : output_size - used);
+		status = rohc_comp_get_segment2(compressor, &segment);
+		if ((status != ROHC_STATUS_OK) && (status != ROHC_STATUS_SEGMENT)) return status;
+
+		segments->size[segments->num_segments] = segment.len;
+		segments->num_segments++;
+		used = used + segment.len;
+	} while (status == ROHC_STATUS_SEGMENT);
+
+	return ROHC_STATUS_OK;
+}
+
+
+/**************************************************************************
+ *                            worker thread                               *
+ **************************************************************************/
+
+// the packet is compressed from the job, and the ROHC packet (or its segments) is written in the job
+static void compress_job(struct rohc_pool *pool, struct rohc_job *job)
+{
+	int k;
+
+	if (pool->prepare != NULL) pool->prepare(job);
+	job->status = rohc_compress_segmented(job->compressor, job->packet, job->size, job->rohc_packet, ROHC_SEGMENTS_BUFSIZE, job->max_rohc_size, &job->segments);
+
+	job->rohc_size = 0;
+	for (k = 0; k < job->segments.num_segments; k++) job->rohc_size = job->rohc_size + job->segments.size[k];
+}
+
+static void *rohc_worker_thread(void *arg)
+{
+	struct rohc_worker *worker = (struct rohc_worker *)arg;
+	struct rohc_pool *pool = worker->pool;
+	const uint64_t one = 1;
+	unsigned int done = 0;
+	uint64_t value;
+
+	while (!atomic_load(&pool->stop)) {
+		if (done == atomic_load_explicit(&worker->tail, memory_order_acquire)) {
+			// no jobs: sleep. 'sleeping' is set before looking again, so a job submitted meanwhile writes 'wake_fd'
+			atomic_store(&worker->sleeping, true);
+			if ((done == atomic_load(&worker->tail)) && !atomic_load(&pool->stop)) {
+				if ((read(worker->wake_fd, &value, sizeof(value)) < 0) && (errno != EINTR)) perror("read() ROHC worker");
+			}
+			atomic_store(&worker->sleeping, false);
+			continue;
+		}
+
+		compress_job(pool, &worker->jobs[done & ROHC_POOL_MASK]);
+		done++;
+		atomic_store_explicit(&worker->done, done, memory_order_release);
+
+		// a single write until the data plane thread takes the jobs
+		if (!atomic_exchange(&pool->signaled, true)) {
+			if (write(pool->done_fd, &one, sizeof(one)) < 0) perror("write() ROHC pool");
+		}
+	}
+	return NULL;
+}
+
+
+/**************************************************************************
+ *                    create and destroy the pool                         *
+ **************************************************************************/
+
+// start the workers. It returns NULL if there is an error
+struct rohc_pool *rohc_pool_create(int num_workers, rohc_job_hook prepare)
+{
+	struct rohc_pool *pool;
+	struct rohc_worker *worker;
+	int k;
+
+	if ((num_workers < 1) || (num_workers > ROHC_POOL_MAX_WORKERS)) return NULL;
+
+	pool = calloc(1, sizeof(struct rohc_pool));
+	if (pool == NULL) return NULL;
+
+	pool->prepare = prepare;
+	atomic_init(&pool->signaled, false);
+	atomic_init(&pool->stop, false);
+
+	pool->done_fd = eventfd(0, EFD_NONBLOCK);
+	if (pool->done_fd < 0) {
+		perror("eventfd() ROHC pool");
+		free(pool);
+		return NULL;
+	}
+
+	for (k = 0; k < num_workers; k++) {
+		worker = calloc(1, sizeof(struct rohc_worker));
+		if (worker == NULL) break;
+
+		worker->pool = pool;
+		worker->index = k;
+		atomic_init(&worker->sleeping, false);
+		atomic_init(&worker->tail, 0);
+		atomic_init(&worker->done, 0);
+
+		worker->wake_fd = eventfd(0, 0);
+		if (worker->wake_fd < 0) {
+			free(worker);
+			break;
+		}
+		if (pthread_create(&worker->thread, NULL, rohc_worker_thread, worker) != 0) {
+			close(worker->wake_fd);
+			free(worker);
+			break;
+		}
+		pool->workers[k] = worker;
+		pool->num_workers++;
+	}
+
+	if (pool->num_workers < num_workers) {
+		rohc_pool_destroy(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+// stop the workers. The jobs not collected are lost
+void rohc_pool_destroy(struct rohc_pool *pool)
+{
+	const uint64_t one = 1;
+	int k;
+
+	if (pool == NULL) return;
+
+	atomic_store(&pool->stop, true);
+	for (k = 0; k < pool->num_workers; k++) {
+		if (write(pool->workers[k]->wake_fd, &one, sizeof(one)) < 0) perror("write() ROHC worker");
+		pthread_join(pool->workers[k]->thread, NULL);
+		close(pool->workers[k]->wake_fd);
+		free(pool->workers[k]);
+	}
+	close(pool->done_fd);
+	free(pool);
+}
+
+
+/**************************************************************************
+ *            data plane thread: submit and collect the jobs              *
+ **************************************************************************/
+
+// the descriptor that can be read when there are compressed jobs
+int rohc_pool_fd(struct rohc_pool *pool)
+{
+	return pool->done_fd;
+}
+
+// called when 'done_fd' can be read, before collecting the jobs
+void rohc_pool_ack(struct rohc_pool *pool)
+{
+	uint64_t value;
+
+	atomic_store(&pool->signaled, false);
+	if ((read(pool->done_fd, &value, sizeof(value)) < 0) && (errno != EAGAIN)) perror("read() ROHC pool");
+}
+
+// a free job of the worker, to be filled in and submitted. It returns NULL if the ring of the worker is full
+struct rohc_job *rohc_pool_job(struct rohc_pool *pool, int worker)
+{
+	struct rohc_worker *w = pool->workers[worker % pool->num_workers];
+	unsigned int tail = atomic_load_explicit(&w->tail, memory_order_relaxed);
+	struct rohc_job *job;
+
+	if (tail - w->head >= ROHC_POOL_JOBS) return NULL;
+
+	job = &w->jobs[tail & ROHC_POOL_MASK];
+	job->worker = w->index;
+	return job;
+}
+
+// give the job returned by rohc_pool_job() to its worker
+void rohc_pool_submit(struct rohc_pool *pool, struct rohc_job *job)
+{
+	struct rohc_worker *w = pool->workers[job->worker];
+	const uint64_t one = 1;
+
+	atomic_store(&w->tail, atomic_load_explicit(&w->tail, memory_order_relaxed) + 1);
+	if (atomic_exchange(&w->sleeping, false)) {
+		if (write(w->wake_fd, &one, sizeof(one)) < 0) perror("write() ROHC worker");
+	}
+}
+
+// the oldest compressed job of a worker (each call starts with the next worker). It returns NULL if there is none
+// the job has to be released before collecting another one
+struct rohc_job *rohc_pool_collect(struct rohc_pool *pool)
+{
+	struct rohc_worker *w;
+	int k;
+
+	for (k = 0; k < pool->num_workers; k++) {
+		w = pool->workers[(pool->next_worker + k) % pool->num_workers];
+		if (w->head != atomic_load_explicit(&w->done, memory_order_acquire)) {
+			pool->next_worker = (w->index + 1) % pool->num_workers;
+			return &w->jobs[w->head & ROHC_POOL_MASK];
+		}
+	}
+	return NULL;
+}
+
+// the job can be reused by its worker
+void rohc_pool_release(struct rohc_pool *pool, struct rohc_job *job)
+{
+	pool->workers[job->worker]->head++;
+}
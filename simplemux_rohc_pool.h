@@ -0,0 +1,71 @@
+/**************************************************************************
+ * simplemux_rohc_pool.h                                                  *
+ *                                                                        *
+ * Worker threads for ROHC compression (option -W). Each compressor (the  *
+ * one of a peer) belongs to a single worker, so the packets of each ROHC *
+ * context are compressed in order. The data plane thread puts the        *
+ * packets in the lock-free job ring of the worker, and takes them back   *
+ * compressed, in the same order, to store them in their mux queue        *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#ifndef SIMPLEMUX_ROHC_POOL_H
+#define SIMPLEMUX_ROHC_POOL_H
+
+#include <stdint.h>
+#include <rohc/rohc.h>
+#include <rohc/rohc_comp.h>
+
+#define ROHC_POOL_MAX_WORKERS 16
+#define ROHC_POOL_JOBS 256					// jobs in the ring of each worker (power of 2)
+#define ROHC_POOL_BUFSIZE 2304				// the same as BUFSIZE in simplemux.c
+#define ROHC_MAX_SEGMENTS 64				// maximum number of segments of a ROHC packet
+#define ROHC_MRRU (2 * ROHC_POOL_BUFSIZE)	// the largest ROHC packet that can be segmented (Maximum Reconstructed Reception Unit)
+#define ROHC_SEGMENTS_BUFSIZE (ROHC_MRRU + 4 * ROHC_MAX_SEGMENTS)	// the segments, with their headers (type and CID)
+
+// the segments of a ROHC packet, stored one after another. A packet that is not segmented has one
+struct rohc_segments {
+	int num_segments;
+	uint16_t size[ROHC_MAX_SEGMENTS];
+};
+
+// a packet to be compressed by a worker
+struct rohc_job {
+	// filled in by the data plane thread
+	struct rohc_comp *compressor;
+	void *owner;							// the mux queue where the packet will be stored
+	unsigned long counter;					// number of the packet read from tun (for the log)
+	uint16_t size;							// size of the native packet
+	uint16_t max_rohc_size;					// a longer ROHC packet is split into segments of this size
+	unsigned char packet[ROHC_POOL_BUFSIZE];
+
+	// filled in by the worker
+	rohc_status_t status;
+	uint16_t rohc_size;						// size of the ROHC packet (all its segments), if status is ROHC_STATUS_OK
+	struct rohc_segments segments;
+	unsigned char rohc_packet[ROHC_SEGMENTS_BUFSIZE];
+
+	int worker;								// the worker that owns the job
+};
+
+// called by the worker before compressing each packet (e.g. for delivering the ROHC feedback to the compressor)
+typedef void (*rohc_job_hook)(struct rohc_job *job);
+
+struct rohc_pool;
+
+rohc_status_t rohc_compress_segmented(struct rohc_comp *compressor, unsigned char *packet, uint16_t size,
+	unsigned char *output, int output_size, int max_size, struct rohc_segments *segments);
+
+struct rohc_pool *rohc_pool_create(int num_workers, rohc_job_hook prepare);
+void rohc_pool_destroy(struct rohc_pool *pool);
+int rohc_pool_fd(struct rohc_pool *pool);
+void rohc_pool_ack(struct rohc_pool *pool);
+
+struct rohc_job *rohc_pool_job(struct rohc_pool *pool, int worker);
+void rohc_pool_submit(struct rohc_pool *pool, struct rohc_job *job);
+struct rohc_job *rohc_pool_collect(struct rohc_pool *pool);
+void rohc_pool_release(struct rohc_pool *pool, struct rohc_job *job);
+
+#endif
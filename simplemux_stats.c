@@ -0,0 +1,271 @@
+/**************************************************************************
+ * simplemux_stats.c                                                      *
+ *                                                                        *
+ * Live statistics of simplemux: the Prometheus text format, and the      *
+ * thread that serves it on a Unix socket.                                *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "simplemux_stats.h"
+
+struct stats_server {
+	int fd;											// listening socket
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	struct simplemux_stats *stats;
+	pthread_t thread;
+	atomic_bool stop;								// set to stop the server thread
+};
+
+static const char *trigger_names[STATS_NUM_TRIGGERS] = { "MTU", "numpacket_limit", "size_limit", "timeout", "period" };
+static const double delay_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+
+/**************************************************************************
+ *                      Prometheus text format                            *
+ **************************************************************************/
+
+// the highest value of a bin of the HDR histogram
+static uint64_t hdr_bin_max(int bin)
+{
+	int bucket = (bin < (2 << HDR_SUB_BUCKET_BITS)) ? 0 : (bin >> HDR_SUB_BUCKET_BITS) - 1;
+	uint64_t sub_bucket = bin - (bucket << HDR_SUB_BUCKET_BITS);
+
+	return ((sub_bucket + 1) << bucket) - 1;
+}
+
+static unsigned long load(atomic_ulong *counter)
+{
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// write all the statistics. It returns -1 if there is an error
+// the counters are read one by one while the data plane updates them, so they may differ slightly
+int stats_write(int fd, struct simplemux_stats *stats)
+{
+	FILE *out;
+	unsigned long delay[HDR_NUM_BINS];
+	unsigned long count, total, native_bytes, muxed_bytes, rohc_input, rohc_output;
+	int k, q;
+
+	out = fdopen(dup(fd), "w");
+	if (out == NULL) return -1;
+
+	fprintf(out, "# HELP simplemux_tun2net_total Packets read from the tun interface\n");
+	fprintf(out, "# TYPE simplemux_tun2net_total counter\n");
+	fprintf(out, "simplemux_tun2net_total %lu\n", load(&stats->tun2net));
+	fprintf(out, "# HELP simplemux_net2tun_total Muxed packets read from the network\n");
+	fprintf(out, "# TYPE simplemux_net2tun_total counter\n");
+	fprintf(out, "simplemux_net2tun_total %lu\n", load(&stats->net2tun));
+	fprintf(out, "# HELP simplemux_feedback_pkts_total ROHC feedback packets received\n");
+	fprintf(out, "# TYPE simplemux_feedback_pkts_total counter\n");
+	fprintf(out, "simplemux_feedback_pkts_total %lu\n", load(&stats->feedback_pkts));
+	fprintf(out, "# HELP simplemux_feedback_piggybacked_total ROHC feedback packets sent inside the muxed packets\n");
+	fprintf(out, "# TYPE simplemux_feedback_piggybacked_total counter\n");
+	fprintf(out, "simplemux_feedback_piggybacked_total %lu\n", load(&stats->feedback_piggybacked));
+	fprintf(out, "# HELP simplemux_tun_written_total Demuxed packets written to the tun interface\n");
+	fprintf(out, "# TYPE simplemux_tun_written_total counter\n");
+	fprintf(out, "simplemux_tun_written_total %lu\n", load(&stats->tun_written));
+	fprintf(out, "# HELP simplemux_tun_writes_total System calls for writing the demuxed packets to the tun interface\n");
+	fprintf(out, "# TYPE simplemux_tun_writes_total counter\n");
+	fprintf(out, "simplemux_tun_writes_total %lu\n", load(&stats->tun_writes));
+
+	fprintf(out, "# HELP simplemux_bundles_total Muxed packets sent\n");
+	fprintf(out, "# TYPE simplemux_bundles_total counter\n");
+	fprintf(out, "simplemux_bundles_total %lu\n", load(&stats->bundles));
+	fprintf(out, "# HELP simplemux_bundles_by_trigger_total Muxed packets sent, by trigger (a bundle may have more than one)\n");
+	fprintf(out, "# TYPE simplemux_bundles_by_trigger_total counter\n");
+	for (k = 0; k < STATS_NUM_TRIGGERS; k++)
+		fprintf(out, "simplemux_bundles_by_trigger_total{trigger=\"%s\"} %lu\n", trigger_names[k], load(&stats->bundles_by_trigger[k]));
+
+	fprintf(out, "# HELP simplemux_packets_per_bundle Packets inside each muxed packet sent\n");
+	fprintf(out, "# TYPE simplemux_packets_per_bundle histogram\n");
+	for (k = 0, count = 0; k < STATS_BUNDLE_BUCKETS - 1; k++) {
+		count = count + load(&stats->packets_per_bundle[k]);
+		fprintf(out, "simplemux_packets_per_bundle_bucket{le=\"%i\"} %lu\n", 1 << k, count);
+	}
+	count = count + load(&stats->packets_per_bundle[STATS_BUNDLE_BUCKETS - 1]);
+	fprintf(out, "simplemux_packets_per_bundle_bucket{le=\"+Inf\"} %lu\n", count);
+	fprintf(out, "simplemux_packets_per_bundle_sum %lu\n", load(&stats->muxed_packets));
+	fprintf(out, "simplemux_packets_per_bundle_count %lu\n", count);
+
+	native_bytes = load(&stats->native_bytes);
+	muxed_bytes = load(&stats->muxed_bytes);
+	fprintf(out, "# HELP simplemux_native_bytes_total Bytes of the packets sent, if each one was tunneled alone without ROHC\n");
+	fprintf(out, "# TYPE simplemux_native_bytes_total counter\n");
+	fprintf(out, "simplemux_native_bytes_total %lu\n", native_bytes);
+	fprintf(out, "# HELP simplemux_muxed_bytes_total Bytes of the muxed packets sent, including the tunneling header\n");
+	fprintf(out, "# TYPE simplemux_muxed_bytes_total counter\n");
+	fprintf(out, "simplemux_muxed_bytes_total %lu\n", muxed_bytes);
+	fprintf(out, "# HELP simplemux_bytes_saved Bytes saved by multiplexing and ROHC\n");
+	fprintf(out, "# TYPE simplemux_bytes_saved gauge\n");
+	fprintf(out, "simplemux_bytes_saved %li\n", (long)(native_bytes - muxed_bytes));
+
+	rohc_input = load(&stats->rohc_input_bytes);
+	rohc_output = load(&stats->rohc_output_bytes);
+	fprintf(out, "# HELP simplemux_rohc_input_bytes_total Bytes of the packets compressed with ROHC\n");
+	fprintf(out, "# TYPE simplemux_rohc_input_bytes_total counter\n");
+	fprintf(out, "simplemux_rohc_input_bytes_total %lu\n", rohc_input);
+	fprintf(out, "# HELP simplemux_rohc_output_bytes_total Bytes of the ROHC packets\n");
+	fprintf(out, "# TYPE simplemux_rohc_output_bytes_total counter\n");
+	fprintf(out, "simplemux_rohc_output_bytes_total %lu\n", rohc_output);
+	fprintf(out, "# HELP simplemux_rohc_compression_ratio Bytes of the ROHC packets divided by the bytes compressed\n");
+	fprintf(out, "# TYPE simplemux_rohc_compression_ratio gauge\n");
+	fprintf(out, "simplemux_rohc_compression_ratio %.4f\n", (rohc_input > 0) ? (double)rohc_output / rohc_input : 1.0);
+	fprintf(out, "# HELP simplemux_rohc_bypassed_total Packets sent without ROHC because their flow was not compressible\n");
+	fprintf(out, "# TYPE simplemux_rohc_bypassed_total counter\n");
+	fprintf(out, "simplemux_rohc_bypassed_total %lu\n", load(&stats->rohc_bypassed));
+	fprintf(out, "# HELP simplemux_rohc_decomp_failed_total ROHC packets received that could not be decompressed\n");
+	fprintf(out, "# TYPE simplemux_rohc_decomp_failed_total counter\n");
+	fprintf(out, "simplemux_rohc_decomp_failed_total %lu\n", load(&stats->rohc_decomp_failed));
+
+	// only the bins with values are written
+	for (k = 0, total = 0; k < HDR_NUM_BINS; k++) {
+		delay[k] = load(&stats->delay[k]);
+		total = total + delay[k];
+	}
+	fprintf(out, "# HELP simplemux_mux_delay_microseconds Time from the storing of each packet until its muxed packet is sent\n");
+	fprintf(out, "# TYPE simplemux_mux_delay_microseconds histogram\n");
+	for (k = 0, count = 0; k < HDR_NUM_BINS; k++) {
+		if (delay[k] == 0) continue;
+		count = count + delay[k];
+		fprintf(out, "simplemux_mux_delay_microseconds_bucket{le=\"%lu\"} %lu\n", (unsigned long)hdr_bin_max(k), count);
+	}
+	fprintf(out, "simplemux_mux_delay_microseconds_bucket{le=\"+Inf\"} %lu\n", total);
+	fprintf(out, "simplemux_mux_delay_microseconds_sum %lu\n", load(&stats->delay_sum));
+	fprintf(out, "simplemux_mux_delay_microseconds_count %lu\n", total);
+
+	fprintf(out, "# HELP simplemux_mux_delay_quantile_microseconds Quantiles of the multiplexing delay (upper bound of the bin)\n");
+	fprintf(out, "# TYPE simplemux_mux_delay_quantile_microseconds gauge\n");
+	for (q = 0; q < (int)(sizeof(delay_quantiles) / sizeof(delay_quantiles[0])); q++) {
+		for (k = 0, count = 0; k < HDR_NUM_BINS; k++) {
+			count = count + delay[k];
+			if ((total > 0) && (count >= delay_quantiles[q] * total)) break;
+		}
+		fprintf(out, "simplemux_mux_delay_quantile_microseconds{quantile=\"%g\"} %lu\n", delay_quantiles[q],
+			(total > 0) ? (unsigned long)hdr_bin_max(k) : 0);
+	}
+
+	if (fclose(out) != 0) return -1;
+	return 0;
+}
+
+
+/**************************************************************************
+ *                           server thread                                *
+ **************************************************************************/
+
+// a client may send an HTTP request (e.g. curl --unix-socket). It is waited for a short time
+static void serve_client(int fd, struct simplemux_stats *stats)
+{
+	const char *http_header = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n";
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	char request[512];
+	ssize_t nread = 0;
+
+	if (poll(&pfd, 1, 100) > 0) nread = recv(fd, request, sizeof(request) - 1, MSG_DONTWAIT);
+
+	if ((nread >= 4) && (memcmp(request, "GET ", 4) == 0)) {
+		if (write(fd, http_header, strlen(http_header)) < 0) return;
+	}
+	stats_write(fd, stats);
+}
+
+static void *stats_server_thread(void *arg)
+{
+	struct stats_server *server = (struct stats_server *)arg;
+	struct pollfd pfd = { server->fd, POLLIN, 0 };
+	sigset_t sigpipe;
+	int client;
+
+	// a client may close the socket before reading everything: write() fails, and SIGPIPE does not stop the program
+	sigemptyset(&sigpipe);
+	sigaddset(&sigpipe, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+
+	while (!atomic_load(&server->stop)) {
+		if (poll(&pfd, 1, STATS_SERVER_POLL) <= 0) continue;
+
+		client = accept(server->fd, NULL, NULL);
+		if (client < 0) {
+			if (errno != EINTR) perror("accept() statistics socket");
+			continue;
+		}
+		serve_client(client, server->stats);
+		close(client);
+	}
+	return NULL;
+}
+
+
+/**************************************************************************
+ *                     open and close the server                          *
+ **************************************************************************/
+
+// create the Unix socket (an old socket file with the same name is removed) and start the server thread
+// it returns NULL if there is an error
+struct stats_server *stats_server_open(const char *path, struct simplemux_stats *stats)
+{
+	struct stats_server *server;
+	struct sockaddr_un address;
+
+	if (strlen(path) >= sizeof(address.sun_path)) return NULL;
+
+	server = calloc(1, sizeof(struct stats_server));
+	if (server == NULL) return NULL;
+
+	server->stats = stats;
+	strcpy(server->path, path);
+	atomic_init(&server->stop, false);
+
+	server->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server->fd < 0) {
+		perror("socket() statistics");
+		free(server);
+		return NULL;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	unlink(path);
+
+	if ((bind(server->fd, (struct sockaddr *)&address, sizeof(address)) < 0) || (listen(server->fd, 8) < 0)) {
+		perror("bind() statistics socket");
+		close(server->fd);
+		free(server);
+		return NULL;
+	}
+
+	if (pthread_create(&server->thread, NULL, stats_server_thread, server) != 0) {
+		close(server->fd);
+		unlink(path);
+		free(server);
+		return NULL;
+	}
+	return server;
+}
+
+// stop the server thread and remove the socket
+void stats_server_close(struct stats_server *server)
+{
+	if (server == NULL) return;
+
+	atomic_store(&server->stop, true);
+	pthread_join(server->thread, NULL);
+	close(server->fd);
+	unlink(server->path);
+	free(server);
+}
@@ -0,0 +1,102 @@
+/**************************************************************************
+ * simplemux_stats.h                                                      *
+ *                                                                        *
+ * Live statistics of simplemux (option -S). The data plane threads only  *
+ * increment counters with relaxed atomics, and a server thread writes    *
+ * them in the Prometheus text format to each client of a Unix socket     *
+ * (plain text, or an HTTP response if the client sends a GET request)    *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#ifndef SIMPLEMUX_STATS_H
+#define SIMPLEMUX_STATS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define STATS_NUM_TRIGGERS 5				// TRIGGER_MTU ... TRIGGER_PERIOD of simplemux_trace.h
+#define STATS_BUNDLE_BUCKETS 11				// packets per bundle: 1, 2, 4 ... 512, more
+#define STATS_SERVER_POLL 200				// (milliseconds) the server checks if it has to stop with this interval
+
+// HDR histogram of the multiplexing delay (microseconds): each power of 2 is divided into
+// 2^HDR_SUB_BUCKET_BITS bins, so the error is below 1/16. Values up to 2^HDR_MAX_BITS - 1
+#define HDR_SUB_BUCKET_BITS 4
+#define HDR_MAX_BITS 30						// about 18 minutes
+#define HDR_NUM_BINS ((HDR_MAX_BITS - HDR_SUB_BUCKET_BITS + 1) << HDR_SUB_BUCKET_BITS)
+
+struct simplemux_stats {
+	// packet counters of the data plane
+	atomic_ulong tun2net;					// packets read from tun
+	atomic_ulong net2tun;					// muxed packets read from the network
+	atomic_ulong feedback_pkts;				// ROHC feedback packets received
+	atomic_ulong feedback_piggybacked;		// ROHC feedback packets sent inside the bundles
+	atomic_ulong tun_written;				// demuxed packets written to tun
+	atomic_ulong tun_writes;				// system calls for writing them (batched, and coalesced with -G)
+
+	// bundles sent
+	atomic_ulong bundles;
+	atomic_ulong bundles_by_trigger[STATS_NUM_TRIGGERS];	// a bundle may have more than one trigger
+	atomic_ulong packets_per_bundle[STATS_BUNDLE_BUCKETS];
+	atomic_ulong muxed_packets;				// packets sent inside the bundles
+	atomic_ulong native_bytes;				// bytes of those packets if each one was tunneled alone, without ROHC
+	atomic_ulong muxed_bytes;				// bytes of the bundles, including the tunneling header
+
+	// ROHC
+	atomic_ulong rohc_input_bytes;			// bytes of the packets compressed
+	atomic_ulong rohc_output_bytes;			// bytes after compressing them
+	atomic_ulong rohc_bypassed;				// packets of the flows that were not compressed (option -R)
+	atomic_ulong rohc_decomp_failed;		// ROHC packets received that could not be decompressed (e.g. context damaged by losses)
+
+	// multiplexing delay: from the moment a packet is stored until its bundle is sent
+	atomic_ulong delay[HDR_NUM_BINS];
+	atomic_ulong delay_sum;					// microseconds
+	atomic_ulong delay_count;
+};
+
+struct stats_server;
+
+struct stats_server *stats_server_open(const char *path, struct simplemux_stats *stats);
+void stats_server_close(struct stats_server *server);
+int stats_write(int fd, struct simplemux_stats *stats);
+
+static inline void stats_add(atomic_ulong *counter, unsigned long value)
+{
+	atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+// the bin of a value in the HDR histogram. The first 2^(HDR_SUB_BUCKET_BITS + 1) bins have one value each
+static inline int hdr_bin(uint64_t value)
+{
+	int bucket;
+
+	if (value >> HDR_MAX_BITS) value = ((uint64_t)1 << HDR_MAX_BITS) - 1;
+	bucket = 63 - __builtin_clzll(value | ((1 << (HDR_SUB_BUCKET_BITS + 1)) - 1)) - HDR_SUB_BUCKET_BITS;
+	return (bucket << HDR_SUB_BUCKET_BITS) + (int)(value >> bucket);
+}
+
+// a bundle of 'num_packets' packets. 'triggers' are the TRIGGER_* of simplemux_trace.h
+static inline void stats_bundle(struct simplemux_stats *stats, int num_packets, int triggers, int native_bytes, int muxed_bytes)
+{
+	int bucket = (num_packets <= 1) ? 0 : 64 - __builtin_clzll(num_packets - 1);
+	int k;
+
+	stats_add(&stats->bundles, 1);
+	for (k = 0; k < STATS_NUM_TRIGGERS; k++)
+		if (triggers & (1 << k)) stats_add(&stats->bundles_by_trigger[k], 1);
+	stats_add(&stats->packets_per_bundle[(bucket < STATS_BUNDLE_BUCKETS) ? bucket : STATS_BUNDLE_BUCKETS - 1], 1);
+	stats_add(&stats->muxed_packets, num_packets);
+	stats_add(&stats->native_bytes, native_bytes);
+	stats_add(&stats->muxed_bytes, muxed_bytes);
+}
+
+// the multiplexing delay of a packet (microseconds)
+static inline void stats_delay(struct simplemux_stats *stats, uint64_t delay)
+{
+	stats_add(&stats->delay[hdr_bin(delay)], 1);
+	stats_add(&stats->delay_sum, delay);
+	stats_add(&stats->delay_count, 1);
+}
+
+#endif
@@ -0,0 +1,265 @@
+#!/bin/bash
+
+# simplemux_testbed.sh version 1.0
+
+# end-to-end test of simplemux in a single machine: two network namespaces connected by a veth pair,
+# with a simplemux in each one. The traffic is sent through the tun interface of the first one, and
+# received from the tun interface of the second one, checking its delivery, order, throughput and delay
+# it runs in network and transport modes, and with each ROHC mode. A delay and a loss can be added to the
+# veth pair with netem, e.g. for measuring how ROHC recovers its context after the losses
+# with -I, each simplemux takes the packets from a veth pair to a host namespace (option -I of simplemux)
+# instead of tun, and the traffic goes from the first host to the second one
+
+# it must be run as root, from the directory where simplemux has been built
+
+# usage:
+
+# $ sudo ./simplemux_testbed.sh [-M "<modes>"] [-r "<ROHC modes>"] [-c <packets>] [-s <size>] [-g <gap (us)>]
+#	[-f <trace file>] [-D <delay (ms)>] [-J <jitter (ms)>] [-L <loss (%)>] [-x "<simplemux options>"] [-I] [-k]
+
+#	-M: tunneling modes to test (default "N T")
+#	-r: ROHC modes to test (default "0 1 2")
+#	-c, -s, -g: packets sent, their size (IP) and the time between them (default 2000, 100 bytes, 1000 us)
+#	-f: replay the native packets of a Simplemux text log (see simplemux_trace2txt) instead
+#	-D, -J, -L: netem delay, jitter and loss of the veth pair, in both directions
+#	-x: more options for both simplemux, e.g. "-n 10 -P 5000"
+#	-I: packet rings on a veth pair to a host namespace instead of tun
+#	-k: keep the logs of simplemux in the directory of the results
+
+# the output has a line per test. The test fails if a packet is lost without netem losses, or if
+# packets arrive out of order without netem jitter. The exit code is the number of failed tests
+
+# the namespaces, interfaces and addresses of the test bed
+NS_A=smtb_a
+NS_B=smtb_b
+VETH_A=smtb_veth_a
+VETH_B=smtb_veth_b
+NET_A=10.253.0.1
+NET_B=10.253.0.2
+TUN=smtb_tun
+TUN_A=192.168.253.1
+TUN_B=192.168.253.2
+HOST_NS_A=smtb_ha
+HOST_NS_B=smtb_hb
+LAN_A=smtb_lan_a
+LAN_B=smtb_lan_b
+HOST_VETH=smtb_host
+GW_A=172.30.253.1
+GW_B=172.30.254.1
+HOST_A=172.30.253.2
+HOST_B=172.30.254.2
+TRAFFIC_PORT=5001
+
+MODES="N T"
+ROHC_MODES="0 1 2"
+PACKETS=2000
+SIZE=100
+GAP=1000
+TRACE_FILE=""
+DELAY=0
+JITTER=0
+LOSS=0
+EXTRA=""
+KEEP=0
+RINGS=0
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+SIMPLEMUX=$DIR/simplemux
+TRAFFIC="perl $DIR/simplemux_testbed_traffic.pl"
+
+usage() {
+	sed -n '/^# usage:/,/^# the output/p' "$0" | sed 's/^#//'
+	exit 1
+}
+
+while getopts "M:r:c:s:g:f:D:J:L:x:Ikh" option; do
+	case $option in
+		M) MODES=$OPTARG ;;
+		r) ROHC_MODES=$OPTARG ;;
+		c) PACKETS=$OPTARG ;;
+		s) SIZE=$OPTARG ;;
+		g) GAP=$OPTARG ;;
+		f) TRACE_FILE=$OPTARG ;;
+		D) DELAY=$OPTARG ;;
+		J) JITTER=$OPTARG ;;
+		L) LOSS=$OPTARG ;;
+		x) EXTRA=$OPTARG ;;
+		I) RINGS=1 ;;
+		k) KEEP=1 ;;
+		*) usage ;;
+	esac
+done
+
+if [ "$(id -u)" -ne 0 ]; then
+	echo "simplemux_testbed.sh must be run as root (it creates network namespaces)" >&2
+	exit 1
+fi
+if [ ! -x "$SIMPLEMUX" ]; then
+	echo "$SIMPLEMUX not found. Run make first" >&2
+	exit 1
+fi
+if [ -n "$TRACE_FILE" ] && [ ! -r "$TRACE_FILE" ]; then
+	echo "Can't read $TRACE_FILE" >&2
+	exit 1
+fi
+
+RESULTS=$(mktemp -d /tmp/simplemux_testbed.XXXXXX)
+
+
+# remove the namespaces, and everything inside them
+cleanup() {
+	for ns in $NS_A $NS_B $HOST_NS_A $HOST_NS_B; do
+		ip netns pids $ns 2>/dev/null | xargs -r kill 2>/dev/null
+	done
+	sleep 0.2
+	for ns in $NS_A $NS_B $HOST_NS_A $HOST_NS_B; do
+		ip netns del $ns 2>/dev/null
+	done
+}
+
+# a host namespace behind a gateway, connected by a veth pair (-I). The gateway does not forward: the packets
+# to the other side only go through simplemux
+# host_setup <host namespace> <gateway namespace> <gateway veth> <gateway address> <host address>
+host_setup() {
+	ip netns add $1 || return 1
+	ip -n $1 link set lo up
+	ip link add $3 netns $2 type veth peer name $HOST_VETH netns $1 || return 1
+	ip -n $2 addr add $4/24 dev $3
+	ip -n $1 addr add $5/24 dev $HOST_VETH
+	ip -n $2 link set $3 up
+	ip -n $1 link set $HOST_VETH up
+	ip -n $1 route add default via $4
+	ip netns exec $2 sysctl -qw net.ipv4.ip_forward=0
+	return 0
+}
+
+# create the namespaces, the veth pair (with netem) and the tun interfaces (or the hosts, with -I)
+setup() {
+	ip netns add $NS_A || return 1
+	ip netns add $NS_B || return 1
+	ip link add $VETH_A netns $NS_A type veth peer name $VETH_B netns $NS_B || return 1
+
+	ip -n $NS_A addr add $NET_A/24 dev $VETH_A
+	ip -n $NS_B addr add $NET_B/24 dev $VETH_B
+	for ns in $NS_A $NS_B; do
+		ip -n $ns link set lo up
+	done
+	ip -n $NS_A link set $VETH_A up
+	ip -n $NS_B link set $VETH_B up
+	if [ $RINGS -eq 1 ]; then
+		host_setup $HOST_NS_A $NS_A $LAN_A $GW_A $HOST_A || return 1
+		host_setup $HOST_NS_B $NS_B $LAN_B $GW_B $HOST_B || return 1
+	else
+		for ns in $NS_A $NS_B; do
+			ip -n $ns tuntap add dev $TUN mode tun || return 1
+			ip -n $ns link set $TUN up
+		done
+		ip -n $NS_A addr add $TUN_A/24 dev $TUN
+		ip -n $NS_B addr add $TUN_B/24 dev $TUN
+	fi
+
+	if [ "$DELAY" != "0" ] || [ "$JITTER" != "0" ] || [ "$LOSS" != "0" ]; then
+		NETEM="delay ${DELAY}ms"
+		[ "$JITTER" != "0" ] && NETEM="$NETEM ${JITTER}ms"
+		[ "$LOSS" != "0" ] && NETEM="$NETEM loss ${LOSS}%"
+		if ! ip netns exec $NS_A tc qdisc add dev $VETH_A root netem $NETEM || ! ip netns exec $NS_B tc qdisc add dev $VETH_B root netem $NETEM; then
+			echo "netem is not available (modprobe sch_netem)" >&2
+			return 1
+		fi
+	fi
+	return 0
+}
+
+# a counter of the statistics socket of a simplemux (empty if curl is not available)
+metric() {
+	command -v curl >/dev/null || return
+	curl -s --unix-socket "$1" http://localhost/metrics 2>/dev/null | awk -v name="$2" '$1 == name { print $2 }'
+}
+
+# a field (name=value) of a line of results
+field() {
+	echo "$1" | tr ' ' '\n' | awk -F= -v name="$2" '$1 == name { print $2 }'
+}
+
+
+trap 'cleanup; exit 1' INT TERM
+cleanup
+
+FAILED=0
+# where the traffic is sent from and to, and what simplemux takes the packets from
+if [ $RINGS -eq 1 ]; then
+	SEND_NS=$HOST_NS_A
+	RECV_NS=$HOST_NS_B
+	DESTINATION=$HOST_B
+else
+	SEND_NS=$NS_A
+	RECV_NS=$NS_B
+	DESTINATION=$TUN_B
+	NATIVE_A="-i $TUN"
+	NATIVE_B="-i $TUN"
+fi
+
+echo "# delay ${DELAY} ms, jitter ${JITTER} ms, loss ${LOSS} %. simplemux options: ${EXTRA:-none}"
+printf "mode\trohc\tsent\treceived\tlost\treordered\tduplicated\tpps\tkbps\tdelay_avg_us\tdelay_max_us\tbundles\tdecomp_failed\tresult\n"
+
+for mode in $MODES; do
+	for rohc in $ROHC_MODES; do
+		name=$RESULTS/${mode}_rohc$rohc
+
+		if ! setup; then
+			echo "Error creating the test bed" >&2
+			cleanup
+			exit 1
+		fi
+
+		if [ $RINGS -eq 1 ]; then
+			NATIVE_A="-I $LAN_A,$(ip netns exec $HOST_NS_A cat /sys/class/net/$HOST_VETH/address)"
+			NATIVE_B="-I $LAN_B,$(ip netns exec $HOST_NS_B cat /sys/class/net/$HOST_VETH/address)"
+		fi
+		ip netns exec $NS_A $SIMPLEMUX $NATIVE_A -e $VETH_A -c $NET_B -M $mode -r $rohc -S $name.a.sock $EXTRA > $name.a.log 2>&1 &
+		ip netns exec $NS_B $SIMPLEMUX $NATIVE_B -e $VETH_B -c $NET_A -M $mode -r $rohc -S $name.b.sock $EXTRA > $name.b.log 2>&1 &
+		sleep 0.5
+
+		ip netns exec $RECV_NS $TRAFFIC recv $TRAFFIC_PORT 2 > $name.recv &
+		receiver=$!
+		sleep 0.3
+
+		if [ -n "$TRACE_FILE" ]; then
+			ip netns exec $SEND_NS $TRAFFIC replay $DESTINATION $TRAFFIC_PORT "$TRACE_FILE" > $name.send
+		else
+			ip netns exec $SEND_NS $TRAFFIC send $DESTINATION $TRAFFIC_PORT $PACKETS $SIZE $GAP > $name.send
+		fi
+		wait $receiver
+
+		sent=$(field "$(cat $name.send)" sent)
+		recv=$(cat $name.recv)
+		received=$(field "$recv" received)
+		reordered=$(field "$recv" reordered)
+		bundles=$(metric $name.a.sock simplemux_bundles_total)
+		decomp_failed=$(metric $name.b.sock simplemux_rohc_decomp_failed_total)
+
+		# without losses every packet must arrive, and without jitter they must arrive in order
+		result=ok
+		if [ -z "$sent" ] || [ -z "$received" ]; then
+			result=FAILED
+		elif [ "$LOSS" = "0" ] && [ "$received" -ne "$sent" ]; then
+			result=FAILED
+		elif [ "$JITTER" = "0" ] && [ "$reordered" -ne 0 ]; then
+			result=FAILED
+		fi
+		[ "$result" = "FAILED" ] && FAILED=$((FAILED + 1))
+
+		printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n" $mode $rohc "${sent:--}" "${received:--}" \
+			$(( ${sent:-0} - ${received:-0} )) "${reordered:--}" "$(field "$recv" duplicated)" "$(field "$recv" pps)" \
+			"$(field "$recv" kbps)" "$(field "$recv" delay_avg_us)" "$(field "$recv" delay_max_us)" "${bundles:--}" "${decomp_failed:--}" $result
+
+		cleanup
+	done
+done
+
+if [ $KEEP -eq 0 ]; then
+	rm -rf "$RESULTS"
+else
+	echo "# logs in $RESULTS"
+fi
+exit $FAILED
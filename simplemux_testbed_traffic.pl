@@ -0,0 +1,144 @@
+# simplemux_testbed_traffic.pl version 1.0
+
+# traffic of the test bed (simplemux_testbed.sh): it sends UDP packets through the tunnel, and
+# receives them at the other end, checking their delivery, order, throughput and delay
+
+# each packet carries its sequence number and the moment it was sent. The two ends
+# run in the same machine, so the delay is the one-way delay
+
+# usage:
+
+# $ perl simplemux_testbed_traffic.pl send <destination IP> <port> <packets> <size> <gap (us)>
+#	sends <packets> UDP packets of <size> bytes (IP size), one every <gap> microseconds
+
+# $ perl simplemux_testbed_traffic.pl replay <destination IP> <port> <trace file>
+#	sends a packet for each native packet received in a Simplemux text log ('rec native' lines),
+#	with the same size and the same time between packets
+
+# $ perl simplemux_testbed_traffic.pl recv <port> <idle time (s)>
+#	receives until no packet arrives for <idle time> seconds, and writes a line with the results:
+#	received=.. duplicated=.. reordered=.. last_seq=.. pps=.. kbps=.. delay_avg_us=.. delay_max_us=..
+
+use strict;
+use warnings;
+use IO::Socket::INET;
+use IO::Select;
+use Time::HiRes qw(time usleep);
+
+my $IP_UDP_HEADERS = 28;		# IPv4 and UDP headers of each packet
+my $MIN_PAYLOAD = 12;			# sequence number and sending time
+
+sub usage {
+	print STDERR "usage:\n";
+	print STDERR "perl simplemux_testbed_traffic.pl send <destination IP> <port> <packets> <size> <gap (us)>\n";
+	print STDERR "perl simplemux_testbed_traffic.pl replay <destination IP> <port> <trace file>\n";
+	print STDERR "perl simplemux_testbed_traffic.pl recv <port> <idle time (s)>\n";
+	exit 1;
+}
+
+# a packet: sequence number, sending time (seconds and microseconds), and padding up to the size
+sub build_packet {
+	my ($seq, $size) = @_;
+	my $now = time();
+	my $payload = $size - $IP_UDP_HEADERS;
+
+	$payload = $MIN_PAYLOAD if ($payload < $MIN_PAYLOAD);
+	return pack("NNN", $seq, int($now), int(($now - int($now)) * 1000000)) . ("\x55" x ($payload - $MIN_PAYLOAD));
+}
+
+# send the packets at their moments. Sleeping is not precise, so each one is sent at
+# (start + its offset), and the packets that are late are sent at once
+sub send_packets {
+	my ($socket, $offsets, $sizes) = @_;
+	my $start = time();
+	my $seq;
+
+	for ($seq = 0; $seq < @$offsets; $seq++) {
+		my $wait = $start + $offsets->[$seq] / 1000000 - time();
+		usleep($wait * 1000000) if ($wait > 0.0005);
+		send($socket, build_packet($seq, $sizes->[$seq]), 0) or warn "send(): $!\n";
+	}
+	printf "sent=%i seconds=%.3f\n", scalar(@$offsets), time() - $start;
+}
+
+my $command = shift @ARGV or usage();
+
+if (($command eq 'send') || ($command eq 'replay')) {
+	my $destination = shift @ARGV or usage();
+	my $port = shift @ARGV or usage();
+	my (@offsets, @sizes);
+
+	if ($command eq 'send') {
+		usage() if (@ARGV < 3);
+		my ($packets, $size, $gap) = @ARGV;
+		for (my $i = 0; $i < $packets; $i++) {
+			push @offsets, $i * $gap;
+			push @sizes, $size;
+		}
+	} else {
+		my $infile = shift @ARGV or usage();
+		my $first;
+		open (TRACE, "<", $infile) || die "Can't open $infile $!";
+		while (my $line = <TRACE>) {
+			#x is the row of data: column 0 is the time (us), 1 and 2 the event, 3 the size
+			my @x = split(' ', $line);
+			next if ((@x < 4) || ($x[1] ne 'rec') || ($x[2] ne 'native'));
+			$first = $x[0] if (!defined($first));
+			push @offsets, $x[0] - $first;
+			push @sizes, $x[3];
+		}
+		close TRACE;
+		die "No native packets in $infile\n" if (@offsets == 0);
+	}
+
+	my $socket = IO::Socket::INET->new(PeerAddr => $destination, PeerPort => $port, Proto => 'udp')
+		|| die "Can't create the socket: $!\n";
+	send_packets($socket, \@offsets, \@sizes);
+
+} elsif ($command eq 'recv') {
+	usage() if (@ARGV < 2);
+	my ($port, $idle) = @ARGV;
+	my $socket = IO::Socket::INET->new(LocalPort => $port, Proto => 'udp')
+		|| die "Can't create the socket: $!\n";
+	my $select = IO::Select->new($socket);
+
+	my (%seen, $first_time, $last_time);
+	my ($received, $duplicated, $reordered, $bytes, $delay_sum, $delay_max) = (0, 0, 0, 0, 0, 0);
+	my $last_seq = -1;
+	my $data;
+
+	# the first packet may take a while (e.g. the tunnel is starting). Then, wait until the traffic stops
+	while ($select->can_read(defined($first_time) ? $idle : 30)) {
+		recv($socket, $data, 65535, 0);
+		next if (length($data) < $MIN_PAYLOAD);
+
+		my $now = time();
+		my ($seq, $seconds, $microseconds) = unpack("NNN", $data);
+		my $delay = ($now - $seconds - $microseconds / 1000000) * 1000000;
+
+		if ($seen{$seq}++) {
+			$duplicated++;
+			next;
+		}
+		$reordered++ if ($seq < $last_seq);
+		$last_seq = $seq if ($seq > $last_seq);
+
+		$first_time = $now if (!defined($first_time));
+		$last_time = $now;
+		$received++;
+		$bytes = $bytes + length($data) + $IP_UDP_HEADERS;
+		$delay_sum = $delay_sum + $delay;
+		$delay_max = $delay if ($delay > $delay_max);
+	}
+
+	my $seconds = (defined($first_time) && ($last_time > $first_time)) ? $last_time - $first_time : 0;
+	printf "received=%i duplicated=%i reordered=%i last_seq=%i pps=%.1f kbps=%.1f delay_avg_us=%.0f delay_max_us=%.0f\n",
+		$received, $duplicated, $reordered, $last_seq,
+		($seconds > 0) ? $received / $seconds : 0, ($seconds > 0) ? $bytes * 8 / $seconds / 1000 : 0,
+		($received > 0) ? $delay_sum / $received : 0, $delay_max;
+
+} else {
+	usage();
+}
+
+exit(0);
@@ -0,0 +1,164 @@
+/**************************************************************************
+ * simplemux_timer.c                                                      *
+ *                                                                        *
+ * Hierarchical timer wheel. A timer is stored in the lowest level where  *
+ * its slot is less than WHEEL_SLOTS slots ahead of the current one. When *
+ * the wheel advances, the slots that have been passed are emptied: the   *
+ * timers that have expired are returned, and the rest go to a lower      *
+ * level.                                                                 *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#include <string.h>
+#include "simplemux_timer.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now)
+{
+	memset(wheel, 0, sizeof(struct timer_wheel));
+	wheel->now = now;
+}
+
+void wheel_timer_init(struct wheel_timer *timer, void *data)
+{
+	memset(timer, 0, sizeof(struct wheel_timer));
+	timer->data = data;
+}
+
+// put the timer in its slot, according to the current time of the wheel
+static void wheel_insert(struct timer_wheel *wheel, struct wheel_timer *timer)
+{
+	uint64_t expires = (timer->expires < wheel->now) ? wheel->now : timer->expires;
+	uint64_t block;
+	int level;
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+		if ((expires >> (WHEEL_BITS * level)) - (wheel->now >> (WHEEL_BITS * level)) < WHEEL_SLOTS) break;
+	}
+
+	block = expires >> (WHEEL_BITS * level);
+	if (block - (wheel->now >> (WHEEL_BITS * level)) >= WHEEL_SLOTS) {
+		// too far: it is put in the last slot of the top level, and it will be moved when that slot is reached
+		block = (wheel->now >> (WHEEL_BITS * level)) + WHEEL_SLOTS - 1;
+	}
+
+	timer->level = level;
+	timer->slot = block & WHEEL_MASK;
+	timer->next = wheel->slots[level][timer->slot];
+	if (timer->next != NULL) timer->next->pprev = &timer->next;
+	timer->pprev = &wheel->slots[level][timer->slot];
+	wheel->slots[level][timer->slot] = timer;
+	wheel->occupied[level][timer->slot / 64] |= (uint64_t)1 << (timer->slot % 64);
+}
+
+// arm the timer (or move it, if it was already armed)
+void timer_wheel_arm(struct timer_wheel *wheel, struct wheel_timer *timer, uint64_t expires)
+{
+	if (wheel_timer_armed(timer)) timer_wheel_cancel(wheel, timer);
+	timer->expires = expires;
+	wheel_insert(wheel, timer);
+}
+
+void timer_wheel_cancel(struct timer_wheel *wheel, struct wheel_timer *timer)
+{
+	if (!wheel_timer_armed(timer)) return;
+
+	*timer->pprev = timer->next;
+	if (timer->next != NULL) timer->next->pprev = timer->pprev;
+	timer->pprev = NULL;
+	timer->next = NULL;
+
+	if (wheel->slots[timer->level][timer->slot] == NULL)
+		wheel->occupied[timer->level][timer->slot / 64] &= ~((uint64_t)1 << (timer->slot % 64));
+}
+
+// move the wheel to 'now'. It returns the list of the timers that have expired, linked by 'next'
+// the returned timers are not armed any more
+struct wheel_timer *timer_wheel_advance(struct timer_wheel *wheel, uint64_t now)
+{
+	struct wheel_timer *expired = NULL;
+	struct wheel_timer *timer, *list;
+	uint64_t old = wheel->now;
+	uint64_t first, last, count, i;
+	int level, slot;
+
+	if (now < old) return NULL;
+	wheel->now = now;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		// the slots passed since the last time. The slot of 'old' at level 0 may have got new timers
+		first = (old >> (WHEEL_BITS * level)) + (level > 0);
+		last = now >> (WHEEL_BITS * level);
+		if (last < first) continue;
+
+		count = last - first + 1;
+		if (count > WHEEL_SLOTS) count = WHEEL_SLOTS;
+
+		for (i = 0; i < count; i++) {
+			slot = (first + i) & WHEEL_MASK;
+			list = wheel->slots[level][slot];
+			if (list == NULL) continue;
+
+			wheel->slots[level][slot] = NULL;
+			wheel->occupied[level][slot / 64] &= ~((uint64_t)1 << (slot % 64));
+
+			while (list != NULL) {
+				timer = list;
+				list = list->next;
+				timer->pprev = NULL;
+
+				if (timer->expires <= now) {
+					timer->next = expired;
+					expired = timer;
+				} else {
+					// not yet: it goes to a lower level
+					wheel_insert(wheel, timer);
+				}
+			}
+		}
+	}
+	return expired;
+}
+
+// distance (in slots) from 'from' to the first slot with timers, or -1 if there are none
+static int next_occupied(const uint64_t *bitmap, int from)
+{
+	uint64_t word;
+	int i, slot;
+
+	for (i = 0; i < WHEEL_SLOTS; ) {
+		slot = (from + i) & WHEEL_MASK;
+		word = bitmap[slot / 64] >> (slot % 64);
+		if (word != 0) {
+			if (i + __builtin_ctzll(word) < WHEEL_SLOTS) return i + __builtin_ctzll(word);
+			return -1;
+		}
+		i = i + 64 - (slot % 64);
+	}
+	return -1;
+}
+
+// the time (microseconds) from 'now' until the wheel has to be advanced, at most 'max'
+// for the upper levels, this is the beginning of the first slot with timers
+uint64_t timer_wheel_time_left(struct timer_wheel *wheel, uint64_t now, uint64_t max)
+{
+	uint64_t next = UINT64_MAX;
+	uint64_t start;
+	int level, distance;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		distance = next_occupied(wheel->occupied[level], (wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK);
+		if (distance < 0) continue;
+
+		start = ((wheel->now >> (WHEEL_BITS * level)) + distance) << (WHEEL_BITS * level);
+		if (start < next) next = start;
+	}
+
+	if (next <= now) return 0;
+	if (next - now > max) return max;
+	return next - now;
+}
@@ -0,0 +1,48 @@
+/**************************************************************************
+ * simplemux_timer.h                                                      *
+ *                                                                        *
+ * Hierarchical timer wheel, used for the period of each peer. Times are  *
+ * in microseconds of CLOCK_MONOTONIC. Arming and cancelling a timer is   *
+ * O(1), so there can be a timer for each peer (or queue).                *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#ifndef SIMPLEMUX_TIMER_H
+#define SIMPLEMUX_TIMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define WHEEL_BITS 8						// each level has 2^8 slots
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4						// a slot is 1 us, 256 us, 65 ms or 16.7 s long. Up to 71 minutes
+
+struct wheel_timer {
+	struct wheel_timer *next;				// next timer of the slot (or of the list of expired timers)
+	struct wheel_timer **pprev;				// the pointer to this timer in the slot. NULL if the timer is not armed
+	uint64_t expires;						// (microseconds) when the timer expires
+	uint16_t level, slot;					// where the timer is
+	void *data;								// owner of the timer
+};
+
+struct timer_wheel {
+	uint64_t now;							// the timers until this moment have already expired
+	struct wheel_timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+	uint64_t occupied[WHEEL_LEVELS][WHEEL_SLOTS / 64];	// bitmap of the slots with timers
+};
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now);
+void wheel_timer_init(struct wheel_timer *timer, void *data);
+void timer_wheel_arm(struct timer_wheel *wheel, struct wheel_timer *timer, uint64_t expires);
+void timer_wheel_cancel(struct timer_wheel *wheel, struct wheel_timer *timer);
+struct wheel_timer *timer_wheel_advance(struct timer_wheel *wheel, uint64_t now);
+uint64_t timer_wheel_time_left(struct timer_wheel *wheel, uint64_t now, uint64_t max);
+
+static inline bool wheel_timer_armed(const struct wheel_timer *timer)
+{
+	return timer->pprev != NULL;
+}
+
+#endif
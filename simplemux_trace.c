@@ -0,0 +1,413 @@
+/**************************************************************************
+ * simplemux_trace.c                                                      *
+ *                                                                        *
+ * Binary event log of simplemux: a ring of records per data plane        *
+ * thread, drained by a writer thread.                                    *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "simplemux_trace.h"
+
+// a single-producer single-consumer ring: the producer is a data plane thread, the consumer is the writer
+struct trace_ring {
+	atomic_uint head;								// next record to be written to the file. Only written by the writer
+	atomic_uint tail;								// next free record. Only written by the data plane thread
+	atomic_ulong lost;								// records dropped because the ring was full
+	struct trace_record records[TRACE_RING_SIZE];
+};
+
+struct trace_log {
+	FILE *file;
+	bool text;										// the records are written as text lines (log to stdout)
+	pthread_t writer;
+	atomic_bool stop;								// set to stop the writer thread
+	pthread_mutex_t lock;							// protects 'rings' and 'num_rings'
+	int num_rings;
+	struct trace_ring *rings[MAXTRACERINGS];
+};
+
+// the columns of each event in the text log
+enum trace_columns {
+	COLUMNS_PACKET,									// size and counter
+	COLUMNS_FROM,									// ... from <IP>
+	COLUMNS_FROM_PORT,								// ... from <IP> <port>
+	COLUMNS_TO,										// ... to <IP> <port> <num_packets> [<triggers>]
+	COLUMNS_STATS,									// the four rates
+	COLUMNS_POLICY									// size threshold, period, to <IP> <port> <arrival rate> <mean size> <class>
+};
+
+static const struct {
+	const char *type;
+	const char *name;
+	enum trace_columns columns;
+} trace_formats[TRACE_NUM_EVENTS] = {
+	[TRACE_REC_NATIVE]				= { "rec",		"native",								COLUMNS_PACKET },
+	[TRACE_DROP_NO_ROUTE]			= { "drop",		"no_route",								COLUMNS_PACKET },
+	[TRACE_DROP_TOO_LONG]			= { "drop",		"too_long",								COLUMNS_TO },
+	[TRACE_COMPR_FAILED]			= { "error",	"compr_failed. Native packet sent",		COLUMNS_PACKET },
+	[TRACE_SENT_MUXED]				= { "sent",		"muxed",								COLUMNS_TO },
+	[TRACE_REC_MUXED]				= { "rec",		"muxed",								COLUMNS_FROM_PORT },
+	[TRACE_DROP_UNKNOWN_PEER]		= { "drop",		"unknown_peer",							COLUMNS_FROM },
+	[TRACE_DROP_NO_ROHC_MODE]		= { "drop",		"no_ROHC_mode",							COLUMNS_PACKET },
+	[TRACE_REC_ROHC_FEEDBACK_ONLY]	= { "rec",		"ROHC_feedback",						COLUMNS_FROM_PORT },
+	[TRACE_DECOMP_FAILED]			= { "error",	"decomp_failed",						COLUMNS_PACKET },
+	[TRACE_DECOMP_OUTPUT_TOO_SMALL]	= { "error",	"decomp_failed. Output buffer is too small",	COLUMNS_PACKET },
+	[TRACE_DECOMP_MALFORMED]		= { "error",	"decomp_failed. No context",			COLUMNS_PACKET },
+	[TRACE_DECOMP_BAD_CRC]			= { "error",	"decomp_failed. Bad CRC",				COLUMNS_PACKET },
+	[TRACE_DECOMP_OTHER_ERROR]		= { "error",	"decomp_failed. Other error",			COLUMNS_PACKET },
+	[TRACE_SENT_DEMUXED]			= { "sent",		"demuxed",								COLUMNS_PACKET },
+	[TRACE_DEMUX_BAD_LENGTH]		= { "error",	"demux_bad_length",						COLUMNS_PACKET },
+	[TRACE_FORWARD_NATIVE]			= { "forward",	"native",								COLUMNS_FROM_PORT },
+	[TRACE_REC_ROHC_FEEDBACK]		= { "rec",		"ROHC feedback",						COLUMNS_FROM_PORT },
+	[TRACE_STATS_PPS]				= { "stats",	"pps",									COLUMNS_STATS },
+	[TRACE_LOST]					= { "error",	"trace_lost",							COLUMNS_PACKET },
+	[TRACE_ADAPT_POLICY]			= { "adapt",	"policy",								COLUMNS_POLICY },
+	[TRACE_DROP_ROHC_BUSY]			= { "drop",		"rohc_busy",							COLUMNS_TO },
+	[TRACE_ROHC_BYPASS]				= { "bypass",	"rohc",									COLUMNS_PACKET },
+};
+
+
+/**************************************************************************
+ * trace_record_print: write a record as a line of the text log           *
+ **************************************************************************/
+// it returns the value of the last fprintf, or -1 if the event is unknown
+int trace_record_print(FILE *out, const struct trace_record *record)
+{
+	char address[INET6_ADDRSTRLEN];
+
+	if (record->event >= TRACE_NUM_EVENTS) return -1;
+
+	fprintf(out, "%"PRIu64"\t%s\t%s", record->timestamp, trace_formats[record->event].type, trace_formats[record->event].name);
+
+	if (trace_formats[record->event].columns == COLUMNS_STATS) {
+		return fprintf(out, "\t%"PRIu32"\t%"PRIu32"\t%"PRIu32"\t%"PRIu32"\n",
+			record->rates[0], record->rates[1], record->rates[2], record->rates[3]);
+	}
+
+	inet_ntop((record->flags & TRACE_FLAG_IPV6) ? AF_INET6 : AF_INET, record->address, address, sizeof(address));
+
+	if (trace_formats[record->event].columns == COLUMNS_POLICY) {
+		fprintf(out, "\t%"PRIu32"\t%"PRIu32"\tto\t%s\t", record->policy.size_threshold, record->policy.period, address);
+		if (!(record->flags & TRACE_FLAG_NO_PORT)) fprintf(out, "%i", record->port);
+		return fprintf(out, "\t%"PRIu32"\t%u\t%s\n", record->policy.arrival_rate, record->policy.mean_size,
+			(record->policy.mux_class == 0) ? "bulk" : "realtime");
+	}
+
+	fprintf(out, "\t%i\t%"PRIu64, record->packet.size, record->packet.counter);
+
+	switch (trace_formats[record->event].columns) {
+		case COLUMNS_FROM:
+			fprintf(out, "\tfrom\t%s", address);
+		break;
+		case COLUMNS_FROM_PORT:
+			fprintf(out, "\tfrom\t%s\t", address);
+			if (!(record->flags & TRACE_FLAG_NO_PORT)) fprintf(out, "%i", record->port);
+		break;
+		case COLUMNS_TO:
+			fprintf(out, "\tto\t%s\t", address);
+			if (!(record->flags & TRACE_FLAG_NO_PORT)) fprintf(out, "%i", record->port);
+			fprintf(out, "\t%i", record->packet.num_packets);
+			if (record->packet.triggers & TRIGGER_MTU) fprintf(out, "\tMTU");
+			if (record->packet.triggers & TRIGGER_NUMPACKET_LIMIT) fprintf(out, "\tnumpacket_limit");
+			if (record->packet.triggers & TRIGGER_SIZE_LIMIT) fprintf(out, "\tsize_limit");
+			if (record->packet.triggers & TRIGGER_TIMEOUT) fprintf(out, "\ttimeout");
+			if (record->packet.triggers & TRIGGER_PERIOD) fprintf(out, "\tperiod");
+		break;
+		default:
+		break;
+	}
+	return fprintf(out, "\n");
+}
+
+
+/**************************************************************************
+ *                 records written by the data plane threads              *
+ **************************************************************************/
+
+// get the next free record of the ring, or NULL if it is full
+static struct trace_record *trace_reserve(struct trace_ring *ring)
+{
+	unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (tail - head == TRACE_RING_SIZE) {
+		atomic_fetch_add_explicit(&ring->lost, 1, memory_order_relaxed);
+		return NULL;
+	}
+	return &ring->records[tail % TRACE_RING_SIZE];
+}
+
+// publish the record obtained with trace_reserve()
+static void trace_commit(struct trace_ring *ring)
+{
+	unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+// an event with only the size and the counter of the packet
+void trace_packet(struct trace_ring *ring, uint64_t timestamp, int event, int size, unsigned long counter)
+{
+	struct trace_record *record = trace_reserve(ring);
+
+	if (record == NULL) return;
+
+	memset(record, 0, sizeof(struct trace_record));
+	record->timestamp = timestamp;
+	record->event = event;
+	record->packet.size = size;
+	record->packet.counter = counter;
+	trace_commit(ring);
+}
+
+// copy the address of the peer (IPv4 or IPv6) to the record
+static void trace_address(struct trace_record *record, const struct sockaddr *address)
+{
+	memset(record->address, 0, sizeof(record->address));
+	if (address->sa_family == AF_INET6) {
+		memcpy(record->address, &((const struct sockaddr_in6 *)address)->sin6_addr, 16);
+		record->flags |= TRACE_FLAG_IPV6;
+	} else {
+		memcpy(record->address, &((const struct sockaddr_in *)address)->sin_addr, 4);
+	}
+}
+
+// an event related to a peer. 'port' is -1 if the port column is empty
+void trace_peer(struct trace_ring *ring, uint64_t timestamp, int event, int size, unsigned long counter,
+				const struct sockaddr *address, int port, int num_packets, int triggers)
+{
+	struct trace_record *record = trace_reserve(ring);
+
+	if (record == NULL) return;
+
+	record->timestamp = timestamp;
+	record->event = event;
+	record->flags = (port < 0) ? TRACE_FLAG_NO_PORT : 0;
+	record->port = (port < 0) ? 0 : port;
+	trace_address(record, address);
+	record->packet.counter = counter;
+	record->packet.size = size;
+	record->packet.num_packets = num_packets;
+	record->packet.triggers = triggers;
+	record->packet.unused = 0;
+	trace_commit(ring);
+}
+
+// the packet-per-second rates
+void trace_stats(struct trace_ring *ring, uint64_t timestamp, double rates[4])
+{
+	struct trace_record *record = trace_reserve(ring);
+	int i;
+
+	if (record == NULL) return;
+
+	memset(record, 0, sizeof(struct trace_record));
+	record->timestamp = timestamp;
+	record->event = TRACE_STATS_PPS;
+	for (i = 0; i < 4; i++)
+		record->rates[i] = (uint32_t)(rates[i] + 0.5);
+	trace_commit(ring);
+}
+
+// the policies chosen by the adaptive controller for a mux queue. 'port' is -1 if the port column is empty
+void trace_policy(struct trace_ring *ring, uint64_t timestamp, const struct sockaddr *address, int port, int mux_class,
+				  int size_threshold, uint64_t period, double arrival_rate, int mean_size)
+{
+	struct trace_record *record = trace_reserve(ring);
+
+	if (record == NULL) return;
+
+	memset(record, 0, sizeof(struct trace_record));
+	record->timestamp = timestamp;
+	record->event = TRACE_ADAPT_POLICY;
+	record->flags = (port < 0) ? TRACE_FLAG_NO_PORT : 0;
+	record->port = (port < 0) ? 0 : port;
+	trace_address(record, address);
+	record->policy.size_threshold = size_threshold;
+	record->policy.period = period;
+	record->policy.arrival_rate = (uint32_t)(arrival_rate + 0.5);
+	record->policy.mean_size = mean_size;
+	record->policy.mux_class = mux_class;
+	trace_commit(ring);
+}
+
+
+/**************************************************************************
+ *                            writer thread                               *
+ **************************************************************************/
+
+static void trace_write(struct trace_log *log, const struct trace_record *record)
+{
+	if (log->text)
+		trace_record_print(log->file, record);
+	else
+		fwrite(record, sizeof(struct trace_record), 1, log->file);
+}
+
+// write the records available in the rings, merged by timestamp (each ring is already in order)
+// it returns the number of records written
+static int trace_drain(struct trace_log *log)
+{
+	struct trace_ring *rings[MAXTRACERINGS];
+	unsigned int head[MAXTRACERINGS], tail[MAXTRACERINGS];
+	struct trace_record lost_record;
+	unsigned long lost;
+	uint64_t last_timestamp = 0;
+	int num_rings;
+	int written = 0;
+	int i, next;
+
+	pthread_mutex_lock(&log->lock);
+	num_rings = log->num_rings;
+	memcpy(rings, log->rings, num_rings * sizeof(struct trace_ring *));
+	pthread_mutex_unlock(&log->lock);
+
+	for (i = 0; i < num_rings; i++) {
+		head[i] = atomic_load_explicit(&rings[i]->head, memory_order_relaxed);
+		tail[i] = atomic_load_explicit(&rings[i]->tail, memory_order_acquire);
+	}
+
+	while (true) {
+		// the ring with the oldest record
+		next = -1;
+		for (i = 0; i < num_rings; i++) {
+			if (head[i] == tail[i]) continue;
+			if ((next < 0) || (rings[i]->records[head[i] % TRACE_RING_SIZE].timestamp < rings[next]->records[head[next] % TRACE_RING_SIZE].timestamp))
+				next = i;
+		}
+		if (next < 0) break;
+
+		last_timestamp = rings[next]->records[head[next] % TRACE_RING_SIZE].timestamp;
+		trace_write(log, &rings[next]->records[head[next] % TRACE_RING_SIZE]);
+		head[next]++;
+		written++;
+	}
+
+	for (i = 0; i < num_rings; i++) {
+		atomic_store_explicit(&rings[i]->head, head[i], memory_order_release);
+
+		// report the records that did not fit in the ring
+		lost = atomic_exchange_explicit(&rings[i]->lost, 0, memory_order_relaxed);
+		if (lost > 0) {
+			memset(&lost_record, 0, sizeof(lost_record));
+			lost_record.timestamp = last_timestamp;
+			lost_record.event = TRACE_LOST;
+			lost_record.packet.counter = lost;
+			trace_write(log, &lost_record);
+			written++;
+		}
+	}
+	return written;
+}
+
+static void *trace_writer(void *arg)
+{
+	struct trace_log *log = (struct trace_log *)arg;
+	struct timespec sleep_time = { 0, TRACE_WRITER_SLEEP * 1000 };
+
+	while (!atomic_load(&log->stop)) {
+		if (trace_drain(log) > 0) {
+			// only the records of the last cycle can be lost if the program is killed
+			fflush(log->file);
+		} else {
+			nanosleep(&sleep_time, NULL);
+		}
+	}
+
+	// the last records
+	trace_drain(log);
+	fflush(log->file);
+	return NULL;
+}
+
+
+/**************************************************************************
+ *                         open and close the log                         *
+ **************************************************************************/
+
+// open the log and start the writer thread. If the name is "stdout", the log is written there as text
+// it returns NULL if there is an error
+struct trace_log *trace_log_open(const char *file_name)
+{
+	struct trace_log *log;
+	struct trace_file_header header;
+
+	log = calloc(1, sizeof(struct trace_log));
+	if (log == NULL) return NULL;
+
+	if (strcmp(file_name, "stdout") == 0) {
+		log->file = stdout;
+		log->text = true;
+	} else {
+		log->file = fopen(file_name, "w");
+		if (log->file == NULL) {
+			free(log);
+			return NULL;
+		}
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+		header.version = TRACE_VERSION;
+		header.record_size = sizeof(struct trace_record);
+		fwrite(&header, sizeof(header), 1, log->file);
+	}
+
+	pthread_mutex_init(&log->lock, NULL);
+	atomic_init(&log->stop, false);
+
+	if (pthread_create(&log->writer, NULL, trace_writer, log) != 0) {
+		if (!log->text) fclose(log->file);
+		free(log);
+		return NULL;
+	}
+	return log;
+}
+
+// get a ring for the calling thread. It returns NULL if there is no log, or there are too many rings
+struct trace_ring *trace_log_attach(struct trace_log *log)
+{
+	struct trace_ring *ring;
+
+	if (log == NULL) return NULL;
+
+	ring = calloc(1, sizeof(struct trace_ring));
+	if (ring == NULL) return NULL;
+
+	pthread_mutex_lock(&log->lock);
+	if (log->num_rings == MAXTRACERINGS) {
+		pthread_mutex_unlock(&log->lock);
+		free(ring);
+		return NULL;
+	}
+	log->rings[log->num_rings] = ring;
+	log->num_rings++;
+	pthread_mutex_unlock(&log->lock);
+
+	return ring;
+}
+
+// stop the writer thread after writing the remaining records, and close the file
+// the rings must not be used after this
+void trace_log_close(struct trace_log *log)
+{
+	int i;
+
+	if (log == NULL) return;
+
+	atomic_store(&log->stop, true);
+	pthread_join(log->writer, NULL);
+
+	if (!log->text) fclose(log->file);
+	for (i = 0; i < log->num_rings; i++)
+		free(log->rings[i]);
+	pthread_mutex_destroy(&log->lock);
+	free(log);
+}
@@ -0,0 +1,116 @@
+/**************************************************************************
+ * simplemux_trace.h                                                      *
+ *                                                                        *
+ * Binary event log of simplemux (option -l). Each data plane thread      *
+ * writes fixed-size records into its own lock-free ring, and a writer    *
+ * thread drains the rings into the log file. simplemux_trace2txt         *
+ * converts the binary log into the tab-separated format read by          *
+ * simplemux_throughput_pps.pl and simplemux_multiplexing_delay.pl        *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#ifndef SIMPLEMUX_TRACE_H
+#define SIMPLEMUX_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define TRACE_MAGIC "SMXTRACE"		// first bytes of a binary log
+#define TRACE_VERSION 2
+#define TRACE_RING_SIZE 8192		// records of each ring (power of 2)
+#define MAXTRACERINGS 16			// maximum number of threads writing to the log
+#define TRACE_WRITER_SLEEP 1000		// (microseconds) the writer sleeps this time when the rings are empty
+
+// events. Each one is a line type of the text log
+enum trace_event {
+	TRACE_REC_NATIVE,				// rec native
+	TRACE_DROP_NO_ROUTE,			// drop no_route
+	TRACE_DROP_TOO_LONG,			// drop too_long
+	TRACE_COMPR_FAILED,				// error compr_failed. Native packet sent
+	TRACE_SENT_MUXED,				// sent muxed
+	TRACE_REC_MUXED,				// rec muxed
+	TRACE_DROP_UNKNOWN_PEER,		// drop unknown_peer
+	TRACE_DROP_NO_ROHC_MODE,		// drop no_ROHC_mode
+	TRACE_REC_ROHC_FEEDBACK_ONLY,	// rec ROHC_feedback (a ROHC packet with only feedback inside a bundle)
+	TRACE_DECOMP_FAILED,			// error decomp_failed
+	TRACE_DECOMP_OUTPUT_TOO_SMALL,	// error decomp_failed. Output buffer is too small
+	TRACE_DECOMP_MALFORMED,			// error decomp_failed. No context
+	TRACE_DECOMP_BAD_CRC,			// error decomp_failed. Bad CRC
+	TRACE_DECOMP_OTHER_ERROR,		// error decomp_failed. Other error
+	TRACE_SENT_DEMUXED,				// sent demuxed
+	TRACE_DEMUX_BAD_LENGTH,			// error demux_bad_length
+	TRACE_FORWARD_NATIVE,			// forward native
+	TRACE_REC_ROHC_FEEDBACK,		// rec ROHC feedback (feedback channel)
+	TRACE_STATS_PPS,				// stats pps
+	TRACE_LOST,						// error trace_lost: records dropped because a ring was full
+	TRACE_ADAPT_POLICY,				// adapt policy: new size threshold and period of a mux queue
+	TRACE_DROP_ROHC_BUSY,			// drop rohc_busy: the ring of the ROHC thread of the peer was full
+	TRACE_ROHC_BYPASS,				// bypass rohc: the flow of the packet will be sent without compressing it for a while
+	TRACE_NUM_EVENTS
+};
+
+// what triggered the sending of a muxed packet
+#define TRIGGER_MTU				0x01
+#define TRIGGER_NUMPACKET_LIMIT	0x02
+#define TRIGGER_SIZE_LIMIT		0x04
+#define TRIGGER_TIMEOUT			0x08
+#define TRIGGER_PERIOD			0x10
+
+#define TRACE_FLAG_NO_PORT		0x01	// the port column is empty
+#define TRACE_FLAG_IPV6			0x02	// the address of the peer is IPv6
+
+// a record of the binary log (48 bytes)
+struct trace_record {
+	uint64_t timestamp;					// microseconds
+	uint8_t event;						// enum trace_event
+	uint8_t flags;						// TRACE_FLAG_*
+	uint16_t port;						// port of the peer (host byte order)
+	uint32_t unused;
+	uint8_t address[16];				// address of the peer (network byte order). IPv4 only uses the first 4 bytes
+	union {
+		struct {
+			uint64_t counter;			// packet counter (tun2net, net2tun or feedback_pkts)
+			int32_t size;				// size of the packet (bytes)
+			uint16_t num_packets;		// number of packets in the bundle
+			uint8_t triggers;			// TRIGGER_* of a sent muxed packet
+			uint8_t unused;
+		} packet;
+		uint32_t rates[4];				// TRACE_STATS_PPS: native pps, tun reads/s, muxed pps, net sends/s
+		struct {
+			uint32_t size_threshold;	// bytes. 0 means that each packet is sent at once
+			uint32_t period;			// microseconds
+			uint32_t arrival_rate;		// packets per second stored in the mux queue
+			uint16_t mean_size;			// bytes
+			uint8_t mux_class;			// the mux queue of the peer: 0 bulk, 1 realtime
+			uint8_t unused;
+		} policy;						// TRACE_ADAPT_POLICY
+	};
+};
+
+// first bytes of a binary log
+struct trace_file_header {
+	char magic[8];						// TRACE_MAGIC
+	uint32_t version;					// TRACE_VERSION
+	uint32_t record_size;				// sizeof(struct trace_record)
+};
+
+struct trace_log;
+struct trace_ring;
+
+struct trace_log *trace_log_open(const char *file_name);
+struct trace_ring *trace_log_attach(struct trace_log *log);
+void trace_log_close(struct trace_log *log);
+
+void trace_packet(struct trace_ring *ring, uint64_t timestamp, int event, int size, unsigned long counter);
+void trace_peer(struct trace_ring *ring, uint64_t timestamp, int event, int size, unsigned long counter,
+				const struct sockaddr *address, int port, int num_packets, int triggers);
+void trace_stats(struct trace_ring *ring, uint64_t timestamp, double rates[4]);
+void trace_policy(struct trace_ring *ring, uint64_t timestamp, const struct sockaddr *address, int port, int mux_class,
+				  int size_threshold, uint64_t period, double arrival_rate, int mean_size);
+
+int trace_record_print(FILE *out, const struct trace_record *record);
+
+#endif
@@ -0,0 +1,65 @@
+/**************************************************************************
+ * simplemux_trace2txt.c                                                  *
+ *                                                                        *
+ * Converts a binary log of simplemux (option -l) into the tab-separated  *
+ * text format read by simplemux_throughput_pps.pl and                    *
+ * simplemux_multiplexing_delay.pl                                        *
+ *                                                                        *
+ * Usage: ./simplemux_trace2txt <binary log> [<text log>]                 *
+ *   if the text log is not specified, the lines are written to stdout    *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "simplemux_trace.h"
+
+int main(int argc, char *argv[])
+{
+	FILE *in, *out = stdout;
+	struct trace_file_header header;
+	struct trace_record record;
+	unsigned long num_records = 0;
+
+	if ((argc < 2) || (argc > 3)) {
+		fprintf(stderr, "Usage: %s <binary log> [<text log>]\n", argv[0]);
+		exit(1);
+	}
+
+	in = fopen(argv[1], "r");
+	if (in == NULL) {
+		perror("Cannot open the binary log");
+		exit(1);
+	}
+
+	if ((fread(&header, sizeof(header), 1, in) != 1) ||
+		(memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0)) {
+		fprintf(stderr, "%s is not a binary log of simplemux\n", argv[1]);
+		exit(1);
+	}
+	if ((header.version != TRACE_VERSION) || (header.record_size != sizeof(struct trace_record))) {
+		fprintf(stderr, "%s: unsupported log version %u (record size %u)\n", argv[1], header.version, header.record_size);
+		exit(1);
+	}
+
+	if (argc == 3) {
+		out = fopen(argv[2], "w");
+		if (out == NULL) {
+			perror("Cannot open the text log");
+			exit(1);
+		}
+	}
+
+	while (fread(&record, sizeof(record), 1, in) == 1) {
+		if (trace_record_print(out, &record) < 0)
+			fprintf(stderr, "Record %lu: unknown event %u\n", num_records, record.event);
+		num_records++;
+	}
+
+	fclose(in);
+	if (out != stdout) fclose(out);
+	return 0;
+}
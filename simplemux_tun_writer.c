@@ -0,0 +1,329 @@
+/**************************************************************************
+ * simplemux_tun_writer.c                                                 *
+ *                                                                        *
+ * Batched writing of the demuxed packets to tun, with io_uring and GSO   *
+ * coalescing of TCP segments.                                            *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/virtio_net.h>
+#include "simplemux_tun_writer.h"
+#include "simplemux_packet_ring.h"
+#include "simplemux_checksum.h"
+#include "simplemux_uring.h"
+
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_ACK 0x10
+#define TCP_CHECKSUM_OFFSET 16
+
+
+/**************************************************************************
+ *                  coalescing of TCP segments (GSO)                      *
+ **************************************************************************/
+
+// a TCP segment that may be coalesced with the ones before or after it
+struct tcp_segment {
+	bool ipv6;
+	int ip_header;
+	int headers;							// IP and TCP headers
+	int payload;
+	uint32_t seq;
+	const unsigned char *tcp;
+};
+
+// it returns false if the packet cannot be coalesced: it is not TCP, it has IPv4 options or extension headers of IPv6,
+// it is a fragment, it has flags other than ACK and PSH, it has no payload, or its checksum is wrong (the kernel
+// computes a new one for the coalesced packet, so a wrong checksum would be hidden)
+static bool parse_tcp_segment(const unsigned char *packet, int size, struct tcp_segment *segment)
+{
+	const unsigned char *tcp;
+
+	if ((size >= 20) && ((packet[0] >> 4) == 4)) {
+		if (((packet[0] & 0x0F) != 5) || (packet[9] != IPPROTO_TCP)) return false;
+		if (((packet[2] << 8) | packet[3]) != size) return false;
+		if (((packet[6] & 0x3F) != 0) || (packet[7] != 0)) return false;		// MF and fragment offset
+		segment->ipv6 = false;
+		segment->ip_header = 20;
+	} else if ((size >= 40) && ((packet[0] >> 4) == 6)) {
+		if ((packet[6] != IPPROTO_TCP) || (((packet[4] << 8) | packet[5]) + 40 != size)) return false;
+		segment->ipv6 = true;
+		segment->ip_header = 40;
+	} else {
+		return false;
+	}
+
+	if (size < segment->ip_header + 20) return false;
+	tcp = packet + segment->ip_header;
+	segment->tcp = tcp;
+	segment->headers = segment->ip_header + (tcp[12] >> 4) * 4;
+	if ((segment->headers < segment->ip_header + 20) || (segment->headers >= size)) return false;
+	segment->payload = size - segment->headers;
+
+	if (((tcp[13] & ~(TCP_FLAG_ACK | TCP_FLAG_PSH)) != 0) || !(tcp[13] & TCP_FLAG_ACK)) return false;
+	segment->seq = ((uint32_t)tcp[4] << 24) | (tcp[5] << 16) | (tcp[6] << 8) | tcp[7];
+
+	return checksum_fold(checksum_sum16(tcp, size - segment->ip_header, checksum_pseudo_header(packet, segment->ipv6, IPPROTO_TCP, size - segment->ip_header))) == 0xFFFF;
+}
+
+// it returns true if the segment continues the last packet of the batch: same flow, headers and options,
+// the next sequence number and IPv4 identifier, and not longer than the segments before
+static bool continues(struct tun_writer *writer, struct tun_out_packet *last, const unsigned char *packet, struct tcp_segment *segment)
+{
+	const unsigned char *first = writer->buffer + last->offset;
+	const unsigned char *first_tcp = first + last->ip_header;
+	uint32_t next_seq;
+	uint16_t next_id;
+
+	if (last->closed || (segment->ipv6 != (last->ip_header == 40)) || (segment->headers != last->headers)) return false;
+	if ((segment->payload > last->mss) || (last->size + segment->payload > TUN_GSO_MAX_SIZE)) return false;
+	if (writer->used + segment->payload > TUN_WRITER_BUFSIZE) return false;
+
+	if (segment->ipv6) {
+		// version, traffic class, flow label, next header, hop limit and addresses
+		if ((memcmp(first, packet, 4) != 0) || (memcmp(first + 6, packet + 6, 34) != 0)) return false;
+	} else {
+		// version, TOS, DF, TTL, protocol and addresses
+		if ((memcmp(first, packet, 2) != 0) || (first[6] != packet[6]) || (memcmp(first + 8, packet + 8, 2) != 0) || (memcmp(first + 12, packet + 12, 8) != 0)) return false;
+		next_id = ((first[4] << 8) | first[5]) + last->segments;
+		if ((packet[4] != (next_id >> 8)) || (packet[5] != (next_id & 0xFF))) return false;
+	}
+
+	// ports, acknowledgement, data offset, window and options. The flags of the first one are only ACK
+	if ((memcmp(first_tcp, segment->tcp, 4) != 0) || (memcmp(first_tcp + 8, segment->tcp + 8, 5) != 0) ||
+		(memcmp(first_tcp + 14, segment->tcp + 14, 2) != 0) ||
+		(memcmp(first_tcp + 20, segment->tcp + 20, segment->headers - last->ip_header - 20) != 0)) return false;
+
+	next_seq = (((uint32_t)first_tcp[4] << 24) | (first_tcp[5] << 16) | (first_tcp[6] << 8) | first_tcp[7]) + (last->size - last->headers);
+	return segment->seq == next_seq;
+}
+
+// the headers of a coalesced packet are set for its whole size, and its virtio_net_hdr asks the kernel for GSO
+static void finish_packet(struct tun_writer *writer, struct tun_out_packet *out)
+{
+	unsigned char *packet = writer->buffer + out->offset;
+	struct virtio_net_hdr *vnet = (struct virtio_net_hdr *)(packet - sizeof(struct virtio_net_hdr));
+	bool ipv6 = (out->ip_header == 40);
+	uint16_t checksum;
+
+	memset(vnet, 0, sizeof(struct virtio_net_hdr));
+	if (out->segments == 1) return;
+
+	if (ipv6) {
+		packet[4] = (out->size - 40) >> 8;
+		packet[5] = (out->size - 40) & 0xFF;
+	} else {
+		packet[2] = out->size >> 8;
+		packet[3] = out->size & 0xFF;
+		packet[10] = 0;
+		packet[11] = 0;
+		checksum = ~checksum_fold(checksum_sum16(packet, 20, 0));
+		packet[10] = checksum >> 8;
+		packet[11] = checksum & 0xFF;
+	}
+
+	// the TCP checksum is completed by the kernel (CHECKSUM_PARTIAL): the field has the sum of the pseudo-header
+	checksum = checksum_fold(checksum_pseudo_header(packet, ipv6, IPPROTO_TCP, out->size - out->ip_header));
+	packet[out->ip_header + TCP_CHECKSUM_OFFSET] = checksum >> 8;
+	packet[out->ip_header + TCP_CHECKSUM_OFFSET + 1] = checksum & 0xFF;
+
+	vnet->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+	vnet->gso_type = ipv6 ? VIRTIO_NET_HDR_GSO_TCPV6 : VIRTIO_NET_HDR_GSO_TCPV4;
+	vnet->hdr_len = out->headers;
+	vnet->gso_size = out->mss;
+	vnet->csum_start = out->ip_header;
+	vnet->csum_offset = TCP_CHECKSUM_OFFSET;
+}
+
+
+/**************************************************************************
+ *                  io_uring: all the writes at once                      *
+ **************************************************************************/
+
+#ifdef HAVE_IO_URING
+// submit a write for each packet, and wait until all of them have completed. It returns the number of system calls
+static int uring_write_all(struct uring_rings *uring, int fd, struct iovec *iov, int num)
+{
+	unsigned tail = *uring->sq_tail, head;
+	unsigned index;
+	int k, submitted = 0, done = 0, calls = 0, ret;
+
+	for (k = 0; k < num; k++) {
+		index = (tail + k) & *uring->sq_mask;
+		struct io_uring_sqe *sqe = &uring->sqes[index];
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = fd;
+		sqe->off = (uint64_t)-1;				// the current position: tun is not seekable
+		sqe->addr = (uint64_t)(uintptr_t)iov[k].iov_base;
+		sqe->len = iov[k].iov_len;
+		sqe->user_data = k;
+		uring->sq_array[index] = index;
+	}
+	__atomic_store_n(uring->sq_tail, tail + num, __ATOMIC_RELEASE);
+
+	// tun does not block on writes, so they usually complete during the submission, in a single call
+	while (done < num) {
+		ret = syscall(__NR_io_uring_enter, uring->ring_fd, num - submitted, num - done, IORING_ENTER_GETEVENTS, NULL, 0);
+		calls++;
+		if ((ret < 0) && (errno == EINTR)) continue;
+		if (ret < 0) {
+			// the writes not submitted are removed from the ring, and lost. The ones submitted may still be in flight:
+			// the function does not return before they complete, as their packets are in the buffer of the batch
+			perror("io_uring_enter() tun");
+			__atomic_store_n(uring->sq_tail, tail + submitted, __ATOMIC_RELEASE);
+			num = submitted;
+		} else {
+			submitted = submitted + ret;
+		}
+
+		head = *uring->cq_head;
+		while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &uring->cqes[head & *uring->cq_mask];
+			if (cqe->res < 0) {
+				errno = -cqe->res;
+				perror("Writing data");
+			}
+			head++;
+			done++;
+		}
+		__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return calls;
+}
+#endif
+
+
+/**************************************************************************
+ *                          the batch                                     *
+ **************************************************************************/
+
+// the ring of io_uring is only created if it is requested, and it falls back to write() if it cannot be created
+void tun_writer_init(struct tun_writer *writer, int fd, struct packet_ring *ring, bool vnet_hdr, bool use_uring)
+{
+	writer->fd = fd;
+	writer->ring = ring;
+	writer->vnet_hdr = vnet_hdr && (ring == NULL);
+	writer->num_packets = 0;
+	writer->used = 0;
+	writer->uring = NULL;
+
+#ifdef HAVE_IO_URING
+	if (use_uring && (ring == NULL)) {
+		writer->uring = malloc(sizeof(struct uring_rings));
+		if ((writer->uring != NULL) && (uring_rings_create(writer->uring, TUN_WRITER_PACKETS) < 0)) {
+			free(writer->uring);
+			writer->uring = NULL;
+		}
+		if (writer->uring == NULL) fprintf(stderr, "Warning: no io_uring for writing to tun. A write() per packet is used\n");
+	}
+#endif
+}
+
+void tun_writer_close(struct tun_writer *writer)
+{
+#ifdef HAVE_IO_URING
+	if (writer->uring != NULL) {
+		uring_rings_free(writer->uring);
+		free(writer->uring);
+	}
+#endif
+	writer->uring = NULL;
+}
+
+// copy a packet to the batch. It is coalesced with the previous one if they are consecutive segments of a TCP flow
+// it returns the number of system calls made (the batch is written if it is full)
+int tun_writer_add(struct tun_writer *writer, const unsigned char *packet, int size)
+{
+	struct tun_out_packet *out;
+	struct tcp_segment segment;
+	int header = writer->vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
+	bool is_tcp = writer->vnet_hdr && parse_tcp_segment(packet, size, &segment);
+	int calls = 0;
+
+	// the TX ring is already a batch: the packet is copied into its next frame
+	if (writer->ring != NULL) {
+		writer->num_packets++;
+		return packet_ring_write(writer->ring, packet, size);
+	}
+
+	if ((size <= 0) || (size + header > TUN_WRITER_BUFSIZE)) return 0;
+
+	// the payload is appended to the last packet. It keeps the headers of its first segment, except PSH
+	if (is_tcp && (writer->num_packets > 0) && continues(writer, &writer->packets[writer->num_packets - 1], packet, &segment)) {
+		out = &writer->packets[writer->num_packets - 1];
+		memcpy(writer->buffer + writer->used, packet + segment.headers, segment.payload);
+		writer->used = writer->used + segment.payload;
+		out->size = out->size + segment.payload;
+		out->segments++;
+		if (segment.tcp[13] & TCP_FLAG_PSH) writer->buffer[out->offset + out->ip_header + 13] |= TCP_FLAG_PSH;
+		out->closed = (segment.payload < out->mss) || (segment.tcp[13] & TCP_FLAG_PSH);
+		return 0;
+	}
+
+	if ((writer->num_packets == TUN_WRITER_PACKETS) || (writer->used + header + size > TUN_WRITER_BUFSIZE)) {
+		calls = tun_writer_flush(writer);
+	}
+
+	out = &writer->packets[writer->num_packets];
+	out->offset = writer->used + header;
+	out->size = size;
+	out->segments = 1;
+	out->closed = !is_tcp || (segment.tcp[13] & TCP_FLAG_PSH);
+	if (is_tcp) {
+		out->mss = segment.payload;
+		out->ip_header = segment.ip_header;
+		out->headers = segment.headers;
+	}
+	memcpy(writer->buffer + out->offset, packet, size);
+	writer->used = out->offset + size;
+	writer->num_packets++;
+	return calls;
+}
+
+// write all the packets of the batch. It returns the number of system calls
+int tun_writer_flush(struct tun_writer *writer)
+{
+	struct iovec iov[TUN_WRITER_PACKETS];
+	int header = writer->vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
+	int k, calls = 0;
+
+	if (writer->num_packets == 0) return 0;
+	if (writer->ring != NULL) {
+		writer->num_packets = 0;
+		return packet_ring_flush(writer->ring);
+	}
+
+	for (k = 0; k < writer->num_packets; k++) {
+		if (writer->vnet_hdr) finish_packet(writer, &writer->packets[k]);
+		iov[k].iov_base = writer->buffer + writer->packets[k].offset - header;
+		iov[k].iov_len = writer->packets[k].size + header;
+	}
+
+#ifdef HAVE_IO_URING
+	if (writer->uring != NULL) {
+		calls = uring_write_all(writer->uring, writer->fd, iov, writer->num_packets);
+	} else
+#endif
+	{
+		// a packet that the kernel refuses is lost, but the others are written
+		for (k = 0; k < writer->num_packets; k++) {
+			if (write(writer->fd, iov[k].iov_base, iov[k].iov_len) < 0) perror("Writing data");
+			calls++;
+		}
+	}
+
+	writer->num_packets = 0;
+	writer->used = 0;
+	return calls;
+}
@@ -0,0 +1,56 @@
+/**************************************************************************
+ * simplemux_tun_writer.h                                                 *
+ *                                                                        *
+ * Output stage of the demultiplexer: the packets demuxed from one or     *
+ * more bundles are collected, and written to tun in a batch before the   *
+ * thread waits again. With the io_uring backend, a batch costs a single  *
+ * system call. With IFF_VNET_HDR (option -G), the consecutive TCP        *
+ * segments of a flow are coalesced into one GSO packet, which the kernel *
+ * splits again (or delivers as it is to the local TCP). With option -I,  *
+ * the packets are injected into the TX ring of a network interface.     *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#ifndef SIMPLEMUX_TUN_WRITER_H
+#define SIMPLEMUX_TUN_WRITER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TUN_WRITER_PACKETS 256				// packets in a batch. A full batch is written at once
+#define TUN_WRITER_BUFSIZE (2 * 65536)		// bytes of the packets in a batch (a GSO packet takes up to 64 KB)
+#define TUN_GSO_MAX_SIZE 65535				// maximum size of a coalesced packet
+
+// a packet of the batch. A coalesced one keeps the headers of its first segment
+struct tun_out_packet {
+	uint32_t offset;						// position of the packet in the buffer (its virtio_net_hdr goes before it)
+	uint16_t size;
+	uint16_t segments;						// TCP segments coalesced in the packet (1: a packet as it was received)
+	uint16_t mss;							// payload of each segment. The last one may be shorter
+	uint16_t ip_header;						// size of the IP header
+	uint16_t headers;						// size of the IP and TCP headers
+	bool closed;							// no more segments can be added to it
+};
+
+struct uring_rings;
+struct packet_ring;
+
+struct tun_writer {
+	int fd;
+	bool vnet_hdr;							// each packet goes after a virtio_net_hdr, and TCP segments are coalesced
+	int num_packets;
+	uint32_t used;							// bytes of the buffer used
+	struct tun_out_packet packets[TUN_WRITER_PACKETS];
+	struct uring_rings *uring;				// ring for submitting the writes at once. NULL: a write() per packet
+	struct packet_ring *ring;				// TX ring of the network interface of the native packets (-I). NULL: tun
+	unsigned char buffer[TUN_WRITER_BUFSIZE];
+};
+
+void tun_writer_init(struct tun_writer *writer, int fd, struct packet_ring *ring, bool vnet_hdr, bool use_uring);
+void tun_writer_close(struct tun_writer *writer);
+int tun_writer_add(struct tun_writer *writer, const unsigned char *packet, int size);
+int tun_writer_flush(struct tun_writer *writer);
+
+#endif
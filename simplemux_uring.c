@@ -0,0 +1,93 @@
+/**************************************************************************
+ * simplemux_uring.c                                                      *
+ *                                                                        *
+ * Creation of an io_uring and mapping of its rings, without liburing.    *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "simplemux_uring.h"
+
+#ifdef HAVE_IO_URING
+
+// create an io_uring of 'entries' submissions and map its rings. It returns -1 if there is an error
+int uring_rings_create(struct uring_rings *rings, unsigned entries)
+{
+	struct io_uring_params params;
+	void *ptr;
+
+	memset(rings, 0, sizeof(*rings));
+	memset(&params, 0, sizeof(params));
+	rings->ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (rings->ring_fd < 0) {
+		perror("io_uring_setup()");
+		return -1;
+	}
+	rings->features = params.features;
+
+	rings->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	rings->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (rings->cq_size > rings->sq_size) rings->sq_size = rings->cq_size;
+		rings->cq_size = rings->sq_size;
+	}
+
+	ptr = mmap(NULL, rings->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rings->ring_fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED) {
+		perror("mmap() of the io_uring submission ring");
+		goto error;
+	}
+	rings->sq_ptr = ptr;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		rings->cq_ptr = rings->sq_ptr;
+	} else {
+		ptr = mmap(NULL, rings->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rings->ring_fd, IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED) {
+			perror("mmap() of the io_uring completion ring");
+			goto error;
+		}
+		rings->cq_ptr = ptr;
+	}
+
+	rings->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, rings->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, rings->ring_fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED) {
+		perror("mmap() of the io_uring submission entries");
+		goto error;
+	}
+	rings->sqes = ptr;
+
+	rings->sq_head = (unsigned *)((char *)rings->sq_ptr + params.sq_off.head);
+	rings->sq_tail = (unsigned *)((char *)rings->sq_ptr + params.sq_off.tail);
+	rings->sq_mask = (unsigned *)((char *)rings->sq_ptr + params.sq_off.ring_mask);
+	rings->sq_array = (unsigned *)((char *)rings->sq_ptr + params.sq_off.array);
+	rings->cq_head = (unsigned *)((char *)rings->cq_ptr + params.cq_off.head);
+	rings->cq_tail = (unsigned *)((char *)rings->cq_ptr + params.cq_off.tail);
+	rings->cq_mask = (unsigned *)((char *)rings->cq_ptr + params.cq_off.ring_mask);
+	rings->cqes = (struct io_uring_cqe *)((char *)rings->cq_ptr + params.cq_off.cqes);
+	return 0;
+
+error:
+	uring_rings_free(rings);
+	return -1;
+}
+
+// unmap the rings and close the io_uring
+void uring_rings_free(struct uring_rings *rings)
+{
+	if (rings->sqes != NULL) munmap(rings->sqes, rings->sqes_size);
+	if ((rings->cq_ptr != NULL) && (rings->cq_ptr != rings->sq_ptr)) munmap(rings->cq_ptr, rings->cq_size);
+	if (rings->sq_ptr != NULL) munmap(rings->sq_ptr, rings->sq_size);
+	if (rings->ring_fd >= 0) close(rings->ring_fd);
+	memset(rings, 0, sizeof(*rings));
+	rings->ring_fd = -1;
+}
+
+#endif
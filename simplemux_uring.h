@@ -0,0 +1,40 @@
+/**************************************************************************
+ * simplemux_uring.h                                                      *
+ *                                                                        *
+ * Creation of an io_uring and mapping of its rings, without liburing.    *
+ * Used by the io_uring event backend (-E u) and by the tun writer.       *
+ *                                                                        *
+ * Jose Saldana wrote this program in 2015, published under GNU GENERAL   *
+ * PUBLIC LICENSE, Version 3, 29 June 2007                                *
+ *************************************************************************/
+
+#ifndef SIMPLEMUX_URING_H
+#define SIMPLEMUX_URING_H
+
+#include <stddef.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>		// no liburing needed
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+struct uring_rings {
+	int ring_fd;						// descriptor of the ring
+	unsigned features;					// IORING_FEAT_* of the kernel
+	void *sq_ptr, *cq_ptr;				// mapped submission and completion rings
+	size_t sq_size, cq_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	struct io_uring_cqe *cqes;
+};
+
+int uring_rings_create(struct uring_rings *rings, unsigned entries);
+void uring_rings_free(struct uring_rings *rings);
+#endif
+
+#endif